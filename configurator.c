@@ -3,6 +3,7 @@
 #define ENABLE_CONFIGURATOR_DEBUGGING 0
 
 #include <libgen.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -16,6 +17,12 @@
 
 static bool configuratorDebug = false;
 
+// Serializes writes.  Each write copies the whole file and renames the copy over the
+// original, so two concurrent writes would otherwise lose one of the two changes.
+static pthread_mutex_t gConfigWriteLock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool setConfigKeyLocked(const char *key, const char *value);
+
 // Returns true if the specified line's key portion matches the specified key.
 bool lineMatchesKey(const char *buf, const char *key) {
   size_t keyLength = strlen(key);
@@ -57,8 +64,15 @@ bool getConfigKeyBool(const char *key) {
   return boolValue;
 }
 
-// Returns the configuration file path (~/.viscaptz.conf unless overridden).
+// Returns the configuration file path (~/.viscaptz.conf unless overridden).  The
+// VISCAPTZ_CONFIG_FILE environment variable overrides everything else, so that tests
+// can run without touching the real configuration.
 const char *getConfigFilePath(void) {
+  const char *override = getenv("VISCAPTZ_CONFIG_FILE");
+  if (override != NULL && override[0] != '\0') {
+    return override;
+  }
+
   #ifdef CONFIG_FILE_PATH
     return CONFIG_FILE_PATH;
   #endif
@@ -123,6 +137,15 @@ char *getConfigKey(const char *key) {
 
 // Sets the configuration key to the specified string value.
 bool setConfigKey(const char *key, const char *value) {
+  pthread_mutex_lock(&gConfigWriteLock);
+  bool retval = setConfigKeyLocked(key, value);
+  pthread_mutex_unlock(&gConfigWriteLock);
+  return retval;
+}
+
+// Sets the configuration key to the specified string value.  The caller must hold
+// gConfigWriteLock.
+static bool setConfigKeyLocked(const char *key, const char *value) {
   FILE *fp = fopen(getConfigFilePath(), "r");
   if (!fp) {
     fprintf(stderr, "WARNING: Could not open %s for reading",
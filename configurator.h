@@ -22,13 +22,11 @@ int64_t getConfigKeyInteger(const char *key);
 /**
  * Sets the value of the specified configuration key.
  *
- * IMPORTANT: These functions perform NO synchronization.  Although
- * writes are atomic against reads, they are NOT atomic against
- * other writes.
- *
- * These functions should ONLY be called during calibration or while
- * handling command-line arguments at launch time, to ensure that
- * concurrent writes from multiple threads cannot happen.
+ * Writes are atomic against reads, and are serialized against
+ * other writes within this process, so they can be called from any
+ * thread.  They are NOT synchronized against other processes, so
+ * command-line tools should not change keys that the running daemon
+ * also writes.
  *
  * @property key   The name of the key.  This key must not contain
  *                 any equals signs.
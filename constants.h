@@ -8,6 +8,14 @@
 #define USEC_PER_SEC 1000000
 #endif
 
+#ifndef NSEC_PER_SEC
+#define NSEC_PER_SEC 1000000000LL
+#endif
+
+// Conversions between monotonicTimeNanos() intervals and floating-point seconds.
+#define NANOS_TO_SECONDS(nanos) ((double)(nanos) / NSEC_PER_SEC)
+#define SECONDS_TO_NANOS(seconds) ((int64_t)((seconds) * NSEC_PER_SEC))
+
 // We use the same tally codes as NewTek and Marshall NDI cameras.
 // Program mode is 5.  Preview mode is 6.
 typedef enum {
@@ -35,6 +43,20 @@ typedef enum {
 
 #define NUM_AXES (axis_identifier_zoom + 1)
 
+// The directions of motion for which calibration data is kept separately.  Some axes
+// move faster one way than the other (for example, a tilt axis lowering a heavy camera
+// versus raising it).  These refer to the sign of the speed sent to the hardware module
+// (after any motor reversal).
+typedef enum {
+  kCalibrationDirectionNegative = 0,  //! Negative hardware speeds.
+  kCalibrationDirectionPositive = 1,  //! Positive hardware speeds.
+  kNumCalibrationDirections = 2
+} calibration_direction_t;
+
+// The calibration direction for a (hardware module) speed with the specified sign.
+#define CALIBRATION_DIRECTION_FOR_SPEED(speed) \
+    (((speed) < 0) ? kCalibrationDirectionNegative : kCalibrationDirectionPositive)
+
 
 #include "config.h"
 
@@ -2,6 +2,7 @@
 #include "constants.h"
 #include "main.h"
 #include "motorptz.h"
+#include "motorsim.h"
 #include "obs_tally.h"
 #include "panasonicptz.h"
 #include "p2protocol.h"
@@ -69,6 +70,18 @@ const char *kCameraIPKey = "camera_ip_address";
 /** Boolean key indicating that the zoom motor uses larger values to zoom out. */
 const char *kZoomMotorReversedKey = "zoom_motor_reversed";
 
+/** String key containing the name of the default motion profile (logistic, trapezoid, or jerk). */
+const char *kMotionProfileKey = "motion_profile";
+
+/**
+ * Integer key containing the standard deviation of unmodeled axis acceleration (in positions
+ * per second squared) used by the position/velocity estimator.
+ */
+const char *kEstimatorProcessNoiseKey = "estimator_process_noise";
+
+/** Integer key containing the standard deviation of encoder readings (in positions). */
+const char *kEstimatorMeasurementNoiseKey = "estimator_measurement_noise";
+
 #if USE_TRICASTER_TALLY_SOURCE
   /** String key containing the switcher IP address for the Tricaster module. */
   const char *kTricasterIPKey = "tricaster_ip_address";
@@ -90,31 +103,135 @@ const char *kTallySourceName = "tally_source_name";
 
 /**
  * The maximum number of times we will try to move the motor if the
- * encoder value does not change.
+ * estimated axis speed stays below kAxisStallVelocity.
  */
 static const int kAxisStallThreshold = 100;
 
+/** The estimated speed (in positions per second) below which an axis is considered stalled. */
+static const double kAxisStallVelocity = 1.0;
+
+/**
+ * How far (in positions) an axis may end up past its target.  An axis that coasts
+ * further than this is driven back before its move is complete.
+ */
+static const int64_t kAxisSettleTolerance = 2;
+
+/** How long (in seconds) the control loop takes to drive an axis back to its target. */
+static const double kAxisCorrectionTime = 0.25;
+
+/**
+ * How long (in seconds) after its planned end a time-based move can spend coming to rest
+ * at its target before the control loop gives up and stops the axis where it is.
+ */
+static const double kAxisSettleTime = 2.0;
+
+/** The default estimator process noise (see kEstimatorProcessNoiseKey). */
+static const double kDefaultEstimatorProcessNoise = 2000.0;
+
+/** The default estimator measurement noise (see kEstimatorMeasurementNoiseKey). */
+static const double kDefaultEstimatorMeasurementNoise = 1.0;
+
 /**
- * The decipercentage of the motion that should be used for ramping up or down.
+ * The decipercentage of the motion that should be used for ramping up or down.  This
+ * also sizes the s-curve tables, so it must be a constant expression.
  */
-static const int kRampUpPeriodEnd = 200;
+#define RAMP_PERIOD_LENGTH 200
+
+/** The end of the ramp-up period (in decipercent of the move). */
+static const int kRampUpPeriodEnd = RAMP_PERIOD_LENGTH;
 
 // Do not change.  The ramp up and ramp down periods must be equal.
 static const int kRampDownPeriodStart = 1000 - kRampUpPeriodEnd;
 
-// During the ramp up/down period, the axis moves at half speed, so each of these periods
-// moves half the distance. Therefore, the percentage of the total distance moved at maximum
-// speed is halfway between 100% and the percentage of time spent at maximum speed.  So for
-// a ramp-up/ramp-down period of 10%, it moves at maximum speed for 90% of the distance.
-//
-// Thus, the slowdown begins after the initial ramp-up period's 5% plus that 90%, or 95%.
-//
-// Assuming the ramp-up period and ramp-down period are equal, this can be simplified to
-// one minus half of the ramp-up period.
-static const double moveDistanceFractionBeforeSlowdown = 1 - ((kRampUpPeriodEnd / 1000) / 2);
+/** The number of fractional bits in s-curve table entries. */
+#define S_CURVE_FRACTION_BITS 16
+
+/** The s-curve table value that represents full (peak) speed. */
+#define S_CURVE_ONE (1 << S_CURVE_FRACTION_BITS)
+
+/** The number of fractional bits in ramp progress values passed to the s-curve lookup. */
+#define S_CURVE_PROGRESS_FRACTION_BITS 8
+
+/**
+ * Proportional gain for the closed-loop move controller, in positions per second
+ * of correction per position of tracking error.  A value of 2 removes a tracking
+ * error in roughly half a second.
+ */
+static const double kControllerProportionalGain = 2.0;
+
+/** Integral gain for the closed-loop move controller (per second squared). */
+static const double kControllerIntegralGain = 0.5;
+
+/**
+ * Velocity gain for the closed-loop move controller, in positions per second of correction
+ * per position per second of difference between the planned and estimated velocity.  This
+ * is the derivative term, but it uses the estimator's filtered velocity instead of
+ * differentiating the (heavily quantized) tracking error.
+ */
+static const double kControllerVelocityGain = 0.2;
+
+/**
+ * The largest correction that the integral term may contribute, as a fraction of
+ * the axis's maximum speed.  Keeps the integrator from winding up during long stalls.
+ */
+static const double kControllerMaxIntegralFraction = 0.2;
+
+/**
+ * The maximum number of setpoints in the planned trajectory for one axis.  Long moves
+ * space their setpoints further apart to fit.
+ */
+#define MAX_TRAJECTORY_SETPOINTS 4096
+
+/** The preferred interval between trajectory setpoints (one control loop tick), in seconds. */
+static const double kTrajectorySetpointInterval = 0.01;
+
+/** The maximum number of stops in a tour (and of moves in the move queue). */
+#define MAX_TOUR_STOPS 32
+
+/**
+ * The fraction of the move duration spent ramping up (and again ramping down) with the
+ * trapezoid profile.  Short ramps get the axis to its target sooner.
+ */
+static const double kTrapezoidRampFraction = 0.1;
+
+/**
+ * The fraction of the move duration spent ramping up (and again ramping down) with the
+ * jerk-limited profile, and the fraction of each ramp spent changing the acceleration.
+ * Long ramps with gradual changes in acceleration are gentlest on heavy payloads.
+ */
+static const double kJerkLimitedRampFraction = 0.25;
+static const double kJerkLimitedJerkFraction = 1.0 / 3.0;
+
+/**
+ * How far an axis in a coordinated move can fall behind the other axes (in seconds of
+ * trajectory time) before they slow down to wait for it.
+ */
+static const double kCoordinatedMoveLagTolerance = 0.02;
+
+/**
+ * How many positions an axis in a coordinated move can trail its setpoint without
+ * counting as behind: one for the encoder's resolution, and two for the controller
+ * switching between adjacent hardware speeds when neither matches the planned speed.
+ * Without this, a slow axis always looks late, and the whole move waits for it.
+ */
+static const double kCoordinatedMoveLagPositions = 3;
+
+/**
+ * How much a coordinated move's clock slows down for each additional second that the
+ * furthest-behind axis lags the others, and the slowest that the clock can run (relative
+ * to real time).
+ */
+static const double kCoordinatedMoveSyncGain = 8.0;
+static const double kCoordinatedMoveMinimumRate = 0.25;
+
+/**
+ * The largest change in a coordinated move's clock rate per second.  This keeps the other
+ * axes from lurching when they start or stop waiting for a lagging axis.
+ */
+static const double kCoordinatedMoveMaxRateChange = 2.0;
 
-// The time fraction mefore slowdown is just kRampDownPeriodStart / 1000.
-static const double moveTimeFractionBeforeSlowdown = (kRampDownPeriodStart / 1000.0);
+/** The hardware scale used for synthetic calibration data in tests and benchmarks. */
+#define PAN_TILT_SCALE_FAKE 100
 
 /**
  * A constant that indicates that a value (pan, tilt, or zoom) in a move
@@ -148,11 +265,147 @@ typedef struct {
   uint8_t data[65527];  // Maximum theoretical IPv6 UDP packet size.
 } visca_response_t;
 
+/**
+ * The state of the closed-loop (feedforward plus PID) controller for one axis.
+ * Reset by setAxisPositionIncrementally at the start of every move.
+ */
+typedef struct {
+  double integral;            //! Accumulated tracking error (position-seconds).
+  int64_t previousTime;       //! Monotonic timestamp (nanoseconds) of the previous update.
+  bool hasPreviousUpdate;     //! False until the first update after a reset.
+  bool saturated;             //! True if the last output was clamped.
+} axis_controller_t;
+
+/** The velocity profiles that a planned move can follow. */
+typedef enum {
+  kMotionProfileDefault = 0,      //! Use the profile from the configuration file (or logistic).
+  kMotionProfileLogistic = 1,     //! Logistic s-curve ramps (computeSpeed).
+  kMotionProfileTrapezoid = 2,    //! Constant-acceleration ramps.
+  kMotionProfileJerkLimited = 3,  //! Seven-segment ramps with limited jerk.
+  kNumMotionProfiles = 4
+} motion_profile_t;
+
+/**
+ * The shape of a motion profile, in normalized time and speed.  Every profile starts and
+ * ends at rest and is symmetric, so the only thing that varies from one move to the next
+ * is the scale in each direction.
+ */
+typedef struct {
+  const char *name;
+
+  /** Returns the fraction of peak speed (0 to 1) at a fraction of the move duration (0 to 1). */
+  double (*speedFraction)(double timeFraction);
+
+  /** Returns the fraction of the total distance (0 to 1) covered by a fraction of the move duration. */
+  double (*distanceFraction)(double timeFraction);
+
+  /**
+   * Returns the average speed across the move as a fraction of the peak speed.  Because the
+   * peak speed can be at most the axis's maximum speed, the fastest possible move of a given
+   * distance takes exactly distance / (maximumSpeed * averageSpeedFraction()) seconds.
+   */
+  double (*averageSpeedFraction)(void);
+} motion_profile_ops_t;
+
+/** The planned position and velocity of an axis at a point in time. */
+typedef struct {
+  double position;  //! Distance from the start position in the direction of motion (positions).
+  double velocity;  //! Velocity in the direction of motion (positions per second).
+} trajectory_setpoint_t;
+
+/**
+ * A move planned by setAxisPositionIncrementally.  Everything that handleRecallUpdates
+ * needs is computed once here, so that the control loop only interpolates between
+ * setpoints and corrects for errors.
+ */
+typedef struct {
+  motion_profile_t profile;        //! The velocity profile (never kMotionProfileDefault).
+  int direction;                   //! Sign of motor speeds for this move (after encoder reversal).
+  int64_t maxPositionsPerSecond;   //! Positions per second at the axis's maximum speed.
+  int minimumSpeed;                //! The slowest core speed that actually moves the axis.
+  double setpointInterval;         //! Seconds between consecutive setpoints.
+  int numSetpoints;                //! Number of valid setpoints (0 for position-based moves).
+  trajectory_setpoint_t setpoints[MAX_TRAJECTORY_SETPOINTS];
+} axis_trajectory_t;
+
+/**
+ * A recall in which every axis follows a trajectory scaled so that all of them arrive at
+ * the same moment.  Axes that cannot move slowly enough to take the whole duration start
+ * late.  The axes share a clock that runs slower than real time whenever one of them falls
+ * behind, so the others wait for it instead of arriving early.
+ *
+ * The per-axis state is stored as parallel arrays indexed by axis so that the control loop
+ * can check every axis in a single pass.
+ */
+typedef struct {
+  bool active;                    //! True until every axis in the move finishes or is cancelled.
+  int64_t startTime;              //! Monotonic timestamp (nanoseconds) at which the move began.
+  int64_t previousUpdateTime;     //! Monotonic timestamp of the previous clock update.
+  double elapsed;                 //! Shared trajectory time (seconds since startTime).
+  double rate;                    //! How fast the shared clock runs, relative to real time.
+  double duration;                //! The common duration by which every axis should arrive.
+  bool moving[NUM_AXES];          //! True for each axis that is following the shared clock.
+  double startOffset[NUM_AXES];   //! Seconds of shared time before each axis starts moving.
+  double lag[NUM_AXES];           //! How far behind each axis was at the last update (seconds).
+} coordinated_move_t;
+
 /** A data structure representing a preset on disk. */
 typedef struct {
     int64_t panPosition, tiltPosition, zoomPosition;
+    int32_t motionProfile;  // A motion_profile_t value.  Older presets lack this (zero is the default).
+    int32_t storedOnCamera;  // Nonzero if the camera also stored this preset.  Older presets lack this.
 } preset_t;
 
+/** One stop on a tour, as stored on disk. */
+typedef struct {
+    int32_t presetNumber;
+    int32_t dwellMilliseconds;  // Time to stay at this stop.  Zero passes through without stopping.
+} tour_stop_t;
+
+/** A data structure representing a tour (a sequence of presets) on disk. */
+typedef struct {
+    int32_t numStops;
+    tour_stop_t stops[MAX_TOUR_STOPS];
+} tour_t;
+
+/** A move waiting in the move queue. */
+typedef struct {
+  int64_t positions[NUM_AXES];    //! The target position for each axis.
+  motion_profile_t profile;       //! The motion profile for the move (or kMotionProfileDefault).
+  double dwell;                   //! Seconds to wait after arriving (0 to blend into the next move).
+} queued_move_t;
+
+/**
+ * One segment of the blended move that is in progress.  A segment starts before the
+ * previous one ends, so that its ramp-up overlaps the previous segment's ramp-down.
+ */
+typedef struct {
+  int64_t targetPositions[NUM_AXES];  //! The position of each axis at the end of the segment.
+  motion_profile_t profile;           //! The segment's motion profile (never kMotionProfileDefault).
+  double startTime;                   //! Seconds after the start of the blended move.
+  double duration;                    //! The segment's duration (seconds).
+} move_segment_t;
+
+/**
+ * A sequence of moves (for example, a preset tour) that runs without further commands.
+ * Consecutive moves with no dwell time between them are combined into a single blended
+ * move, as long as no axis changes direction, so the camera does not stop at each one.
+ * Everything is loaded up front, so running the queue never touches the disk.
+ */
+typedef struct {
+  bool active;                              //! True while the queue is running.
+  bool loop;                                //! True if the queue starts over after the last move.
+  bool blendedMoveInProgress;               //! True while the current blended move is running.
+  int numMoves;                             //! The number of valid entries in moves.
+  int nextMove;                             //! The index of the next move to start.
+  int64_t moveEndTime;                      //! Monotonic time (nanoseconds) the current move should end.
+  int64_t dwellEndTime;                     //! Monotonic time (nanoseconds) to start the next move.
+  double dwell;                             //! Seconds to wait after the current blended move.
+  queued_move_t moves[MAX_TOUR_STOPS];
+  int numSegments;                          //! The number of segments in the current blended move.
+  move_segment_t segments[MAX_TOUR_STOPS];
+} move_queue_t;
+
 
 #pragma mark - Global variables
 
@@ -216,18 +469,11 @@ static int64_t gAxisMoveMaxSpeed[NUM_AXES];
 static int64_t gAxisLastMoveSpeed[NUM_AXES];
 
 /**
- * The position of the specified axis at the previous move interval (1/100th of
- * a second).  Used to determine if the motor has stalled at the end of an
- * uncalibrated move to avoid wasting power (forever) unnecessarily.
+ * The most recent distinct position of the specified axis during the current
+ * move.  Used to slow down position-based moves before they overshoot.
  */
 static int64_t gAxisPreviousPosition[NUM_AXES];
 
-/**
- * The timestamp when gAxisPreviousPosition was last updated.  Used for debugging
- * speed calculations.
- */
-static double gAxisPreviousPositionTimestamp[NUM_AXES];
-
 /**
  * The desired duration of the move on the specified axis in seconds (relative
  * to gAxisStartTime).
@@ -235,19 +481,92 @@ static double gAxisPreviousPositionTimestamp[NUM_AXES];
 static double gAxisDuration[NUM_AXES];
 
 /**
- * The timestamp (in floating-point seconds since the ephoc) at which the
- * current move began.
+ * The monotonic timestamp (in nanoseconds) at which the current move began.
  */
-static double gAxisStartTime[NUM_AXES];
+static int64_t gAxisStartTime[NUM_AXES];
 
 /**
  * The number of consecutive checks of the position of the axis in which
- * the position value did not change.  Used to stop moving early if the
+ * the estimated speed was below kAxisStallVelocity.  Used to stop moving early if the
  * motor has stalled during an uncalibrated move, rather than wasting
  * power forever.
  */
 static int gAxisStalls[NUM_AXES];
 
+/**
+ * The s-curve speed fraction at each decipercent of the ramp-up period (0 through
+ * kRampUpPeriodEnd), in fixed point (S_CURVE_ONE is full speed).  The ramp-down
+ * period uses the same values in reverse.  Populated by initSCurveTable().
+ */
+static int32_t gSCurveTable[RAMP_PERIOD_LENGTH + 1];
+
+/**
+ * The area under the s-curve from the start of the ramp-up period through each
+ * entry in gSCurveTable, in units of S_CURVE_ONE times one decipercent.  Used to
+ * compute where an axis should be at any point in a move.
+ */
+static int64_t gSCurveAreaTable[RAMP_PERIOD_LENGTH + 1];
+
+/** Closed-loop controller state for each axis. */
+static axis_controller_t gAxisController[NUM_AXES];
+
+/**
+ * Filtered position and velocity for each axis, updated from the encoders on every
+ * tick of handleRecallUpdates while a move is in progress.
+ */
+static axis_estimator_t gAxisEstimator[NUM_AXES];
+
+/** The planned trajectory for each axis (preallocated so that planning never allocates). */
+static axis_trajectory_t gAxisTrajectory[NUM_AXES];
+
+/** The state of the current coordinated move (see planCoordinatedMove). */
+static coordinated_move_t gCoordinatedMove;
+
+/** The move queue (see startMoveQueue).  Only used on the network thread. */
+static move_queue_t gMoveQueue;
+
+/**
+ * The motion profile for moves that are started by the current recall, or
+ * kMotionProfileDefault to use the configured default.
+ */
+static motion_profile_t gRecallMotionProfile = kMotionProfileDefault;
+
+/**
+ * The configured default motion profile, cached by loadDefaultMotionProfile so that
+ * planning a move does not reread the configuration file.
+ */
+static motion_profile_t gDefaultMotionProfile = kMotionProfileLogistic;
+
+/**
+ * The sign to apply to motor speeds for each axis (-1 if the motor is reversed), cached
+ * when a move is planned so that the control loop does not reread the configuration.
+ */
+static int gAxisMotorDirection[NUM_AXES] = { 1, 1, 1 };
+
+/**
+ * True while the axes are replaced by simulated axes (see startMotorSimulation).  Only
+ * used by tests and benchmarks, before any other threads start.
+ */
+static bool gMotorSimulationActive = false;
+
+/** The interval between control loop updates in a simulation (the network thread's rate). */
+static const int64_t kMotorSimulationTickNanos = NSEC_PER_SEC / 100;
+
+/** The simulated axes used when gMotorSimulationActive is true. */
+static motor_sim_axis_t gSimulatedAxes[NUM_AXES];
+
+/** Ideal calibration data (for each direction of motion) for each simulated axis. */
+static directional_calibration_t gSimulatedCalibration[NUM_AXES];
+
+/** The sign of encoder values relative to motor speeds for each simulated axis. */
+static int gSimulatedEncoderDirection[NUM_AXES];
+
+/** True if monotonicTimeNanos should return gVirtualClockNanos (see setVirtualClock). */
+static bool gVirtualClockEnabled = false;
+
+/** The current time on the virtual clock, in nanoseconds. */
+static int64_t gVirtualClockNanos = 0;
+
 /**
  * The current tally state as set by VISCA commands.  Used only if
  * the VISCA tally source is active.
@@ -287,10 +606,12 @@ void cancelRecallIfNeeded(char *context);
 double durationForMove(moveModeFlags flags, int64_t panPosition, int64_t tiltPosition, int64_t zoomPosition);
 
 /**
- * Computes the maximum speed (in core speed) that the motor should reach
- * when moving the specified distance over the specified time.
+ * Computes the duration for a move between two sets of positions (indexed by axis) the same
+ * way that durationForMove does, but starting from fromPositions instead of the current
+ * position.  Used for planning moves that begin where an earlier move ends.
  */
-int peakSpeedForMove(axis_identifier_t axis, int64_t fromPosition, int64_t toPosition, double time);
+double durationForMoveBetweenPositions(moveModeFlags flags, const int64_t *fromPositions,
+                                       const int64_t *toPositions);
 
 /**
  * Returns the fastest possible move that the camera can make to the specified
@@ -298,6 +619,12 @@ int peakSpeedForMove(axis_identifier_t axis, int64_t fromPosition, int64_t toPos
  */
 double fastestMoveForAxisToPosition(axis_identifier_t axis, int64_t position);
 
+/**
+ * Returns the fastest possible move that the camera can make along the specified axis
+ * over the specified distance (measured in seconds).
+ */
+double fastestMoveForAxisDistance(axis_identifier_t axis, int64_t distance);
+
 /**
  * Returns the current position of the specified axis.
  *
@@ -308,9 +635,26 @@ int64_t getAxisPosition(axis_identifier_t axis);
 /** Updates the speed of axes that are being moved incrementally under programmatic control. */
 void handleRecallUpdates(void);
 
-/** Returns the number of positions that a given axis moves in a second at its maximum speed. */
+/**
+ * Returns the number of positions that a given axis moves in a second at its maximum speed
+ * (in the slower direction, if the axis moves faster one way than the other).
+ */
 int64_t maximumPositionsPerSecondForAxis(axis_identifier_t axis);
 
+/**
+ * Returns the number of positions that a given axis moves in a second at its maximum speed
+ * when driven with core speeds of the specified sign (1 or -1).
+ */
+int64_t maximumPositionsPerSecondForAxisInDirection(axis_identifier_t axis, int direction);
+
+/**
+ * Returns the slowest core speed that actually moves the specified axis, given the number of
+ * positions per second that it moves at core speed SCALE_CORE.  Slower nonzero core speeds
+ * produce the same motion, because the calibration tables never map them to a speed that
+ * stalls the motor.
+ */
+int minimumMovingSpeedForAxis(axis_identifier_t axis, int64_t maxPPS);
+
 /**
  * Sets the position of an axis to the specified position.
  *
@@ -319,9 +663,10 @@ int64_t maximumPositionsPerSecondForAxis(axis_identifier_t axis);
  * @param maxSpeed  The maximum speed for the axis (used only if duration is 0).
  * @param duration  The desired move duration, or 0 to use position-based progress
                     prior to or during calibration.
- * @param startTime The timestamp when motion should begin, or zero to start immediately.
+ * @param startTime The monotonic timestamp (from monotonicTimeNanos) when motion should
+ *                  begin, or zero to start immediately.
  */
-bool setAxisPositionIncrementally(axis_identifier_t axis, int64_t position, int64_t maxSpeed, double duration, double startTime);
+bool setAxisPositionIncrementally(axis_identifier_t axis, int64_t position, int64_t maxSpeed, double duration, int64_t startTime);
 
 /** Sets the axis speed, using core scale speed values. */
 bool setAxisSpeed(axis_identifier_t axis, int64_t coreSpeed, bool debug);
@@ -329,15 +674,47 @@ bool setAxisSpeed(axis_identifier_t axis, int64_t coreSpeed, bool debug);
 /** Sets the axis speed, using values based on the hardware scale for that axis. */
 bool setAxisSpeedRaw(axis_identifier_t axis, int64_t speed, bool debug);
 
+/**
+ * Returns the hardware speed (0..toScale) that most closely matches the specified
+ * core speed by searching the forward table in scaleData.  Used for building the
+ * inverse table in convertSpeedValues.  Call scaleSpeed instead.
+ */
+int scaleSpeedByScanning(int absSpeed, int toScale, int32_t *scaleData);
+
+/**
+ * Returns the inverse (core speed to hardware speed) lookup table, with
+ * SCALE_CORE + 1 entries, for scale data returned by convertSpeedValues.
+ */
+int32_t *inverseScaleDataForScaleData(int32_t *scaleData, int maxSpeed);
+
 /** Do not use directly.  Call setAxisSpeed or setAxisSpeedRaw instead. */
 bool setAxisSpeedInternal(axis_identifier_t axis, int64_t speed, bool debug, bool isRaw);
 
+/**
+ * Sets the axis speed (core scale) during a planned move, using the motor directions
+ * cached when the move was planned instead of rereading them from the configuration.
+ */
+bool setPlannedAxisSpeed(axis_identifier_t axis, int64_t coreSpeed, bool debug);
+
+/**
+ * Do not use directly.  Sets the axis speed, multiplying each axis's speed by the
+ * corresponding value (1 or -1) in motorDirections.
+ */
+bool setAxisSpeedWithMotorDirections(axis_identifier_t axis, int64_t speed, bool debug, bool isRaw,
+                                     int *motorDirections);
+
 /**
  * Returns the slowest possible move that the camera can make to the specified
  * position on the specified axis (measured in seconds).
  */
 double slowestMoveForAxisToPosition(axis_identifier_t axis, int64_t position);
 
+/**
+ * Returns the slowest possible move that the camera can make along the specified axis
+ * over the specified distance (measured in seconds).
+ */
+double slowestMoveForAxisDistance(axis_identifier_t axis, int64_t distance);
+
 /** Clamps a move direction based on the maximum and minimum speeds for that axis.  */
 double makeDurationValid(axis_identifier_t axis, double duration, int64_t position);
 
@@ -351,6 +728,67 @@ double makeDurationValid(axis_identifier_t axis, double duration, int64_t positi
  */
 bool recallPreset(int presetNumber);
 
+/**
+ * Moves the camera to the specified position the same way that recallPreset does,
+ * using the specified motion profile (or kMotionProfileDefault).
+ */
+bool recallPosition(int64_t panPosition, int64_t tiltPosition, int64_t zoomPosition,
+                    motion_profile_t profile);
+
+/**
+ * Plans a coordinated move to the specified positions (indexed by axis) on the axes in
+ * flags.  Each axis's duration is clamped to what that axis can physically do, and axes
+ * that cannot move slowly enough start late so that every axis arrives at the same time.
+ *
+ * @param flags          The axes that are moving.
+ * @param positions      The target position for each axis.
+ * @param startTime      The monotonic timestamp (in nanoseconds) at which the move begins.
+ * @param axisDurations  On return, the duration of each axis's move (in seconds).
+ * @param axisStartTimes On return, the monotonic timestamp (in nanoseconds) at which each
+ *                       axis should start moving.
+ *
+ * @return Returns the common duration of the move (in seconds).
+ */
+double planCoordinatedMove(moveModeFlags flags, const int64_t *positions, int64_t startTime,
+                           double *axisDurations, int64_t *axisStartTimes);
+
+/**
+ * Makes the axes that setAxisPositionIncrementally started for a move planned with
+ * planCoordinatedMove share a clock, so that the control loop can keep them in step.
+ *
+ * @param startTime The monotonic timestamp (in nanoseconds) at which the move began.
+ * @param duration  The common duration returned by planCoordinatedMove.
+ */
+void beginCoordinatedMove(int64_t startTime, double duration);
+
+/**
+ * Starts running a sequence of moves, replacing any move or queue in progress.  The queue
+ * runs from the control loop (handleRecallUpdates) until it finishes, or until it is
+ * stopped by stopMoveQueue or by any other move.
+ *
+ * @param moves     The moves, in order.  These are copied.
+ * @param numMoves  The number of moves (at most MAX_TOUR_STOPS).
+ * @param loop      If true, the queue starts over after the last move.
+ */
+bool startMoveQueue(const queued_move_t *moves, int numMoves, bool loop);
+
+/** Stops the move queue after the current move (if any).  Does not stop the move itself. */
+void stopMoveQueue(void);
+
+/** Returns true while the move queue is running. */
+bool moveQueueActive(void);
+
+/**
+ * Starts the specified tour, loading every preset on the tour before the camera moves.
+ *
+ * @param tourNumber The tour to start.
+ * @param loop       If true, the tour repeats until stopped.
+ */
+bool startTour(int tourNumber, bool loop);
+
+/** Stores a tour with the specified stops. */
+bool saveTour(int tourNumber, const tour_stop_t *stops, int numStops);
+
 /**
  * Stores the current position into the specified preset.
  *
@@ -359,6 +797,12 @@ bool recallPreset(int presetNumber);
  */
 bool savePreset(int presetNumber);
 
+/**
+ * Changes the motion profile used when recalling a saved preset.  Pass
+ * kMotionProfileDefault to use the configured default profile.
+ */
+bool setPresetMotionProfile(int presetNumber, motion_profile_t profile);
+
 
 // VISCA-related functions
 
@@ -403,8 +847,75 @@ void *runNetworkThread(void *argIgnored);
 /** Runs a series of tests for built-in conversion functions. */
 void runStartupTests(void);
 
-/** Returns the current time in seconds and fractions of a second. */
-double timeStamp(void);
+/**
+ * Runs timing benchmarks for the motion code and prints the results to stdout.  Returns
+ * false if any simulated move failed to happen at all.
+ */
+bool runBenchmarks(void);
+
+/**
+ * Makes monotonicTimeNanos return the specified time (in nanoseconds) until the next
+ * call, or returns it to the system clock if enabled is false.  Not thread-safe.
+ */
+void setVirtualClock(bool enabled, int64_t nanoseconds);
+
+/**
+ * Replaces the hardware for every axis with a simulated axis and starts the virtual
+ * clock at zero.  Until stopMotorSimulation is called, axis positions, speeds, and
+ * speed limits all come from the simulated axes, which use ideal calibration data.
+ */
+void startMotorSimulation(const motor_sim_params_t *params, const int64_t *startPositions);
+
+/**
+ * Advances the simulated axes and the virtual clock by the specified number of nanoseconds
+ * without running the control loop.
+ */
+void advanceMotorSimulation(int64_t nanoseconds);
+
+/** Advances the simulation by the specified time, running the control loop every 10 ms. */
+void runMotorSimulation(double seconds);
+
+/** Cancels any move in progress and returns control to the hardware and system clock. */
+void stopMotorSimulation(void);
+
+/** Fills the specified array with synthetic calibration data for tests and benchmarks. */
+void fakeBenchmarkCalibrationCurve(int64_t *calibrationData, int maxSpeed);
+
+/** Precomputes the s-curve used by computeSpeed.  Must be called before any motion. */
+void initSCurveTable(void);
+
+/**
+ * Returns the fraction of the total move distance (0 to 1) that an axis following the
+ * s-curve should have covered at the specified (fixed point) decipercent of the move duration.
+ */
+double sCurveDistanceFractionForProgress(int32_t progress);
+
+/** Returns the profile that newly planned moves should use (never kMotionProfileDefault). */
+motion_profile_t activeMotionProfile(void);
+
+/** Rereads the default motion profile from the configuration file. */
+void loadDefaultMotionProfile(void);
+
+/** Returns the motion profile with the specified name, or kMotionProfileDefault if unknown. */
+motion_profile_t motionProfileForName(const char *name);
+
+/**
+ * Returns the duration (in seconds) of the fastest move of the specified distance that an
+ * axis whose top speed is maxPPS positions per second can make using the specified profile.
+ */
+double fastestDurationForProfile(motion_profile_t profile, int64_t distance, int64_t maxPPS);
+
+/** Clears the closed-loop controller state for an axis.  Called at the start of each move. */
+void resetAxisController(axis_identifier_t axis);
+
+/**
+ * Returns the core speed (0 to 1000, in the direction of motion) that keeps an axis on
+ * its planned trajectory, updating the axis's closed-loop controller state.
+ */
+int updateAxisController(axis_identifier_t axis, double setpointDistance, double actualDistance,
+                         double feedforwardPPS, double actualPPS, int64_t maxPPS,
+                         int minimumSpeed, int64_t currentTime);
+
 
 
 /**
@@ -414,6 +925,12 @@ double timeStamp(void);
  */
 bool sendVISCAResponse(visca_response_t *response, uint32_t sequenceNumber, int sock, struct sockaddr *client, socklen_t structLength);
 
+/**
+ * Sends a VISCA command to the copy of this software that is running on this machine,
+ * and waits for its response.  Returns false if the command fails or gets no response.
+ */
+bool sendLocalVISCACommand(uint8_t *data, uint8_t len);
+
 /** Handles a VISCA inquiry packet. */
 bool handleVISCAInquiry(uint8_t *command, uint8_t len, uint32_t sequenceNumber, int sock, struct sockaddr *client, socklen_t structLength);
 
@@ -477,6 +994,8 @@ int main(int argc, char *argv[]) {
 
   signal(SIGPIPE, SIG_IGN);
 
+  initSCurveTable();
+  loadDefaultMotionProfile();
   runStartupTests();
 
   if (argc >= 2) {
@@ -503,6 +1022,72 @@ int main(int argc, char *argv[]) {
       gCalibrationModeZoomOnly = true;
     } else if (!strcmp(argv[1], "--recenter")) {
       gRecenter = true;
+    } else if (!strcmp(argv[1], "--benchmark")) {
+      exit(runBenchmarks() ? 0 : 1);
+#ifdef BENCHMARK_CAMERA
+    } else if (!strcmp(argv[1], "--benchmarkcamera")) {
+      // Commands are sent synchronously until the module starts, so don't start it.
+      char *cameraIP = getConfigKey(kCameraIPKey);
+      if (cameraIP == NULL) {
+        fprintf(stderr, "Run viscaptz --setcameraip before benchmarking the camera.\n");
+        exit(1);
+      }
+      SET_IP_ADDR(cameraIP);
+      if (!panaModuleInit()) {
+        fprintf(stderr, "Panasonic module init failed.  Bailing.\n");
+        exit(1);
+      }
+      exit(BENCHMARK_CAMERA() ? 0 : 1);
+#endif
+    } else if (!strcmp(argv[1], "--setmotionprofile")) {
+      if (argc < 3 || motionProfileForName(argv[2]) == kMotionProfileDefault) {
+        fprintf(stderr, "Usage: viscaptz --setmotionprofile [logistic|trapezoid|jerk]\n");
+        exit(1);
+      }
+      setConfigKey(kMotionProfileKey, argv[2]);
+      loadDefaultMotionProfile();
+      exit(0);
+    } else if (!strcmp(argv[1], "--setestimatornoise")) {
+      if (argc < 4 || atoi(argv[2]) <= 0 || atoi(argv[3]) <= 0) {
+        fprintf(stderr, "Usage: viscaptz --setestimatornoise <acceleration noise> <encoder noise>\n");
+        exit(1);
+      }
+      setConfigKeyInteger(kEstimatorProcessNoiseKey, atoi(argv[2]));
+      setConfigKeyInteger(kEstimatorMeasurementNoiseKey, atoi(argv[3]));
+      exit(0);
+    } else if (!strcmp(argv[1], "--setpresetprofile")) {
+      motion_profile_t profile = (argc < 4) ? kMotionProfileDefault : motionProfileForName(argv[3]);
+      if (argc < 4 || (profile == kMotionProfileDefault && strcmp(argv[3], "default"))) {
+        fprintf(stderr, "Usage: viscaptz --setpresetprofile <preset number> [default|logistic|trapezoid|jerk]\n");
+        exit(1);
+      }
+      exit(setPresetMotionProfile(atoi(argv[2]), profile) ? 0 : 1);
+    } else if (!strcmp(argv[1], "--settour")) {
+      // Each stop is a preset number, optionally followed by @ and a dwell time in seconds.
+      tour_stop_t stops[MAX_TOUR_STOPS];
+      int numStops = argc - 3;
+      if (argc < 4 || numStops > MAX_TOUR_STOPS) {
+        fprintf(stderr, "Usage: viscaptz --settour <tour number> <preset>[@<dwell seconds>] ...\n");
+        exit(1);
+      }
+      for (int i = 0; i < numStops; i++) {
+        char *dwell = strchr(argv[i + 3], '@');
+        stops[i].presetNumber = atoi(argv[i + 3]);
+        stops[i].dwellMilliseconds = dwell ? (int32_t)(atof(dwell + 1) * 1000) : 0;
+      }
+      exit(saveTour(atoi(argv[2]), stops, numStops) ? 0 : 1);
+    } else if (!strcmp(argv[1], "--runtour") || !strcmp(argv[1], "--looptour")) {
+      if (argc < 3) {
+        fprintf(stderr, "Usage: viscaptz %s <tour number>\n", argv[1]);
+        exit(1);
+      }
+      uint8_t command[] = { 0x81, 0x01, 0x04, 0x3F, 0x10, 0x00, 0xFF };
+      command[4] = strcmp(argv[1], "--looptour") ? 0x10 : 0x11;
+      command[5] = atoi(argv[2]);
+      exit(sendLocalVISCACommand(command, sizeof(command)) ? 0 : 1);
+    } else if (!strcmp(argv[1], "--stoptour")) {
+      uint8_t command[] = { 0x81, 0x01, 0x04, 0x3F, 0x12, 0x00, 0xFF };
+      exit(sendLocalVISCACommand(command, sizeof(command)) ? 0 : 1);
 #if USE_MOTOR_PAN_AND_TILT
     } else if (!strcmp(argv[1], "--setswappedmotors")) {
       if (argc < 3) {
@@ -654,7 +1239,8 @@ int main(int argc, char *argv[]) {
 #pragma mark - Generic move routines
 
 int actionProgress(int axis, int64_t startPosition, int64_t curPosition, int64_t endPosition,
-                   int64_t previousPosition, int *stalls, bool usingTimeComputation) {
+                   int64_t previousPosition, double estimatedVelocity, int *stalls,
+                   bool usingTimeComputation, bool drivingAxis) {
   bool localDebug = false;
   int64_t progress = llabs(curPosition - startPosition);
   int64_t total = llabs(endPosition - startPosition);
@@ -668,10 +1254,16 @@ int actionProgress(int axis, int64_t startPosition, int64_t curPosition, int64_t
   }
 
   // For position-based computation, we don't count stalls before the
-  // motor starts moving.  For time-based computation, we count all
-  // stalls equally.
-  if ( (usingTimeComputation || (startPosition != curPosition)) &&
-       (previousPosition == curPosition) ) {
+  // motor starts moving.  For time-based computation, we count stalls
+  // only while the axis is being driven (its setpoint is ahead of it,
+  // and it is being commanded at a speed that should move it), because
+  // the controller legitimately stops the motor at the start of a slow
+  // ramp and whenever the axis gets ahead.  Use the estimated speed
+  // rather than comparing consecutive readings, because a slow-moving
+  // axis often reports the same position several ticks in a row without
+  // being stalled.
+  if ( (usingTimeComputation ? drivingAxis : (startPosition != curPosition)) &&
+       (fabs(estimatedVelocity) < kAxisStallVelocity) ) {
     // We may have slowed down to the point where the motors no longer move.
     // Don't keep wasting power and heating up the motors.
     *stalls = (*stalls) + 1;
@@ -683,8 +1275,8 @@ int actionProgress(int axis, int64_t startPosition, int64_t curPosition, int64_t
     }
   } else {
     if (localDebug) {
-      fprintf(stderr, "Axis %d NOT STALLED (%" PRId64 " == %" PRId64 " && %" PRId64 " != %" PRId64 ")\n",
-              axis, startPosition, curPosition, previousPosition, curPosition);
+      fprintf(stderr, "Axis %d NOT STALLED (%" PRId64 " == %" PRId64 " && %lf pps)\n",
+              axis, startPosition, curPosition, estimatedVelocity);
     }
     *stalls = 0;
   }
@@ -720,37 +1312,291 @@ int actionProgress(int axis, int64_t startPosition, int64_t curPosition, int64_t
   return (tenth_percent < 0) ? 0 : (tenth_percent > 1000) ? 1000 : tenth_percent;
 }
 
-/// Computes the speed for pan, tilt, and zoom motors on a scale of -1000 to 1000 (core speed).
+/// Returns the speed fraction from the analytic s-curve at the specified point in the ramp.
 ///
-///     @param progress         How much progress has been made (in tenths of a percent
-///                             of the total move length).
-///     @param peakSpeed        The computed maximum speed for the move, computed by
-///                             a prior call to peakSpeedForMove().
-int computeSpeed(int progress, int peakSpeed) {
-    if (progress < kRampUpPeriodEnd || progress > kRampDownPeriodStart) {
-        int decipercentProgressToStartOrEnd = (progress >= kRampDownPeriodStart) ? (1000 - progress) : progress;
+///     @param rampProgress     How far into the ramp-up period the axis is (in tenths of a
+///                             percent of the total move length, from 0 to kRampUpPeriodEnd).
+static double analyticSCurveFraction(double rampProgress) {
+  // Convert the ramp progress to the range 0..100.
+  double percentOfRampDuration = (rampProgress * 100.0) / kRampUpPeriodEnd;
+  double exponent = 7.0 - ((7.0 * percentOfRampDuration) / 50.0);
+  return 1 / (1 + pow(M_E, exponent));
+}
 
-        // Depending on whether you run this function before or after calibrating the
-        // motor speed, the progress value is either based on the percentage of progress
-        // position-wise or time-wise.  The former is extremely inaccurate, giving fairly
-        // jerky motion, but that's the best you can do without knowing the maximum speed
-        // of the motor.
-        //
-        // After you calibrate the motor speed, this uses a time-based curve.  The explanation
-        // below tells how this works.
-        //
-        // From 20% to 80%, the motor moves at its maximum speed.  On either end, the motor's
-        // speed is computed based on an s-curve, computed as follows:
-        //
-        // With vertical acccuracy of ± .1% at the two endpoints (i.e. 0.001 at the bottom,
-        //     0.999 at the top):
-        //
-        // 1 / (1 + e^-x) would give us a curve of length 14 from -7 to 7.
-        // 1 / (1 + e^-(x*7)) would give us a curve of length 14 from -1 to 1.
-        // 1 / (1 + e^-((x*7 / 50)) would give us a curve of length 100 from -50 to 50.
-        // 1 / (1 + e^-(((x - 50)*7 / 50)) gives us a curve from 0 to 100 (one tenth the
-        //                                 progress period).
-        // 1 / (1 + e^-(7x/50 - 7)) is simplified.
+// Public function.  Docs in header.
+void initSCurveTable(void) {
+  assert(sizeof(gSCurveTable) / sizeof(gSCurveTable[0]) == kRampUpPeriodEnd + 1);
+  for (int i = 0; i <= kRampUpPeriodEnd; i++) {
+    gSCurveTable[i] = (int32_t)round(analyticSCurveFraction(i) * S_CURVE_ONE);
+  }
+
+  // Integrate with the trapezoid rule.  The area is in fixed point, times decipercent.
+  gSCurveAreaTable[0] = 0;
+  for (int i = 1; i <= kRampUpPeriodEnd; i++) {
+    gSCurveAreaTable[i] = gSCurveAreaTable[i - 1] + ((gSCurveTable[i - 1] + gSCurveTable[i]) / 2);
+  }
+}
+
+/// Returns the s-curve speed fraction (in fixed point, where S_CURVE_ONE is full speed)
+/// for a point in the ramp-up period, linearly interpolating between table entries.
+///
+///     @param rampProgress     How far into the ramp-up period the axis is (in tenths of a
+///                             percent of the total move length, from 0 to kRampUpPeriodEnd),
+///                             in fixed point with S_CURVE_PROGRESS_FRACTION_BITS fractional
+///                             bits.
+static int32_t sCurveFractionForRampProgress(int32_t rampProgress) {
+  int32_t maxProgress = kRampUpPeriodEnd << S_CURVE_PROGRESS_FRACTION_BITS;
+  rampProgress = (rampProgress < 0) ? 0 : (rampProgress > maxProgress) ? maxProgress : rampProgress;
+
+  int32_t index = rampProgress >> S_CURVE_PROGRESS_FRACTION_BITS;
+  int32_t remainder = rampProgress & ((1 << S_CURVE_PROGRESS_FRACTION_BITS) - 1);
+  if (remainder == 0) {
+    return gSCurveTable[index];
+  }
+  int32_t delta = gSCurveTable[index + 1] - gSCurveTable[index];
+  return gSCurveTable[index] + ((delta * remainder) >> S_CURVE_PROGRESS_FRACTION_BITS);
+}
+
+/// Returns the area under the ramp-up part of the s-curve from the start of the ramp
+/// through the specified (fixed point) ramp progress value.
+static int64_t sCurveAreaForRampProgress(int32_t rampProgress) {
+  int32_t maxProgress = kRampUpPeriodEnd << S_CURVE_PROGRESS_FRACTION_BITS;
+  rampProgress = (rampProgress < 0) ? 0 : (rampProgress > maxProgress) ? maxProgress : rampProgress;
+
+  int32_t index = rampProgress >> S_CURVE_PROGRESS_FRACTION_BITS;
+  int32_t remainder = rampProgress & ((1 << S_CURVE_PROGRESS_FRACTION_BITS) - 1);
+  int64_t partialArea = ((int64_t)(gSCurveTable[index] + sCurveFractionForRampProgress(rampProgress)) *
+                         remainder) >> (S_CURVE_PROGRESS_FRACTION_BITS + 1);
+  return gSCurveAreaTable[index] + partialArea;
+}
+
+/// Returns the fraction of the total move distance that an axis following the s-curve
+/// should have covered at the specified point in the move, from 0 to 1.
+///
+///     @param progress         How much time has elapsed (in tenths of a percent of
+///                             the total move duration), in fixed point with
+///                             S_CURVE_PROGRESS_FRACTION_BITS fractional bits.
+double sCurveDistanceFractionForProgress(int32_t progress) {
+  int32_t rampEnd = kRampUpPeriodEnd << S_CURVE_PROGRESS_FRACTION_BITS;
+  int32_t rampDownStart = kRampDownPeriodStart << S_CURVE_PROGRESS_FRACTION_BITS;
+  int32_t end = 1000 << S_CURVE_PROGRESS_FRACTION_BITS;
+  int64_t rampArea = gSCurveAreaTable[kRampUpPeriodEnd];
+  int64_t totalArea = (2 * rampArea) + ((int64_t)(kRampDownPeriodStart - kRampUpPeriodEnd) * S_CURVE_ONE);
+
+  if (progress <= 0) {
+    return 0;
+  } else if (progress >= end) {
+    return 1;
+  } else if (progress < rampEnd) {
+    return (double)sCurveAreaForRampProgress(progress) / totalArea;
+  } else if (progress <= rampDownStart) {
+    int64_t fullSpeedArea = ((int64_t)(progress - rampEnd) * S_CURVE_ONE) >> S_CURVE_PROGRESS_FRACTION_BITS;
+    return (double)(rampArea + fullSpeedArea) / totalArea;
+  }
+  return 1.0 - ((double)sCurveAreaForRampProgress(end - progress) / totalArea);
+}
+
+/// Returns the fraction of peak speed (0 to 1) at the specified point in the move.
+///
+///     @param progress         How much time has elapsed (in tenths of a percent of
+///                             the total move duration), in fixed point with
+///                             S_CURVE_PROGRESS_FRACTION_BITS fractional bits.
+static double sCurveSpeedFractionForProgress(int32_t progress) {
+  int32_t end = 1000 << S_CURVE_PROGRESS_FRACTION_BITS;
+  int32_t progressToStartOrEnd = MIN(progress, end - progress);
+  if (progressToStartOrEnd >= (kRampUpPeriodEnd << S_CURVE_PROGRESS_FRACTION_BITS)) {
+    return 1;
+  }
+  return (double)sCurveFractionForRampProgress(progressToStartOrEnd) / S_CURVE_ONE;
+}
+
+/// Returns the average speed across an entire s-curve move as a fraction of its peak speed.
+static double sCurveAverageSpeedFraction(void) {
+  int64_t totalArea = (2 * gSCurveAreaTable[kRampUpPeriodEnd]) +
+                      ((int64_t)(kRampDownPeriodStart - kRampUpPeriodEnd) * S_CURVE_ONE);
+  return (double)totalArea / (1000.0 * S_CURVE_ONE);
+}
+
+/// Converts a fraction of the move duration into fixed point s-curve progress.
+static int32_t sCurveProgressForTimeFraction(double timeFraction) {
+  return (int32_t)(timeFraction * (1000 << S_CURVE_PROGRESS_FRACTION_BITS));
+}
+
+static double logisticSpeedFraction(double timeFraction) {
+  return sCurveSpeedFractionForProgress(sCurveProgressForTimeFraction(timeFraction));
+}
+
+static double logisticDistanceFraction(double timeFraction) {
+  return sCurveDistanceFractionForProgress(sCurveProgressForTimeFraction(timeFraction));
+}
+
+// The trapezoid accelerates at a constant rate for kTrapezoidRampFraction of the move,
+// so the ramps average half speed, and the whole move averages 1 - kTrapezoidRampFraction.
+static double trapezoidSpeedFraction(double timeFraction) {
+  double timeToStartOrEnd = MIN(timeFraction, 1 - timeFraction);
+  return (timeToStartOrEnd >= kTrapezoidRampFraction) ? 1 : MAX(timeToStartOrEnd, 0) / kTrapezoidRampFraction;
+}
+
+static double trapezoidAverageSpeedFraction(void) {
+  return 1 - kTrapezoidRampFraction;
+}
+
+static double trapezoidDistanceFraction(double timeFraction) {
+  double ramp = kTrapezoidRampFraction;
+  double distance;
+  if (timeFraction <= 0) {
+    return 0;
+  } else if (timeFraction >= 1) {
+    return 1;
+  } else if (timeFraction < ramp) {
+    distance = (timeFraction * timeFraction) / (2 * ramp);
+  } else if (timeFraction <= 1 - ramp) {
+    distance = (ramp / 2) + (timeFraction - ramp);
+  } else {
+    double remaining = 1 - timeFraction;
+    return 1 - (((remaining * remaining) / (2 * ramp)) / trapezoidAverageSpeedFraction());
+  }
+  return distance / trapezoidAverageSpeedFraction();
+}
+
+// The jerk-limited profile ramps up over kJerkLimitedRampFraction of the move in three
+// segments: increasing acceleration (constant positive jerk), constant acceleration, and
+// decreasing acceleration (constant negative jerk).  The ramp down mirrors the ramp up.
+// Each ramp is symmetric about its midpoint, so it averages half speed.
+static double jerkLimitedAverageSpeedFraction(void) {
+  return 1 - kJerkLimitedRampFraction;
+}
+
+/// Returns the speed (0 to 1) and distance (in normalized time times speed) during the
+/// ramp-up period of the jerk-limited profile.
+static void jerkLimitedRamp(double time, double *speed, double *distance) {
+  double ramp = kJerkLimitedRampFraction;
+  double jerkTime = kJerkLimitedRampFraction * kJerkLimitedJerkFraction;
+  double acceleration = 1 / (ramp - jerkTime);  // Peak acceleration; reaches speed 1 at the ramp end.
+
+  time = MAX(MIN(time, ramp), 0);
+  if (time < jerkTime) {
+    *speed = (acceleration * time * time) / (2 * jerkTime);
+    *distance = (acceleration * time * time * time) / (6 * jerkTime);
+  } else if (time < ramp - jerkTime) {
+    double constantTime = time - jerkTime;
+    *speed = (acceleration * jerkTime / 2) + (acceleration * constantTime);
+    *distance = (acceleration * jerkTime * jerkTime / 6) + (acceleration * jerkTime / 2 * constantTime) +
+                (acceleration * constantTime * constantTime / 2);
+  } else {
+    double remaining = ramp - time;
+    *speed = 1 - ((acceleration * remaining * remaining) / (2 * jerkTime));
+    *distance = (ramp / 2) - (remaining - ((acceleration * remaining * remaining * remaining) / (6 * jerkTime)));
+  }
+}
+
+static double jerkLimitedSpeedFraction(double timeFraction) {
+  double speed, distance;
+  jerkLimitedRamp(MIN(timeFraction, 1 - timeFraction), &speed, &distance);
+  return speed;
+}
+
+static double jerkLimitedDistanceFraction(double timeFraction) {
+  double ramp = kJerkLimitedRampFraction;
+  double speed, distance;
+  if (timeFraction <= 0) {
+    return 0;
+  } else if (timeFraction >= 1) {
+    return 1;
+  } else if (timeFraction < ramp) {
+    jerkLimitedRamp(timeFraction, &speed, &distance);
+  } else if (timeFraction <= 1 - ramp) {
+    distance = (ramp / 2) + (timeFraction - ramp);
+  } else {
+    jerkLimitedRamp(1 - timeFraction, &speed, &distance);
+    return 1 - (distance / jerkLimitedAverageSpeedFraction());
+  }
+  return distance / jerkLimitedAverageSpeedFraction();
+}
+
+/** The available motion profiles, indexed by motion_profile_t. */
+static const motion_profile_ops_t kMotionProfiles[kNumMotionProfiles] = {
+  [kMotionProfileLogistic] = { "logistic", logisticSpeedFraction, logisticDistanceFraction,
+                               sCurveAverageSpeedFraction },
+  [kMotionProfileTrapezoid] = { "trapezoid", trapezoidSpeedFraction, trapezoidDistanceFraction,
+                                trapezoidAverageSpeedFraction },
+  [kMotionProfileJerkLimited] = { "jerk", jerkLimitedSpeedFraction, jerkLimitedDistanceFraction,
+                                  jerkLimitedAverageSpeedFraction },
+};
+
+/// Returns the implementation of a motion profile, resolving kMotionProfileDefault.
+static const motion_profile_ops_t *opsForMotionProfile(motion_profile_t profile) {
+  if (profile <= kMotionProfileDefault || profile >= kNumMotionProfiles) {
+    profile = activeMotionProfile();
+  }
+  return &kMotionProfiles[profile];
+}
+
+// Public function.  Docs in header.
+motion_profile_t motionProfileForName(const char *name) {
+  for (motion_profile_t profile = kMotionProfileLogistic; profile < kNumMotionProfiles; profile++) {
+    if (name != NULL && !strcmp(name, kMotionProfiles[profile].name)) {
+      return profile;
+    }
+  }
+  return kMotionProfileDefault;
+}
+
+// Public function.  Docs in header.
+motion_profile_t activeMotionProfile(void) {
+  if (gRecallMotionProfile > kMotionProfileDefault && gRecallMotionProfile < kNumMotionProfiles) {
+    return gRecallMotionProfile;
+  }
+  return gDefaultMotionProfile;
+}
+
+// Public function.  Docs in header.
+void loadDefaultMotionProfile(void) {
+  char *name = getConfigKey(kMotionProfileKey);
+  motion_profile_t profile = motionProfileForName(name);
+  free(name);
+  gDefaultMotionProfile = (profile == kMotionProfileDefault) ? kMotionProfileLogistic : profile;
+}
+
+// Public function.  Docs in header.
+double fastestDurationForProfile(motion_profile_t profile, int64_t distance, int64_t maxPPS) {
+  if (maxPPS == 0) {
+    return 0;
+  }
+  return (double)llabs(distance) / ((double)maxPPS * opsForMotionProfile(profile)->averageSpeedFraction());
+}
+
+
+/// Computes the speed for pan, tilt, and zoom motors on a scale of -1000 to 1000 (core speed).
+///
+///     @param progress         How much progress has been made (in tenths of a percent
+///                             of the total move length).
+///     @param peakSpeed        The maximum speed for the move (in core speed).
+int computeSpeed(int progress, int peakSpeed) {
+    if (progress < kRampUpPeriodEnd || progress > kRampDownPeriodStart) {
+        int decipercentProgressToStartOrEnd = (progress >= kRampDownPeriodStart) ? (1000 - progress) : progress;
+
+        // Depending on whether you run this function before or after calibrating the
+        // motor speed, the progress value is either based on the percentage of progress
+        // position-wise or time-wise.  The former is extremely inaccurate, giving fairly
+        // jerky motion, but that's the best you can do without knowing the maximum speed
+        // of the motor.
+        //
+        // After you calibrate the motor speed, this uses a time-based curve.  The explanation
+        // below tells how this works.
+        //
+        // From 20% to 80%, the motor moves at its maximum speed.  On either end, the motor's
+        // speed is computed based on an s-curve, computed as follows:
+        //
+        // With vertical acccuracy of ± .1% at the two endpoints (i.e. 0.001 at the bottom,
+        //     0.999 at the top):
+        //
+        // 1 / (1 + e^-x) would give us a curve of length 14 from -7 to 7.
+        // 1 / (1 + e^-(x*7)) would give us a curve of length 14 from -1 to 1.
+        // 1 / (1 + e^-((x*7 / 50)) would give us a curve of length 100 from -50 to 50.
+        // 1 / (1 + e^-(((x - 50)*7 / 50)) gives us a curve from 0 to 100 (one tenth the
+        //                                 progress period).
+        // 1 / (1 + e^-(7x/50 - 7)) is simplified.
         // 1 / (1 + e^(7 - (7x/50))) is fully simplified.
         //
         // The integral of this is -(1/7)((-50 * ln (1+e^(7-(7x /50))))-7x+350).
@@ -831,16 +1677,448 @@ int computeSpeed(int progress, int peakSpeed) {
         // each hardware speed is to the expected values, and can adjust them accordingly.
 
         // The value of decipercentProgressToStartOrEnd is in the range 0..kRampUpPeriodEnd.
-        // Convert that to the range 0..100.
-        double percentOfRampDuration = (decipercentProgressToStartOrEnd * 100.0) / kRampUpPeriodEnd;
-        double exponent = 7.0 - ((7.0 * percentOfRampDuration) / 50.0);
-        double speedFromProgress = 1 / (1 + pow(M_E, exponent));
-        return round(speedFromProgress * 1.0 * peakSpeed);
+        // The curve itself is precomputed by initSCurveTable() so that this function
+        // does not need to call pow() on every tick of the control loop.
+        int64_t fraction =
+            sCurveFractionForRampProgress(decipercentProgressToStartOrEnd << S_CURVE_PROGRESS_FRACTION_BITS);
+        int64_t scaledSpeed = ((fraction * llabs(peakSpeed)) + (S_CURVE_ONE / 2)) >> S_CURVE_FRACTION_BITS;
+        return (peakSpeed < 0) ? -scaledSpeed : scaledSpeed;
     } else {
         return peakSpeed;
     }
 }
 
+// Public function.  Docs in header.
+//
+// Reads the estimator noise model from the configuration file.
+double axisEstimatorProcessNoise(void) {
+  int64_t value = getConfigKeyInteger(kEstimatorProcessNoiseKey);
+  return (value > 0) ? value : kDefaultEstimatorProcessNoise;
+}
+
+// Public function.  Docs in header.
+double axisEstimatorMeasurementNoise(void) {
+  int64_t value = getConfigKeyInteger(kEstimatorMeasurementNoiseKey);
+  return (value > 0) ? value : kDefaultEstimatorMeasurementNoise;
+}
+
+// Public function.  Docs in header.
+void resetAxisEstimator(axis_estimator_t *estimator, double processNoise, double measurementNoise) {
+  memset(estimator, 0, sizeof(*estimator));
+  estimator->processNoise = processNoise;
+  estimator->measurementNoise = measurementNoise;
+}
+
+// Public function.  Docs in header.
+//
+// This is a steady-state alpha-beta filter.  The position gain comes from the
+// tracking index (the ratio of the motion uncertainty over one sample interval to
+// the measurement uncertainty), using Kalata's relation, and is recomputed on every
+// sample because the interval between samples varies.  The velocity gain uses the
+// Benedict-Bordner relation rather than the Kalman one, because the Kalman gain
+// becomes badly underdamped when the samples are far apart (as with P2 zoom data).
+void updateAxisEstimator(axis_estimator_t *estimator, int64_t position, int64_t timestamp) {
+  if (!estimator->initialized) {
+    estimator->position = position;
+    estimator->velocity = 0;
+    estimator->lastUpdateTime = timestamp;
+    estimator->initialized = true;
+    return;
+  }
+
+  double deltaTime = NANOS_TO_SECONDS(timestamp - estimator->lastUpdateTime);
+  if (deltaTime <= 0) {
+    return;
+  }
+
+  double trackingIndex = (estimator->processNoise * deltaTime * deltaTime) /
+                         MAX(estimator->measurementNoise, 1e-6);
+  double r = (4 + trackingIndex - sqrt((8 * trackingIndex) + (trackingIndex * trackingIndex))) / 4;
+  double alpha = 1 - (r * r);
+  double beta = (alpha * alpha) / (2 - alpha);
+
+  double predictedPosition = estimator->position + (estimator->velocity * deltaTime);
+  double residual = position - predictedPosition;
+
+  estimator->position = predictedPosition + (alpha * residual);
+  estimator->velocity += (beta * residual) / deltaTime;
+  estimator->lastUpdateTime = timestamp;
+}
+
+// Public function.  Docs in header.
+double predictedAxisEstimatorPosition(const axis_estimator_t *estimator, int64_t timestamp) {
+  if (!estimator->initialized) {
+    return 0;
+  }
+  return estimator->position +
+         (estimator->velocity * NANOS_TO_SECONDS(timestamp - estimator->lastUpdateTime));
+}
+
+// Public function.  Docs in header.
+void resetAxisController(axis_identifier_t axis) {
+  memset(&gAxisController[axis], 0, sizeof(gAxisController[axis]));
+}
+
+/// Computes the core speed (0 to 1000, in the direction of motion) for an axis that is
+/// following a time-parameterized position setpoint.
+///
+/// The expected velocity at this point in the move is used as feedforward (the
+/// calibration tables then translate the resulting core speed into the hardware speed
+/// that produces that velocity), and a PID term corrects any difference between the
+/// expected and actual distance travelled.  The derivative term compares the expected
+/// velocity with the estimator's velocity, so the controller reacts as soon as the axis
+/// starts to lag, before a large position error builds up.  The integral only accumulates while the
+/// output is not saturated (or while the error is pulling it back out of saturation),
+/// so a stalled or slow axis does not cause an overshoot once it breaks free.
+///
+/// While the setpoint is ahead of the axis, a positive output is never allowed to drop
+/// below the slowest speed that actually moves the motor.  Otherwise, the start and end of
+/// a slow ramp (where the feedforward speed rounds to zero) would never move the axis,
+/// because the integral is capped and the error stays under one position.
+///
+///     @param axis             The axis being moved.
+///     @param setpointDistance How far the axis should have moved from its start
+///                             position by now (in positions).
+///     @param actualDistance   How far the axis has actually moved toward its
+///                             target (in positions, negative if it moved away).
+///     @param feedforwardPPS   The expected velocity at this point in the move (in
+///                             positions per second).
+///     @param actualPPS        The estimated velocity of the axis toward its target
+///                             (in positions per second).
+///     @param maxPPS           The number of positions per second that the axis
+///                             moves at its maximum speed.
+///     @param minimumSpeed     The slowest core speed that moves the axis.
+///     @param currentTime      The current monotonic timestamp (in nanoseconds).
+int updateAxisController(axis_identifier_t axis, double setpointDistance, double actualDistance,
+                         double feedforwardPPS, double actualPPS, int64_t maxPPS,
+                         int minimumSpeed, int64_t currentTime) {
+  bool localDebug = false;
+  axis_controller_t *controller = &gAxisController[axis];
+
+  if (maxPPS <= 0) {
+    return 0;
+  }
+
+  double error = setpointDistance - actualDistance;
+  double deltaTime = controller->hasPreviousUpdate ?
+      NANOS_TO_SECONDS(currentTime - controller->previousTime) : 0;
+  double velocityError = feedforwardPPS - actualPPS;
+
+  double maxIntegral = (kControllerMaxIntegralFraction * maxPPS) / kControllerIntegralGain;
+  double candidateIntegral = controller->integral + (error * deltaTime);
+  candidateIntegral = MAX(MIN(candidateIntegral, maxIntegral), -maxIntegral);
+
+  double outputPPS = feedforwardPPS + (kControllerProportionalGain * error) +
+                     (kControllerIntegralGain * candidateIntegral) +
+                     (kControllerVelocityGain * velocityError);
+  double coreSpeed = (outputPPS * SCALE_CORE) / maxPPS;
+
+  // Never reverse direction mid-move (that just causes hunting around the setpoint),
+  // and never exceed the maximum speed.
+  bool saturatedHigh = (coreSpeed > SCALE_CORE);
+  bool saturatedLow = (coreSpeed < 0);
+  if ((!saturatedHigh && !saturatedLow) || (saturatedHigh && error < 0) || (saturatedLow && error > 0)) {
+    controller->integral = candidateIntegral;
+  }
+  controller->saturated = saturatedHigh || saturatedLow;
+  controller->previousTime = currentTime;
+  controller->hasPreviousUpdate = true;
+
+  int speed = saturatedHigh ? SCALE_CORE : saturatedLow ? 0 : (int)round(coreSpeed);
+  if (error > 0 && coreSpeed > 0 && speed < minimumSpeed) {
+    speed = minimumSpeed;
+  }
+
+  if (localDebug) {
+    fprintf(stderr, "Axis %s setpoint: %lf actual: %lf error: %lf ff: %lf pps actual: %lf pps "
+                    "integral: %lf speed: %d%s\n",
+            nameForAxis(axis), setpointDistance, actualDistance, error, feedforwardPPS,
+            actualPPS, controller->integral, speed,
+            controller->saturated ? " (SATURATED)" : "");
+  }
+  return speed;
+}
+
+static void fillTrajectorySetpoints(axis_trajectory_t *trajectory, int64_t distance, double duration);
+
+/// Plans the move that setAxisPositionIncrementally just set up for the specified axis.
+///
+/// This caches the direction of motion (after any encoder reversal), the motor directions,
+/// and the axis's maximum speed, and for time-based moves, fills in the axis's setpoint
+/// array with the expected position and velocity at every control loop tick.
+static void planAxisTrajectory(axis_identifier_t axis) {
+  bool localDebug = false;
+  axis_trajectory_t *trajectory = &gAxisTrajectory[axis];
+  int64_t startPosition = gAxisMoveStartPosition[axis];
+  int64_t targetPosition = gAxisMoveTargetPosition[axis];
+
+  // Left/up values are treated as positive (ignoring any inversion required if the motor is
+  // backwards).  Right/down are negative.
+  //
+  // Normal encoder:   Higher values are left.  So a higher value (left of current) means
+  //                   positive motor speeds
+  // Reversed encoder: Higher values are right.  So a higher value (right of current) means
+  //                   negative motor speeds.
+  trajectory->direction = (targetPosition > startPosition) ? 1 : -1;
+  if ((axis == axis_identifier_pan && panEncoderReversed()) ||
+      (axis == axis_identifier_tilt && tiltEncoderReversed()) ||
+      (axis == axis_identifier_zoom && zoomEncoderReversed())) {
+    trajectory->direction = -trajectory->direction;
+  }
+
+  // Setting the speed of one of the motor axes also resends the other's speed, so
+  // refresh the reversal information for every axis.
+  gAxisMotorDirection[axis_identifier_pan] = panMotorReversed() ? -1 : 1;
+  gAxisMotorDirection[axis_identifier_tilt] = tiltMotorReversed() ? -1 : 1;
+  gAxisMotorDirection[axis_identifier_zoom] = zoomMotorReversed() ? -1 : 1;
+
+  trajectory->profile = activeMotionProfile();
+  trajectory->maxPositionsPerSecond =
+      maximumPositionsPerSecondForAxisInDirection(axis, trajectory->direction);
+  trajectory->minimumSpeed = minimumMovingSpeedForAxis(axis, trajectory->maxPositionsPerSecond);
+  trajectory->numSetpoints = 0;
+  trajectory->setpointInterval = kTrajectorySetpointInterval;
+
+#if !EXPERIMENTAL_TIME_PROGRESS
+  gAxisDuration[axis] = 0;
+#endif
+
+  // Without calibration data, the only option is position-based progress.
+  if (trajectory->maxPositionsPerSecond == 0) {
+    gAxisDuration[axis] = 0;
+  }
+
+  double duration = gAxisDuration[axis];
+  if (duration <= 0) {
+    if (localDebug) {
+      fprintf(stderr, "Axis %s planned position-based move (direction %d)\n",
+              nameForAxis(axis), trajectory->direction);
+    }
+    return;
+  }
+
+  fillTrajectorySetpoints(trajectory, llabs(targetPosition - startPosition), duration);
+
+  if (localDebug) {
+    fprintf(stderr, "Axis %s planned %d setpoints %lf seconds apart (direction %d, profile %s)\n",
+            nameForAxis(axis), trajectory->numSetpoints, trajectory->setpointInterval,
+            trajectory->direction, opsForMotionProfile(trajectory->profile)->name);
+  }
+}
+
+/// Fills in the setpoints for a move of the specified distance (in positions) and duration
+/// (in seconds), using the profile specified in the trajectory.
+static void fillTrajectorySetpoints(axis_trajectory_t *trajectory, int64_t distance, double duration) {
+  const motion_profile_ops_t *ops = opsForMotionProfile(trajectory->profile);
+  double peakPositionsPerSecond = (distance / duration) / ops->averageSpeedFraction();
+
+  trajectory->setpointInterval = MAX(kTrajectorySetpointInterval, duration / (MAX_TRAJECTORY_SETPOINTS - 1));
+  trajectory->numSetpoints = MIN(MAX_TRAJECTORY_SETPOINTS,
+                                 (int)ceil(duration / trajectory->setpointInterval) + 1);
+
+  for (int i = 0; i < trajectory->numSetpoints; i++) {
+    double timeFraction = MIN(i * trajectory->setpointInterval, duration) / duration;
+    trajectory->setpoints[i].position = distance * ops->distanceFraction(timeFraction);
+    trajectory->setpoints[i].velocity = peakPositionsPerSecond * ops->speedFraction(timeFraction);
+  }
+}
+
+/// Returns the planned position and velocity for an axis at the specified number of
+/// seconds after the start of its move, interpolating between setpoints.
+static trajectory_setpoint_t trajectorySetpointForAxisAtTime(axis_identifier_t axis, double elapsedTime) {
+  axis_trajectory_t *trajectory = &gAxisTrajectory[axis];
+  trajectory_setpoint_t result = { 0, 0 };
+
+  if (trajectory->numSetpoints == 0) {
+    return result;
+  }
+
+  double index = MAX(elapsedTime, 0) / trajectory->setpointInterval;
+  int lowerIndex = (int)index;
+  if (lowerIndex >= trajectory->numSetpoints - 1) {
+    return trajectory->setpoints[trajectory->numSetpoints - 1];
+  }
+
+  double fraction = index - lowerIndex;
+  trajectory_setpoint_t *lower = &trajectory->setpoints[lowerIndex];
+  trajectory_setpoint_t *upper = &trajectory->setpoints[lowerIndex + 1];
+  result.position = lower->position + ((upper->position - lower->position) * fraction);
+  result.velocity = lower->velocity + ((upper->velocity - lower->velocity) * fraction);
+  return result;
+}
+
+/// Returns the time (in seconds after the start of its move) at which an axis's planned
+/// trajectory reaches the specified distance from its start position.
+static double trajectoryTimeForAxisAtDistance(axis_identifier_t axis, double distance) {
+  axis_trajectory_t *trajectory = &gAxisTrajectory[axis];
+  if (trajectory->numSetpoints == 0 || distance <= trajectory->setpoints[0].position) {
+    return 0;
+  }
+
+  // The planned position never decreases, so binary search for the surrounding setpoints.
+  int lower = 0;
+  int upper = trajectory->numSetpoints - 1;
+  if (distance >= trajectory->setpoints[upper].position) {
+    return upper * trajectory->setpointInterval;
+  }
+  while (upper - lower > 1) {
+    int middle = (lower + upper) / 2;
+    if (trajectory->setpoints[middle].position <= distance) {
+      lower = middle;
+    } else {
+      upper = middle;
+    }
+  }
+  double span = trajectory->setpoints[upper].position - trajectory->setpoints[lower].position;
+  double fraction = (span > 0) ? (distance - trajectory->setpoints[lower].position) / span : 0;
+  return (lower + fraction) * trajectory->setpointInterval;
+}
+
+// Public function.  Docs in header.
+double planCoordinatedMove(moveModeFlags flags, const int64_t *positions, int64_t startTime,
+                           double *axisDurations, int64_t *axisStartTimes) {
+  bool localDebug = false;
+  static const moveModeFlags axisFlags[NUM_AXES] = { kFlagMovePan, kFlagMoveTilt, kFlagMoveZoom };
+  double duration = durationForMove(flags, positions[axis_identifier_pan],
+                                    positions[axis_identifier_tilt], positions[axis_identifier_zoom]);
+
+  // Scale each axis's profile to the common duration, within that axis's speed limits.
+  // The duration from durationForMove is long enough for every axis, but an axis that
+  // is barely moving may not be able to move slowly enough to take that long.
+  double commonDuration = 0;
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    axisDurations[axis] = (flags & axisFlags[axis]) ?
+        makeDurationValid(axis, duration, positions[axis]) : 0;
+    commonDuration = MAX(commonDuration, axisDurations[axis]);
+  }
+
+  // Start those axes late, so that they still arrive with the others.
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    double offset = (axisDurations[axis] > 0) ? (commonDuration - axisDurations[axis]) : 0;
+    axisStartTimes[axis] = startTime + SECONDS_TO_NANOS(offset);
+    if (localDebug) {
+      fprintf(stderr, "Axis %s: duration %lf, starting after %lf of %lf seconds\n",
+              nameForAxis(axis), axisDurations[axis], offset, commonDuration);
+    }
+  }
+  return (commonDuration > 0) ? commonDuration : duration;
+}
+
+// Public function.  Docs in header.
+void beginCoordinatedMove(int64_t startTime, double duration) {
+  coordinated_move_t *move = &gCoordinatedMove;
+  move->active = false;
+  move->startTime = startTime;
+  move->previousUpdateTime = startTime;
+  move->elapsed = 0;
+  move->rate = 1;
+  move->duration = duration;
+
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    axis_trajectory_t *trajectory = &gAxisTrajectory[axis];
+
+    // Only axes that the control loop moves along a planned trajectory can wait for each
+    // other.  Position-based moves and moves handled by the camera itself run on their own.
+    bool moving = gAxisMoveInProgress[axis] && gAxisDuration[axis] > 0 && trajectory->numSetpoints > 0;
+
+    move->moving[axis] = moving;
+    move->startOffset[axis] = moving ? NANOS_TO_SECONDS(gAxisStartTime[axis] - startTime) : 0;
+    move->lag[axis] = 0;
+    move->active = move->active || moving;
+  }
+}
+
+/// Returns how far (in seconds) an axis is into its move, or a negative value if it should
+/// not start yet.  Axes in a coordinated move use the shared clock, which runs slower than
+/// real time while they wait for a lagging axis.
+static double elapsedTimeForAxis(axis_identifier_t axis, int64_t currentTime) {
+  if (gCoordinatedMove.active && gCoordinatedMove.moving[axis]) {
+    return gCoordinatedMove.elapsed - gCoordinatedMove.startOffset[axis];
+  }
+  return NANOS_TO_SECONDS(currentTime - gAxisStartTime[axis]);
+}
+
+/// Advances the shared clock of the current coordinated move to the specified time at its
+/// current rate, and returns the real time that passed (in seconds).  Ends the coordinated
+/// move once none of its axes are still moving.
+static double advanceCoordinatedMoveClock(int64_t currentTime) {
+  coordinated_move_t *move = &gCoordinatedMove;
+  bool stillMoving = false;
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    stillMoving = stillMoving || (move->moving[axis] && gAxisMoveInProgress[axis]);
+  }
+  if (!stillMoving) {
+    move->active = false;
+    return 0;
+  }
+
+  double deltaTime = MAX(NANOS_TO_SECONDS(currentTime - move->previousUpdateTime), 0);
+  move->elapsed += deltaTime * move->rate;
+  move->previousUpdateTime = currentTime;
+  return deltaTime;
+}
+
+/// Measures how far each axis in the current coordinated move lags its trajectory (the
+/// difference between the shared clock and the time at which the trajectory reaches the
+/// axis's actual position), and slows the shared clock while any axis is too far behind
+/// the others, so that they wait for it instead of arriving first.
+///
+///     @param positions        The current position of each axis.
+///     @param positionValid    Whether each entry in positions was read on this tick.
+///     @param deltaTime        The real time since the previous update (in seconds).
+static void synchronizeCoordinatedMove(const int64_t *positions, const bool *positionValid,
+                                       double deltaTime) {
+  bool localDebug = false;
+  coordinated_move_t *move = &gCoordinatedMove;
+  double maxLag = -INFINITY;
+  double minLag = INFINITY;
+
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    move->lag[axis] = 0;
+    if (!move->moving[axis] || !positionValid[axis] || !gAxisMoveInProgress[axis]) {
+      continue;
+    }
+
+    // An axis that is still creeping toward its target after its time is up is behind by
+    // however long the trajectory says the rest of the move should take.
+    double elapsedTime = MIN(move->elapsed - move->startOffset[axis], gAxisDuration[axis]);
+    if (elapsedTime <= 0) {
+      continue;
+    }
+
+    int64_t startPosition = gAxisMoveStartPosition[axis];
+    int64_t targetPosition = gAxisMoveTargetPosition[axis];
+    double actualDistance = (targetPosition > startPosition) ? (positions[axis] - startPosition) :
+                                                               (startPosition - positions[axis]);
+
+    // Give each axis the benefit of the doubt for the positions that its encoder and
+    // speed steps can't resolve.  Otherwise, a short, slow move looks like it stutters.
+    move->lag[axis] = elapsedTime -
+        trajectoryTimeForAxisAtDistance(axis, actualDistance + kCoordinatedMoveLagPositions);
+    maxLag = MAX(maxLag, move->lag[axis]);
+    minLag = MIN(minLag, move->lag[axis]);
+  }
+
+  // Only the difference between the axes matters.  If they are all behind (for example,
+  // because none of the motors can move as slowly as the start of the ramp), slowing the
+  // clock down would only make it harder for them to get going.  An axis that is ahead
+  // (one that can't move as slowly as planned) doesn't need the others to slow down either.
+  double spread = (maxLag > minLag) ? (maxLag - MAX(minLag, 0)) : 0;
+  double targetRate = 1;
+  if (spread > kCoordinatedMoveLagTolerance) {
+    targetRate = MAX(kCoordinatedMoveMinimumRate,
+                     1 - (kCoordinatedMoveSyncGain * (spread - kCoordinatedMoveLagTolerance)));
+  }
+  double maxChange = kCoordinatedMoveMaxRateChange * deltaTime;
+  move->rate += MAX(MIN(targetRate - move->rate, maxChange), -maxChange);
+
+  if (localDebug) {
+    fprintf(stderr, "Coordinated move: elapsed %lf lag %lf/%lf/%lf rate %lf\n", move->elapsed,
+            move->lag[axis_identifier_pan], move->lag[axis_identifier_tilt],
+            move->lag[axis_identifier_zoom], move->rate);
+  }
+}
+
 bool moveInProgress(void) {
   for (axis_identifier_t axis = axis_identifier_pan ; axis < NUM_AXES; axis++) {
     if (gAxisMoveInProgress[axis]) {
@@ -850,66 +2128,78 @@ bool moveInProgress(void) {
   return false;
 }
 
+static void advanceMoveQueue(int64_t currentTime);
+
 void handleRecallUpdates(void) {
   int localDebug = 0;
+  int64_t currentTime = monotonicTimeNanos();
+  double deltaTime = gCoordinatedMove.active ? advanceCoordinatedMoveClock(currentTime) : 0;
+
+  // Read every moving axis's position first, so that a coordinated move can compare all of
+  // the axes before adjusting any of them.
+  int64_t axisPositions[NUM_AXES] = { 0 };
+  double axisElapsedTimes[NUM_AXES] = { 0 };
+  bool axisStarted[NUM_AXES] = { false };
+  for (axis_identifier_t axis = axis_identifier_pan ; axis < NUM_AXES; axis++) {
+    if (gAxisMoveInProgress[axis]) {
+      axisElapsedTimes[axis] = elapsedTimeForAxis(axis, currentTime);
+      if (axisElapsedTimes[axis] >= 0) {
+        axisPositions[axis] = getAxisPosition(axis);
+        updateAxisEstimator(&gAxisEstimator[axis], axisPositions[axis], currentTime);
+        axisStarted[axis] = true;
+      }
+    }
+  }
+  if (gCoordinatedMove.active) {
+    synchronizeCoordinatedMove(axisPositions, axisStarted, deltaTime);
+  }
 
   for (axis_identifier_t axis = axis_identifier_pan ; axis < NUM_AXES; axis++) {
     if (gAxisMoveInProgress[axis]) {
       if (localDebug) {
         fprintf(stderr, "UPDATING AXIS %d\n", axis);
       }
+      axis_trajectory_t *trajectory = &gAxisTrajectory[axis];
       int64_t startPosition = gAxisMoveStartPosition[axis];
       int64_t targetPosition = gAxisMoveTargetPosition[axis];
 
-      // Compute how far into the motion we are (with a range of 0 to 1,000).
-      int direction = (targetPosition > startPosition) ? 1 : -1;
+      // The direction (including any encoder reversal) was computed when the move was planned.
+      int direction = trajectory->direction;
       if (localDebug) {
         fprintf(stderr, "Axis %d direction %d\n", axis, direction);
       }
 
-      // Left/up values are treated as positive (ignoring any inversion required if the motor is
-      // backwards).  Right/down are negative.
-      //
-      // Normal encoder:   Higher values are left.  So a higher value (left of current) means
-      //                   positive motor speeds
-      // Reversed encoder: Higher values are right.  So a higher value (right of current) means
-      //                   negative motor speeds.
-      if ((axis == axis_identifier_pan && panEncoderReversed()) ||
-          (axis == axis_identifier_tilt && tiltEncoderReversed()) ||
-          (axis == axis_identifier_zoom && zoomEncoderReversed())) {
-        if (localDebug) {
-          fprintf(stderr, "Axis %d reversed\n", axis);
-        }
-        direction = -direction;
+      if (!axisStarted[axis]) {
         if (localDebug) {
-          fprintf(stderr, "Axis %d direction now %d\n", axis, direction);
+          fprintf(stderr, "Axis start time is in the future.  Doing nothing.\n");
         }
-      } else if (localDebug) {
-        fprintf(stderr, "Axis %d not reversed.\n", axis);
+        continue;  // Go on the the next axis.
       }
 
-      if (localDebug) {
-        fprintf(stderr, "Axis %d updated direction %d\n", axis, direction);
-      }
-      int64_t axisPosition = getAxisPosition(axis);
-#if EXPERIMENTAL_TIME_PROGRESS
+      int64_t axisPosition = axisPositions[axis];
       double duration = gAxisDuration[axis];
-#else
-      double duration = 0;
-#endif
+      double elapsedTime = axisElapsedTimes[axis];
+      axis_estimator_t *estimator = &gAxisEstimator[axis];
+      trajectory_setpoint_t setpoint = trajectorySetpointForAxisAtTime(axis, elapsedTime);
+
+      // How far the axis has gone past its target (negative if it hasn't reached it).
+      int64_t overshoot = (targetPosition > startPosition) ? (axisPosition - targetPosition) :
+                                                             (targetPosition - axisPosition);
+
+      // A time-based move is only stalled if the axis should be moving: it is behind its
+      // setpoint (or is being driven back after overshooting), and the last command was
+      // fast enough to move the motor.
+      double estimatedDistance = (targetPosition > startPosition) ?
+          (estimator->position - startPosition) : (startPosition - estimator->position);
+      bool drivingAxis = ((setpoint.position > estimatedDistance) ||
+                          (overshoot > kAxisSettleTolerance)) &&
+                         (llabs(gAxisLastMoveSpeed[axis]) >= trajectory->minimumSpeed);
+
+      // Compute how far into the motion we are (with a range of 0 to 1,000).
       int moveProgressByPosition = actionProgress(axis, startPosition, axisPosition,
                                                   targetPosition, gAxisPreviousPosition[axis],
-                                                  &gAxisStalls[axis], (duration != 0));
-#if EXPERIMENTAL_TIME_PROGRESS
-      double currentTime = timeStamp();
-      double remainingTime = gAxisStartTime[axis] + duration - currentTime;
-
-      if (gAxisStartTime[axis] > currentTime) { 
-        if (localDebug) {
-          fprintf(stderr, "Axis start time is in the future.  Doing nothing.\n");
-        }
-        continue;  // Go on the the next axis.
-      }
+                                                  estimator->velocity, &gAxisStalls[axis],
+                                                  (duration != 0), drivingAxis);
 
       // Time-based computation can be slightly imprecise.  If the progress based on position is
       // 1000, we're done with this axis no matter what the wall clock says.  And of course, if
@@ -918,17 +2208,18 @@ void handleRecallUpdates(void) {
       // guarantee that we don't move.
       bool usingPositionBasedProgress = (duration == 0 || moveProgressByPosition == 1000);
 
-      int moveProgressByTime = usingPositionBasedProgress ? 0 : 1000 - ((1000.0 * remainingTime ) / duration);
+      int moveProgressByTime = usingPositionBasedProgress ? 0 : MIN(1000, (int)((1000.0 * elapsedTime) / duration));
       int moveProgress = usingPositionBasedProgress ? moveProgressByPosition : moveProgressByTime;
 
       if (usingPositionBasedProgress && localDebug) {
         fprintf(stderr, "WARNING: NO DURATION AVAILABLE FOR RECALL COMMAND.\n");
       } else if (localDebug) {
-        fprintf(stderr, "Axis %s START: %lf END: %lf CURRENT: %lf REMAINING: %lf\n"
+        fprintf(stderr, "Axis %s START: %lf END: %lf CURRENT: %lf ELAPSED: %lf\n"
                         "DURATION: %lf PROGRESS: %d\n",
                 nameForAxis(axis),
-                gAxisStartTime[axis], gAxisStartTime[axis] + duration,
-                currentTime, remainingTime,
+                NANOS_TO_SECONDS(gAxisStartTime[axis]),
+                NANOS_TO_SECONDS(gAxisStartTime[axis]) + duration,
+                NANOS_TO_SECONDS(currentTime), elapsedTime,
                 duration, moveProgressByTime);
         fprintf(stderr, "Axis %s STARTPOS: %" PRId64 " ENDPOS: %" PRId64
                         " CURRENTPOS: %" PRId64 " REMAININGPOS: %" PRId64 "\n",
@@ -937,105 +2228,59 @@ void handleRecallUpdates(void) {
                 axisPosition, llabs(targetPosition - axisPosition));
       }
 
-      int peakSpeed = usingPositionBasedProgress ? 1000 :
-          peakSpeedForMove(axis, startPosition, targetPosition, duration);
-
-      // Cap the maximum speed if we don't have calibration data.
-      if (usingPositionBasedProgress && gAxisMoveMaxSpeed[axis] != 0) {
-        peakSpeed = MIN(peakSpeed, gAxisMoveMaxSpeed[axis]);
-      }
-
-      // In the middle part of the move, make sure we don't run behind or ahead too much.
-      // We know when we plan to start slowing down, and that's a good enough goalpost.
-      if ((!usingPositionBasedProgress) && moveProgressByTime >= kRampUpPeriodEnd &&
-          moveProgressByTime <= kRampDownPeriodStart) {
-
-          // When the slowdown begins at the 80% mark, it should be at 90% of the final position,
-          // because it will move at, on average, half speed for 20% of the duration.
-          int64_t moveDistanceBeforeStartOfSlowdown =
-              moveDistanceFractionBeforeSlowdown * llabs(targetPosition - startPosition);
-
-          // First some debugging data.
-          double kFullSpeedPeriodByTime = kRampDownPeriodStart - kRampUpPeriodEnd;
-          double kFullSpeedPeriodByDistance = kRampUpPeriodEnd;
-          int expectedMoveProgressByPosition =
-              // Progress during first kRampUpPeriodEnd positions
-              50 +
-              // Progress from 20 to 80 scaled to be from 10 to 90.
-              ((moveProgressByTime - kRampUpPeriodEnd) * kFullSpeedPeriodByDistance / kFullSpeedPeriodByTime);
-
-          if (localDebug) {
-            fprintf(stderr, "Axis %s progressByTime: %d\n", nameForAxis(axis), moveProgress);
-            fprintf(stderr, "Axis %s expected progress: %d actual: %d\n", nameForAxis(axis),
-                    expectedMoveProgressByPosition, moveProgressByPosition);
-            fprintf(stderr, "Axis %s peak speed before adjustment: %d\n", nameForAxis(axis), peakSpeed);
-          }
-
-          // Compute how long we have left to move at peak speed.
-          double timeBeforeSlowingDown = MAX(remainingTime - (0.1 * duration), 0);
-          if (localDebug) {
-            fprintf(stderr, "Axis %s time before slowing down: %lf\n", nameForAxis(axis), timeBeforeSlowingDown);
-          }
-
-          // Update the peak speed.
-          int64_t maxPPSForAxis = maximumPositionsPerSecondForAxis(axis);
-          int64_t distanceMoved = llabs(axisPosition - startPosition);
-          int64_t distanceLeft = moveDistanceBeforeStartOfSlowdown - distanceMoved;
-
-          if (localDebug) {
-            fprintf(stderr, "Axis %s max PPS for axis: %" PRId64" remaining distance: %" PRId64 "\n",
-                    nameForAxis(axis), maxPPSForAxis, distanceLeft);
-          }
-
-          peakSpeed = (1000.0 * distanceLeft) / (maxPPSForAxis * timeBeforeSlowingDown);
-
-          if (localDebug) {
-            fprintf(stderr, "Axis %s peak speed after adjustment: %d\n", nameForAxis(axis), peakSpeed);
-          }
-      }
       bool creeping = (moveProgress == 1000) && (moveProgressByPosition < 1000);
-#else
-      bool usingPositionBasedProgress = true;
-      int moveProgress = moveProgressByPosition;
-      int peakSpeed = 1000;
-      bool creeping = false;
-#endif
-
-      bool axisPositionHasChanged = (gAxisPreviousPosition[axis] != axisPosition);
-
-      if (axisPositionHasChanged) {
-        double deltaTimeSinceLastChange = currentTime - gAxisPreviousPositionTimestamp[axis];
-        uint64_t deltaPositionSinceLastChange = axisPosition - gAxisPreviousPosition[axis];
-        int64_t maxPPSForAxis = maximumPositionsPerSecondForAxis(axis);
-        double targetPPS = peakSpeed * maxPPSForAxis / 1000.0;
+      bool settling = (duration > 0) && (elapsedTime < duration + kAxisSettleTime);
 
+      if (gAxisPreviousPosition[axis] != axisPosition) {
         if (localDebug) {
+          int64_t deltaPositionSinceLastChange = axisPosition - gAxisPreviousPosition[axis];
           fprintf(stderr, "POSITION CHANGE: %" PRId64 "\n", deltaPositionSinceLastChange);
-          fprintf(stderr, "TIME CHANGE: %lf\n", deltaTimeSinceLastChange);
-          fprintf(stderr, "COMPUTED SPEED: %lf pps EXPECTED: %lf pps\n",
-                  (double)((int)deltaPositionSinceLastChange / deltaTimeSinceLastChange),
-                  targetPPS);
+          fprintf(stderr, "ESTIMATED POSITION: %lf SPEED: %lf pps\n",
+                  estimator->position, estimator->velocity);
         }
 
         gAxisPreviousPosition[axis] = axisPosition;
-        gAxisPreviousPositionTimestamp[axis] = currentTime;
       }
 
-
       if (moveProgress == 1000) {
         if (creeping) {
           // If we have reached the expected elapsed time but have not yet hit the target position,
-          // creep as slowly as possible.  To do this, set the axis speed to +/-1 (the minimum nonzero
-          // value).  The scaling function will increase that value as needed to ensure that the motor
-          // does not stall.
+          // creep as slowly as possible.  To do this, set the axis speed to the slowest core speed
+          // that moves the motor.  (Any slower nonzero speed would be scaled up to the same
+          // hardware speed, but would not count as driving the axis for stall detection.)
           if (localDebug) {
             fprintf(stderr, "CREEPING TO FINAL POSITION AT MINIMUM SPEED\n");
           }
-          setAxisSpeed(axis, 1 * direction, false);
+          setPlannedAxisSpeed(axis, trajectory->minimumSpeed * direction, false);
 
           if (localDebug) {
             fprintf(stderr, "SPEEDINFO AXIS: %d POS: %04d TIME: %04d SPEED: %d (CREEP)\n",
-                    axis, moveProgressByPosition, usingPositionBasedProgress ? -1 : moveProgress, 1 * direction);
+                    axis, moveProgressByPosition, usingPositionBasedProgress ? -1 : moveProgress,
+                    trajectory->minimumSpeed * direction);
+          }
+        } else if (settling && overshoot > kAxisSettleTolerance &&
+                   gAxisStalls[axis] <= kAxisStallThreshold) {
+          // If the axis coasted past its target, drive it back, slowing down as it gets
+          // closer, so that it doesn't overshoot in the other direction.  (If the motor
+          // can't move, the stall counter eventually gives up.)
+          int speed = trajectory->minimumSpeed;
+          if (trajectory->maxPositionsPerSecond > 0) {
+            double positionsPerSecond = overshoot / kAxisCorrectionTime;
+            speed = MAX(speed, MIN(SCALE_CORE, (int)ceil((positionsPerSecond * SCALE_CORE) /
+                                                         trajectory->maxPositionsPerSecond)));
+          }
+          if (localDebug) {
+            fprintf(stderr, "CORRECTING OVERSHOOT OF %" PRId64 " AT SPEED %d\n", overshoot,
+                    -speed * direction);
+          }
+          if (-speed * direction != gAxisLastMoveSpeed[axis]) {
+            setPlannedAxisSpeed(axis, -speed * direction, false);
+          }
+        } else if (settling && fabs(estimator->velocity) >= kAxisStallVelocity) {
+          // The axis reached its target, but is still coasting.  Stop driving it, and wait
+          // to see where it ends up before deciding whether the move is complete.
+          if (gAxisLastMoveSpeed[axis] != 0) {
+            setPlannedAxisSpeed(axis, 0, false);
           }
         } else {
           // If we have reached the target position, stop all motion on the axis.
@@ -1044,7 +2289,7 @@ void handleRecallUpdates(void) {
           }
           gAxisMoveInProgress[axis] = false;
           gAxisStalls[axis] = 0;
-          setAxisSpeed(axis, 0, false);
+          setPlannedAxisSpeed(axis, 0, false);
           if (localDebug) {
             fprintf(stderr, "SPEEDINFO AXIS: %d POS: %04d TIME: %04d SPEED: %d (stopped)\n",
                     axis, moveProgressByPosition, usingPositionBasedProgress ? -1 : moveProgress, 0 * direction);
@@ -1059,17 +2304,33 @@ void handleRecallUpdates(void) {
         // increases, so if the motor stalls (no motion) at a given voltage, the speed
         // would never increase, so the motor would never start moving.
         //
-        // Do not use a minimum speed if we are using wall clock time, because computed
-        // progress doesn't depend on the motors changing the encoder position.
-        int speed = usingPositionBasedProgress ?
-            MAX(computeSpeed(moveProgress, peakSpeed), MIN_PAN_TILT_SPEED) :
-            computeSpeed(moveProgress, peakSpeed);
-
-        if (axisPositionHasChanged || usingPositionBasedProgress || moveProgress < kRampUpPeriodEnd ||
-            moveProgress > kRampDownPeriodStart || gAxisLastMoveSpeed[axis] == 0) {
-          setAxisSpeed(axis, speed * direction, localDebug);
-        } else if (localDebug) {
-          fprintf(stderr, "Skipping speed change to avoid feedback drift because axis position has not changed.\n");
+        // With a duration, the closed-loop controller instead tracks the trajectory that
+        // was planned when the move started.  Progress along the trajectory doesn't depend
+        // on the motors changing the encoder position, so the controller only enforces the
+        // axis's slowest moving speed while the axis is behind its setpoint.
+        int speed;
+        if (usingPositionBasedProgress) {
+          int peakSpeed = (gAxisMoveMaxSpeed[axis] != 0) ? MIN(SCALE_CORE, gAxisMoveMaxSpeed[axis]) : SCALE_CORE;
+          speed = MAX(computeSpeed(moveProgress, peakSpeed), MIN_PAN_TILT_SPEED);
+        } else {
+          double actualDistance = (targetPosition > startPosition) ? (axisPosition - startPosition) :
+                                                                     (startPosition - axisPosition);
+          double actualVelocity = (targetPosition > startPosition) ? estimator->velocity :
+                                                                     -estimator->velocity;
+
+          // While a coordinated move's clock runs slow, so does the setpoint.
+          double feedforwardVelocity = setpoint.velocity;
+          if (gCoordinatedMove.active && gCoordinatedMove.moving[axis]) {
+            feedforwardVelocity *= gCoordinatedMove.rate;
+          }
+          speed = updateAxisController(axis, setpoint.position, actualDistance, feedforwardVelocity,
+                                       actualVelocity, trajectory->maxPositionsPerSecond,
+                                       trajectory->minimumSpeed, currentTime);
+        }
+
+        // Only talk to the hardware when the speed actually changes.
+        if (usingPositionBasedProgress || (speed * direction) != gAxisLastMoveSpeed[axis]) {
+          setPlannedAxisSpeed(axis, speed * direction, localDebug);
         }
         if (localDebug) {
             fprintf(stderr, "SPEEDINFO AXIS: %d POS: %04d TIME: %04d SPEED: %d (%s)\n",
@@ -1084,6 +2345,8 @@ void handleRecallUpdates(void) {
       fprintf(stderr, "NOT UPDATING AXIS %d: NOT IN MOTION\n", axis);
     }
   }
+
+  advanceMoveQueue(currentTime);
 }
 
 // Returns the integer value that is at least as far from zero as
@@ -1117,9 +2380,12 @@ double absceil(double value) {
 // possible given motors' tendency to stall out at low speeds.
 // If fromScale is not the core scale, the value is first converted
 // to that scale.
+//
+// The lookup itself is a single array index into the inverse (core to
+// hardware) table that convertSpeedValues stores after the scaled data.
+// The inverse table is built with scaleSpeedByScanning, so both paths
+// always return the same value.
 int scaleSpeed(int speed, int fromScale, int toScale, int32_t *scaleData) {
-  bool localDebug = false;
-
   if (scaleData == NULL) {
     return absceil((speed * 1.0 * toScale) / fromScale);
   }
@@ -1139,14 +2405,30 @@ int scaleSpeed(int speed, int fromScale, int toScale, int32_t *scaleData) {
     absSpeed = scaleSpeed(absSpeed, fromScale, SCALE_CORE, NULL);
   }
 
+  if (absSpeed > SCALE_CORE) {
+    return scaleSpeedByScanning(absSpeed, toScale, scaleData) * sign;
+  }
+  return inverseScaleDataForScaleData(scaleData, toScale)[absSpeed] * sign;
+}
+
+// Returns the hardware speed (0..toScale) for a core speed (0 or more) by
+// searching the forward (hardware to core) table in scaleData.  This is
+// used to build the inverse table, and for out-of-range input values.
+int scaleSpeedByScanning(int absSpeed, int toScale, int32_t *scaleData) {
+  bool localDebug = false;
+
+  if (absSpeed == 0) {
+    return 0;
+  }
+
   // Find the lowest speed that is at least as large as the
   // target speed.
   for (int i = 0; i <= toScale; i++) {
     if (scaleData[i] == absSpeed) {
-      int retval = i * sign;
+      int retval = i;
       if (localDebug) {
         fprintf(stderr, "SCALED %d to %d.  ERROR: %d (%lf%%)\n",
-                speed, retval, abs(absSpeed - scaleData[i]),
+                absSpeed, retval, abs(absSpeed - scaleData[i]),
                 100 * fabs(1.0 * absSpeed - scaleData[i]) / absSpeed);
       }
       return retval;
@@ -1162,10 +2444,10 @@ int scaleSpeed(int speed, int fromScale, int toScale, int32_t *scaleData) {
       // not the responsiblity of the VISCA interpreter/
       // motor controller.)
       if (scaleData[i - 1] == 0) {
-        int retval = i * sign;
+        int retval = i;
         if (localDebug) {
           fprintf(stderr, "SCALED %d to %d.  ERROR: %d (%lf%%)\n",
-                  speed, retval, abs(absSpeed - scaleData[i]),
+                  absSpeed, retval, abs(absSpeed - scaleData[i]),
                   100 * fabs(1.0 * absSpeed - scaleData[i]) / absSpeed);
         }
         return retval;
@@ -1177,10 +2459,10 @@ int scaleSpeed(int speed, int fromScale, int toScale, int32_t *scaleData) {
       int distanceBelow = absSpeed - scaleData[i-1];
       int distanceAbove = scaleData[i] - absSpeed;
       int chosenIndex = ((distanceAbove < distanceBelow) ? i : i-1);
-      int retval = chosenIndex * sign;
+      int retval = chosenIndex;
       if (localDebug) {
         fprintf(stderr, "SCALED %d to %d.  ERROR: %d (%lf%%)\n",
-                speed, retval, abs(absSpeed - scaleData[chosenIndex]),
+                absSpeed, retval, abs(absSpeed - scaleData[chosenIndex]),
                 100 * fabs(1.0 * absSpeed - scaleData[chosenIndex]) / absSpeed);
       }
       return retval;
@@ -1188,10 +2470,10 @@ int scaleSpeed(int speed, int fromScale, int toScale, int32_t *scaleData) {
   }
   // If we ran off the end, return the maximum speed.
   int chosenIndex = toScale;
-  int retval = chosenIndex * sign;
+  int retval = chosenIndex;
   if (localDebug) {
     fprintf(stderr, "SCALED %d to %d.  ERROR: %d (%lf%%)\n",
-            speed, retval, abs(absSpeed - scaleData[chosenIndex]),
+            absSpeed, retval, abs(absSpeed - scaleData[chosenIndex]),
             100 * fabs(1.0 * absSpeed - scaleData[chosenIndex]) / absSpeed);
   }
   return retval;
@@ -1213,14 +2495,28 @@ int32_t *convertSpeedValues(int64_t *speedValues, int maxSpeed, axis_identifier_
       fprintf(stderr, "You should recalibrate immediately\n");
       scale_max = maxSpeed;
   }
+  // The forward (hardware to core) table is followed immediately by the
+  // inverse (core to hardware) table, so that callers can keep passing
+  // a single pointer around.
   int32_t *outputValues =
-      (int32_t *)malloc((maxSpeed + 1) * sizeof(int32_t));
+      (int32_t *)malloc((maxSpeed + 1 + SCALE_CORE + 1) * sizeof(int32_t));
   for (int i = 0; i <= maxSpeed; i++) {
       outputValues[i] = speedValues[i] * 1000 / scale_max;
   }
+
+  int32_t *inverseValues = inverseScaleDataForScaleData(outputValues, maxSpeed);
+  for (int i = 0; i <= SCALE_CORE; i++) {
+      inverseValues[i] = scaleSpeedByScanning(i, maxSpeed, outputValues);
+  }
   return outputValues;
 }
 
+// Returns a pointer to the inverse (core to hardware) table that
+// convertSpeedValues stores after the scaled data for an axis.
+int32_t *inverseScaleDataForScaleData(int32_t *scaleData, int maxSpeed) {
+  return &scaleData[maxSpeed + 1];
+}
+
 int getInteractiveScale() {
   bool localDebug = true;
 
@@ -1271,6 +2567,9 @@ int64_t scaleVISCAZoomSpeedToCoreSpeed(int speed) {
 }
 
 int64_t getAxisPosition(axis_identifier_t axis) {
+  if (gMotorSimulationActive) {
+    return motorSimEncoderPosition(&gSimulatedAxes[axis]) * gSimulatedEncoderDirection[axis];
+  }
   switch(axis) {
     case axis_identifier_pan:
     case axis_identifier_tilt:
@@ -1293,7 +2592,7 @@ int64_t getAxisPosition(axis_identifier_t axis) {
   return 0;
 }
 
-bool setZoomPosition(int64_t position, int64_t speed, double duration, double startTime) {
+bool setZoomPosition(int64_t position, int64_t speed, double duration, int64_t startTime) {
     bool localDebug = false;
 
     if (localDebug) {
@@ -1304,12 +2603,19 @@ bool setZoomPosition(int64_t position, int64_t speed, double duration, double st
         duration = durationForMove(kFlagMoveZoom, kUnusedPosition, kUnusedPosition, position);
     }
 
+    // Simulated axes are always moved incrementally, whatever the real hardware does.
+    if (gMotorSimulationActive) {
+        return setAxisPositionIncrementally(axis_identifier_zoom, position, speed,
+                                            makeDurationValid(axis_identifier_zoom, duration, position),
+                                            startTime);
+    }
+
     return SET_ZOOM_POSITION(position, speed, makeDurationValid(axis_identifier_zoom, duration, position), startTime);
 }
 
 bool setPanTiltPosition(int64_t panPosition, int64_t panSpeed,
                         int64_t tiltPosition, int64_t tiltSpeed, double duration,
-                        double panStartTime, double tiltStartTime) {
+                        int64_t panStartTime, int64_t tiltStartTime) {
     bool localDebug = false;
 
     if (localDebug) {
@@ -1332,6 +2638,15 @@ bool setPanTiltPosition(int64_t panPosition, int64_t panSpeed,
         duration = durationForMove(kFlagMovePan | kFlagMoveTilt, panPosition, tiltPosition, kUnusedPosition);
     }
 
+    if (gMotorSimulationActive) {
+        return setAxisPositionIncrementally(axis_identifier_pan, panPosition, panSpeed,
+                                            makeDurationValid(axis_identifier_pan, duration, panPosition),
+                                            panStartTime) &&
+               setAxisPositionIncrementally(axis_identifier_tilt, tiltPosition, tiltSpeed,
+                                            makeDurationValid(axis_identifier_tilt, duration, tiltPosition),
+                                            tiltStartTime);
+    }
+
     return SET_PAN_TILT_POSITION(panPosition, panSpeed, tiltPosition, tiltSpeed,
                                  makeDurationValid(axis_identifier_pan, duration, panPosition),
                                  makeDurationValid(axis_identifier_tilt, duration, tiltPosition),
@@ -1377,14 +2692,29 @@ double makeDurationValid(axis_identifier_t axis, double duration, int64_t positi
  * target position that quickly or slowly.
  *
  * If it is not possible to make all axes reach the destination simultaneously because of speed
- * differences, this returns the longer of the possible durations, and one axis will just finish
- * sooner.
+ * differences, this returns the longer of the possible durations, and planCoordinatedMove starts
+ * the other axes late so that they still arrive together.
  *
  * Additionally, this caps the maximum amount of change at +/- 25% to prevent a massively slow or
  * fast axis (or a very short move) from changing things too severely.
  */
 double durationForMove(moveModeFlags flags, int64_t panPosition, int64_t tiltPosition, int64_t zoomPosition) {
+  int64_t fromPositions[NUM_AXES];
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    fromPositions[axis] = getAxisPosition(axis);
+  }
+  int64_t toPositions[NUM_AXES] = { panPosition, tiltPosition, zoomPosition };
+  return durationForMoveBetweenPositions(flags, fromPositions, toPositions);
+}
+
+// Public function.  Docs in header.
+double durationForMoveBetweenPositions(moveModeFlags flags, const int64_t *fromPositions,
+                                       const int64_t *toPositions) {
   bool localDebug = false;
+  int64_t distances[NUM_AXES];
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    distances[axis] = toPositions[axis] - fromPositions[axis];
+  }
 
   // VISCA (or at least the PTZOptics dialect thereof) allows a range of 1 to 24.  This
   // maps those into speeds.
@@ -1424,13 +2754,13 @@ double durationForMove(moveModeFlags flags, int64_t panPosition, int64_t tiltPos
 #else
   // Compute the duration based on fractions of the speed that the axes can actually move,
   // in a manner of speaking, with a capped maximum duration of 30 seconds.
-  double longestPanDuration = slowestMoveForAxisToPosition(axis_identifier_pan, panPosition);
-  double longestTiltDuration = slowestMoveForAxisToPosition(axis_identifier_tilt, tiltPosition);
-  double longestZoomDuration = slowestMoveForAxisToPosition(axis_identifier_zoom, zoomPosition);
+  double longestPanDuration = slowestMoveForAxisDistance(axis_identifier_pan, distances[axis_identifier_pan]);
+  double longestTiltDuration = slowestMoveForAxisDistance(axis_identifier_tilt, distances[axis_identifier_tilt]);
+  double longestZoomDuration = slowestMoveForAxisDistance(axis_identifier_zoom, distances[axis_identifier_zoom]);
 
-  double shortestPanDuration = fastestMoveForAxisToPosition(axis_identifier_pan, panPosition);
-  double shortestTiltDuration = fastestMoveForAxisToPosition(axis_identifier_tilt, tiltPosition);
-  double shortestZoomDuration = fastestMoveForAxisToPosition(axis_identifier_zoom, zoomPosition);
+  double shortestPanDuration = fastestMoveForAxisDistance(axis_identifier_pan, distances[axis_identifier_pan]);
+  double shortestTiltDuration = fastestMoveForAxisDistance(axis_identifier_tilt, distances[axis_identifier_tilt]);
+  double shortestZoomDuration = fastestMoveForAxisDistance(axis_identifier_zoom, distances[axis_identifier_zoom]);
 
   if (localDebug) {
     fprintf(stderr, "longestPanDuration: %lf\n", longestPanDuration);
@@ -1484,7 +2814,7 @@ double durationForMove(moveModeFlags flags, int64_t panPosition, int64_t tiltPos
 
   // First, make sure the ideal duration is not too fast for any axis.
   if (flags & kFlagMovePan) {
-    double timeAtMaximumSpeed = fastestMoveForAxisToPosition(axis_identifier_pan, panPosition);
+    double timeAtMaximumSpeed = fastestMoveForAxisDistance(axis_identifier_pan, distances[axis_identifier_pan]);
     if (timeAtMaximumSpeed == 0) {
       if (localDebug) {
         fprintf(stderr, "Maximum speed for pan axis not available.  Ignoring axis.\n");
@@ -1498,7 +2828,7 @@ double durationForMove(moveModeFlags flags, int64_t panPosition, int64_t tiltPos
     }
   }
   if (flags & kFlagMoveTilt) {
-    double timeAtMaximumSpeed = fastestMoveForAxisToPosition(axis_identifier_tilt, tiltPosition);
+    double timeAtMaximumSpeed = fastestMoveForAxisDistance(axis_identifier_tilt, distances[axis_identifier_tilt]);
     if (timeAtMaximumSpeed == 0) {
       if (localDebug) {
         fprintf(stderr, "Maximum speed for tilt axis not available.  Ignoring axis.\n");
@@ -1512,7 +2842,7 @@ double durationForMove(moveModeFlags flags, int64_t panPosition, int64_t tiltPos
     }
   }
   if (flags & kFlagMoveZoom) {
-    double timeAtMaximumSpeed = fastestMoveForAxisToPosition(axis_identifier_zoom, zoomPosition);
+    double timeAtMaximumSpeed = fastestMoveForAxisDistance(axis_identifier_zoom, distances[axis_identifier_zoom]);
     if (timeAtMaximumSpeed == 0) {
       if (localDebug) {
         fprintf(stderr, "Maximum speed for zoom axis not available.  Ignoring axis.\n");
@@ -1528,7 +2858,7 @@ double durationForMove(moveModeFlags flags, int64_t panPosition, int64_t tiltPos
 
   // Now, make sure the ideal duration is not too slow for any axis.
   if (flags & kFlagMovePan) {
-    double timeAtMinimumSpeed = slowestMoveForAxisToPosition(axis_identifier_pan, panPosition);
+    double timeAtMinimumSpeed = slowestMoveForAxisDistance(axis_identifier_pan, distances[axis_identifier_pan]);
     if (timeAtMinimumSpeed == 0) {
       if (localDebug) {
         fprintf(stderr, "Minimum speed for pan axis not available.  Ignoring axis.\n");
@@ -1542,7 +2872,7 @@ double durationForMove(moveModeFlags flags, int64_t panPosition, int64_t tiltPos
     }
   }
   if (flags & kFlagMoveTilt) {
-    double timeAtMinimumSpeed = slowestMoveForAxisToPosition(axis_identifier_tilt, tiltPosition);
+    double timeAtMinimumSpeed = slowestMoveForAxisDistance(axis_identifier_tilt, distances[axis_identifier_tilt]);
     if (timeAtMinimumSpeed == 0) {
       if (localDebug) {
         fprintf(stderr, "Minimum speed for tilt axis not available.  Ignoring axis.\n");
@@ -1556,7 +2886,7 @@ double durationForMove(moveModeFlags flags, int64_t panPosition, int64_t tiltPos
     }
   }
   if (flags & kFlagMoveZoom) {
-    double timeAtMinimumSpeed = slowestMoveForAxisToPosition(axis_identifier_zoom, zoomPosition);
+    double timeAtMinimumSpeed = slowestMoveForAxisDistance(axis_identifier_zoom, distances[axis_identifier_zoom]);
     if (timeAtMinimumSpeed == 0) {
       if (localDebug) {
         fprintf(stderr, "Minimum speed for zoom axis not available.  Ignoring axis.\n");
@@ -1583,6 +2913,9 @@ double durationForMove(moveModeFlags flags, int64_t panPosition, int64_t tiltPos
 }
 
 int64_t minimumPositionsPerSecondForAxis(axis_identifier_t axis) {
+  if (gMotorSimulationActive) {
+    return minimumPositionsPerSecondForCalibration(&gSimulatedCalibration[axis]);
+  }
   switch(axis) {
     case axis_identifier_pan:
         return MIN_PAN_POSITIONS_PER_SECOND();
@@ -1606,69 +2939,87 @@ int64_t minimumPositionsPerSecondForData(int64_t *calibrationData, int maximumSp
   return 0;
 }
 
+// Public function.  Docs in header.
+int minimumMovingSpeedForAxis(axis_identifier_t axis, int64_t maxPPS) {
+  int64_t minimumPositionsPerSecond = minimumPositionsPerSecondForAxis(axis);
+  if (minimumPositionsPerSecond <= 0 || maxPPS <= 0) {
+    return 1;
+  }
+  return MAX(1, MIN(SCALE_CORE, (int)ceil((minimumPositionsPerSecond * (double)SCALE_CORE) / maxPPS)));
+}
+
 int64_t maximumPositionsPerSecondForAxis(axis_identifier_t axis) {
-  switch(axis) {
+  return MIN(maximumPositionsPerSecondForAxisInDirection(axis, -1),
+             maximumPositionsPerSecondForAxisInDirection(axis, 1));
+}
+
+// Modules without per-direction calibration data move at the same speed both ways.
+#ifndef MAX_PAN_POSITIONS_PER_SECOND_IN_DIRECTION
+  #define MAX_PAN_POSITIONS_PER_SECOND_IN_DIRECTION(direction) MAX_PAN_POSITIONS_PER_SECOND()
+#endif
+#ifndef MAX_TILT_POSITIONS_PER_SECOND_IN_DIRECTION
+  #define MAX_TILT_POSITIONS_PER_SECOND_IN_DIRECTION(direction) MAX_TILT_POSITIONS_PER_SECOND()
+#endif
+#ifndef MAX_ZOOM_POSITIONS_PER_SECOND_IN_DIRECTION
+  #define MAX_ZOOM_POSITIONS_PER_SECOND_IN_DIRECTION(direction) MAX_ZOOM_POSITIONS_PER_SECOND()
+#endif
+
+/// Returns true if the motor for the specified axis is reversed.  Simulated motors are never
+/// reversed.
+static bool motorReversedForAxis(axis_identifier_t axis) {
+  if (gMotorSimulationActive) {
+    return false;
+  }
+  switch (axis) {
     case axis_identifier_pan:
-        return MAX_PAN_POSITIONS_PER_SECOND();
+      return panMotorReversed();
     case axis_identifier_tilt:
-        return MAX_TILT_POSITIONS_PER_SECOND();
+      return tiltMotorReversed();
     case axis_identifier_zoom:
-        return MAX_ZOOM_POSITIONS_PER_SECOND();
+      return zoomMotorReversed();
   }
-  return 0;
+  return false;
 }
 
-// Returns the maximum core speed that the motor should move once the initial ramp-up period
-// is over, and prior to the ramp-down period beginning.
-//
-// Per the explanation in the comments for computeSpeed(), we can compute this by determining
-// the average speed and dividing by a value halfway between the total move time and the
-// time spent at full speed (because the ramp periods average 50% speed).
-//
-// We start by computing the number of positions per second given the time and distance.
-// We then divide by moveTimeFractionBeforeSlowdown.
-int peakSpeedForMove(axis_identifier_t axis, int64_t fromPosition, int64_t toPosition, double time) {
-  bool localDebug = false;
-  double peakPositionsPerSecond = (llabs(fromPosition - toPosition) / time) / moveTimeFractionBeforeSlowdown;
-
-  if (localDebug) {
-    fprintf(stderr, "Peak points per second for move along axis %d from %lld to %lld over time %lf is %lf\n",
-            axis, fromPosition, toPosition, time, peakPositionsPerSecond);
+int64_t maximumPositionsPerSecondForAxisInDirection(axis_identifier_t axis, int direction) {
+  int physicalDirection = motorReversedForAxis(axis) ? -direction : direction;
+  calibration_direction_t calibrationDirection = CALIBRATION_DIRECTION_FOR_SPEED(physicalDirection);
+  if (gMotorSimulationActive) {
+    return maximumPositionsPerSecondForCalibration(&gSimulatedCalibration[axis],
+                                                   calibrationDirection);
   }
-
-  int64_t maxPPSForAxis = maximumPositionsPerSecondForAxis(axis);
-  int peakSpeed = (peakPositionsPerSecond * 1000) / maxPPSForAxis;
-
-  if (localDebug) {
-    fprintf(stderr, "Peak speed: %d (max PPS for axis is %" PRId64 ", peakPPS is %lf)\n",
-            peakSpeed, maxPPSForAxis, peakPositionsPerSecond);
+  switch(axis) {
+    case axis_identifier_pan:
+        return MAX_PAN_POSITIONS_PER_SECOND_IN_DIRECTION(calibrationDirection);
+    case axis_identifier_tilt:
+        return MAX_TILT_POSITIONS_PER_SECOND_IN_DIRECTION(calibrationDirection);
+    case axis_identifier_zoom:
+        return MAX_ZOOM_POSITIONS_PER_SECOND_IN_DIRECTION(calibrationDirection);
   }
-
-  return peakSpeed;
+  return 0;
 }
 
 double fastestMoveForAxisToPosition(axis_identifier_t axis, int64_t position) {
-  // With 80% of the move at 100% speed and the first and last 10% transitioning from/to 0% and
-  // averaging 50%, that means the average speed through the entire move is always 90% of the
-  // maximum speed from that middle 80%.  This is a slight approximation because there is a
-  // minimum speed for the motors, but we ignore that to make the computation reasonable.
-  //
-  // Based on that, we can take the maximum number of positions per second that the axis is
-  // capable of moving at maximum speed, mutiply times moveTimeFractionBeforeSlowdown, and
-  // get the maximum average speed.
+  // Every motion profile is a fixed shape scaled to the move's distance and duration, so the
+  // average speed across the move is always the same fraction of its peak speed (for example,
+  // 80% for the logistic s-curve, which spends 20% of the move at each end ramping at an average
+  // of 50% speed).  This is a slight approximation because there is a minimum speed for the
+  // motors, but we ignore that to make the computation reasonable.
   //
-  // You can then divide the total move distance by that number, and that gives you the
-  // minimum number of seconds that the camera can spend reaching that destination (using
-  // our s-curve algorithm; it is, of course, possible to achieve a slightly shorter
-  // duration by ramping more quickly to the maximum speed).
+  // The fastest move runs at the axis's maximum speed during the middle of the move, so
+  // dividing the move distance by that fraction of the maximum speed gives the minimum
+  // number of seconds that the camera can spend reaching that destination with the
+  // active profile.
+  return fastestMoveForAxisDistance(axis, position - getAxisPosition(axis));
+}
 
+// Public function.  Docs in header.
+double fastestMoveForAxisDistance(axis_identifier_t axis, int64_t distance) {
   int64_t maximumPositionsPerSecond = maximumPositionsPerSecondForAxis(axis);
   if (maximumPositionsPerSecond == 0) {
     return 0;
   }
-  int64_t currentPosition = getAxisPosition(axis);
-  int64_t distance = llabs(position - currentPosition);
-  return (double)distance / ((double)maximumPositionsPerSecond * moveTimeFractionBeforeSlowdown);
+  return fastestDurationForProfile(kMotionProfileDefault, distance, maximumPositionsPerSecond);
 }
 
 double slowestMoveForAxisToPosition(axis_identifier_t axis, int64_t position) {
@@ -1680,14 +3031,16 @@ double slowestMoveForAxisToPosition(axis_identifier_t axis, int64_t position) {
   // speed, both because it would be too hard to compute that ramp time, and
   // because in practice, the ramp time to the slowest native speed is usually
   // negligible anyway.
+  return slowestMoveForAxisDistance(axis, position - getAxisPosition(axis));
+}
 
+// Public function.  Docs in header.
+double slowestMoveForAxisDistance(axis_identifier_t axis, int64_t distance) {
   int64_t minimumPositionsPerSecond = minimumPositionsPerSecondForAxis(axis);
   if (minimumPositionsPerSecond == 0) {
     return 0;
   }
-  int64_t currentPosition = getAxisPosition(axis);
-  int64_t distance = llabs(position - currentPosition);
-  return (double)distance / (double)minimumPositionsPerSecond;
+  return (double)llabs(distance) / (double)minimumPositionsPerSecond;
 }
 
 bool setAxisSpeed(axis_identifier_t axis, int64_t coreSpeed, bool debug) {
@@ -1699,23 +3052,46 @@ bool setAxisSpeedRaw(axis_identifier_t axis, int64_t speed, bool debug) {
 }
 
 bool setAxisSpeedInternal(axis_identifier_t axis, int64_t speed, bool debug, bool isRaw) {
+  int motorDirections[NUM_AXES];
+  motorDirections[axis_identifier_pan] = panMotorReversed() ? -1 : 1;
+  motorDirections[axis_identifier_tilt] = tiltMotorReversed() ? -1 : 1;
+  motorDirections[axis_identifier_zoom] = zoomMotorReversed() ? -1 : 1;
+
+  return setAxisSpeedWithMotorDirections(axis, speed, debug, isRaw, motorDirections);
+}
+
+bool setPlannedAxisSpeed(axis_identifier_t axis, int64_t coreSpeed, bool debug) {
+  return setAxisSpeedWithMotorDirections(axis, coreSpeed, debug, false, gAxisMotorDirection);
+}
+
+bool setAxisSpeedWithMotorDirections(axis_identifier_t axis, int64_t speed, bool debug, bool isRaw,
+                                     int *motorDirections) {
   if (debug) {
     if (gAxisLastMoveSpeed[axis] != speed) {
       fprintf(stderr, "CHANGED AXIS %d from %" PRId64 " to %" PRId64 "\n", axis, gAxisLastMoveSpeed[axis], speed);
     }
   }
 
-  int panReversed = panMotorReversed() ? -1 : 1;
-  int tiltReversed = tiltMotorReversed() ? -1 : 1;
-  int zoomReversed = zoomMotorReversed() ? -1 : 1;
+  int panReversed = motorDirections[axis_identifier_pan];
+  int tiltReversed = motorDirections[axis_identifier_tilt];
+  int zoomReversed = motorDirections[axis_identifier_zoom];
 
   if (debug) {
     fprintf(stderr, "Reverse motor direction for pan: %s tilt: %s zoom: %s\n",
-            panReversed ? "YES" : "NO", tiltReversed ? "YES" : "NO", zoomReversed ? "YES" : "NO");
+            (panReversed < 0) ? "YES" : "NO", (tiltReversed < 0) ? "YES" : "NO",
+            (zoomReversed < 0) ? "YES" : "NO");
   }
 
   gAxisLastMoveSpeed[axis] = speed;
 
+  // Simulated motors are never reversed.  Encoder reversal is part of the simulation.
+  if (gMotorSimulationActive) {
+    int scale = gSimulatedAxes[axis].params.hardwareScale;
+    int64_t hardwareSpeed = isRaw ? speed : scaleSpeed(speed, SCALE_CORE, scale, scaleDataForSpeed(&gSimulatedCalibration[axis], speed));
+    motorSimSetSpeed(&gSimulatedAxes[axis], (int)hardwareSpeed);
+    return true;
+  }
+
   switch(axis) {
     case axis_identifier_pan:
         return SET_PAN_TILT_SPEED(speed * panReversed, gAxisLastMoveSpeed[axis_identifier_tilt] * tiltReversed, isRaw);
@@ -1728,6 +3104,9 @@ bool setAxisSpeedInternal(axis_identifier_t axis, int64_t speed, bool debug, boo
 }
 
 bool absolutePositioningSupportedForAxis(axis_identifier_t axis) {
+  if (gMotorSimulationActive) {
+    return true;
+  }
   switch(axis) {
     case axis_identifier_pan:
       return PAN_AND_TILT_POSITION_SUPPORTED;
@@ -1748,13 +3127,15 @@ void cancelRecallIfNeeded(char *context) {
     gAxisMoveInProgress[axis] = false;
     gAxisStalls[axis] = 0;
   }
+  gCoordinatedMove.active = false;
+  stopMoveQueue();
   if (didCancel) {
     fprintf(stderr, "RECALL CANCELLED (%s)\n", context);
   }
 }
 
 bool setAxisPositionIncrementally(axis_identifier_t axis, int64_t position, int64_t maxSpeed, double duration,
-                                  double startTime) {
+                                  int64_t startTime) {
   bool localDebug = false;
 
   if (localDebug) {
@@ -1773,14 +3154,18 @@ bool setAxisPositionIncrementally(axis_identifier_t axis, int64_t position, int6
 
   gAxisMoveInProgress[axis] = true;
   gAxisStalls[axis] = 0;
-  gAxisStartTime[axis] = startTime ?: timeStamp();
+  gAxisStartTime[axis] = startTime ?: monotonicTimeNanos();
+  gCoordinatedMove.moving[axis] = false;  // Until beginCoordinatedMove says otherwise.
   gAxisDuration[axis] = duration;
   gAxisMoveStartPosition[axis] = getAxisPosition(axis);
   gAxisMoveTargetPosition[axis] = position;
   gAxisMoveMaxSpeed[axis] = maxSpeed;
   gAxisPreviousPosition[axis] = gAxisMoveStartPosition[axis];
-  gAxisPreviousPositionTimestamp[axis] = gAxisStartTime[axis];
+  resetAxisEstimator(&gAxisEstimator[axis], axisEstimatorProcessNoise(),
+                     axisEstimatorMeasurementNoise());
   gAxisLastMoveSpeed[axis] = 0;
+  resetAxisController(axis);
+  planAxisTrajectory(axis);
 
   if (localDebug) {
     fprintf(stderr, "gAxisMoveInProgress[%d] = %s\n", axis, gAxisMoveInProgress[axis] ? "true" : "false");
@@ -1858,6 +3243,51 @@ void *runNetworkThread(void *argIgnored) {
   return NULL;
 }
 
+// Public function.  Docs in header.
+bool sendLocalVISCACommand(uint8_t *data, uint8_t len) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return false;
+  }
+
+  struct sockaddr_in server;
+  memset((char *) &server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server.sin_port = htons(52381);
+
+  visca_cmd_t command;
+  command.cmd[0] = 0x01;
+  command.cmd[1] = 0x00;
+  command.len = htons(len);
+  command.sequence_number = 0;
+  memcpy(command.data, data, len);
+  if (sendto(sock, &command, len + 8, 0, (struct sockaddr *)&server, sizeof(server)) < 0) {
+    perror("sendto");
+    close(sock);
+    return false;
+  }
+
+  fd_set read_fds;
+  FD_ZERO(&read_fds);
+  FD_SET(sock, &read_fds);
+  struct timeval timeout;
+  timeout.tv_sec = 2;
+  timeout.tv_usec = 0;
+
+  bool retval = false;
+  visca_response_t response;
+  if (select(sock + 1, &read_fds, NULL, NULL, &timeout) <= 0) {
+    fprintf(stderr, "No response.  Is viscaptz running?\n");
+  } else if (recv(sock, &response, sizeof(response), 0) >= 10) {
+    // Errors are 0x60 (see failedVISCAResponse).
+    retval = ((response.data[1] & 0xF0) != 0x60);
+  }
+  close(sock);
+  return retval;
+}
+
 bool sendVISCAResponse(visca_response_t *response, uint32_t sequenceNumber, int sock, struct sockaddr *client, socklen_t structLength) {
   uint16_t length = htons(response->len);
   response->sequence_number = sequenceNumber;
@@ -2201,6 +3631,19 @@ fprintf(stderr, "Speed: %d\n", zoomSpeed);
                           while (!sendVISCAResponse(completedVISCAResponse(), sequenceNumber, sock, client, structLength));
                           return true;
                       }
+                      break;
+                    // Nonstandard extension: tours.  Byte 5 is the tour number.
+                    case 0x10:  // Run the tour once.
+                    case 0x11:  // Run the tour repeatedly.
+                      if (startTour(presetNumber, command[4] == 0x11)) {
+                          while (!sendVISCAResponse(completedVISCAResponse(), sequenceNumber, sock, client, structLength));
+                          return true;
+                      }
+                      break;
+                    case 0x12:  // Stop the tour after the current move.
+                      stopMoveQueue();
+                      while (!sendVISCAResponse(completedVISCAResponse(), sequenceNumber, sock, client, structLength));
+                      return true;
                   }
                 }
                 break;
@@ -2427,19 +3870,35 @@ fprintf(stderr, "Speed: %d\n", zoomSpeed);
 
 #pragma mark - Preset management
 
+/// The directory that holds preset and tour files, or NULL for the current directory.
+/// The startup tests point this at a scratch directory.
+static const char *gDataDirectory = NULL;
+
 char *presetFilename(int presetNumber) {
     static char *buf = NULL;
     if (buf != NULL) {
         free(buf);
     }
-    asprintf(&buf, "preset_%d", presetNumber);
+    asprintf(&buf, "%s%spreset_%d", gDataDirectory ? gDataDirectory : "",
+             gDataDirectory ? "/" : "", presetNumber);
     return buf;
 }
 
 bool savePreset(int presetNumber) {
     preset_t preset;
+    bzero(&preset, sizeof(preset));
     bool retval = GET_PAN_TILT_POSITION(&preset.panPosition, &preset.tiltPosition);
     preset.zoomPosition = GET_ZOOM_POSITION();
+    preset.motionProfile = kMotionProfileDefault;
+
+#if NATIVE_PRESETS_SUPPORTED
+    // Also store the preset in the camera, so that it can move there on its own.  This
+    // waits for the camera to confirm, so a rejected or lost #M falls back to the
+    // locally saved position when the preset is recalled.
+    if (retval && !gMotorSimulationActive) {
+        preset.storedOnCamera = SAVE_NATIVE_PRESET(presetNumber);
+    }
+#endif
 
     if (retval) {
         FILE *fp = fopen(presetFilename(presetNumber), "w");
@@ -2474,11 +3933,7 @@ int getVISCARecallSpeed(void) {
   return getVISCAZoomSpeedFromTallyState() * 3;
 }
 
-double adjustedStartTimeForMove(double totalDuration, double shortMoveDuration, bool alignToEnd);
-
 bool recallPreset(int presetNumber) {
-    bool localDebug = false;
-
     // Do not attempt to recall positions in calibration mode!
     if (gCalibrationMode) {
         fprintf(stderr, "Ignoring recall while in calibration mode.\n");
@@ -2493,9 +3948,37 @@ bool recallPreset(int presetNumber) {
         fprintf(stderr, "Failed to load preset %d (no data)\n", presetNumber);
         return false;
     }
-    fread((void *)&preset, sizeof(preset), 1, fp);
+    fread((void *)&preset, 1, sizeof(preset), fp);  // Byte count, so that older, shorter presets load.
     fclose(fp);
 
+#if NATIVE_PRESETS_SUPPORTED
+    // If the camera stored the preset, let it move there on its own, unless the preset
+    // needs a motion profile that only a coordinated move provides.
+    if (preset.storedOnCamera && preset.motionProfile == kMotionProfileDefault &&
+        !gMotorSimulationActive) {
+        cancelRecallIfNeeded("recallPreset");
+        bool retval = RECALL_NATIVE_PRESET(presetNumber);
+        fprintf(stderr, "%s camera preset %d\n", retval ? "Recalled" : "Failed to recall",
+                presetNumber);
+        return retval;
+    }
+#endif
+
+    bool retval = recallPosition(preset.panPosition, preset.tiltPosition, preset.zoomPosition,
+                                 preset.motionProfile);
+    if (retval) {
+        fprintf(stderr, "Loaded preset %d\n", presetNumber);
+    } else {
+        fprintf(stderr, "Failed to load preset %d\n", presetNumber);
+    }
+    return retval;
+}
+
+/// Starts moving every axis to the specified positions (indexed by axis) over the specified
+/// duration, starting each axis at the specified time.  The caller is responsible for
+/// cancelling any earlier move and for setting gRecallMotionProfile.
+static bool startMoveToPositions(const int64_t *positions, double duration,
+                                 const int64_t *axisStartTimes) {
     int tallyState = GET_TALLY_STATE();
     bool onProgram = (tallyState == kTallyStateRed);
 
@@ -2504,77 +3987,91 @@ bool recallPreset(int presetNumber) {
     int tiltSpeed = onProgram ? 5 : 24;
     int zoomSpeed = getVISCAZoomSpeedFromTallyState();
 
+    bool retval = setPanTiltPosition(positions[axis_identifier_pan],
+                                     scaleVISCAPanTiltSpeedToCoreSpeed(panSpeed, false),
+                                     positions[axis_identifier_tilt],
+                                     scaleVISCAPanTiltSpeedToCoreSpeed(tiltSpeed, false),
+                                     duration, axisStartTimes[axis_identifier_pan],
+                                     axisStartTimes[axis_identifier_tilt]);
+    bool retval2 = setZoomPosition(positions[axis_identifier_zoom],
+                                   scaleVISCAZoomSpeedToCoreSpeed(zoomSpeed),
+                                   duration, axisStartTimes[axis_identifier_zoom]);
+
+    if (!retval || !retval2) {
+        if (!retval) {
+            fprintf(stderr, "    Failed to set pan and tilt position.\n");
+        }
+        if (!retval2) {
+            fprintf(stderr, "    Failed to set zoom position.\n");
+        }
+    }
+
+    return retval && retval2;
+}
+
+bool recallPosition(int64_t panPosition, int64_t tiltPosition, int64_t zoomPosition,
+                    motion_profile_t profile) {
+    bool localDebug = false;
+
+    // Use the requested motion profile for every duration computation and move below.
+    gRecallMotionProfile = profile;
+
     int64_t currentPanPosition = getAxisPosition(axis_identifier_pan);
     int64_t currentTiltPosition = getAxisPosition(axis_identifier_tilt);
     int64_t currentZoomPosition = getAxisPosition(axis_identifier_zoom);
 
     // To avoid breaking pan and tilt for devices that don't support zoom automation or vice versa,
     // set flags only for axes that are actually moving.
-    int flags = ((preset.panPosition != currentPanPosition) ? kFlagMovePan : 0) |
-                ((preset.tiltPosition != currentTiltPosition) ? kFlagMoveTilt : 0) |
-                ((preset.zoomPosition != currentZoomPosition) ? kFlagMoveZoom : 0);
+    int flags = ((panPosition != currentPanPosition) ? kFlagMovePan : 0) |
+                ((tiltPosition != currentTiltPosition) ? kFlagMoveTilt : 0) |
+                ((zoomPosition != currentZoomPosition) ? kFlagMoveZoom : 0);
 
     if (localDebug) {
       fprintf(stderr, "flags: %d\n", flags);
     }
 
-    double duration = durationForMove(flags, preset.panPosition, preset.tiltPosition, preset.zoomPosition);
+    // Pan, tilt, and zoom move as a single coordinated move, arriving together.
+    int64_t positions[NUM_AXES] = { panPosition, tiltPosition, zoomPosition };
+    double axisDurations[NUM_AXES];
+    int64_t axisStartTimes[NUM_AXES];
+    int64_t moveStartTime = monotonicTimeNanos();
+    double duration = planCoordinatedMove(flags, positions, moveStartTime, axisDurations,
+                                          axisStartTimes);
 
     if (duration == 0 && localDebug) {
         fprintf(stderr, "WARNING: durationForMove returned 0\n");
     }
 
-    bool isZoomingOut = zoomEncoderReversed() ? (preset.zoomPosition > currentZoomPosition) :
-        (currentZoomPosition > preset.zoomPosition);
+    cancelRecallIfNeeded("recallPreset");
+    bool retval = startMoveToPositions(positions, duration, axisStartTimes);
+    gRecallMotionProfile = kMotionProfileDefault;
+    beginCoordinatedMove(moveStartTime, duration);
 
-    double zoomStartTime = 0;
-    double panStartTime = 0;
-    double tiltStartTime = 0;
+    return retval;
+}
 
-    double panDuration = makeDurationValid(axis_identifier_pan, duration, preset.panPosition);
-    double tiltDuration = makeDurationValid(axis_identifier_tilt, duration, preset.tiltPosition);
-    double zoomDuration = makeDurationValid(axis_identifier_zoom, duration, preset.zoomPosition);
+bool setPresetMotionProfile(int presetNumber, motion_profile_t profile) {
+    preset_t preset;
+    bzero(&preset, sizeof(preset));
 
-    // If the camera is zooming out, align pans and tilts with the end of the zoom operation so that
-    // they are less distractiong.  If the camera is zooming in, align them with the beginning of
-    // of the zoom operation for the same reason.
-    if (panDuration < duration && zoomDuration > panDuration) {
-      panStartTime = adjustedStartTimeForMove(duration, panDuration, isZoomingOut);
-    }
-    if (tiltDuration < duration && zoomDuration > tiltDuration) {
-      tiltStartTime = adjustedStartTimeForMove(duration, tiltDuration, isZoomingOut);
-    }
-    if (zoomDuration < duration) {
-      // We prefer to zoom in at the end of the move or zoom out at the beginning, so reverse the
-      // boolean when adjusting the zoom start time.
-      zoomStartTime = adjustedStartTimeForMove(duration, zoomDuration, !isZoomingOut);
+    FILE *fp = fopen(presetFilename(presetNumber), "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to load preset %d (no data)\n", presetNumber);
+        return false;
     }
+    fread((void *)&preset, 1, sizeof(preset), fp);
+    fclose(fp);
 
-    cancelRecallIfNeeded("recallPreset");
-    bool retval = setPanTiltPosition(preset.panPosition, scaleVISCAPanTiltSpeedToCoreSpeed(panSpeed, false),
-                                     preset.tiltPosition, scaleVISCAPanTiltSpeedToCoreSpeed(tiltSpeed, false),
-                                     duration, panStartTime, tiltStartTime);
-    bool retval2 = setZoomPosition(preset.zoomPosition, scaleVISCAZoomSpeedToCoreSpeed(zoomSpeed),
-                                   duration, zoomStartTime);
+    preset.motionProfile = profile;
 
-    if (retval && retval2) {
-        fprintf(stderr, "Loaded preset %d\n", presetNumber);
-    } else {
-        fprintf(stderr, "Failed to load preset %d\n", presetNumber);
-        if (!retval) {
-            fprintf(stderr, "    Failed to set pan and tilt position.\n");
-        }
-        if (!retval2) {
-            fprintf(stderr, "    Failed to set zoom position.\n");
-        }
+    fp = fopen(presetFilename(presetNumber), "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to save preset %d\n", presetNumber);
+        return false;
     }
-
-    return retval && retval2;
-}
-
-double adjustedStartTimeForMove(double totalDuration, double shortMoveDuration, bool alignToEnd) {
-  double currentTime = timeStamp();
-  return alignToEnd ? (currentTime + totalDuration - shortMoveDuration) : currentTime;
+    fwrite((void *)&preset, sizeof(preset), 1, fp);
+    fclose(fp);
+    return true;
 }
 
 
@@ -2584,62 +4081,402 @@ void setRecallSpeedVISCA(int value) {
 }
 
 
-#pragma mark - Calibration
+#pragma mark - Tours and move queue
 
-// Computes a map between motor speed and encoder positions per second for each axis.
-void do_calibration(void) {
-  int localDebug = 0;
-  int64_t lastPosition[NUM_AXES];
-  int64_t maxPosition[NUM_AXES];
-  int64_t minPosition[NUM_AXES];
-  bool lastMoveWasPositive[NUM_AXES];  // If true, positive values moved right/down.
-  bool lastMoveWasPositiveAtEncoder[NUM_AXES];  // If true, last move increased encoder position.
-  bool axisHasMoved[NUM_AXES];
+char *tourFilename(int tourNumber) {
+    static char *buf = NULL;
+    if (buf != NULL) {
+        free(buf);
+    }
+    asprintf(&buf, "%s%stour_%d", gDataDirectory ? gDataDirectory : "",
+             gDataDirectory ? "/" : "", tourNumber);
+    return buf;
+}
 
-  bzero(&axisHasMoved, sizeof(axisHasMoved));
-  bzero(&lastMoveWasPositive, sizeof(lastMoveWasPositive));
-  bzero(&lastMoveWasPositiveAtEncoder, sizeof(lastMoveWasPositiveAtEncoder));
+// Public function.  Docs in header.
+bool saveTour(int tourNumber, const tour_stop_t *stops, int numStops) {
+    if (numStops < 1 || numStops > MAX_TOUR_STOPS) {
+        fprintf(stderr, "Tours must have 1 to %d stops.\n", MAX_TOUR_STOPS);
+        return false;
+    }
 
-  if (!gCalibrationModeQuick) {
-    if (localDebug) {
-      // This technically happened a bit earlier (before module initialization), but log it
-      // onscreen now so that the user will know.
-      fprintf(stderr, "Resetting metrics.\n");
+    tour_t tour;
+    bzero(&tour, sizeof(tour));
+    tour.numStops = numStops;
+    memcpy(tour.stops, stops, numStops * sizeof(tour_stop_t));
+
+    FILE *fp = fopen(tourFilename(tourNumber), "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to save tour %d\n", tourNumber);
+        return false;
     }
+    fwrite((void *)&tour, sizeof(tour), 1, fp);
+    fclose(fp);
+    return true;
+}
 
-    if (localDebug) {
-      fprintf(stderr, "Waiting for the system to stabilize.\n");
+/// Reads the specified tour from disk.
+static bool loadTour(int tourNumber, tour_t *tour) {
+    bzero(tour, sizeof(*tour));
+
+    FILE *fp = fopen(tourFilename(tourNumber), "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to load tour %d (no data)\n", tourNumber);
+        return false;
     }
+    fread((void *)tour, 1, sizeof(*tour), fp);
+    fclose(fp);
 
-    // Wait two seconds to ensure everything is up and running.
-    usleep(2000000);
+    if (tour->numStops < 1 || tour->numStops > MAX_TOUR_STOPS) {
+        fprintf(stderr, "Tour %d is corrupt.\n", tourNumber);
+        return false;
+    }
+    return true;
+}
 
-    for (axis_identifier_t axis = axis_identifier_pan; axis <= axis_identifier_tilt; axis++) {
-      int64_t value = getAxisPosition(axis);
-      lastPosition[axis] = value;
-      maxPosition[axis] = value;
-      minPosition[axis] = value;
+// Public function.  Docs in header.
+bool startTour(int tourNumber, bool loop) {
+    if (gCalibrationMode) {
+        fprintf(stderr, "Ignoring tour while in calibration mode.\n");
+        return false;
     }
 
-    if (localDebug) {
-      fprintf(stderr, "Pan maximally left, then right, then tilt maximally up, then down\n");
+    tour_t tour;
+    if (!loadTour(tourNumber, &tour)) {
+        return false;
     }
 
-    // After both pan and tilt axes have moved AND the gimbal has been idle for at
-    // least 10 seconds, stop calibrating.
-    double lastMoveTime = timeStamp();
-    while (!axisHasMoved[axis_identifier_pan] || !axisHasMoved[axis_identifier_tilt] ||
-            (timeStamp() - lastMoveTime) < 10) {
-      for (axis_identifier_t axis = 0; axis <= axis_identifier_tilt; axis++) {
-        if (localDebug > 1) {
-          fprintf(stderr, "Processing axis %d\n", axis);
+    // Load every preset now, so that the tour never waits for the disk between moves.
+    queued_move_t moves[MAX_TOUR_STOPS];
+    for (int i = 0; i < tour.numStops; i++) {
+        preset_t preset;
+        bzero(&preset, sizeof(preset));
+        FILE *fp = fopen(presetFilename(tour.stops[i].presetNumber), "r");
+        if (!fp) {
+            fprintf(stderr, "Failed to load preset %d for tour %d (no data)\n",
+                    tour.stops[i].presetNumber, tourNumber);
+            return false;
+        }
+        fread((void *)&preset, 1, sizeof(preset), fp);
+        fclose(fp);
+
+        moves[i].positions[axis_identifier_pan] = preset.panPosition;
+        moves[i].positions[axis_identifier_tilt] = preset.tiltPosition;
+        moves[i].positions[axis_identifier_zoom] = preset.zoomPosition;
+        moves[i].profile = preset.motionProfile;
+        moves[i].dwell = MAX(tour.stops[i].dwellMilliseconds, 0) / 1000.0;
+    }
+
+    if (!startMoveQueue(moves, tour.numStops, loop)) {
+        return false;
+    }
+    fprintf(stderr, "Started tour %d (%d stops%s)\n", tourNumber, tour.numStops,
+            loop ? ", looping" : "");
+    return true;
+}
+
+// Public function.  Docs in header.
+bool startMoveQueue(const queued_move_t *moves, int numMoves, bool loop) {
+    if (numMoves < 1 || numMoves > MAX_TOUR_STOPS) {
+        return false;
+    }
+    cancelRecallIfNeeded("startMoveQueue");
+
+    move_queue_t *queue = &gMoveQueue;
+    memcpy(queue->moves, moves, numMoves * sizeof(queued_move_t));
+    queue->numMoves = numMoves;
+    queue->nextMove = 0;
+    queue->loop = loop;
+    queue->blendedMoveInProgress = false;
+    queue->dwellEndTime = 0;
+    queue->numSegments = 0;
+    queue->active = true;
+
+    // Start moving right away, rather than on the next control loop tick.
+    advanceMoveQueue(monotonicTimeNanos());
+    return queue->active;
+}
+
+// Public function.  Docs in header.
+void stopMoveQueue(void) {
+    if (gMoveQueue.active) {
+        fprintf(stderr, "Move queue stopped.\n");
+    }
+    gMoveQueue.active = false;
+}
+
+// Public function.  Docs in header.
+bool moveQueueActive(void) {
+    return gMoveQueue.active;
+}
+
+/// Returns the fraction of a move's duration that the specified profile spends in each
+/// ramp.  Every profile averages half speed while ramping and full speed otherwise, so
+/// this is just the part of the move that isn't at full speed.
+static double rampFractionForProfile(motion_profile_t profile) {
+    return 1 - opsForMotionProfile(profile)->averageSpeedFraction();
+}
+
+/// Fills in an axis's setpoints for the segments of the current blended move.  Each segment
+/// follows its own profile, and where two segments overlap, their velocities add, so the
+/// axis goes smoothly from one segment's speed to the next instead of stopping between them.
+static void fillBlendedTrajectorySetpoints(axis_identifier_t axis, double duration) {
+    axis_trajectory_t *trajectory = &gAxisTrajectory[axis];
+    double distances[MAX_TOUR_STOPS];
+    double peakPositionsPerSecond[MAX_TOUR_STOPS];
+
+    int64_t segmentStartPosition = gAxisMoveStartPosition[axis];
+    for (int i = 0; i < gMoveQueue.numSegments; i++) {
+        move_segment_t *segment = &gMoveQueue.segments[i];
+        distances[i] = llabs(segment->targetPositions[axis] - segmentStartPosition);
+        peakPositionsPerSecond[i] = (distances[i] / segment->duration) /
+                                    opsForMotionProfile(segment->profile)->averageSpeedFraction();
+        segmentStartPosition = segment->targetPositions[axis];
+    }
+
+    trajectory->profile = gMoveQueue.segments[0].profile;
+    trajectory->setpointInterval = MAX(kTrajectorySetpointInterval, duration / (MAX_TRAJECTORY_SETPOINTS - 1));
+    trajectory->numSetpoints = MIN(MAX_TRAJECTORY_SETPOINTS,
+                                   (int)ceil(duration / trajectory->setpointInterval) + 1);
+
+    for (int i = 0; i < trajectory->numSetpoints; i++) {
+        double time = MIN(i * trajectory->setpointInterval, duration);
+        trajectory_setpoint_t *setpoint = &trajectory->setpoints[i];
+        setpoint->position = 0;
+        setpoint->velocity = 0;
+        for (int j = 0; j < gMoveQueue.numSegments; j++) {
+            move_segment_t *segment = &gMoveQueue.segments[j];
+            if (distances[j] == 0 || time <= segment->startTime) {
+                continue;
+            }
+            const motion_profile_ops_t *ops = opsForMotionProfile(segment->profile);
+            double timeFraction = MIN((time - segment->startTime) / segment->duration, 1);
+            setpoint->position += distances[j] * ops->distanceFraction(timeFraction);
+            if (timeFraction < 1) {
+                setpoint->velocity += peakPositionsPerSecond[j] * ops->speedFraction(timeFraction);
+            }
+        }
+    }
+}
+
+/// Plans the next blended move from the queue (the longest run of moves with no dwell time
+/// between them in which no axis changes direction) and starts it.
+///
+///     @param currentTime  The monotonic timestamp (in nanoseconds) at which to start.
+///     @param duration     On return, the duration of the blended move (in seconds).
+static bool startNextBlendedMove(int64_t currentTime, double *duration) {
+    bool localDebug = false;
+    static const moveModeFlags axisFlags[NUM_AXES] = { kFlagMovePan, kFlagMoveTilt, kFlagMoveZoom };
+    move_queue_t *queue = &gMoveQueue;
+
+    int64_t fromPositions[NUM_AXES];
+    int direction[NUM_AXES] = { 0, 0, 0 };
+    moveModeFlags legFlags = 0;
+    for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+        fromPositions[axis] = getAxisPosition(axis);
+    }
+
+    queue->numSegments = 0;
+    queue->dwell = 0;
+    *duration = 0;
+    for (int count = 0; count < queue->numMoves && queue->nextMove < queue->numMoves; count++) {
+        queued_move_t *move = &queue->moves[queue->nextMove];
+        moveModeFlags flags = 0;
+        bool reverses = false;
+        for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+            int64_t delta = move->positions[axis] - fromPositions[axis];
+            int sign = (delta > 0) - (delta < 0);
+            if (sign != 0) {
+                flags |= axisFlags[axis];
+                reverses = reverses || (direction[axis] != 0 && direction[axis] != sign);
+            }
+        }
+
+        // An axis that turns around has to stop first, so end the blended move here.
+        if (reverses) {
+            break;
+        }
+
+        if (flags != 0) {
+            gRecallMotionProfile = move->profile;
+            motion_profile_t profile = activeMotionProfile();
+            double segmentDuration = durationForMoveBetweenPositions(flags, fromPositions,
+                                                                     move->positions);
+            gRecallMotionProfile = kMotionProfileDefault;
+
+            // Without a duration (no calibration data), there is nothing to blend, so the
+            // camera has to stop at the end of each move.
+            if (segmentDuration <= 0 && queue->numSegments > 0) {
+                break;
+            }
+
+            move_segment_t *segment = &queue->segments[queue->numSegments];
+            memcpy(segment->targetPositions, move->positions, sizeof(segment->targetPositions));
+            segment->profile = profile;
+            segment->duration = segmentDuration;
+            segment->startTime = 0;
+            if (queue->numSegments > 0) {
+                // Overlap the previous segment's ramp-down with this segment's ramp-up, with
+                // the middles of the two ramps lined up, so that the speed changes smoothly
+                // from one segment's speed to the other's even if the ramps differ in length.
+                move_segment_t *previous = &queue->segments[queue->numSegments - 1];
+                double overlap = ((rampFractionForProfile(previous->profile) * previous->duration) +
+                                  (rampFractionForProfile(profile) * segmentDuration)) / 2;
+                segment->startTime = previous->startTime + previous->duration - overlap;
+            }
+            *duration = segment->startTime + segmentDuration;
+            queue->numSegments++;
+            legFlags |= flags;
+
+            for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+                int64_t delta = move->positions[axis] - fromPositions[axis];
+                if (delta != 0) {
+                    direction[axis] = (delta > 0) ? 1 : -1;
+                }
+                fromPositions[axis] = move->positions[axis];
+            }
+        }
+
+        queue->dwell = move->dwell;
+        queue->nextMove++;
+        if (queue->loop && queue->nextMove == queue->numMoves) {
+            queue->nextMove = 0;
+        }
+        if (move->dwell > 0 || (queue->numSegments > 0 && queue->segments[0].duration <= 0)) {
+            break;
+        }
+    }
+
+    if (queue->numSegments == 0) {
+        return true;  // Already there.
+    }
+
+    int64_t *targetPositions = queue->segments[queue->numSegments - 1].targetPositions;
+    double axisDurations[NUM_AXES];
+    int64_t axisStartTimes[NUM_AXES] = { currentTime, currentTime, currentTime };
+    gRecallMotionProfile = queue->segments[0].profile;
+    if (queue->numSegments == 1) {
+        // A single move is just a recall.
+        *duration = planCoordinatedMove(legFlags, targetPositions, currentTime, axisDurations,
+                                        axisStartTimes);
+    }
+    bool retval = startMoveToPositions(targetPositions, *duration, axisStartTimes);
+    gRecallMotionProfile = kMotionProfileDefault;
+
+    // Replace the single-move trajectory that was planned for each axis with the blended one.
+    // Axes that the camera moves on its own just go straight to the end of the last segment.
+    if (queue->numSegments > 1) {
+        for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+            if (gAxisMoveInProgress[axis] && gAxisDuration[axis] > 0 &&
+                gAxisTrajectory[axis].numSetpoints > 0) {
+                gAxisDuration[axis] = *duration;
+                fillBlendedTrajectorySetpoints(axis, *duration);
+            }
+        }
+    }
+    beginCoordinatedMove(currentTime, *duration);
+
+    if (localDebug) {
+        fprintf(stderr, "Blended move: %d segments over %lf seconds, then dwell %lf\n",
+                queue->numSegments, *duration, queue->dwell);
+    }
+    return retval;
+}
+
+/// Starts the next move in the queue once the previous one has finished and its dwell
+/// time has passed.  Called on every tick of the control loop.
+static void advanceMoveQueue(int64_t currentTime) {
+    move_queue_t *queue = &gMoveQueue;
+    if (!queue->active) {
+        return;
+    }
+
+    if (queue->blendedMoveInProgress) {
+        // A camera that moves itself reports no move in progress, so also wait for the
+        // planned duration to pass.
+        if (moveInProgress() || currentTime < queue->moveEndTime) {
+            return;
+        }
+        queue->blendedMoveInProgress = false;
+        queue->dwellEndTime = currentTime + SECONDS_TO_NANOS(queue->dwell);
+    }
+    if (currentTime < queue->dwellEndTime) {
+        return;
+    }
+
+    if (queue->nextMove >= queue->numMoves) {
+        fprintf(stderr, "Move queue finished.\n");
+        queue->active = false;
+        return;
+    }
+
+    double duration = 0;
+    if (!startNextBlendedMove(currentTime, &duration)) {
+        fprintf(stderr, "Move queue stopped (move failed).\n");
+        queue->active = false;
+        return;
+    }
+    queue->blendedMoveInProgress = true;
+    queue->moveEndTime = currentTime + SECONDS_TO_NANOS(duration);
+}
+
+
+#pragma mark - Calibration
+
+// Computes a map between motor speed and encoder positions per second for each axis.
+void do_calibration(void) {
+  int localDebug = 0;
+  int64_t lastPosition[NUM_AXES];
+  int64_t maxPosition[NUM_AXES];
+  int64_t minPosition[NUM_AXES];
+  bool lastMoveWasPositive[NUM_AXES];  // If true, positive values moved right/down.
+  bool lastMoveWasPositiveAtEncoder[NUM_AXES];  // If true, last move increased encoder position.
+  bool axisHasMoved[NUM_AXES];
+
+  bzero(&axisHasMoved, sizeof(axisHasMoved));
+  bzero(&lastMoveWasPositive, sizeof(lastMoveWasPositive));
+  bzero(&lastMoveWasPositiveAtEncoder, sizeof(lastMoveWasPositiveAtEncoder));
+
+  if (!gCalibrationModeQuick) {
+    if (localDebug) {
+      // This technically happened a bit earlier (before module initialization), but log it
+      // onscreen now so that the user will know.
+      fprintf(stderr, "Resetting metrics.\n");
+    }
+
+    if (localDebug) {
+      fprintf(stderr, "Waiting for the system to stabilize.\n");
+    }
+
+    // Wait two seconds to ensure everything is up and running.
+    usleep(2000000);
+
+    for (axis_identifier_t axis = axis_identifier_pan; axis <= axis_identifier_tilt; axis++) {
+      int64_t value = getAxisPosition(axis);
+      lastPosition[axis] = value;
+      maxPosition[axis] = value;
+      minPosition[axis] = value;
+    }
+
+    if (localDebug) {
+      fprintf(stderr, "Pan maximally left, then right, then tilt maximally up, then down\n");
+    }
+
+    // After both pan and tilt axes have moved AND the gimbal has been idle for at
+    // least 10 seconds, stop calibrating.
+    int64_t lastMoveTime = monotonicTimeNanos();
+    while (!axisHasMoved[axis_identifier_pan] || !axisHasMoved[axis_identifier_tilt] ||
+            NANOS_TO_SECONDS(monotonicTimeNanos() - lastMoveTime) < 10) {
+      for (axis_identifier_t axis = 0; axis <= axis_identifier_tilt; axis++) {
+        if (localDebug > 1) {
+          fprintf(stderr, "Processing axis %d\n", axis);
         }
 
         // See if the position has moved (by enough to matter).
         int64_t value = getAxisPosition(axis);
         bool axisMoved = false;
         if (llabs(lastPosition[axis] - value) > 200) {
-          lastMoveTime = timeStamp();
+          lastMoveTime = monotonicTimeNanos();
           axisHasMoved[axis] = true;
           axisMoved = true;
 
@@ -2688,7 +4525,7 @@ void do_calibration(void) {
         fprintf(stderr, "Loop check: panMoved: %s tiltMoved: %s time since last move: %lf\n",
                 axisHasMoved[axis_identifier_pan] ? "YES" : "NO",
                 axisHasMoved[axis_identifier_tilt] ? "YES" : "NO",
-                (timeStamp() - lastMoveTime));
+                NANOS_TO_SECONDS(monotonicTimeNanos() - lastMoveTime));
       }
     }
 
@@ -2781,10 +4618,22 @@ void do_calibration(void) {
 #endif  // ENABLE_P2_MODE
 }
 
-double timeStamp(void) {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return (double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0);
+// Public function.  Docs in header.
+//
+// CLOCK_MONOTONIC_RAW is not slewed by NTP, so the calibration tables (which were measured
+// against it) stay consistent with the move timing even while the clock is being disciplined.
+int64_t monotonicTimeNanos(void) {
+  if (gVirtualClockEnabled) {
+    return gVirtualClockNanos;
+  }
+
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return ((int64_t)ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec;
 }
 
 void waitForAxisMove(axis_identifier_t axis) {
@@ -2796,384 +4645,1418 @@ void waitForAxisMove(axis_identifier_t axis) {
   }
 }
 
+/// The phases of one axis's calibration sampling state machine.
+typedef enum {
+  kAxisCalibrationStateSpinningUp = 0,  //! Running at the sample speed until it settles.
+  kAxisCalibrationStateMeasuring = 1,   //! Measuring the distance moved at the sample speed.
+  kAxisCalibrationStateReversing = 2,   //! Stopped briefly before reversing direction.
+  kAxisCalibrationStateDone = 3         //! Every speed has been measured.
+} axis_calibration_state_t;
+
+/// The phases of adaptive calibration (see calibrateAxesConcurrently).
+typedef enum {
+  kAdaptiveCalibrationPhaseMaximum = 0,  //! Measuring the fastest speed.
+  kAdaptiveCalibrationPhaseStall = 1,    //! Bisecting to find the slowest speed that moves.
+  kAdaptiveCalibrationPhaseSeeding = 2,  //! Measuring evenly spaced speeds above the stall.
+  kAdaptiveCalibrationPhaseRefining = 3  //! Measuring midpoints where the fit might be wrong.
+} adaptive_calibration_phase_t;
+
+#define NUM_SAMPLES 10
+#define MIN_SAMPLES 4
+
+/** The number of evenly spaced speeds (including the ends) measured before refining. */
+static const int kAdaptiveCalibrationSeedSpeeds = 5;
+
+/** The largest acceptable interpolation error, as a fraction of the fastest speed. */
+static const double kAdaptiveCalibrationTolerance = 0.015;
+
+/// The sampling state for one axis being calibrated by calibrateAxesConcurrently.
+typedef struct {
+  axis_calibration_request_t *request;
+  axis_calibration_state_t state;
+  int32_t speed;                //! The hardware speed being measured.
+  int direction;                //! The sign of the raw speed being sent (before motor reversal).
+  bool inMotion;                //! True if the axis is already moving in the right direction.
+  bool movedTooFast;            //! True if spinning up ran out of room (use shorter intervals).
+  bool reversingForBalance;     //! True if reversing so the round has samples both ways.
+  int attempts;                 //! Attempts at taking the current sample.
+  int64_t phaseStartTime;       //! When the current phase (state) began.
+  int64_t phaseInterval;        //! How long the current phase should last.
+  int64_t lastPollTime;         //! The last time the position was within bounds.
+  int64_t motionStartPosition;  //! The position when measuring began.
+  double actualDuration;        //! The length of the most recent measurement, in seconds.
+  double samples[NUM_SAMPLES];
+  calibration_direction_t sampleDirections[NUM_SAMPLES];
+  int sampleCount;
+  int failures;                 //! Rounds of samples discarded for being inconsistent.
+
+  // Used only for adaptive calibration.
+  adaptive_calibration_phase_t adaptivePhase;
+  bool *measured;               //! True for each speed that has been measured.
+  int32_t stallLow;             //! The fastest speed known to stall.
+  int32_t stallHigh;            //! The slowest speed known to move.
+  int32_t stallThreshold;       //! The slowest speed that moves (after bisection).
+  int32_t (*pendingIntervals)[2];  //! Intervals between measured speeds still to check.
+  int numPendingIntervals;
+  bool refining;                //! True if the speed being measured is an interval's midpoint.
+  int32_t refiningInterval[2];  //! The interval whose midpoint is being measured.
+  double predictedValues[kNumCalibrationDirections];  //! The fit's predictions for that midpoint.
+  double maxResidual;           //! The largest miss among midpoints that were close enough.
+} axis_calibration_t;
+
 bool pastEnd(int64_t currentPosition, int64_t startPosition, int64_t endPosition, int direction) {
+  bool localDebug = false;
   if (direction == 1) {
     if (startPosition > endPosition) {
-      fprintf(stderr, "Past end: currentPosition >= startPosition: %" PRId64 " %" PRId64 " %s\n", currentPosition, startPosition, (currentPosition >= startPosition) ? "true" : "false");
+      if (localDebug) fprintf(stderr, "Past end: currentPosition >= startPosition: %" PRId64 " %" PRId64 " %s\n", currentPosition, startPosition, (currentPosition >= startPosition) ? "true" : "false");
       return currentPosition >= startPosition;
     }
-    fprintf(stderr, "Past end: currentPosition <= startPosition: %" PRId64 " %" PRId64 " %s\n", currentPosition, startPosition, (currentPosition <= startPosition) ? "true" : "false");
+    if (localDebug) fprintf(stderr, "Past end: currentPosition <= startPosition: %" PRId64 " %" PRId64 " %s\n", currentPosition, startPosition, (currentPosition <= startPosition) ? "true" : "false");
 
     return currentPosition <= startPosition;
   } else {
     if (startPosition > endPosition) {
-      fprintf(stderr, "Past end: currentPosition <= endPosition: %" PRId64 " %" PRId64 " %s\n", currentPosition, endPosition, (currentPosition <= endPosition) ? "true" : "false");
+      if (localDebug) fprintf(stderr, "Past end: currentPosition <= endPosition: %" PRId64 " %" PRId64 " %s\n", currentPosition, endPosition, (currentPosition <= endPosition) ? "true" : "false");
       return currentPosition <= endPosition;
     }
-    fprintf(stderr, "Past end: currentPosition >= endPosition: %" PRId64 " %" PRId64 " %s\n", currentPosition, endPosition, (currentPosition >= endPosition) ? "true" : "false");
+    if (localDebug) fprintf(stderr, "Past end: currentPosition >= endPosition: %" PRId64 " %" PRId64 " %s\n", currentPosition, endPosition, (currentPosition >= endPosition) ? "true" : "false");
     return currentPosition >= endPosition;
   }
 }
 
-// Returns number of seconds before last valid sample (with ~10,000 usec precision).
-double spinAxis(axis_identifier_t axis, int microseconds, int64_t startPosition, int64_t endPosition,
-              int direction) {
-  bool localDebug = true;
-
-  if (localDebug) {
-    fprintf(stderr, "Spinning axis %d for %d microseconds.\n", axis, microseconds);
+/// Waits for one calibration scheduler tick (10 ms).  In a simulation, this runs the
+/// simulated axes and the control loop for a tick instead of sleeping.
+static void waitForCalibrationTick(void) {
+  if (gMotorSimulationActive) {
+    runMotorSimulation(NANOS_TO_SECONDS(kMotorSimulationTickNanos));
+  } else {
+    usleep(10000);  // Wake up 100x per second or so.
   }
+}
 
-  double startTime = timeStamp();
-  double interval = (double)microseconds / USEC_PER_SEC;
-  double endTime = startTime;
-  while (true) {
-    int64_t currentPosition = getAxisPosition(axis);
-    if (pastEnd(currentPosition, startPosition, endPosition, direction)) {
-      if (localDebug) {
-        fprintf(stderr, "Stopped spinning early (out of bounds)\n");
-      }
-      return (endTime - startTime);
-    }
+/// Enters the specified phase of the calibration state machine at the specified time.
+static void setAxisCalibrationState(axis_calibration_t *calibration, axis_calibration_state_t state,
+                                    int64_t interval, int64_t now) {
+  calibration->state = state;
+  calibration->phaseStartTime = now;
+  calibration->phaseInterval = interval;
+  calibration->lastPollTime = now;
+}
 
-    endTime = timeStamp();
-    if (endTime >= (startTime + interval)) {
-      break;
-    }
-    usleep(10000);  // Wake up 100x per second or so.
+static void beginCalibrationSampleAttempt(axis_calibration_t *calibration, int64_t now);
+static void finishCalibrationSample(axis_calibration_t *calibration, int64_t now);
+
+/// Records the direction that the axis is being driven (after any motor reversal) as the
+/// direction of the sample being taken.
+static void recordCalibrationSampleDirection(axis_calibration_t *calibration) {
+  int physicalDirection = motorReversedForAxis(calibration->request->axis) ?
+      -calibration->direction : calibration->direction;
+  calibration->sampleDirections[calibration->sampleCount] =
+      CALIBRATION_DIRECTION_FOR_SPEED(physicalDirection);
+}
+
+/// Starts measuring the speed of the axis at the current hardware speed.
+static void beginCalibrationSample(axis_calibration_t *calibration, int64_t now) {
+  recordCalibrationSampleDirection(calibration);
+  calibration->attempts = 0;
+  calibration->movedTooFast = false;
+  calibration->actualDuration = 0;
+  calibration->motionStartPosition = getAxisPosition(calibration->request->axis);
+  beginCalibrationSampleAttempt(calibration, now);
+}
+
+/// Starts (or restarts) the measuring phase, which samples for 2 seconds (or 1 second if
+/// the axis ran out of room while spinning up).
+static void beginCalibrationMeasurement(axis_calibration_t *calibration, int64_t now) {
+  recordCalibrationSampleDirection(calibration);
+  calibration->motionStartPosition = getAxisPosition(calibration->request->axis);
+  int64_t duration = calibration->movedTooFast ? NSEC_PER_SEC : 2 * NSEC_PER_SEC;
+  setAxisCalibrationState(calibration, kAxisCalibrationStateMeasuring, duration, now);
+}
+
+/// Sets the axis in motion at the sample speed in the current direction, and waits for it
+/// to get up to speed (unless it was already moving that way).  Gives up after five tries.
+static void beginCalibrationSampleAttempt(axis_calibration_t *calibration, int64_t now) {
+  axis_calibration_request_t *request = calibration->request;
+  bool localDebug = false;
+  if (calibration->attempts++ >= 5) {
+    finishCalibrationSample(calibration, now);
+    return;
   }
   if (localDebug) {
-    fprintf(stderr, "Done spinning\n");
+    fprintf(stderr, "Setting axis %d to speed %d direction %d\n", request->axis,
+            calibration->speed, calibration->direction);
+  }
+  // Set the axis speed using the "raw" function so that there is no scaling involved.  This
+  // avoids any precision loss caused by converting from motor speeds to core speeds and back
+  // without having to run the motor at all 1,000 core speeds.
+  setAxisSpeedRaw(request->axis, calibration->speed * calibration->direction, false);
+
+  // Run the motors for a while before computing the speed.
+  float dutyCycle = (request->maxSpeed == request->minSpeed) ? 1 :
+      (calibration->speed - request->minSpeed) / (float)(request->maxSpeed - request->minSpeed);
+  float dutyCycleMultiplier = (dutyCycle < .25) ? 2 : (dutyCycle < .50) ? 1.5 : 1;
+  if (request->pollingIsSlow) dutyCycleMultiplier *= 5;
+  int delay = (calibration->inMotion ? 0 : calibration->movedTooFast ? 1000000 : 2000000) *
+      dutyCycleMultiplier;
+
+  if (delay == 0) {
+    beginCalibrationMeasurement(calibration, now);
+  } else {
+    setAxisCalibrationState(calibration, kAxisCalibrationStateSpinningUp,
+                            (int64_t)delay * (NSEC_PER_SEC / USEC_PER_SEC), now);
   }
+}
 
-  return (endTime - startTime);
+/// Stops the axis briefly before trying again in the other direction.
+static void reverseCalibrationDirection(axis_calibration_t *calibration, int64_t now) {
+  bool localDebug = false;
+  if (localDebug) fprintf(stderr, "Reached end position on %s axis while computing speed %d.  Reversing direction.\n",
+          nameForAxis(calibration->request->axis), calibration->speed);
+  setAxisSpeedRaw(calibration->request->axis, 0, false);
+  setAxisCalibrationState(calibration, kAxisCalibrationStateReversing, NSEC_PER_SEC / 2, now);
 }
 
-double calibrationValueForMoveAlongAxis(axis_identifier_t axis,
-    int64_t startPosition, int64_t endPosition, int speed, float dutyCycle,
-    bool pollingIsSlow) {
-  bool localDebug = true;
-  int attempts = 0;
-  int64_t motionStartPosition = 0;
-  int64_t motionEndPosition = 1;
+/// Finishes the current phase early if the axis has reached the end of its range of motion,
+/// or on time if it hasn't.  Returns the number of seconds before the last in-bounds position
+/// check (with ~10,000 usec precision), or -1 if the phase isn't over yet.
+static double pollCalibrationPhase(axis_calibration_t *calibration, int64_t now) {
+  axis_calibration_request_t *request = calibration->request;
+  int64_t currentPosition = getAxisPosition(request->axis);
+  if (pastEnd(currentPosition, request->startPosition, request->endPosition,
+              calibration->direction)) {
+    return NANOS_TO_SECONDS(calibration->lastPollTime - calibration->phaseStartTime);
+  }
+  calibration->lastPollTime = now;
+  if (now >= calibration->phaseStartTime + calibration->phaseInterval) {
+    return NANOS_TO_SECONDS(now - calibration->phaseStartTime);
+  }
+  return -1;
+}
 
-  // If the motor was already moving in the right direction, don't wait as long.
-  static bool inMotion = false;
+/// Computes the average, minimum, and maximum of the samples taken while moving in the
+/// specified direction, ignoring values more than one standard deviation from their mean.
+/// Returns the number of samples taken in that direction.  If there are none, the output
+/// parameters are left unchanged.
+static int filteredCalibrationStatisticsForDirection(double *samples,
+                                                     calibration_direction_t *sampleDirections,
+                                                     int count,
+                                                     calibration_direction_t direction,
+                                                     double *average,
+                                                     double *minimum,
+                                                     double *maximum) {
+  double total = 0;
+  int matchingCount = 0;
+  for (int i = 0; i < count; i++) {
+    if (sampleDirections[i] == direction) {
+      total += samples[i];
+      matchingCount++;
+    }
+  }
+  if (matchingCount == 0) {
+    return 0;
+  }
+  double mean = total / matchingCount;
+  double sumOfSquares = 0;
+  for (int i = 0; i < count; i++) {
+    if (sampleDirections[i] == direction) {
+      sumOfSquares += (samples[i] - mean) * (samples[i] - mean);
+    }
+  }
+  double standardDeviation = sqrt(sumOfSquares / matchingCount);
+
+  // Every sample is within one standard deviation of the mean unless there are outliers.
+  double filteredTotal = 0;
+  int filteredCount = 0;
+  *minimum = INFINITY;
+  *maximum = -INFINITY;
+  for (int i = 0; i < count; i++) {
+    if (sampleDirections[i] != direction) {
+      continue;
+    }
+    if (fabs(samples[i] - mean) > standardDeviation) {
+      continue;
+    }
+    filteredTotal += samples[i];
+    filteredCount++;
+    *minimum = MIN(*minimum, samples[i]);
+    *maximum = MAX(*maximum, samples[i]);
+  }
+  *average = filteredTotal / filteredCount;
+  return matchingCount;
+}
 
-  // If we don't get values because a half second moves too far, set to true.
-  bool movedTooFast = false;
+/// Returns the average of the samples taken while moving in the specified direction,
+/// ignoring values more than one standard deviation from their mean, or fallbackValue
+/// if no samples were taken in that direction.
+static double filteredCalibrationAverageForDirection(double *samples,
+                                                     calibration_direction_t *sampleDirections,
+                                                     int count,
+                                                     calibration_direction_t direction,
+                                                     double fallbackValue) {
+  double average = fallbackValue, minimum = 0, maximum = 0;
+  filteredCalibrationStatisticsForDirection(samples, sampleDirections, count, direction,
+                                            &average, &minimum, &maximum);
+  return average;
+}
 
-  if (localDebug) {
-    fprintf(stderr, "Obtaining calibration value for axis %d speed %d (start=%" PRId64
-                    ", end=%" PRId64 "\n", axis, speed, startPosition, endPosition);
+/// Checks whether a complete round of samples is consistent enough to use.  If so, or if
+/// there have been too many retries, stores the average and returns true.
+static bool evaluateCalibrationRound(axis_calibration_t *calibration, double *average) {
+  double min = calibration->samples[0], max = calibration->samples[0];
+  for (int i = 1 ; i < calibration->sampleCount; i++) {
+    min = MIN(min, calibration->samples[i]);
+    max = MAX(max, calibration->samples[i]);
+  }
+  if ((int64_t)min == (int64_t)max) {
+    *average = (int64_t)min;
+    return true;
   }
 
-  static int direction = -1;
+  // An axis that moves faster one way than the other (e.g. tilting with gravity) would look
+  // hopelessly inconsistent if both directions were lumped together, so check each direction's
+  // samples separately, and average the two directions.
+  double total = 0;
+  int directions = 0;
+  bool consistent = true;
+  double worstError = 0, worstErrorPercent = 0;
+  for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections; direction++) {
+    double directionalAverage = 0, newmin = 0, newmax = 0;
+    if (!filteredCalibrationStatisticsForDirection(calibration->samples,
+                                                   calibration->sampleDirections,
+                                                   calibration->sampleCount, direction,
+                                                   &directionalAverage, &newmin, &newmax)) {
+      continue;
+    }
+    total += directionalAverage;
+    directions++;
 
-  double actualDuration = 0;
-  while (attempts++ < 5) {
-    if (localDebug) {
-      fprintf(stderr, "Setting axis %d to speed %d direction %d\n", axis, speed, direction);
-    }
-    // Set the axis speed using the "raw" function so that there is no scaling involved.  This
-    // avoids any precision loss caused by converting from motor speeds to core speeds and back
-    // without having to run the motor at all 1,000 core speeds.
-    setAxisSpeedRaw(axis, speed * direction, false);
-
-    // Run the motors for a while before computing the speed.
-    float dutyCycleMultiplier = (dutyCycle < .25) ? 2 : (dutyCycle < .50) ? 1.5 : 1;
-    if (pollingIsSlow) dutyCycleMultiplier *= 5;
-    int delay = (inMotion ? 0 : movedTooFast ? 1000000 : 2000000) * dutyCycleMultiplier;
-
-    fprintf(stderr, "Starting to spin axis\n");
-    if (spinAxis(axis, delay, startPosition, endPosition, direction) >=
-        (delay * 1.0 / USEC_PER_SEC)) {
-
-      fprintf(stderr, "Axis spin success.\n");
-
-      motionStartPosition = getAxisPosition(axis);
-
-      // Try to sample data for 2 seconds, and throw it away if we can't get at least 1.5
-      // seconds of data.  Lower the threshold if we fail twice in a row, because that
-      // means it takes less than 2 seconds to move the full distance.  (This shouldn't
-      // ever occur in practice.)
-      const int duration = movedTooFast ? 1000000 : 2000000;
-      const double minValidInterval = movedTooFast ? 1 : 1.5;
-      actualDuration = spinAxis(axis, duration, startPosition, endPosition, direction);
-      if (actualDuration >= minValidInterval) {
-        if (localDebug) {
-          fprintf(stderr, "Got speed data.\n");
-        }
-        break;
-      }
-    } else if (attempts > 2) {
-      fprintf(stderr, "Axis spin failed.\n");
-      if (localDebug) {
-        fprintf(stderr, "Moved too fast.\n");
-      }
-      movedTooFast = true;
+    double error = newmax - newmin;
+    double errorPercent = (newmax > 0) ? (error / newmax) : 0;
+    if (!(error <= 2 || errorPercent < .1)) {
+      consistent = false;
     }
-    if (localDebug || 1) {
-      fprintf(stderr, "Reached end position while computing speed %d.  Reversing direction.\n", speed);
-      setAxisSpeedRaw(axis, 0, false);
-      usleep(500000);
+    if (errorPercent >= worstErrorPercent) {
+      worstError = error;
+      worstErrorPercent = errorPercent;
     }
-    direction = -direction;
-
-    inMotion = false;
-    attempts++;
   }
-  motionEndPosition = getAxisPosition(axis);
-
-  int64_t distance = llabs(motionEndPosition - motionStartPosition);
+  *average = total / directions;
 
-  inMotion = true;
-  double distancePerSecond = ((double)distance / actualDuration);
-  if (localDebug) {
-    fprintf(stderr, "Returning distance per second %lf\n", distancePerSecond);
+  if (consistent) {
+    return true;
+  } else if (calibration->failures >= 3) {
+    fprintf(stderr, "Total error is still too large, but too many retries, so giving up.\n");
+    return true;
   }
-  return distancePerSecond;
+  fprintf(stderr, "Total error %lf > 2 and error percent %lf >= .1.  Trying again.\n",
+          worstError, worstErrorPercent);
+  calibration->failures++;
+  return false;
 }
 
-int64_t *calibrationDataForMoveAlongAxis(axis_identifier_t axis,
-                                     int64_t startPosition,
-                                     int64_t endPosition,
-                                     int32_t minSpeed,
-                                     int32_t maxSpeed,
-                                     bool pollingIsSlow) {
-  bool localDebug = true;
-  if (localDebug) {
-    fprintf(stderr, "Gathering calibration data for axis %d\n", axis);
+/// Returns the value at x of the monotone piecewise cubic (Fritsch-Carlson PCHIP) through the
+/// specified points, which must be in increasing order of x.  Values beyond either end are
+/// clamped to the nearest point's value.  If the points are monotone, so is the result.
+static double interpolateMonotoneCubic(const double *xs, const double *ys, int count, double x) {
+  if (count == 0) {
+    return 0;
+  }
+  if (count == 1 || x <= xs[0]) {
+    return ys[0];
+  }
+  if (x >= xs[count - 1]) {
+    return ys[count - 1];
+  }
+  int k = 0;
+  while (x > xs[k + 1]) {
+    k++;
   }
 
-  int64_t *data = (int64_t *)malloc(sizeof(int64_t) * (maxSpeed - minSpeed + 1));
-  setAxisPositionIncrementally(axis, startPosition, SCALE_CORE, 0, 0);  // Move as quickly as possible.
-  waitForAxisMove(axis);
-
-  if (localDebug) {
-    fprintf(stderr, "Finished initial move.\n");
+  // The slope at each end of segment k.  Interior slopes are a weighted harmonic mean of the
+  // neighboring secants (or zero at a local extremum), which keeps the curve from overshooting.
+  double slopes[2];
+  for (int end = 0; end < 2; end++) {
+    int i = k + end;
+    if (i == 0 || i == count - 1) {
+      int segment = (i == 0) ? 0 : count - 2;
+      slopes[end] = (ys[segment + 1] - ys[segment]) / (xs[segment + 1] - xs[segment]);
+      continue;
+    }
+    double previousWidth = xs[i] - xs[i - 1];
+    double width = xs[i + 1] - xs[i];
+    double previousSecant = (ys[i] - ys[i - 1]) / previousWidth;
+    double secant = (ys[i + 1] - ys[i]) / width;
+    if (previousSecant * secant <= 0) {
+      slopes[end] = 0;
+    } else {
+      double w1 = (2 * width) + previousWidth;
+      double w2 = width + (2 * previousWidth);
+      slopes[end] = (w1 + w2) / ((w1 / previousSecant) + (w2 / secant));
+    }
   }
 
-  for (int32_t speed = minSpeed; speed <= maxSpeed; speed++) {
-    float dutyCycle = (speed - minSpeed) / (float)(maxSpeed - minSpeed);
+  double h = xs[k + 1] - xs[k];
+  double t = (x - xs[k]) / h;
+  double t2 = t * t;
+  double t3 = t2 * t;
+  return (((2 * t3) - (3 * t2) + 1) * ys[k]) + ((t3 - (2 * t2) + t) * h * slopes[0]) +
+         (((-2 * t3) + (3 * t2)) * ys[k + 1]) + ((t3 - t2) * h * slopes[1]);
+}
 
-    fprintf(stderr, "Computing calibration for speed %d\n", speed);
+/// Collects the measured speeds at or above the stall threshold (and their values from the
+/// specified table) as points for interpolateMonotoneCubic, forcing the values to be
+/// nondecreasing.  Returns the number of points.
+static int adaptiveCalibrationPoints(axis_calibration_t *calibration, int64_t *table,
+                                     double *speeds, double *values) {
+  axis_calibration_request_t *request = calibration->request;
+  int count = 0;
+  for (int32_t speed = MAX(calibration->stallThreshold, request->minSpeed);
+       speed <= request->maxSpeed; speed++) {
+    int index = speed - request->minSpeed;
+    if (calibration->measured[index]) {
+      speeds[count] = speed;
+      values[count] = (count > 0) ? MAX(table[index], values[count - 1]) : table[index];
+      count++;
+    }
+  }
+  return count;
+}
 
-    bool done = false;
+/// Returns the fit's value for the specified speed, using the specified table's measurements.
+static double adaptiveCalibrationPrediction(axis_calibration_t *calibration, int64_t *table,
+                                            int32_t speed) {
+  axis_calibration_request_t *request = calibration->request;
+  int length = request->maxSpeed - request->minSpeed + 1;
+  double speeds[length], values[length];
+  int count = adaptiveCalibrationPoints(calibration, table, speeds, values);
+  return interpolateMonotoneCubic(speeds, values, count, speed);
+}
 
-#define NUM_SAMPLES 10
-#define MIN_SAMPLES 4
+/// Queues the interval between two measured speeds for refinement if it contains any
+/// unmeasured speeds.
+static void addAdaptiveCalibrationInterval(axis_calibration_t *calibration, int32_t low,
+                                           int32_t high) {
+  if (high - low > 1) {
+    calibration->pendingIntervals[calibration->numPendingIntervals][0] = low;
+    calibration->pendingIntervals[calibration->numPendingIntervals][1] = high;
+    calibration->numPendingIntervals++;
+  }
+}
 
-    double positionsPerSecond[NUM_SAMPLES];
-    double positionsPerSecondAverage = 0;
-    int failures = 0;
-    while (!done) {
-      // No need to invert the drive direction.  The motor driver should already be
-      // handling that.
-      fprintf(stderr, "Start of loop\n");
-      int64_t min = 0, max = 0;
-      int64_t sameValue = -1;
-      for (int i = 0 ; i < NUM_SAMPLES; i++) {
-        double value =
-            calibrationValueForMoveAlongAxis(axis, startPosition, endPosition, speed, dutyCycle,
-                                             pollingIsSlow);
-        positionsPerSecond[i] = value;
-        if (i == 0) {
-          sameValue = value;
-          min = value;
-          max = value;
-        } else if (value > max) {
-          max = value;
-        } else if (value < min) {
-          min = value;
-        }
-        fprintf(stderr, "Positions per second at speed %d [%d]: %lf\n",
-                speed, i, positionsPerSecond[i]);
-
-        // If we get MIN_SAMPLES identical values immediately (realistically because this uses
-        // a floating-point value, this always means that the motor isn't moving), don't bother
-        // getting any more values.
-        if (value == sameValue && i == (MIN_SAMPLES - 1)) {
-          // We got MIN_SAMPLES with identical values.  Bail early.
-          done = true;
-          break;
-        } else if (value != sameValue) {
-          sameValue = -1;
+/// Decides which speed adaptive calibration should measure next, given that the current
+/// speed was just measured.  Returns a speed past the maximum when calibration is done.
+static int32_t nextAdaptiveCalibrationSpeed(axis_calibration_t *calibration) {
+  axis_calibration_request_t *request = calibration->request;
+  int32_t speed = calibration->speed;
+  int64_t value = request->data[speed - request->minSpeed];
+  int64_t fastestValue = MAX(request->directionalData[0][request->maxSpeed - request->minSpeed],
+                             request->directionalData[1][request->maxSpeed - request->minSpeed]);
+  const int32_t done = request->maxSpeed + 1;
+
+  switch (calibration->adaptivePhase) {
+    case kAdaptiveCalibrationPhaseMaximum:
+      if (value == 0 || request->minSpeed == request->maxSpeed) {
+        // The axis doesn't move at all (or there is nothing else to measure).
+        calibration->stallThreshold = (value == 0) ? done : request->maxSpeed;
+        return done;
+      }
+      calibration->adaptivePhase = kAdaptiveCalibrationPhaseStall;
+      calibration->stallLow = request->minSpeed - 1;
+      calibration->stallHigh = request->maxSpeed;
+      return request->minSpeed;
+    case kAdaptiveCalibrationPhaseStall:
+      if (value == 0) {
+        calibration->stallLow = speed;
+      } else {
+        calibration->stallHigh = speed;
+      }
+      if (calibration->stallHigh - calibration->stallLow > 1) {
+        return (calibration->stallLow + calibration->stallHigh) / 2;
+      }
+      calibration->stallThreshold = calibration->stallHigh;
+      calibration->adaptivePhase = kAdaptiveCalibrationPhaseSeeding;
+      // Fall through.
+    case kAdaptiveCalibrationPhaseSeeding: {
+      int32_t threshold = calibration->stallThreshold;
+      for (int i = 0; i < kAdaptiveCalibrationSeedSpeeds; i++) {
+        int32_t seed = threshold + (int32_t)round((double)(request->maxSpeed - threshold) * i /
+                                                  (kAdaptiveCalibrationSeedSpeeds - 1));
+        if (!calibration->measured[seed - request->minSpeed]) {
+          return seed;
         }
-        fprintf(stderr, "Are we done?  %s.  (%lf, %" PRId64 ", %d %d) \n", done ? "Yes" : "No",
-          value, sameValue, i, (MIN_SAMPLES - 1));
       }
-      if (!done) {
-        if (min == max) {
-          positionsPerSecondAverage = min;
-          done = true;
-        } else {
-          int64_t alltotal = 0;
-          int64_t total = 0;
-          int count = 0;
-          // int64_t tempmin = min, tempmax = max;
-          int64_t newmin = -1, newmax = -1;
-          for (int i = 0 ; i < NUM_SAMPLES; i++) {
-            int64_t value = positionsPerSecond[i];
-            alltotal += value;
-          }
-          double mean = (double)alltotal / NUM_SAMPLES;
-          double sumOfSquares = 0;
-          for (int i = 0 ; i < NUM_SAMPLES; i++) {
-            int64_t value = positionsPerSecond[i];
-            double deviation = value - mean;
-            sumOfSquares += (deviation * deviation);
-          }
-          double standardDeviation = sqrt(sumOfSquares / NUM_SAMPLES);
-          for (int i = 0 ; i < NUM_SAMPLES; i++) {
-            int64_t value = positionsPerSecond[i];
-
-            if (fabs(1.0 * value - mean) > standardDeviation) {
-              fprintf(stderr, "Discarding outlier %" PRId64 ".\n", value);
-              continue;
-            }
-            total += value;
-            if (newmin == -1 || value < newmin) {
-              newmin = value;
-            }
-            if (newmax == -1 || value > newmax) {
-              newmax = value;
-            }
-            count++;
-          }
-          positionsPerSecondAverage = (double)total / count;
-
-          double error = (double)newmax - newmin;
-          double errorPercent = error / newmax;
-          if (error <= 2 || errorPercent < .1) {
-            done = true;
-          } else if (failures >= 3) {
-            done = true;
-            fprintf(stderr, "Total error is still too large, but too many retries, so giving up.\n");
-          } else {
-            fprintf(stderr, "Total error %lf > 2 and error percent %lf >= .1.  Trying again.\n",
-                    error, errorPercent);
-            failures++;
+      int32_t previous = -1;
+      for (int32_t measuredSpeed = threshold; measuredSpeed <= request->maxSpeed; measuredSpeed++) {
+        if (calibration->measured[measuredSpeed - request->minSpeed]) {
+          if (previous >= 0) {
+            addAdaptiveCalibrationInterval(calibration, previous, measuredSpeed);
           }
+          previous = measuredSpeed;
         }
-        fprintf(stderr, "End loop\n");
       }
+      calibration->adaptivePhase = kAdaptiveCalibrationPhaseRefining;
+      break;
+    }
+    case kAdaptiveCalibrationPhaseRefining:
+      break;
+  }
+
+  // Refining.  If the fit missed the midpoint that was just measured, both halves of that
+  // interval need a closer look.
+  if (calibration->refining) {
+    double residual = 0;
+    for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections;
+         direction++) {
+      int64_t directionalValue = request->directionalData[direction][speed - request->minSpeed];
+      residual = MAX(residual, fabs(directionalValue - calibration->predictedValues[direction]));
+    }
+    double tolerance = MAX(2, fastestValue * kAdaptiveCalibrationTolerance);
+    if (residual > tolerance) {
+      addAdaptiveCalibrationInterval(calibration, calibration->refiningInterval[0], speed);
+      addAdaptiveCalibrationInterval(calibration, speed, calibration->refiningInterval[1]);
+    } else {
+      calibration->maxResidual = MAX(calibration->maxResidual, residual);
+    }
+    calibration->refining = false;
+  }
+  if (calibration->numPendingIntervals == 0) {
+    return done;
+  }
+  calibration->numPendingIntervals--;
+  int32_t low = calibration->pendingIntervals[calibration->numPendingIntervals][0];
+  int32_t high = calibration->pendingIntervals[calibration->numPendingIntervals][1];
+  int32_t midpoint = (low + high) / 2;
+  calibration->refining = true;
+  calibration->refiningInterval[0] = low;
+  calibration->refiningInterval[1] = high;
+  for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections; direction++) {
+    calibration->predictedValues[direction] =
+        adaptiveCalibrationPrediction(calibration, request->directionalData[direction], midpoint);
+  }
+  return midpoint;
+}
+
+/// Fills in the unmeasured speeds in each of the request's tables from the measured ones
+/// (zero below the stall threshold, and the monotone fit above it).
+static void fillAdaptiveCalibrationTables(axis_calibration_t *calibration) {
+  axis_calibration_request_t *request = calibration->request;
+  int64_t *tables[] = {
+    request->data,
+    request->directionalData[kCalibrationDirectionNegative],
+    request->directionalData[kCalibrationDirectionPositive]
+  };
+  for (int table = 0; table < 3; table++) {
+    int64_t *data = tables[table];
+    int64_t fitted[request->maxSpeed - request->minSpeed + 1];
+    for (int32_t speed = request->minSpeed; speed <= request->maxSpeed; speed++) {
+      int index = speed - request->minSpeed;
+      if (speed < calibration->stallThreshold) {
+        fitted[index] = 0;
+      } else if (calibration->measured[index]) {
+        fitted[index] = data[index];
+      } else {
+        fitted[index] = round(adaptiveCalibrationPrediction(calibration, data, speed));
+      }
+    }
+    for (int index = 0; index <= request->maxSpeed - request->minSpeed; index++) {
+      data[index] = (index > 0) ? MAX(fitted[index], data[index - 1]) : fitted[index];
     }
+  }
+
+  request->confidenceBand = calibration->maxResidual;
+  int64_t fastestValue = request->data[request->maxSpeed - request->minSpeed];
+  fprintf(stderr, "Calibrated %s axis by measuring %d of %d speeds (slowest moving speed: %d).  "
+          "Interpolated values are within about %.0lf positions per second (%.1lf%%).\n",
+          nameForAxis(request->axis), request->speedsMeasured,
+          request->maxSpeed - request->minSpeed + 1, calibration->stallThreshold,
+          request->confidenceBand,
+          (fastestValue > 0) ? (100.0 * request->confidenceBand / fastestValue) : 0);
+}
+
+/// Starts measuring the next speed, or finishes if every speed has been measured.
+static void beginCalibrationSpeed(axis_calibration_t *calibration, int32_t speed, int64_t now) {
+  bool localDebug = false;
+  axis_calibration_request_t *request = calibration->request;
+  if (speed > request->maxSpeed) {
+    setAxisSpeedRaw(request->axis, 0, false);
+    calibration->state = kAxisCalibrationStateDone;
+    fprintf(stderr, "Done collecting data for axis %d\n", request->axis);
+    return;
+  }
+  if (localDebug) {
+    fprintf(stderr, "Computing %s calibration for speed %d\n", nameForAxis(request->axis), speed);
+  }
+  // A big jump in speed (as adaptive calibration makes) takes a while to settle, just like
+  // reversing direction does.
+  if (abs(speed - calibration->speed) > 1) {
+    calibration->inMotion = false;
+  }
+  calibration->speed = speed;
+  request->speedsMeasured++;
+  calibration->sampleCount = 0;
+  calibration->failures = 0;
+  beginCalibrationSample(calibration, now);
+}
+
+/// Records the average speed for the current hardware speed (overall and for each
+/// direction), then moves on to the next speed.
+static void finishCalibrationSpeed(axis_calibration_t *calibration, double positionsPerSecondAverage,
+                                   int64_t now) {
+  axis_calibration_request_t *request = calibration->request;
+  int index = calibration->speed - request->minSpeed;
+  int64_t *data = request->data;
+  data[index] = round(positionsPerSecondAverage);
+  fprintf(stderr, "Positions per second on %s axis at speed %d (average): %lf (%lld)\n",
+          nameForAxis(request->axis), calibration->speed, positionsPerSecondAverage, data[index]);
+
+  // The motor is driven alternately in each direction, so the same samples also yield
+  // separate values for each direction (e.g. tilting up against gravity versus down).
+  for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections; direction++) {
+    double directionalAverage = (positionsPerSecondAverage == 0) ? 0 :
+        filteredCalibrationAverageForDirection(calibration->samples, calibration->sampleDirections,
+                                               calibration->sampleCount, direction,
+                                               positionsPerSecondAverage);
+    request->directionalData[direction][index] = round(directionalAverage);
+  }
+
+  if (request->adaptive) {
+    calibration->measured[index] = true;
+    beginCalibrationSpeed(calibration, nextAdaptiveCalibrationSpeed(calibration), now);
+    return;
+  }
+
+  // The motor may stall at low voltages, but once it gets moving, it should get faster
+  // for each increase in voltage.  If not, something went wrong, and our results are invalid.
+  // In some cases (e.g. for zoom motors hidden behind software), two speed values might result
+  // in identical speeds, so it's potentially okay for it to not speed up, but it should never
+  // slow down.
+  int32_t nextSpeed = calibration->speed + 1;
+  if (index >= 1 && data[index] < data[index - 1] && data[index] > 0) {
+    if (request->pollingIsSlow) {
+      fprintf(stderr, "Motor slowed down.  Assuming speed is unchanged.\n");
+      data[index] = data[index - 1];
+    } else {
+      fprintf(stderr, "Motor slowed down.  Recomputing previous position and current position.\n");
+      nextSpeed = calibration->speed - 1;
+    }
+  }
+  beginCalibrationSpeed(calibration, nextSpeed, now);
+}
+
+/// Computes the speed from the most recent measurement and adds it to the current round
+/// of samples.  When the round is complete, either starts another round or moves on.
+static void finishCalibrationSample(axis_calibration_t *calibration, int64_t now) {
+  bool localDebug = false;
+  axis_calibration_request_t *request = calibration->request;
+  int64_t distance = llabs(getAxisPosition(request->axis) - calibration->motionStartPosition);
+  calibration->inMotion = true;
+  double value = (calibration->actualDuration > 0) ? (distance / calibration->actualDuration) : 0;
+
+  int i = calibration->sampleCount++;
+  calibration->samples[i] = value;
+  if (localDebug) fprintf(stderr, "Positions per second on %s axis at speed %d [%d]: %lf\n",
+          nameForAxis(request->axis), calibration->speed, i, value);
+
+  // If we get MIN_SAMPLES identical values immediately (realistically because this uses
+  // a floating-point value, this always means that the motor isn't moving), don't bother
+  // getting any more values.
+  bool allSame = true;
+  double sameValue = (int64_t)calibration->samples[0];
+  for (int j = 1; j < calibration->sampleCount; j++) {
+    if (calibration->samples[j] != sameValue) {
+      allSame = false;
+    }
+  }
+  if (allSame && calibration->sampleCount == MIN_SAMPLES) {
+    finishCalibrationSpeed(calibration, sameValue, now);
+    return;
+  }
+
+  if (calibration->sampleCount < NUM_SAMPLES) {
+    // At slow speeds, the axis might not reach the end of its range during a whole round, so
+    // turn around halfway through if necessary to get samples for both directions.
+    bool balanced = false;
+    for (int j = 1; j < calibration->sampleCount; j++) {
+      balanced = balanced || (calibration->sampleDirections[j] != calibration->sampleDirections[0]);
+    }
+    if (!balanced && calibration->sampleCount == NUM_SAMPLES / 2) {
+      calibration->reversingForBalance = true;
+      reverseCalibrationDirection(calibration, now);
+    } else {
+      beginCalibrationSample(calibration, now);
+    }
+    return;
+  }
+
+  double average = 0;
+  if (evaluateCalibrationRound(calibration, &average)) {
+    finishCalibrationSpeed(calibration, average, now);
+  } else {
+    calibration->sampleCount = 0;
+    beginCalibrationSample(calibration, now);
+  }
+}
+
+/// Advances one axis's calibration state machine.  Called once per scheduler tick.
+static void stepAxisCalibration(axis_calibration_t *calibration, int64_t now) {
+  switch (calibration->state) {
+    case kAxisCalibrationStateSpinningUp: {
+      double elapsed = pollCalibrationPhase(calibration, now);
+      if (elapsed < 0) {
+        break;
+      }
+      if (elapsed >= NANOS_TO_SECONDS(calibration->phaseInterval)) {
+        beginCalibrationMeasurement(calibration, now);
+      } else {
+        if (calibration->attempts > 2) {
+          fprintf(stderr, "Axis %s spin failed.  Moved too fast.\n",
+                  nameForAxis(calibration->request->axis));
+          calibration->movedTooFast = true;
+        }
+        reverseCalibrationDirection(calibration, now);
+      }
+      break;
+    }
+    case kAxisCalibrationStateMeasuring: {
+      double elapsed = pollCalibrationPhase(calibration, now);
+      if (elapsed < 0) {
+        break;
+      }
+
+      // Throw away the sample if we can't get at least 1.5 seconds of data (or 1 second if
+      // spinning up ran out of room, which means it takes less than 2 seconds to move the
+      // full distance).
+      calibration->actualDuration = elapsed;
+      double minValidInterval = calibration->movedTooFast ? 1 : 1.5;
+      if (elapsed >= minValidInterval) {
+        finishCalibrationSample(calibration, now);
+      } else {
+        reverseCalibrationDirection(calibration, now);
+      }
+      break;
+    }
+    case kAxisCalibrationStateReversing:
+      if (now >= calibration->phaseStartTime + calibration->phaseInterval) {
+        calibration->direction = -calibration->direction;
+        calibration->inMotion = false;
+        if (calibration->reversingForBalance) {
+          calibration->reversingForBalance = false;
+          beginCalibrationSample(calibration, now);
+        } else {
+          calibration->attempts++;
+          beginCalibrationSampleAttempt(calibration, now);
+        }
+      }
+      break;
+    case kAxisCalibrationStateDone:
+      break;
+  }
+}
+
+// Public function.  Docs in header.
+//
+// Each axis gets its own state machine, and this single loop advances all of them every
+// 10 ms.  Because only this thread changes the axes' speeds (the motor and encoder threads
+// do the actual bus traffic, as always), the axes can share buses safely.
+void calibrateAxesConcurrently(axis_calibration_request_t *requests, int count) {
+  axis_calibration_t *calibrations = calloc(count, sizeof(axis_calibration_t));
+  for (int i = 0; i < count; i++) {
+    axis_calibration_request_t *request = &requests[i];
+    fprintf(stderr, "Gathering calibration data for axis %d\n", request->axis);
+    int length = request->maxSpeed - request->minSpeed + 1;
+    request->data = malloc(sizeof(int64_t) * length);
+    for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections;
+         direction++) {
+      request->directionalData[direction] = malloc(sizeof(int64_t) * length);
+    }
+    calibrations[i].request = request;
+    calibrations[i].direction = -1;
+    request->speedsMeasured = 0;
+    request->confidenceBand = 0;
+    if (request->adaptive) {
+      calibrations[i].measured = calloc(length, sizeof(bool));
+      calibrations[i].pendingIntervals = calloc(length, sizeof(int32_t[2]));
+      calibrations[i].stallThreshold = request->minSpeed;
+    }
+
+    // Move as quickly as possible.
+    setAxisPositionIncrementally(request->axis, request->startPosition, SCALE_CORE, 0, 0);
+  }
+
+  // Finish every initial move before sampling, so that no axis is under position control
+  // (with core-scale speeds) while another is being driven with raw speeds.
+  bool moving = true;
+  while (moving) {
+    moving = false;
+    for (int i = 0; i < count; i++) {
+      moving = moving || gAxisMoveInProgress[requests[i].axis];
+    }
+    if (moving) {
+      waitForCalibrationTick();
+    }
+  }
+  fprintf(stderr, "Finished initial move.\n");
+
+  int64_t now = monotonicTimeNanos();
+  for (int i = 0; i < count; i++) {
+    beginCalibrationSpeed(&calibrations[i],
+                          requests[i].adaptive ? requests[i].maxSpeed : requests[i].minSpeed, now);
+  }
+  bool active = true;
+  while (active) {
+    waitForCalibrationTick();
+    now = monotonicTimeNanos();
+    active = false;
+    for (int i = 0; i < count; i++) {
+      stepAxisCalibration(&calibrations[i], now);
+      active = active || (calibrations[i].state != kAxisCalibrationStateDone);
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    if (requests[i].adaptive) {
+      fillAdaptiveCalibrationTables(&calibrations[i]);
+      free(calibrations[i].measured);
+      free(calibrations[i].pendingIntervals);
+    }
+  }
+  free(calibrations);
+
+  // With only half as many samples, a directional table can occasionally slow down
+  // where the combined table did not.  Never let the speed drop as the duty cycle rises.
+  for (int i = 0; i < count; i++) {
+    axis_calibration_request_t *request = &requests[i];
+    for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections;
+         direction++) {
+      int64_t *directionalData = request->directionalData[direction];
+      for (int index = 1; index <= request->maxSpeed - request->minSpeed; index++) {
+        directionalData[index] = MAX(directionalData[index], directionalData[index - 1]);
+      }
+    }
+  }
+}
+
+// Public function.  Docs in header.
+int64_t *calibrationDataForMoveAlongAxis(axis_identifier_t axis,
+                                     int64_t startPosition,
+                                     int64_t endPosition,
+                                     int32_t minSpeed,
+                                     int32_t maxSpeed,
+                                     bool pollingIsSlow,
+                                     int64_t **directionalData) {
+  axis_calibration_request_t request = {
+    .axis = axis,
+    .startPosition = startPosition,
+    .endPosition = endPosition,
+    .minSpeed = minSpeed,
+    .maxSpeed = maxSpeed,
+    .pollingIsSlow = pollingIsSlow
+  };
+  calibrateAxesConcurrently(&request, 1);
+  for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections; direction++) {
+    if (directionalData != NULL) {
+      directionalData[direction] = request.directionalData[direction];
+    } else {
+      free(request.directionalData[direction]);
+    }
+  }
+  return request.data;
+}
+
+const char *nameForAxis(axis_identifier_t axis) {
+  switch (axis) {
+    case axis_identifier_pan:
+      return "pan";
+    case axis_identifier_tilt:
+      return "tilt";
+      break;
+    case axis_identifier_zoom:
+      return "zoom";
+    default:
+      return "unknown";
+  }
+}
+
+const char *calibrationDataKeyNameForAxis(axis_identifier_t axis) {
+  switch (axis) {
+    case axis_identifier_pan:
+      return "calibration_data_pan";
+    case axis_identifier_tilt:
+      return "calibration_data_tilt";
+      break;
+    case axis_identifier_zoom:
+      return "calibration_data_zoom";
+    default:
+      return "calibration_data_unknown";
+  }
+}
+
+// Public function.  Docs in header.
+//
+// Reads calibration data from the configuration file.
+int64_t *readCalibrationDataForAxis(axis_identifier_t axis,
+                                    int *maxSpeed) {
+  char *rawCalibrationData = getConfigKey(calibrationDataKeyNameForAxis(axis));
+  if (rawCalibrationData == NULL) {
+    return NULL;
+  }
+
+  int64_t *data = NULL;
+  ssize_t size = 0;
+  int count = 0;
+  char *pos = rawCalibrationData;
+  while (*pos != '\0') {
+    int64_t value = strtoull(pos, NULL, 10);
+    int64_t *newData = realloc(data, size + sizeof(int64_t));
+    size += sizeof(int64_t);
+    if (newData == NULL) {
+      // This should never occur.
+      free(data);
+      free(rawCalibrationData);
+      return NULL;
+    }
+    data = newData;
+    data[count++] = value;
+
+    // Skip to the next value.
+    while (*pos && *pos != ' ') {
+      pos++;
+    }
+    while (*pos && *pos == ' ') {
+      pos++;
+    }
+  }
+
+  free(rawCalibrationData);
+  if (maxSpeed) {
+    // Return the last index.
+    *maxSpeed = count - 1;
+  }
+  return data;
+}
+
+// Public function.  Docs in header.
+//
+// Writes calibration data to the configuration file.
+bool writeCalibrationDataForAxis(axis_identifier_t axis, int64_t *calibrationData, int maxSpeed) {
+  char *stringData = NULL;
+  asprintf(&stringData, "%s", "");
+  for (int i = 0; i <= maxSpeed; i++) {
+    char *previousStringData = stringData;
+    asprintf(&stringData, "%s %" PRId64, previousStringData, calibrationData[i]);
+    free(previousStringData);
+  }
+  bool retval = setConfigKey(calibrationDataKeyNameForAxis(axis), stringData + 1);
+  free(stringData);
+  return retval;
+}
+
+/// Returns the configuration key for the calibration data for one direction of an axis.
+static char *directionalCalibrationDataKeyNameForAxis(axis_identifier_t axis,
+                                                      calibration_direction_t direction) {
+  static char *buf = NULL;
+  if (buf != NULL) {
+    free(buf);
+  }
+  asprintf(&buf, "%s_%s", calibrationDataKeyNameForAxis(axis),
+           (direction == kCalibrationDirectionNegative) ? "negative" : "positive");
+  return buf;
+}
+
+// Public function.  Docs in header.
+int64_t *readDirectionalCalibrationDataForAxis(axis_identifier_t axis,
+                                               calibration_direction_t direction,
+                                               int *maxSpeed) {
+  char *rawCalibrationData = getConfigKey(directionalCalibrationDataKeyNameForAxis(axis, direction));
+  if (rawCalibrationData == NULL) {
+    return NULL;
+  }
+
+  int count = 0;
+  int64_t *data = malloc((strlen(rawCalibrationData) / 2 + 1) * sizeof(int64_t));
+  char *pos = rawCalibrationData;
+  while (*pos != '\0') {
+    data[count++] = strtoull(pos, &pos, 10);
+    while (*pos == ' ') {
+      pos++;
+    }
+  }
+
+  free(rawCalibrationData);
+  if (maxSpeed) {
+    *maxSpeed = count - 1;
+  }
+  return data;
+}
+
+// Public function.  Docs in header.
+bool writeDirectionalCalibrationDataForAxis(axis_identifier_t axis,
+                                            calibration_direction_t direction,
+                                            int64_t *calibrationData,
+                                            int maxSpeed) {
+  char *stringData = NULL;
+  asprintf(&stringData, "%s", "");
+  for (int i = 0; i <= maxSpeed; i++) {
+    char *previousStringData = stringData;
+    asprintf(&stringData, "%s %" PRId64, previousStringData, calibrationData[i]);
+    free(previousStringData);
+  }
+  bool retval = setConfigKey(directionalCalibrationDataKeyNameForAxis(axis, direction),
+                             stringData + 1);
+  free(stringData);
+  return retval;
+}
+
+// Public function.  Docs in header.
+bool loadDirectionalCalibrationForAxis(axis_identifier_t axis, int maxSpeed,
+                                       directional_calibration_t *calibration) {
+  int64_t *directionalData[kNumCalibrationDirections];
+  for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections; direction++) {
+    int directionalMaxSpeed = 0;
+    directionalData[direction] = readDirectionalCalibrationDataForAxis(axis, direction,
+                                                                       &directionalMaxSpeed);
+    if (directionalData[direction] != NULL && directionalMaxSpeed != maxSpeed) {
+      fprintf(stderr, "Ignoring %s calibration data for %s because the scale (%d) is incorrect.\n",
+              (direction == kCalibrationDirectionNegative) ? "negative" : "positive",
+              nameForAxis(axis), directionalMaxSpeed);
+      free(directionalData[direction]);
+      directionalData[direction] = NULL;
+    }
+  }
+
+  // Calibration data from before per-direction data was recorded applies to both directions.
+  if (directionalData[kCalibrationDirectionNegative] == NULL &&
+      directionalData[kCalibrationDirectionPositive] == NULL) {
+    int combinedMaxSpeed = 0;
+    int64_t *combinedData = readCalibrationDataForAxis(axis, &combinedMaxSpeed);
+    if (combinedData != NULL && combinedMaxSpeed != maxSpeed) {
+      free(combinedData);
+      combinedData = NULL;
+    }
+    directionalData[kCalibrationDirectionPositive] = combinedData;
+  }
+
+  return setDirectionalCalibrationData(calibration, axis, maxSpeed,
+                                       directionalData[kCalibrationDirectionNegative],
+                                       directionalData[kCalibrationDirectionPositive]);
+}
+
+// Public function.  Docs in header.
+bool setDirectionalCalibrationData(directional_calibration_t *calibration, axis_identifier_t axis,
+                                   int maxSpeed, int64_t *negativeData, int64_t *positiveData) {
+  bzero(calibration, sizeof(*calibration));
+  if (negativeData == NULL && positiveData == NULL) {
+    return false;
+  }
+  calibration->maxSpeed = maxSpeed;
+  calibration->data[kCalibrationDirectionNegative] = negativeData;
+  calibration->data[kCalibrationDirectionPositive] = positiveData;
+  for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections; direction++) {
+    if (calibration->data[direction] == NULL) {
+      // Copy the other direction's data, so that each table can be freed on its own.
+      int64_t *otherData = calibration->data[kNumCalibrationDirections - 1 - direction];
+      calibration->data[direction] = malloc((maxSpeed + 1) * sizeof(int64_t));
+      memcpy(calibration->data[direction], otherData, (maxSpeed + 1) * sizeof(int64_t));
+    }
+    calibration->scaledData[direction] = convertSpeedValues(calibration->data[direction],
+                                                            maxSpeed, axis);
+  }
+  return true;
+}
+
+// Public function.  Docs in header.
+void freeDirectionalCalibration(directional_calibration_t *calibration) {
+  for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections; direction++) {
+    free(calibration->data[direction]);
+    free(calibration->scaledData[direction]);
+  }
+  bzero(calibration, sizeof(*calibration));
+}
+
+// Public function.  Docs in header.
+int32_t *scaleDataForSpeed(const directional_calibration_t *calibration, int64_t speed) {
+  if (calibration == NULL) {
+    return NULL;
+  }
+  return calibration->scaledData[CALIBRATION_DIRECTION_FOR_SPEED(speed)];
+}
+
+// Public function.  Docs in header.
+int64_t maximumPositionsPerSecondForCalibration(const directional_calibration_t *calibration,
+                                                calibration_direction_t direction) {
+  if (calibration == NULL || calibration->data[direction] == NULL) {
+    return 0;
+  }
+  return calibration->data[direction][calibration->maxSpeed];
+}
+
+// Public function.  Docs in header.
+int64_t minimumPositionsPerSecondForCalibration(const directional_calibration_t *calibration) {
+  if (calibration == NULL) {
+    return 0;
+  }
+  return MAX(minimumPositionsPerSecondForData(calibration->data[kCalibrationDirectionNegative],
+                                              calibration->maxSpeed),
+             minimumPositionsPerSecondForData(calibration->data[kCalibrationDirectionPositive],
+                                              calibration->maxSpeed));
+}
+
+
+#pragma mark - Online calibration
+
+/** How long a speed must be held before the axis is assumed to have reached it. */
+static const int64_t kOnlineCalibrationSettleNanos = NSEC_PER_SEC * 3 / 10;
+
+/** How long the sampler measures a steady speed for each sample. */
+static const int64_t kOnlineCalibrationWindowNanos = NSEC_PER_SEC / 2;
+
+/**
+ * How much each older sample counts relative to the next (the RLS forgetting factor).
+ * At two samples per second, this keeps roughly the last few minutes of moves.
+ */
+static const double kOnlineCalibrationForgetting = 0.995;
+
+/**
+ * Samples that miss the current model by more than this fraction of the axis's top
+ * speed are ignored (the axis hit something, or someone grabbed the camera).
+ */
+static const double kOnlineCalibrationOutlierLimit = 0.25;
+
+/** New tables are published only if some speed changed by more than this fraction. */
+static const double kOnlineCalibrationPublishThreshold = 0.005;
+
+/// Resets the speed model for both directions to "the base tables are right."
+static void resetOnlineCalibrationModel(online_calibration_t *online) {
+  for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections; direction++) {
+    online->gain[direction][0] = 1;
+    online->gain[direction][1] = 0;
+    bzero(online->covariance[direction], sizeof(online->covariance[direction]));
+
+    // Steady moves measure speeds about as well as a full calibration does, so the
+    // full calibration only counts as a few samples' worth.
+    online->covariance[direction][0][0] = 1;
+    online->covariance[direction][1][1] = 0.1;
+    online->samplesUsed[direction] = 0;
+  }
+  online->sampleCount = 0;
+}
+
+/// Returns a newly allocated copy of a directional calibration.
+static directional_calibration_t *copyDirectionalCalibration(
+    const directional_calibration_t *calibration, axis_identifier_t axis) {
+  directional_calibration_t *copy = malloc(sizeof(directional_calibration_t));
+  size_t length = (calibration->maxSpeed + 1) * sizeof(int64_t);
+  int64_t *negativeData = malloc(length);
+  int64_t *positiveData = malloc(length);
+  memcpy(negativeData, calibration->data[kCalibrationDirectionNegative], length);
+  memcpy(positiveData, calibration->data[kCalibrationDirectionPositive], length);
+  setDirectionalCalibrationData(copy, axis, calibration->maxSpeed, negativeData, positiveData);
+  return copy;
+}
+
+/// Frees replaced tables once the lock-free reader has finished a loop since they were
+/// replaced (or all of them, if force is true).  The caller must hold the lock.
+static void freeRetiredOnlineCalibrations(online_calibration_t *online, bool force) {
+  uint64_t generation = __atomic_load_n(&online->readerGeneration, __ATOMIC_SEQ_CST);
+  online_calibration_retired_t **link = &online->retired;
+  while (*link != NULL) {
+    online_calibration_retired_t *retired = *link;
+    if (force || generation > retired->readerGeneration) {
+      *link = retired->next;
+      freeDirectionalCalibration(retired->calibration);
+      free(retired->calibration);
+      free(retired);
+    } else {
+      link = &retired->next;
+    }
+  }
+}
+
+/// Makes new tables the published tables.  The caller must hold the lock.  The reader
+/// never locks, so the tables being replaced stay around until it has finished a loop.
+static void publishOnlineCalibration(online_calibration_t *online,
+                                     directional_calibration_t *calibration) {
+  directional_calibration_t *previous =
+      __atomic_exchange_n(&online->published, calibration, __ATOMIC_SEQ_CST);
+  if (previous != NULL) {
+    online_calibration_retired_t *retired = malloc(sizeof(online_calibration_retired_t));
+    retired->calibration = previous;
+    retired->readerGeneration = __atomic_load_n(&online->readerGeneration, __ATOMIC_SEQ_CST);
+    retired->next = online->retired;
+    online->retired = retired;
+  }
+  freeRetiredOnlineCalibrations(online, false);
+}
+
+// Public function.  Docs in header.
+bool startOnlineCalibration(online_calibration_t *online, axis_identifier_t axis,
+                            const directional_calibration_t *base) {
+  if (!online->started) {
+    pthread_mutex_init(&online->lock, NULL);
+    online->started = true;
+  }
+  pthread_mutex_lock(&online->lock);
+  freeDirectionalCalibration(&online->base);
+  online->axis = axis;
+  resetOnlineCalibrationModel(online);
+
+  bool hasData = (base != NULL && base->data[kCalibrationDirectionNegative] != NULL &&
+                  base->data[kCalibrationDirectionPositive] != NULL);
+  if (hasData) {
+    directional_calibration_t *baseCopy = copyDirectionalCalibration(base, axis);
+    online->base = *baseCopy;
+    free(baseCopy);
+  }
+  publishOnlineCalibration(online, hasData ? copyDirectionalCalibration(base, axis) : NULL);
+  pthread_mutex_unlock(&online->lock);
+  return hasData;
+}
+
+// Public function.  Docs in header.
+void stopOnlineCalibration(online_calibration_t *online) {
+  if (!online->started) {
+    return;
+  }
+  pthread_mutex_lock(&online->lock);
+  publishOnlineCalibration(online, NULL);
+  freeRetiredOnlineCalibrations(online, true);
+  freeDirectionalCalibration(&online->base);
+  online->started = false;
+  pthread_mutex_unlock(&online->lock);
+  pthread_mutex_destroy(&online->lock);
+}
+
+// Public function.  Docs in header.
+const directional_calibration_t *publishedCalibration(online_calibration_t *online) {
+  return __atomic_load_n(&online->published, __ATOMIC_SEQ_CST);
+}
+
+// Public function.  Docs in header.
+void onlineCalibrationReaderIdle(online_calibration_t *online) {
+  __atomic_add_fetch(&online->readerGeneration, 1, __ATOMIC_SEQ_CST);
+}
+
+// Public function.  Docs in header.
+int64_t minimumPositionsPerSecondForOnlineCalibration(online_calibration_t *online) {
+  if (!online->started) {
+    return 0;
+  }
+  pthread_mutex_lock(&online->lock);
+  int64_t positionsPerSecond = minimumPositionsPerSecondForCalibration(online->published);
+  pthread_mutex_unlock(&online->lock);
+  return positionsPerSecond;
+}
+
+// Public function.  Docs in header.
+int64_t maximumPositionsPerSecondForOnlineCalibration(online_calibration_t *online,
+                                                      calibration_direction_t direction) {
+  if (!online->started) {
+    return 0;
+  }
+  pthread_mutex_lock(&online->lock);
+  int64_t positionsPerSecond =
+      maximumPositionsPerSecondForCalibration(online->published, direction);
+  pthread_mutex_unlock(&online->lock);
+  return positionsPerSecond;
+}
+
+/// Queues a sample for the next update.  This is called from latency-critical
+/// threads, so if an update is in progress, the sample is dropped instead.
+static void addOnlineCalibrationSample(online_calibration_t *online, int hardwareSpeed,
+                                       double positionsPerSecond) {
+  if (!online->started || pthread_mutex_trylock(&online->lock) != 0) {
+    return;
+  }
+  if (online->sampleCount < ONLINE_CALIBRATION_MAX_SAMPLES) {
+    online->samples[online->sampleCount].hardwareSpeed = hardwareSpeed;
+    online->samples[online->sampleCount].positionsPerSecond = positionsPerSecond;
+    online->sampleCount++;
+  }
+  pthread_mutex_unlock(&online->lock);
+}
+
+// Public function.  Docs in header.
+void observeOnlineCalibrationSpeed(online_calibration_sampler_t *sampler,
+                                   online_calibration_t *online, int hardwareSpeed,
+                                   int64_t position, int64_t now) {
+  if (hardwareSpeed != sampler->hardwareSpeed || sampler->speedStartTime == 0) {
+    sampler->hardwareSpeed = hardwareSpeed;
+    sampler->speedStartTime = now;
+    sampler->windowStartTime = 0;
+    return;
+  }
+  if (hardwareSpeed == 0 || now - sampler->speedStartTime < kOnlineCalibrationSettleNanos) {
+    return;
+  }
+  if (sampler->windowStartTime == 0) {
+    sampler->windowStartTime = now;
+    sampler->windowStartPosition = position;
+    return;
+  }
+  int64_t elapsed = now - sampler->windowStartTime;
+  if (elapsed >= kOnlineCalibrationWindowNanos) {
+    double positionsPerSecond =
+        (double)llabs(position - sampler->windowStartPosition) * NSEC_PER_SEC / elapsed;
+    addOnlineCalibrationSample(online, hardwareSpeed, positionsPerSecond);
+    sampler->windowStartTime = now;
+    sampler->windowStartPosition = position;
+  }
+}
 
-    int index = speed - minSpeed;
-    data[index] = round(positionsPerSecondAverage);
-    fprintf(stderr, "Positions per second at speed %d (average): %lf (%lld)\n",
-            index, positionsPerSecondAverage, data[index]);
+/// Updates one direction's model (speed = gain[0] * base speed + gain[1] * top base
+/// speed, all as fractions of the top base speed) with one sample, using recursive
+/// least squares.  Returns false if the sample was rejected.
+static bool updateOnlineCalibrationModel(online_calibration_t *online,
+                                         calibration_direction_t direction,
+                                         double baseFraction, double measuredFraction) {
+  double *gain = online->gain[direction];
+  double (*covariance)[2] = online->covariance[direction];
+  double x[2] = { baseFraction, 1 };
+
+  double error = measuredFraction - (gain[0] * x[0] + gain[1] * x[1]);
+  if (fabs(error) > kOnlineCalibrationOutlierLimit) {
+    return false;
+  }
 
-    // The motor may stall at low voltages, but once it gets moving, it should get faster
-    // for each increase in voltage.  If not, something went wrong, and our results are invalid.
-    // In some cases (e.g. for zoom motors hidden behind software), two speed values might result
-    // in identical speeds, so it's potentially okay for it to not speed up, but it should never
-    // slow down.
-    if (speed >= 1 && data[index] < data[index - 1] && data[index] > 0) {
-      if (pollingIsSlow) {
-        fprintf(stderr, "Motor slowed down.  Assuming speed is unchanged.\n");
-        data[index] = data[index - 1];
-      } else {
-        fprintf(stderr, "Motor slowed down.  Recomputing previous position and current position.\n");
-        speed -= 2;
-      }
+  double px[2] = { covariance[0][0] * x[0] + covariance[0][1] * x[1],
+                   covariance[1][0] * x[0] + covariance[1][1] * x[1] };
+  double denominator = kOnlineCalibrationForgetting + x[0] * px[0] + x[1] * px[1];
+  double k[2] = { px[0] / denominator, px[1] / denominator };
+
+  gain[0] += k[0] * error;
+  gain[1] += k[1] * error;
+
+  // P = (P - k * x^T * P) / lambda.  P is symmetric, so x^T * P is px^T.
+  for (int row = 0; row < 2; row++) {
+    for (int column = 0; column < 2; column++) {
+      covariance[row][column] =
+          (covariance[row][column] - k[row] * px[column]) / kOnlineCalibrationForgetting;
     }
   }
-  setAxisSpeedRaw(axis, 0, false);
-  if (localDebug) {
-    fprintf(stderr, "Done collecting data for axis %d\n", axis);
-  }
-
-  return data;
+  online->samplesUsed[direction]++;
+  return true;
 }
 
-const char *nameForAxis(axis_identifier_t axis) {
-  switch (axis) {
-    case axis_identifier_pan:
-      return "pan";
-    case axis_identifier_tilt:
-      return "tilt";
-      break;
-    case axis_identifier_zoom:
-      return "zoom";
-    default:
-      return "unknown";
+/// Builds tables from the base tables and the current model.  The caller must hold
+/// the lock.
+static directional_calibration_t *onlineCalibrationTables(online_calibration_t *online) {
+  int maxSpeed = online->base.maxSpeed;
+  int64_t *data[kNumCalibrationDirections];
+  for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections; direction++) {
+    const int64_t *baseData = online->base.data[direction];
+    double topSpeed = baseData[maxSpeed];
+    double scale = fmax(0.5, fmin(2, online->gain[direction][0]));
+    double offset = fmax(-0.2, fmin(0.2, online->gain[direction][1])) * topSpeed;
+
+    data[direction] = malloc((maxSpeed + 1) * sizeof(int64_t));
+    int64_t fastest = 0;
+    for (int speed = 0; speed <= maxSpeed; speed++) {
+      // Speeds where the axis stalled stay stalled, and faster speeds never move slower.
+      if (baseData[speed] == 0) {
+        data[direction][speed] = 0;
+        continue;
+      }
+      fastest = MAX(fastest, MAX(1, llround(scale * baseData[speed] + offset)));
+      data[direction][speed] = fastest;
+    }
   }
+  directional_calibration_t *calibration = malloc(sizeof(directional_calibration_t));
+  setDirectionalCalibrationData(calibration, online->axis, maxSpeed,
+                                data[kCalibrationDirectionNegative],
+                                data[kCalibrationDirectionPositive]);
+  return calibration;
 }
 
-const char *calibrationDataKeyNameForAxis(axis_identifier_t axis) {
-  switch (axis) {
-    case axis_identifier_pan:
-      return "calibration_data_pan";
-    case axis_identifier_tilt:
-      return "calibration_data_tilt";
-      break;
-    case axis_identifier_zoom:
-      return "calibration_data_zoom";
-    default:
-      return "calibration_data_unknown";
+/// Returns the largest change between two sets of tables, as a fraction of the
+/// top speed.
+static double onlineCalibrationChange(const directional_calibration_t *old,
+                                      const directional_calibration_t *new) {
+  double change = 0;
+  for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections; direction++) {
+    double topSpeed = MAX(1, old->data[direction][old->maxSpeed]);
+    for (int speed = 0; speed <= old->maxSpeed; speed++) {
+      change = fmax(change, llabs(new->data[direction][speed] - old->data[direction][speed]) /
+                            topSpeed);
+    }
   }
+  return change;
 }
 
 // Public function.  Docs in header.
-//
-// Reads calibration data from the configuration file.
-int64_t *readCalibrationDataForAxis(axis_identifier_t axis,
-                                    int *maxSpeed) {
-  char *rawCalibrationData = getConfigKey(calibrationDataKeyNameForAxis(axis));
-  if (rawCalibrationData == NULL) {
-    return NULL;
+bool updateOnlineCalibration(online_calibration_t *online, int64_t now) {
+  bool localDebug = false;
+  if (!online->started) {
+    return false;
+  }
+  pthread_mutex_lock(&online->lock);
+  freeRetiredOnlineCalibrations(online, false);
+  const directional_calibration_t *published = online->published;
+  if (published == NULL || online->sampleCount == 0) {
+    online->sampleCount = 0;
+    pthread_mutex_unlock(&online->lock);
+    return false;
   }
 
-  int64_t *data = NULL;
-  ssize_t size = 0;
-  int count = 0;
-  char *pos = rawCalibrationData;
-  while (*pos != '\0') {
-    int64_t value = strtoull(pos, NULL, 10);
-    int64_t *newData = realloc(data, size + sizeof(int64_t));
-    size += sizeof(int64_t);
-    if (newData == NULL) {
-      // This should never occur.
-      free(data);
-      free(rawCalibrationData);
-      return NULL;
-    }
-    data = newData;
-    data[count++] = value;
-
-    // Skip to the next value.
-    while (*pos && *pos != ' ') {
-      pos++;
+  int maxSpeed = online->base.maxSpeed;
+  for (int i = 0; i < online->sampleCount; i++) {
+    online_calibration_sample_t *sample = &online->samples[i];
+    int speed = abs(sample->hardwareSpeed);
+    calibration_direction_t direction = CALIBRATION_DIRECTION_FOR_SPEED(sample->hardwareSpeed);
+    int64_t topSpeed = online->base.data[direction][maxSpeed];
+    if (speed > maxSpeed || topSpeed <= 0 || online->base.data[direction][speed] == 0) {
+      continue;
     }
-    while (*pos && *pos == ' ') {
-      pos++;
+    if (!updateOnlineCalibrationModel(online, direction,
+                                      (double)online->base.data[direction][speed] / topSpeed,
+                                      sample->positionsPerSecond / topSpeed)) {
+      if (localDebug) {
+        fprintf(stderr, "Ignoring %s speed sample %d -> %f\n", nameForAxis(online->axis),
+                sample->hardwareSpeed, sample->positionsPerSecond);
+      }
     }
   }
+  online->sampleCount = 0;
 
-  free(rawCalibrationData);
-  if (maxSpeed) {
-    // Return the last index.
-    *maxSpeed = count - 1;
+  directional_calibration_t *candidate = onlineCalibrationTables(online);
+  bool changed = onlineCalibrationChange(published, candidate) > kOnlineCalibrationPublishThreshold;
+  if (changed) {
+    if (localDebug) {
+      fprintf(stderr, "Updated %s calibration (negative %f/%f, positive %f/%f)\n",
+              nameForAxis(online->axis),
+              online->gain[kCalibrationDirectionNegative][0],
+              online->gain[kCalibrationDirectionNegative][1],
+              online->gain[kCalibrationDirectionPositive][0],
+              online->gain[kCalibrationDirectionPositive][1]);
+    }
+    publishOnlineCalibration(online, candidate);
+    online->unsaved = true;
+  } else {
+    freeDirectionalCalibration(candidate);
+    free(candidate);
   }
-  return data;
-}
 
-// Public function.  Docs in header.
-//
-// Writes calibration data to the configuration file.
-bool writeCalibrationDataForAxis(axis_identifier_t axis, int64_t *calibrationData, int maxSpeed) {
-  char *stringData = NULL;
-  asprintf(&stringData, "%s", "");
-  for (int i = 0; i <= maxSpeed; i++) {
-    char *previousStringData = stringData;
-    asprintf(&stringData, "%s %" PRId64, previousStringData, calibrationData[i]);
-    free(previousStringData);
+  // Writing the configuration file is slow, so copy the tables and write them after
+  // unlocking.
+  directional_calibration_t *toSave = NULL;
+  if (online->unsaved && online->persistIntervalNanos > 0 &&
+      now - online->lastPersistTime >= online->persistIntervalNanos) {
+    toSave = copyDirectionalCalibration(online->published, online->axis);
+    online->lastPersistTime = now;
+    online->unsaved = false;
   }
-  bool retval = setConfigKey(calibrationDataKeyNameForAxis(axis), stringData + 1);
-  free(stringData);
-  return retval;
+  axis_identifier_t axis = online->axis;
+  pthread_mutex_unlock(&online->lock);
+
+  if (toSave != NULL) {
+    for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections;
+         direction++) {
+      writeDirectionalCalibrationDataForAxis(axis, direction, toSave->data[direction],
+                                             toSave->maxSpeed);
+    }
+    freeDirectionalCalibration(toSave);
+    free(toSave);
+  }
+  return changed;
 }
 
 
@@ -3300,8 +6183,92 @@ void setTricasterIP(char *TricasterIP) {
 #endif
 
 
+#pragma mark - Simulation
+
+void setVirtualClock(bool enabled, int64_t nanoseconds) {
+  gVirtualClockEnabled = enabled;
+  gVirtualClockNanos = nanoseconds;
+}
+
+void startMotorSimulation(const motor_sim_params_t *params, const int64_t *startPositions) {
+  setVirtualClock(true, 0);
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    motorSimInitAxis(&gSimulatedAxes[axis], &params[axis], startPositions[axis]);
+    setDirectionalCalibrationData(&gSimulatedCalibration[axis], axis, params[axis].hardwareScale,
+                                  motorSimCalibrationData(&params[axis], -1),
+                                  motorSimCalibrationData(&params[axis], 1));
+    gSimulatedEncoderDirection[axis] = 1;
+    gAxisMoveInProgress[axis] = false;
+  }
+
+  // A reversed encoder counts down when the motor turns forward.
+  if (panEncoderReversed()) gSimulatedEncoderDirection[axis_identifier_pan] = -1;
+  if (tiltEncoderReversed()) gSimulatedEncoderDirection[axis_identifier_tilt] = -1;
+  if (zoomEncoderReversed()) gSimulatedEncoderDirection[axis_identifier_zoom] = -1;
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    gSimulatedAxes[axis].motorPosition *= gSimulatedEncoderDirection[axis];
+    gSimulatedAxes[axis].loadPosition *= gSimulatedEncoderDirection[axis];
+  }
+  gMotorSimulationActive = true;
+}
+
+void advanceMotorSimulation(int64_t nanoseconds) {
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    motorSimStep(&gSimulatedAxes[axis], nanoseconds);
+  }
+  gVirtualClockNanos += nanoseconds;
+}
+
+void runMotorSimulation(double seconds) {
+  int64_t endTime = gVirtualClockNanos + SECONDS_TO_NANOS(seconds);
+  while (gVirtualClockNanos < endTime) {
+    advanceMotorSimulation(MIN(kMotorSimulationTickNanos, endTime - gVirtualClockNanos));
+    handleRecallUpdates();
+  }
+}
+
+void stopMotorSimulation(void) {
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    gAxisMoveInProgress[axis] = false;
+    gAxisLastMoveSpeed[axis] = 0;
+    freeDirectionalCalibration(&gSimulatedCalibration[axis]);
+  }
+  gMotorSimulationActive = false;
+  setVirtualClock(false, 0);
+}
+
+
 #pragma mark - Tests
 
+// Runs the simulation until every axis has finished moving (or maxSeconds passes), and
+// records when each axis first came within half a percent of its target (or -1 if it never
+// did).  Returns the slowest rate that the coordinated move's clock ran at along the way.
+static double runMotorSimulationUntilArrival(const int64_t *startPositions,
+                                             const int64_t *targetPositions, double maxSeconds,
+                                             double *arrivalTimes) {
+  double slowestRate = 1;
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    arrivalTimes[axis] = -1;
+  }
+  while (NANOS_TO_SECONDS(gVirtualClockNanos) < maxSeconds) {
+    runMotorSimulation(NANOS_TO_SECONDS(kMotorSimulationTickNanos));
+    if (gCoordinatedMove.active) {
+      slowestRate = MIN(slowestRate, gCoordinatedMove.rate);
+    }
+    for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+      int64_t tolerance = MAX(llabs(targetPositions[axis] - startPositions[axis]) / 200, 2);
+      if (arrivalTimes[axis] < 0 && startPositions[axis] != targetPositions[axis] &&
+          llabs(getAxisPosition(axis) - targetPositions[axis]) <= tolerance) {
+        arrivalTimes[axis] = NANOS_TO_SECONDS(gVirtualClockNanos);
+      }
+    }
+    if (!moveInProgress()) {
+      break;
+    }
+  }
+  return slowestRate;
+}
+
 void runStartupTests(void) {
   char *bogusValue = getConfigKey("nonexistentKey");
   assert(bogusValue == NULL);
@@ -3377,4 +6344,841 @@ void runStartupTests(void) {
   for (int i = 0; i < (sizeof(source100Values) / sizeof(source100Values[0])); i++) {
     assert(scaleSpeed(-source100Values[i], 100, maxSpeed, translatedData) == -expectedValues[i]);
   }
+
+  // Verify that the inverse lookup table returns exactly what the linear scan
+  // returns for every core speed, using a curve that stalls at low speeds.
+  int64_t fakeCurve[PAN_TILT_SCALE_FAKE + 1];
+  fakeBenchmarkCalibrationCurve(fakeCurve, PAN_TILT_SCALE_FAKE);
+  int32_t *fakeCurveScaled = convertSpeedValues(fakeCurve, PAN_TILT_SCALE_FAKE, 0);
+  for (int speed = -SCALE_CORE - 10; speed <= SCALE_CORE + 10; speed++) {
+    int expected = scaleSpeedByScanning(abs(speed), PAN_TILT_SCALE_FAKE, fakeCurveScaled) * ((speed < 0) ? -1 : 1);
+    assert(scaleSpeed(speed, SCALE_CORE, PAN_TILT_SCALE_FAKE, fakeCurveScaled) == expected);
+  }
+  free(fakeCurveScaled);
+
+  // Verify that the s-curve lookup table stays within rounding error of the analytic curve,
+  // both at table entries and between them.
+  double maxSCurveError = 0;
+  for (int32_t rampProgress = 0; rampProgress <= (kRampUpPeriodEnd << S_CURVE_PROGRESS_FRACTION_BITS);
+       rampProgress += 16) {
+    double expected = analyticSCurveFraction(rampProgress / (double)(1 << S_CURVE_PROGRESS_FRACTION_BITS));
+    double actual = sCurveFractionForRampProgress(rampProgress) / (double)S_CURVE_ONE;
+    maxSCurveError = MAX(maxSCurveError, fabs(expected - actual));
+  }
+  assert(maxSCurveError < 0.0002);
+
+  // Verify that the planned distance along the s-curve starts at 0, ends at 1, is
+  // symmetric, and never moves backwards.
+  assert(sCurveDistanceFractionForProgress(0) == 0);
+  assert(sCurveDistanceFractionForProgress(1000 << S_CURVE_PROGRESS_FRACTION_BITS) == 1);
+  assert(fabs(sCurveDistanceFractionForProgress(500 << S_CURVE_PROGRESS_FRACTION_BITS) - 0.5) < 0.0001);
+  double previousFraction = 0;
+  for (int32_t progress = 0; progress <= (1000 << S_CURVE_PROGRESS_FRACTION_BITS); progress += 37) {
+    double fraction = sCurveDistanceFractionForProgress(progress);
+    assert(fraction >= previousFraction);
+    previousFraction = fraction;
+  }
+
+  // Verify that a planned trajectory ends at the target, and that its velocities
+  // add up to the same distance as its positions, for both short and long moves.
+  double testDurations[] = { 0.5, 3.0, 120.0 };
+  for (int i = 0; i < (sizeof(testDurations) / sizeof(testDurations[0])) * (kNumMotionProfiles - 1); i++) {
+    axis_trajectory_t *trajectory = &gAxisTrajectory[axis_identifier_pan];
+    trajectory->profile = kMotionProfileLogistic + (i % (kNumMotionProfiles - 1));
+    fillTrajectorySetpoints(trajectory, 12345, testDurations[i / (kNumMotionProfiles - 1)]);
+    assert(trajectory->numSetpoints <= MAX_TRAJECTORY_SETPOINTS);
+    assert(fabs(trajectory->setpoints[trajectory->numSetpoints - 1].position - 12345) < 0.001);
+    double integratedDistance = 0;
+    for (int j = 1; j < trajectory->numSetpoints; j++) {
+      integratedDistance += (trajectory->setpoints[j - 1].velocity + trajectory->setpoints[j].velocity) *
+                            trajectory->setpointInterval / 2;
+    }
+    assert(fabs(integratedDistance - 12345) < 12345 * 0.005);
+    trajectory->numSetpoints = 0;
+  }
+
+  // Verify that each profile is continuous, symmetric, and covers the whole distance, and
+  // that a move planned with the fastest duration never needs more than the maximum speed.
+  for (motion_profile_t profile = kMotionProfileLogistic; profile < kNumMotionProfiles; profile++) {
+    const motion_profile_ops_t *ops = opsForMotionProfile(profile);
+    assert(ops->distanceFraction(0) == 0 && ops->distanceFraction(1) == 1);
+    assert(ops->speedFraction(0.5) == 1);
+    double previousSpeed = ops->speedFraction(0);
+    double previousDistance = 0;
+    for (double t = 0.001; t <= 1.0; t += 0.001) {
+      double speed = ops->speedFraction(t);
+      double distance = ops->distanceFraction(t);
+      assert(fabs(speed - previousSpeed) < 0.02);
+      assert(distance >= previousDistance && distance - previousDistance < 0.002);
+      assert(fabs(speed - ops->speedFraction(1 - t)) < 0.001);
+      assert(fabs(distance + ops->distanceFraction(1 - t) - 1) < 0.001);
+      previousSpeed = speed;
+      previousDistance = distance;
+    }
+
+    double fastest = fastestDurationForProfile(profile, 5000, 2000);
+    axis_trajectory_t *trajectory = &gAxisTrajectory[axis_identifier_pan];
+    trajectory->profile = profile;
+    fillTrajectorySetpoints(trajectory, 5000, fastest);
+    for (int i = 0; i < trajectory->numSetpoints; i++) {
+      assert(trajectory->setpoints[i].velocity <= 2000.001);
+    }
+    assert(fabs(trajectory->setpoints[trajectory->numSetpoints / 2].velocity - 2000) < 0.001);
+    trajectory->numSetpoints = 0;
+  }
+  assert(fastestDurationForProfile(kMotionProfileTrapezoid, 1000, 1000) <
+         fastestDurationForProfile(kMotionProfileLogistic, 1000, 1000));
+  assert(motionProfileForName("jerk") == kMotionProfileJerkLimited);
+  assert(motionProfileForName("bogus") == kMotionProfileDefault);
+
+  // Verify that the controller passes the feedforward speed through when the axis is on
+  // track, and that a long stall saturates the output without winding up the integral.
+  resetAxisController(axis_identifier_pan);
+  assert(updateAxisController(axis_identifier_pan, 100, 100, 500, 500, 1000, 1, NSEC_PER_SEC) == 500);
+  int stalledSpeed = 0;
+  for (int i = 1; i <= 1000; i++) {
+    stalledSpeed = updateAxisController(axis_identifier_pan, 100 + (i * 10), 100, 500, 0, 1000, 1,
+                                        NSEC_PER_SEC + SECONDS_TO_NANOS(i * 0.01));
+  }
+  assert(stalledSpeed == SCALE_CORE && gAxisController[axis_identifier_pan].saturated);
+  assert(gAxisController[axis_identifier_pan].integral * kControllerIntegralGain <=
+         (kControllerMaxIntegralFraction * 1000) + 0.0001);
+
+  // Once the axis catches up, the output must drop back below the maximum immediately.
+  assert(updateAxisController(axis_identifier_pan, 10100, 10100, 500, 500, 1000, 1,
+                              SECONDS_TO_NANOS(11.01)) < SCALE_CORE);
+  resetAxisController(axis_identifier_pan);
+
+  // A feedforward speed that rounds to zero must still move the axis while it is behind,
+  // but the floor must not push an axis that is ahead of its setpoint.
+  assert(updateAxisController(axis_identifier_pan, 0.4, 0, 0.2, 0, 1000, 20, NSEC_PER_SEC) == 20);
+  assert(updateAxisController(axis_identifier_pan, 0.4, 1, 0.2, 0, 1000, 20,
+                              NSEC_PER_SEC + SECONDS_TO_NANOS(0.01)) == 0);
+  resetAxisController(axis_identifier_pan);
+
+  // Verify that the estimator recovers the velocity of a quantized encoder, that it
+  // notices a stall within the stall threshold, and that sparse samples (like P2 zoom
+  // reports) do not make it oscillate.
+  axis_estimator_t estimator;
+  resetAxisEstimator(&estimator, kDefaultEstimatorProcessNoise, kDefaultEstimatorMeasurementNoise);
+  int64_t sampleTime = 0;
+  for (int i = 0; i <= 200; i++) {
+    sampleTime = SECONDS_TO_NANOS(i * 0.01);
+    updateAxisEstimator(&estimator, (int64_t)floor(1234.0 * i * 0.01), sampleTime);
+  }
+  assert(fabs(estimator.velocity - 1234) < 1234 * 0.02);
+  assert(fabs(predictedAxisEstimatorPosition(&estimator, sampleTime + SECONDS_TO_NANOS(0.1)) -
+              (1234 * 2.1)) < 5);
+  for (int i = 1; i <= kAxisStallThreshold; i++) {
+    updateAxisEstimator(&estimator, 2468, sampleTime + SECONDS_TO_NANOS(i * 0.01));
+  }
+  assert(fabs(estimator.velocity) < kAxisStallVelocity);
+
+  resetAxisEstimator(&estimator, kDefaultEstimatorProcessNoise, kDefaultEstimatorMeasurementNoise);
+  double previousVelocityError = 1e9;
+  for (int i = 0; i <= 10; i++) {
+    updateAxisEstimator(&estimator, 300 * i, SECONDS_TO_NANOS(i * 0.5));
+    if (i > 1) {
+      double velocityError = fabs(estimator.velocity - 600);
+      assert(velocityError <= previousVelocityError);
+      previousVelocityError = velocityError;
+    }
+  }
+  assert(previousVelocityError < 1);
+
+  // Verify that computeSpeed matches the original pow()-based computation to within
+  // one unit of core speed across the entire move.
+  int peakSpeeds[] = { 1000, 555, 37, 1, -1000, -37 };
+  for (int i = 0; i < (sizeof(peakSpeeds) / sizeof(peakSpeeds[0])); i++) {
+    for (int progress = 0; progress <= 1000; progress++) {
+      int decipercentProgressToStartOrEnd = (progress >= kRampDownPeriodStart) ? (1000 - progress) : progress;
+      int expected = (progress < kRampUpPeriodEnd || progress > kRampDownPeriodStart) ?
+          round(analyticSCurveFraction(decipercentProgressToStartOrEnd) * peakSpeeds[i]) : peakSpeeds[i];
+      assert(abs(computeSpeed(progress, peakSpeeds[i]) - expected) <= 1);
+    }
+  }
+
+  // Run the same simulated recall twice (far faster than real time) and verify that every
+  // axis stays on its planned trajectory, arrives at its target, and ends up in exactly the
+  // same place both times.
+  motor_sim_params_t simParams[NUM_AXES];
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    motorSimDefaultParams(&simParams[axis], axis);
+  }
+  const int64_t simStartPositions[NUM_AXES] = { 1000000, 1000000, 500 };
+  const int64_t simTargetPositions[NUM_AXES] = { 1012000, 995000, 2500 };
+  int64_t simFinalPositions[NUM_AXES];
+  for (int run = 0; run < 2; run++) {
+    startMotorSimulation(simParams, simStartPositions);
+    for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+      setAxisPositionIncrementally(axis, simTargetPositions[axis], SCALE_CORE, 3.0, 0);
+    }
+    runMotorSimulation(1.5);
+    for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+      int64_t distance = llabs(simTargetPositions[axis] - simStartPositions[axis]);
+      int64_t midpoint = (simStartPositions[axis] + simTargetPositions[axis]) / 2;
+      assert(llabs(getAxisPosition(axis) - midpoint) < distance / 20);
+    }
+    runMotorSimulation(2.5);
+    for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+      int64_t distance = llabs(simTargetPositions[axis] - simStartPositions[axis]);
+      assert(!gAxisMoveInProgress[axis]);
+      assert(llabs(getAxisPosition(axis) - simTargetPositions[axis]) < distance / 100);
+      if (run == 0) {
+        simFinalPositions[axis] = getAxisPosition(axis);
+      } else {
+        assert(getAxisPosition(axis) == simFinalPositions[axis]);
+      }
+    }
+    stopMotorSimulation();
+  }
+
+  // Verify that a coordinated recall starts an axis late if it can't move slowly enough
+  // to take the whole move, so that every axis still arrives at the same time.
+  bool savedRecallSpeedSet = gRecallSpeedSet;
+  int savedVISCARecallSpeed = gVISCARecallSpeed;
+  gRecallSpeedSet = true;
+  gVISCARecallSpeed = 24;
+
+  const int64_t coordinatedStartPositions[NUM_AXES] = { 1000000, 1000000, 530 };
+  const int64_t coordinatedTargetPositions[NUM_AXES] = { 1020000, 992000, 500 };
+  double arrivalTimes[NUM_AXES];
+  startMotorSimulation(simParams, coordinatedStartPositions);
+  assert(recallPosition(coordinatedTargetPositions[axis_identifier_pan],
+                        coordinatedTargetPositions[axis_identifier_tilt],
+                        coordinatedTargetPositions[axis_identifier_zoom], kMotionProfileDefault));
+  assert(gCoordinatedMove.active);
+  assert(gCoordinatedMove.startOffset[axis_identifier_pan] == 0);
+  assert(gCoordinatedMove.startOffset[axis_identifier_zoom] > 0.1);
+  double coordinatedDuration = gCoordinatedMove.duration;
+  runMotorSimulationUntilArrival(coordinatedStartPositions, coordinatedTargetPositions,
+                                 coordinatedDuration + 2, arrivalTimes);
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    // The s-curve's tail is so slow that an axis gets close to its target a little early,
+    // but none of them should get there before the last tenth of its move.
+    assert(arrivalTimes[axis] >= coordinatedDuration - (0.1 * gAxisDuration[axis]) - 0.05);
+    assert(arrivalTimes[axis] <= coordinatedDuration + 0.15);
+  }
+  stopMotorSimulation();
+
+  // Verify that when one axis falls behind (here, because the tilt motor is weaker than its
+  // calibration data says), the shared clock slows down so that the others wait for it.
+  const int64_t laggingTargetPositions[NUM_AXES] = { 1020000, 992000, 530 };
+  startMotorSimulation(simParams, coordinatedStartPositions);
+  assert(recallPosition(laggingTargetPositions[axis_identifier_pan],
+                        laggingTargetPositions[axis_identifier_tilt],
+                        laggingTargetPositions[axis_identifier_zoom], kMotionProfileDefault));
+  gSimulatedAxes[axis_identifier_tilt].params.maxPositionsPerSecond *= 0.6;
+  coordinatedDuration = gCoordinatedMove.duration;
+  double slowestRate = runMotorSimulationUntilArrival(coordinatedStartPositions,
+                                                      laggingTargetPositions,
+                                                      coordinatedDuration + 4, arrivalTimes);
+  assert(slowestRate < 0.9);
+  assert(arrivalTimes[axis_identifier_pan] > coordinatedDuration);
+  assert(fabs(arrivalTimes[axis_identifier_pan] - arrivalTimes[axis_identifier_tilt]) < 0.25);
+  stopMotorSimulation();
+
+  // Verify that a slow recall (the speed used when the camera is live) of a short move is
+  // not mistaken for a stall while the start of its ramp is too slow to move the motors.
+  gVISCARecallSpeed = 6;
+  const int64_t slowTargetPositions[NUM_AXES] = { 1001500, 999200, 800 };
+  startMotorSimulation(simParams, simStartPositions);
+  assert(recallPosition(slowTargetPositions[axis_identifier_pan],
+                        slowTargetPositions[axis_identifier_tilt],
+                        slowTargetPositions[axis_identifier_zoom], kMotionProfileDefault));
+  double slowDuration = gCoordinatedMove.duration;
+  assert(slowDuration > 10);
+  runMotorSimulationUntilArrival(simStartPositions, slowTargetPositions, slowDuration + 2,
+                                 arrivalTimes);
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    assert(!gAxisMoveInProgress[axis]);
+    assert(arrivalTimes[axis] > slowDuration / 2);
+    assert(llabs(getAxisPosition(axis) - slowTargetPositions[axis]) <= 2);
+  }
+  stopMotorSimulation();
+  gVISCARecallSpeed = 24;
+
+  // Verify that an axis that moves faster in one direction (here, tilting with gravity) gets
+  // separate calibration data for each direction, and that moves each way plan with the
+  // matching maximum speed and still arrive on time.
+  motor_sim_params_t gravityParams[NUM_AXES];
+  memcpy(gravityParams, simParams, sizeof(gravityParams));
+  gravityParams[axis_identifier_tilt].negativeSpeedScale = 1.5;
+  const int64_t gravityTargetPositions[2][NUM_AXES] = {
+    { 1000000, 992000, 530 },
+    { 1000000, 1008000, 530 },
+  };
+  int64_t plannedMaximums[2];
+  for (int move = 0; move < 2; move++) {
+    startMotorSimulation(gravityParams, coordinatedStartPositions);
+    directional_calibration_t *tiltCalibration = &gSimulatedCalibration[axis_identifier_tilt];
+    int64_t negativeMaximum = maximumPositionsPerSecondForAxisInDirection(axis_identifier_tilt, -1);
+    int64_t positiveMaximum = maximumPositionsPerSecondForAxisInDirection(axis_identifier_tilt, 1);
+    assert(negativeMaximum > 1.45 * positiveMaximum && negativeMaximum < 1.55 * positiveMaximum);
+    assert(maximumPositionsPerSecondForAxis(axis_identifier_tilt) == positiveMaximum);
+    assert(scaleDataForSpeed(tiltCalibration, -1) ==
+           tiltCalibration->scaledData[kCalibrationDirectionNegative]);
+    assert(scaleDataForSpeed(tiltCalibration, 1) ==
+           tiltCalibration->scaledData[kCalibrationDirectionPositive]);
+    assert(maximumPositionsPerSecondForAxisInDirection(axis_identifier_pan, -1) ==
+           maximumPositionsPerSecondForAxisInDirection(axis_identifier_pan, 1));
+
+    assert(recallPosition(gravityTargetPositions[move][axis_identifier_pan],
+                          gravityTargetPositions[move][axis_identifier_tilt],
+                          gravityTargetPositions[move][axis_identifier_zoom],
+                          kMotionProfileDefault));
+    axis_trajectory_t *tiltTrajectory = &gAxisTrajectory[axis_identifier_tilt];
+    plannedMaximums[move] = tiltTrajectory->maxPositionsPerSecond;
+    assert(plannedMaximums[move] ==
+           maximumPositionsPerSecondForAxisInDirection(axis_identifier_tilt,
+                                                       tiltTrajectory->direction));
+    double tiltDuration = gAxisDuration[axis_identifier_tilt];
+    runMotorSimulationUntilArrival(coordinatedStartPositions, gravityTargetPositions[move],
+                                   gCoordinatedMove.duration + 2, arrivalTimes);
+    assert(arrivalTimes[axis_identifier_tilt] >= 0.85 * tiltDuration);
+    assert(arrivalTimes[axis_identifier_tilt] <= tiltDuration + 0.15);
+    assert(llabs(getAxisPosition(axis_identifier_tilt) -
+                 gravityTargetPositions[move][axis_identifier_tilt]) <= 100);
+    stopMotorSimulation();
+  }
+  assert(plannedMaximums[0] != plannedMaximums[1]);
+
+  // Verify that calibrating pan and tilt at once takes about as long as the slower of the two
+  // alone, and still measures each simulated motor's actual speed in each direction.
+  int64_t calibrationTimes[3];
+  for (int run = 0; run < 3; run++) {
+    startMotorSimulation(gravityParams, simStartPositions);
+    axis_calibration_request_t calibrationRequests[2];
+    int calibrationCount = 0;
+    for (axis_identifier_t axis = axis_identifier_pan; axis <= axis_identifier_tilt; axis++) {
+      if (run != 0 && run != axis + 1) {
+        continue;
+      }
+      bool encoderReversed = (axis == axis_identifier_pan) ? panEncoderReversed() :
+          tiltEncoderReversed();
+      int64_t span = encoderReversed ? -30000 : 30000;
+      calibrationRequests[calibrationCount++] = (axis_calibration_request_t){
+        .axis = axis,
+        .startPosition = simStartPositions[axis] + span,
+        .endPosition = simStartPositions[axis] - span,
+        .minSpeed = 98,
+        .maxSpeed = 100,
+        .pollingIsSlow = false
+      };
+    }
+    int64_t calibrationStartTime = gVirtualClockNanos;
+    calibrateAxesConcurrently(calibrationRequests, calibrationCount);
+    calibrationTimes[run] = gVirtualClockNanos - calibrationStartTime;
+
+    for (int i = 0; i < calibrationCount; i++) {
+      axis_calibration_request_t *request = &calibrationRequests[i];
+      int64_t *idealData[kNumCalibrationDirections] = {
+        motorSimCalibrationData(&gravityParams[request->axis], -1),
+        motorSimCalibrationData(&gravityParams[request->axis], 1)
+      };
+      for (int32_t speed = request->minSpeed; speed <= request->maxSpeed; speed++) {
+        int index = speed - request->minSpeed;
+        for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections;
+             direction++) {
+          assert(llabs(request->directionalData[direction][index] - idealData[direction][speed]) <=
+                 idealData[direction][speed] * 0.03);
+        }
+        assert(request->data[index] >= MIN(idealData[0][speed], idealData[1][speed]) * 0.97);
+        assert(request->data[index] <= MAX(idealData[0][speed], idealData[1][speed]) * 1.03);
+      }
+      for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections;
+           direction++) {
+        free(idealData[direction]);
+        free(request->directionalData[direction]);
+      }
+      free(request->data);
+    }
+    stopMotorSimulation();
+  }
+  assert(calibrationTimes[0] < 0.7 * (calibrationTimes[1] + calibrationTimes[2]));
+  assert(calibrationTimes[0] <= 1.1 * MAX(calibrationTimes[1], calibrationTimes[2]));
+
+  // Verify that the monotone cubic passes through its points, stays flat where they are
+  // flat, and never overshoots.
+  double fitSpeeds[5] = { 10, 20, 30, 40, 60 };
+  double fitValues[5] = { 0, 100, 100, 900, 1000 };
+  double previousFitValue = 0;
+  for (int speed = 0; speed <= 70; speed++) {
+    double fitValue = interpolateMonotoneCubic(fitSpeeds, fitValues, 5, speed);
+    assert(fitValue >= previousFitValue - 1e-9);
+    assert(fitValue >= 0 && fitValue <= 1000);
+    if (speed >= 20 && speed <= 30) {
+      assert(fabs(fitValue - 100) < 1e-9);
+    }
+    previousFitValue = fitValue;
+  }
+  for (int i = 0; i < 5; i++) {
+    assert(fabs(interpolateMonotoneCubic(fitSpeeds, fitValues, 5, fitSpeeds[i]) - fitValues[i]) < 1e-9);
+  }
+
+  // Verify that adaptive calibration finds where each simulated motor stalls, measures only a
+  // fraction of the speeds, and still matches the motor's real speed at every speed.
+  startMotorSimulation(gravityParams, simStartPositions);
+  axis_calibration_request_t adaptiveRequests[2];
+  for (axis_identifier_t axis = axis_identifier_pan; axis <= axis_identifier_tilt; axis++) {
+    bool encoderReversed = (axis == axis_identifier_pan) ? panEncoderReversed() :
+        tiltEncoderReversed();
+    int64_t span = encoderReversed ? -30000 : 30000;
+    adaptiveRequests[axis] = (axis_calibration_request_t){
+      .axis = axis,
+      .startPosition = simStartPositions[axis] + span,
+      .endPosition = simStartPositions[axis] - span,
+      .minSpeed = 0,
+      .maxSpeed = gravityParams[axis].hardwareScale,
+      .pollingIsSlow = false,
+      .adaptive = true
+    };
+  }
+  int64_t adaptiveStartTime = gVirtualClockNanos;
+  calibrateAxesConcurrently(adaptiveRequests, 2);
+
+  // Measuring every speed takes about as long per speed as the three-speed runs above did.
+  double denseCalibrationTime = (calibrationTimes[0] / 3.0) * (gravityParams[0].hardwareScale + 1);
+  assert(gVirtualClockNanos - adaptiveStartTime < 0.4 * denseCalibrationTime);
+  for (int i = 0; i < 2; i++) {
+    axis_calibration_request_t *request = &adaptiveRequests[i];
+    assert(request->speedsMeasured <= (request->maxSpeed + 1) / 3);
+    int64_t *idealData[kNumCalibrationDirections] = {
+      motorSimCalibrationData(&gravityParams[request->axis], -1),
+      motorSimCalibrationData(&gravityParams[request->axis], 1)
+    };
+    double tolerance = idealData[1][request->maxSpeed] * 0.03;
+    assert(request->confidenceBand <= tolerance);
+    for (int32_t speed = request->minSpeed; speed <= request->maxSpeed; speed++) {
+      for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections;
+           direction++) {
+        assert(llabs(request->directionalData[direction][speed] - idealData[direction][speed]) <=
+               tolerance + 2);
+        if (idealData[direction][speed] == 0) {
+          assert(request->directionalData[direction][speed] == 0);
+        }
+      }
+    }
+    for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections;
+         direction++) {
+      free(idealData[direction]);
+      free(request->directionalData[direction]);
+    }
+    free(request->data);
+  }
+  stopMotorSimulation();
+
+  // Verify that online calibration follows a tilt motor that slows down by 10% (more
+  // against gravity) during normal moves, without giving readers a torn table.
+  online_calibration_t onlineCalibration = { .persistIntervalNanos = 0 };
+  directional_calibration_t baseCalibration;
+  setDirectionalCalibrationData(&baseCalibration, axis_identifier_tilt,
+                                gravityParams[axis_identifier_tilt].hardwareScale,
+                                motorSimCalibrationData(&gravityParams[axis_identifier_tilt], -1),
+                                motorSimCalibrationData(&gravityParams[axis_identifier_tilt], 1));
+  assert(startOnlineCalibration(&onlineCalibration, axis_identifier_tilt, &baseCalibration));
+  const directional_calibration_t *initialCalibration = publishedCalibration(&onlineCalibration);
+  assert(initialCalibration != NULL && initialCalibration != &baseCalibration);
+  assert(initialCalibration->data[kCalibrationDirectionPositive][100] ==
+         baseCalibration.data[kCalibrationDirectionPositive][100]);
+
+  motor_sim_params_t driftedParams = gravityParams[axis_identifier_tilt];
+  driftedParams.maxPositionsPerSecond *= 0.9;
+  driftedParams.negativeSpeedScale *= 0.95;
+  motor_sim_axis_t driftedAxis;
+  motorSimInitAxis(&driftedAxis, &driftedParams, 1000000);
+  online_calibration_sampler_t onlineSampler = { 0 };
+  static const int onlineSpeeds[] = { 40, -60, 80, -100, 100, -45, 65, -85 };
+  int onlineUpdates = 0;
+  for (int64_t now = kMotorSimulationTickNanos; now <= 120 * NSEC_PER_SEC;
+       now += kMotorSimulationTickNanos) {
+    int speed = onlineSpeeds[(now / (3 * NSEC_PER_SEC)) % (sizeof(onlineSpeeds) / sizeof(int))];
+    motorSimSetSpeed(&driftedAxis, speed);
+    motorSimStep(&driftedAxis, kMotorSimulationTickNanos);
+    observeOnlineCalibrationSpeed(&onlineSampler, &onlineCalibration, speed,
+                                  motorSimEncoderPosition(&driftedAxis), now);
+    if (now % NSEC_PER_SEC == 0 && updateOnlineCalibration(&onlineCalibration, now)) {
+      onlineUpdates++;
+    }
+  }
+  const directional_calibration_t *driftedCalibration = publishedCalibration(&onlineCalibration);
+  assert(onlineUpdates > 0);
+  for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections; direction++) {
+    int64_t *idealData = motorSimCalibrationData(&driftedParams,
+                                                 (direction == kCalibrationDirectionNegative) ?
+                                                 -1 : 1);
+    int maxSpeed = driftedCalibration->maxSpeed;
+    assert(driftedCalibration->scaledData[direction] != NULL);
+    for (int speed = 0; speed <= maxSpeed; speed++) {
+      assert(llabs(driftedCalibration->data[direction][speed] - idealData[speed]) <=
+             idealData[maxSpeed] * 0.02 + 1);
+    }
+    free(idealData);
+  }
+
+  // Restarting (after a full calibration) goes back to the new base tables, and the
+  // replaced tables stay around until the reader has finished a loop.
+  onlineCalibrationReaderIdle(&onlineCalibration);
+  assert(startOnlineCalibration(&onlineCalibration, axis_identifier_tilt, &baseCalibration));
+  assert(publishedCalibration(&onlineCalibration)->data[kCalibrationDirectionPositive][100] ==
+         baseCalibration.data[kCalibrationDirectionPositive][100]);
+  assert(onlineCalibration.retired != NULL &&
+         onlineCalibration.retired->calibration == driftedCalibration);
+  assert(updateOnlineCalibration(&onlineCalibration, 121 * NSEC_PER_SEC) == false);
+  assert(onlineCalibration.retired != NULL);
+  onlineCalibrationReaderIdle(&onlineCalibration);
+  assert(updateOnlineCalibration(&onlineCalibration, 122 * NSEC_PER_SEC) == false);
+  assert(onlineCalibration.retired == NULL);
+  assert(maximumPositionsPerSecondForOnlineCalibration(&onlineCalibration,
+                                                       kCalibrationDirectionPositive) ==
+         maximumPositionsPerSecondForCalibration(&baseCalibration,
+                                                 kCalibrationDirectionPositive));
+  stopOnlineCalibration(&onlineCalibration);
+  assert(publishedCalibration(&onlineCalibration) == NULL);
+  assert(scaleDataForSpeed(publishedCalibration(&onlineCalibration), 1) == NULL);
+  freeDirectionalCalibration(&baseCalibration);
+
+  // Verify that calibration samples are split by direction before discarding outliers.
+  double calibrationSamples[6] = { 100, 150, 102, 151, 98, 400 };
+  calibration_direction_t calibrationSampleDirections[6] = {
+    kCalibrationDirectionPositive, kCalibrationDirectionNegative,
+    kCalibrationDirectionPositive, kCalibrationDirectionNegative,
+    kCalibrationDirectionPositive, kCalibrationDirectionNegative
+  };
+  assert(filteredCalibrationAverageForDirection(calibrationSamples, calibrationSampleDirections, 6,
+                                                kCalibrationDirectionPositive, 0) == 100);
+  assert(filteredCalibrationAverageForDirection(calibrationSamples, calibrationSampleDirections, 6,
+                                                kCalibrationDirectionNegative, 0) == 150.5);
+  assert(filteredCalibrationAverageForDirection(calibrationSamples, calibrationSampleDirections, 3,
+                                                kCalibrationDirectionNegative, 0) == 150);
+  assert(filteredCalibrationAverageForDirection(calibrationSamples, calibrationSampleDirections, 1,
+                                                kCalibrationDirectionNegative, 42) == 42);
+
+  // Verify that moves with no dwell time between them blend into one move, so the camera
+  // passes through the middle stop without slowing to a stop.
+  queued_move_t pathMoves[2] = {
+    { { 1010000, 996000, 530 }, kMotionProfileDefault, 0 },
+    { { 1025000, 990000, 530 }, kMotionProfileDefault, 0 },
+  };
+  startMotorSimulation(simParams, coordinatedStartPositions);
+  assert(startMoveQueue(pathMoves, 2, false));
+  assert(gMoveQueue.numSegments == 2);
+  assert(gCoordinatedMove.duration < gMoveQueue.segments[0].duration + gMoveQueue.segments[1].duration);
+  double peakPanSpeed = 0;
+  double slowestPanSpeedNearMiddle = INFINITY;
+  while (moveQueueActive() && NANOS_TO_SECONDS(gVirtualClockNanos) < 20) {
+    runMotorSimulation(NANOS_TO_SECONDS(kMotorSimulationTickNanos));
+    double panSpeed = fabs(gSimulatedAxes[axis_identifier_pan].velocity);
+    int64_t panPosition = getAxisPosition(axis_identifier_pan);
+    peakPanSpeed = MAX(peakPanSpeed, panSpeed);
+    if (panPosition > 1006000 && panPosition < 1014000) {
+      slowestPanSpeedNearMiddle = MIN(slowestPanSpeedNearMiddle, panSpeed);
+    }
+  }
+  assert(!moveQueueActive());
+  assert(slowestPanSpeedNearMiddle > 0.75 * peakPanSpeed);
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    assert(llabs(getAxisPosition(axis) - pathMoves[1].positions[axis]) <= 100);
+  }
+  stopMotorSimulation();
+
+  // Verify that an axis that reverses direction or a dwell time ends a blended move, and
+  // that the queue waits out the dwell time before moving on.
+  queued_move_t tourMoves[3] = {
+    { { 1010000, 996000, 530 }, kMotionProfileDefault, 0 },
+    { { 1000000, 996000, 530 }, kMotionProfileDefault, 0.5 },
+    { { 1000000, 1000000, 530 }, kMotionProfileDefault, 0 },
+  };
+  startMotorSimulation(simParams, coordinatedStartPositions);
+  assert(startMoveQueue(tourMoves, 3, false));
+  assert(gMoveQueue.numSegments == 1);
+  assert(gMoveQueue.nextMove == 1);
+  while (gMoveQueue.nextMove == 1 && NANOS_TO_SECONDS(gVirtualClockNanos) < 20) {
+    runMotorSimulation(NANOS_TO_SECONDS(kMotorSimulationTickNanos));
+  }
+  assert(gMoveQueue.numSegments == 1);
+  while (gMoveQueue.blendedMoveInProgress && NANOS_TO_SECONDS(gVirtualClockNanos) < 20) {
+    runMotorSimulation(NANOS_TO_SECONDS(kMotorSimulationTickNanos));
+  }
+  int64_t dwellStartTime = gVirtualClockNanos;
+  while (gMoveQueue.nextMove == 2 && NANOS_TO_SECONDS(gVirtualClockNanos) < 20) {
+    runMotorSimulation(NANOS_TO_SECONDS(kMotorSimulationTickNanos));
+  }
+  assert(NANOS_TO_SECONDS(gVirtualClockNanos - dwellStartTime) >= 0.5);
+  while (moveQueueActive() && NANOS_TO_SECONDS(gVirtualClockNanos) < 30) {
+    runMotorSimulation(NANOS_TO_SECONDS(kMotorSimulationTickNanos));
+  }
+  assert(!moveQueueActive());
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    assert(llabs(getAxisPosition(axis) - tourMoves[2].positions[axis]) <= 100);
+  }
+
+  // Any other move stops the queue.
+  assert(startMoveQueue(tourMoves, 3, true));
+  cancelRecallIfNeeded("test");
+  assert(!moveQueueActive());
+  stopMotorSimulation();
+
+  // Verify that tours survive a round trip through the disk.  This uses a scratch
+  // directory, so that it never touches the real presets and tours.
+  char dataDirectory[] = "/tmp/viscaptz_test_XXXXXX";
+  assert(mkdtemp(dataDirectory) != NULL);
+  gDataDirectory = dataDirectory;
+  tour_stop_t testStops[2] = { { 10000, 0 }, { 10001, 2500 } };
+  tour_t testTour;
+  assert(saveTour(10000, testStops, 2));
+  assert(loadTour(10000, &testTour));
+  assert(testTour.numStops == 2);
+  assert(testTour.stops[1].presetNumber == 10001 && testTour.stops[1].dwellMilliseconds == 2500);
+  assert(!startTour(10000, false));  // The presets don't exist.
+  unlink(tourFilename(10000));
+  assert(!saveTour(10000, testStops, 0));
+  gDataDirectory = NULL;
+  rmdir(dataDirectory);
+
+  gRecallSpeedSet = savedRecallSpeedSet;
+  gVISCARecallSpeed = savedVISCARecallSpeed;
+}
+
+
+#pragma mark - Benchmarks
+
+// Fills calibrationData with a plausible motor curve: no motion at the lowest
+// speeds, then roughly quadratic growth up to the top speed.
+void fakeBenchmarkCalibrationCurve(int64_t *calibrationData, int maxSpeed) {
+  for (int i = 0; i <= maxSpeed; i++) {
+    calibrationData[i] = (i < maxSpeed / 10) ? 0 : (i * i * 7) + (i * 30);
+  }
+}
+
+// Returns the time in nanoseconds for benchmarking purposes.
+static int64_t benchmarkTimeNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec;
+}
+
+// Returns the CPU time used by the calling thread in nanoseconds.
+static int64_t benchmarkCPUTimeNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ((int64_t)ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec;
+}
+
+/** A scripted preset-to-preset move for the motion benchmark. */
+typedef struct {
+  const char *name;
+  int64_t startPositions[NUM_AXES];
+  int64_t targetPositions[NUM_AXES];
+} motion_scenario_t;
+
+static const motion_scenario_t kMotionScenarios[] = {
+  { "short_pan", { 1000000, 1000000, 500 }, { 1002000, 1000000, 500 } },
+  { "long_pan", { 1000000, 1000000, 500 }, { 1040000, 1000000, 500 } },
+  { "tilt_only", { 1000000, 1000000, 500 }, { 1000000, 985000, 500 } },
+  { "zoom_only", { 1000000, 1000000, 500 }, { 1000000, 1000000, 4000 } },
+  { "mixed", { 1000000, 1000000, 500 }, { 1020000, 992000, 3000 } },
+  { "short_mixed", { 1000000, 1000000, 500 }, { 1001500, 999200, 800 } },
+};
+
+/** How early or late (in seconds) an axis can arrive before the benchmark fails it. */
+static const double kBenchmarkArrivalTolerance = 0.5;
+
+/** How long (in seconds) after its planned end an axis can take to settle. */
+static const double kBenchmarkSettleTolerance = 0.5;
+
+/** The per-axis results of one motion benchmark run. */
+typedef struct {
+  double plannedEnd;       //! Seconds from the recall until the move should finish.
+  double plannedArrival;   //! Seconds until the planned trajectory came within tolerance.
+  double arrivalTime;      //! Seconds until the axis first came within tolerance (or NAN).
+  double settleTime;       //! Seconds until the axis came within tolerance for good (or NAN).
+  int64_t overshoot;       //! Furthest travel past the target, in positions.
+  double peakJerk;         //! Largest jerk, in fractions of the axis's top speed per second cubed.
+  int64_t finalError;      //! Distance from the target when the run ended, in positions.
+} motion_axis_result_t;
+
+// Replays one recall scenario against the simulated plant, filling in results for every
+// axis and returning the average CPU time per control loop update (in nanoseconds).
+static double runMotionScenario(const motion_scenario_t *scenario, int VISCARecallSpeed,
+                                motion_axis_result_t *results) {
+  motor_sim_params_t params[NUM_AXES];
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    motorSimDefaultParams(&params[axis], axis);
+  }
+  startMotorSimulation(params, scenario->startPositions);
+  gRecallSpeedSet = true;
+  gVISCARecallSpeed = VISCARecallSpeed;
+
+  recallPosition(scenario->targetPositions[axis_identifier_pan],
+                 scenario->targetPositions[axis_identifier_tilt],
+                 scenario->targetPositions[axis_identifier_zoom], kMotionProfileDefault);
+
+  int64_t tolerance[NUM_AXES];
+  int direction[NUM_AXES];
+  double previousVelocity[NUM_AXES];
+  double previousAcceleration[NUM_AXES];
+  double runTime = 0;
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    int64_t distance = scenario->targetPositions[axis] - scenario->startPositions[axis];
+    bzero(&results[axis], sizeof(results[axis]));
+    results[axis].plannedEnd =
+        NANOS_TO_SECONDS(gAxisStartTime[axis] + SECONDS_TO_NANOS(gAxisDuration[axis]));
+    results[axis].arrivalTime = NAN;
+    results[axis].settleTime = NAN;
+    tolerance[axis] = MAX(llabs(distance) / 200, 2);
+
+    // An s-curve spends a long time on the last fraction of a percent, so compare the
+    // arrival with the time when the plan itself comes within tolerance, not its end.
+    results[axis].plannedArrival = results[axis].plannedEnd;
+    if (gAxisTrajectory[axis].numSetpoints > 0) {
+      results[axis].plannedArrival = NANOS_TO_SECONDS(gAxisStartTime[axis]) +
+          trajectoryTimeForAxisAtDistance(axis, llabs(distance) - tolerance[axis]);
+    }
+    direction[axis] = (distance < 0) ? -1 : 1;
+    previousVelocity[axis] = 0;
+    previousAcceleration[axis] = 0;
+    runTime = MAX(runTime, results[axis].plannedEnd);
+  }
+
+  // Keep going for a while after the planned end so that late arrivals and settling show up.
+  int64_t endTime = SECONDS_TO_NANOS(runTime + 2.0);
+  double tickSeconds = NANOS_TO_SECONDS(kMotorSimulationTickNanos);
+  int64_t ticks = 0;
+  int64_t cpuTime = 0;
+  while (gVirtualClockNanos < endTime) {
+    advanceMotorSimulation(kMotorSimulationTickNanos);
+    int64_t start = benchmarkCPUTimeNanos();
+    handleRecallUpdates();
+    cpuTime += benchmarkCPUTimeNanos() - start;
+    ticks++;
+
+    double now = NANOS_TO_SECONDS(gVirtualClockNanos);
+    for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+      motor_sim_axis_t *simulatedAxis = &gSimulatedAxes[axis];
+      int64_t position = getAxisPosition(axis);
+      int64_t error = position - scenario->targetPositions[axis];
+
+      results[axis].overshoot = MAX(results[axis].overshoot, error * direction[axis]);
+      if (llabs(error) <= tolerance[axis]) {
+        if (isnan(results[axis].arrivalTime)) results[axis].arrivalTime = now;
+        if (isnan(results[axis].settleTime)) results[axis].settleTime = now;
+      } else {
+        results[axis].settleTime = NAN;
+      }
+
+      double velocity = simulatedAxis->velocity / simulatedAxis->params.maxPositionsPerSecond;
+      double acceleration = (velocity - previousVelocity[axis]) / tickSeconds;
+      double jerk = (acceleration - previousAcceleration[axis]) / tickSeconds;
+      results[axis].peakJerk = MAX(results[axis].peakJerk, fabs(jerk));
+      previousVelocity[axis] = velocity;
+      previousAcceleration[axis] = acceleration;
+      results[axis].finalError = llabs(error);
+    }
+  }
+
+  stopMotorSimulation();
+  return ticks ? (double)cpuTime / ticks : 0;
+}
+
+// Checks one axis's benchmark results against the tolerances above.  Returns true if
+// they are acceptable.  Otherwise, describes the problem in reason and returns false.
+// A time that was never measured (NAN) is not acceptable.
+static bool motionResultAcceptable(const motion_axis_result_t *result, char *reason,
+                                   size_t reasonSize) {
+  double arrivalError = result->arrivalTime - result->plannedArrival;
+  if (isnan(result->arrivalTime)) {
+    snprintf(reason, reasonSize, "never got close to its target");
+  } else if (fabs(arrivalError) > kBenchmarkArrivalTolerance) {
+    snprintf(reason, reasonSize, "arrived %.3lf seconds %s", fabs(arrivalError),
+             (arrivalError < 0) ? "early" : "late");
+  } else if (isnan(result->settleTime) ||
+             result->settleTime > result->plannedEnd + kBenchmarkSettleTolerance) {
+    snprintf(reason, reasonSize, "did not settle within %.1lf seconds of its planned end",
+             kBenchmarkSettleTolerance);
+  } else if (result->finalError > kAxisSettleTolerance) {
+    snprintf(reason, reasonSize, "stopped %" PRId64 " positions from its target",
+             result->finalError);
+  } else {
+    return true;
+  }
+  return false;
+}
+
+// Prints a tab-separated table of motion quality results for every scripted scenario,
+// both with the camera live (slow recalls) and not live (fast recalls).  An axis that
+// arrives too early or late, doesn't settle in time, or stops too far from its target
+// is marked FAILED, and this returns false.
+static bool runMotionBenchmarks(void) {
+  bool savedRecallSpeedSet = gRecallSpeedSet;
+  int savedVISCARecallSpeed = gVISCARecallSpeed;
+  bool allPassed = true;
+
+  fprintf(stdout, "scenario\tlive\taxis\tplanned_s\tarrival_error_s\tovershoot\t"
+                  "peak_jerk\tsettle_s\tfinal_error\tcpu_ns_per_tick\tstatus\n");
+  for (int i = 0; i < sizeof(kMotionScenarios) / sizeof(kMotionScenarios[0]); i++) {
+    for (int live = 1; live >= 0; live--) {
+      const motion_scenario_t *scenario = &kMotionScenarios[i];
+      motion_axis_result_t results[NUM_AXES];
+
+      // Match getVISCARecallSpeed's speeds for a camera that is on program and one that isn't.
+      double cpuNanosPerTick = runMotionScenario(scenario, live ? 6 : 24, results);
+      for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+        if (scenario->targetPositions[axis] == scenario->startPositions[axis]) continue;
+        motion_axis_result_t *result = &results[axis];
+        char reason[100];
+        bool passed = motionResultAcceptable(result, reason, sizeof(reason));
+        if (!passed) {
+          fprintf(stderr, "Motion benchmark FAILED: %s (live %d) %s axis %s.\n",
+                  scenario->name, live, nameForAxis(axis), reason);
+          allPassed = false;
+        }
+        fprintf(stdout, "%s\t%d\t%s\t%.3lf\t%.3lf\t%" PRId64 "\t%.1lf\t%.3lf\t%" PRId64 "\t%.0lf\t%s\n",
+                scenario->name, live, nameForAxis(axis), result->plannedEnd,
+                result->arrivalTime - result->plannedArrival,
+                result->overshoot, result->peakJerk, result->settleTime, result->finalError,
+                cpuNanosPerTick, passed ? "ok" : "FAILED");
+      }
+    }
+  }
+
+  gRecallSpeedSet = savedRecallSpeedSet;
+  gVISCARecallSpeed = savedVISCARecallSpeed;
+  return allPassed;
+}
+
+bool runBenchmarks(void) {
+  const int iterations = 2000;
+  int64_t fakeCurve[PAN_TILT_SCALE_FAKE + 1];
+  fakeBenchmarkCalibrationCurve(fakeCurve, PAN_TILT_SCALE_FAKE);
+  int32_t *scaleData = convertSpeedValues(fakeCurve, PAN_TILT_SCALE_FAKE, 0);
+
+  // Use the result so that the compiler can't discard the loops.
+  volatile int64_t checksum = 0;
+
+  int64_t start = benchmarkTimeNanos();
+  for (int i = 0; i < iterations; i++) {
+    for (int speed = -SCALE_CORE; speed <= SCALE_CORE; speed++) {
+      checksum += (speed < 0) ? -scaleSpeedByScanning(-speed, PAN_TILT_SCALE_FAKE, scaleData) :
+                                scaleSpeedByScanning(speed, PAN_TILT_SCALE_FAKE, scaleData);
+    }
+  }
+  int64_t scanTime = benchmarkTimeNanos() - start;
+
+  start = benchmarkTimeNanos();
+  for (int i = 0; i < iterations; i++) {
+    for (int speed = -SCALE_CORE; speed <= SCALE_CORE; speed++) {
+      checksum += scaleSpeed(speed, SCALE_CORE, PAN_TILT_SCALE_FAKE, scaleData);
+    }
+  }
+  int64_t tableTime = benchmarkTimeNanos() - start;
+
+  int64_t calls = (int64_t)iterations * ((2 * SCALE_CORE) + 1);
+  fprintf(stdout, "benchmark\tcalls\tns_per_call\n");
+  fprintf(stdout, "scale_speed_scan\t%" PRId64 "\t%.2lf\n", calls, (double)scanTime / calls);
+  fprintf(stdout, "scale_speed_table\t%" PRId64 "\t%.2lf\n", calls, (double)tableTime / calls);
+  free(scaleData);
+
+  fprintf(stdout, "\n");
+  return runMotionBenchmarks();
 }
@@ -1,11 +1,49 @@
+#include <pthread.h>
 #include <sys/types.h>
 
 #include "constants.h"
 
 #pragma mark - Base implementation functions, callable from modules.
 
-/** Returns seconds since January 1, 1970 with microsecond precision. */
-double timeStamp(void);
+/**
+ * Returns a monotonic timestamp in nanoseconds (from an arbitrary starting point).  This
+ * clock is not affected by wall-clock changes, so it is the only clock that should be used
+ * for move timing, timeouts, and speed computations.
+ */
+int64_t monotonicTimeNanos(void);
+
+/**
+ * The state of a position/velocity estimator for one axis.  The estimator fuses
+ * timestamped position samples (which are quantized and noisy) into a filtered
+ * position and velocity.
+ */
+typedef struct {
+  double position;          //! The filtered position at lastUpdateTime.
+  double velocity;          //! The filtered velocity (positions per second).
+  double processNoise;      //! Std. deviation of unmodeled acceleration (positions/sec^2).
+  double measurementNoise;  //! Std. deviation of position samples (positions).
+  int64_t lastUpdateTime;   //! Monotonic timestamp of the most recent sample.
+  bool initialized;         //! False until the first sample arrives.
+} axis_estimator_t;
+
+/**
+ * Clears an estimator and sets its noise model.  Larger process noise values make the
+ * estimator follow speed changes more quickly.  Larger measurement noise values make it
+ * smooth the samples more heavily.
+ */
+void resetAxisEstimator(axis_estimator_t *estimator, double processNoise, double measurementNoise);
+
+/** Feeds a position sample taken at the specified monotonic timestamp into an estimator. */
+void updateAxisEstimator(axis_estimator_t *estimator, int64_t position, int64_t timestamp);
+
+/** Returns the position that an estimator expects at the specified monotonic timestamp. */
+double predictedAxisEstimatorPosition(const axis_estimator_t *estimator, int64_t timestamp);
+
+/** Returns the configured estimator process noise (positions per second squared). */
+double axisEstimatorProcessNoise(void);
+
+/** Returns the configured estimator measurement noise (positions). */
+double axisEstimatorMeasurementNoise(void);
 
 /** True when in calibration mode. */
 extern bool gCalibrationMode;
@@ -28,6 +66,13 @@ bool setTallyGreen(void);
 /** Sets the tally light to off (if possible). */
 bool setTallyOff(void);
 
+/** Calibration data for both directions of an axis, as loaded by loadDirectionalCalibrationForAxis. */
+typedef struct {
+  int maxSpeed;                                   //! The maximum hardware speed.
+  int64_t *data[kNumCalibrationDirections];       //! Positions per second at each speed.
+  int32_t *scaledData[kNumCalibrationDirections]; //! Scale data (from convertSpeedValues).
+} directional_calibration_t;
+
 /**
  * Performs calibration for motion on a given axis, computing a
  * mapping table that tells how many encoder positions the axis
@@ -52,16 +97,60 @@ bool setTallyOff(void);
  *                      is slow.  This allows for longer durations per
  *                      measurement to get a more precise value.
  *
+ * @param directionalData If non-NULL, an array of kNumCalibrationDirections
+ *                        pointers that receive separate tables (in the same
+ *                        format as the result) for each direction of motion.
+ *                        The caller is responsible for freeing them.
+ *
  * @result Returns an array where position 0 is the number of positions
  *         moved in one second at minSpeed, position 1 is at minSpeed + 1,
- *         and so on.  The caller is responsible for freeing the array.
+ *         and so on, averaged across both directions.  The caller is
+ *         responsible for freeing the array.
  */
 int64_t *calibrationDataForMoveAlongAxis(axis_identifier_t axis,
                                          int64_t startPosition,
                                          int64_t endPosition,
                                          int32_t minSpeed,
                                          int32_t maxSpeed,
-                                         bool pollingIsSlow);
+                                         bool pollingIsSlow,
+                                         int64_t **directionalData);
+
+/** One axis for calibrateAxesConcurrently to calibrate, and the resulting data. */
+typedef struct {
+  axis_identifier_t axis;
+  int64_t startPosition;  //! As for calibrationDataForMoveAlongAxis.
+  int64_t endPosition;    //! As for calibrationDataForMoveAlongAxis.
+  int32_t minSpeed;       //! As for calibrationDataForMoveAlongAxis.
+  int32_t maxSpeed;       //! As for calibrationDataForMoveAlongAxis.
+  bool pollingIsSlow;     //! As for calibrationDataForMoveAlongAxis.
+  bool adaptive;          //! Measure only some speeds and interpolate the rest (see below).
+  int64_t *data;          //! Output: the combined table (the caller must free it).
+  int64_t *directionalData[kNumCalibrationDirections];  //! Output: per-direction tables.
+  int speedsMeasured;     //! Output: the number of speeds actually measured.
+  double confidenceBand;  //! Output: adaptive only; the largest error (positions per second)
+                          //! seen when checking the interpolation against a measurement.
+} axis_calibration_request_t;
+
+/**
+ * Performs calibration for several independent axes (e.g. pan and
+ * tilt) at the same time, in the same way as
+ * calibrationDataForMoveAlongAxis, storing the results in each
+ * request.  Each axis has its own sampling state machine, and a
+ * single scheduler loop advances all of them, so the total time
+ * is roughly that of the slowest axis instead of the sum.
+ *
+ * Do not calibrate axes that share a motor or otherwise affect
+ * each other's speed this way.
+ *
+ * For adaptive requests, this finds the slowest speed at which the
+ * axis moves by bisection, measures a few speeds evenly spaced above
+ * it, and then repeatedly measures the midpoint between measured
+ * speeds, predicting it first with a monotone cubic (PCHIP) fit.
+ * Wherever the prediction misses by more than 1.5% of the top speed,
+ * it splits that interval and keeps going.  Every other speed comes
+ * from the fit.
+ */
+void calibrateAxesConcurrently(axis_calibration_request_t *requests, int count);
 
 /**
  * Reads the calibration data for the specified axis from the
@@ -80,6 +169,174 @@ bool writeCalibrationDataForAxis(axis_identifier_t axis,
                                  int64_t *calibrationData,
                                  int length);
 
+/**
+ * Reads the calibration data for one direction of the specified axis
+ * from the configuration file, in the same format as
+ * readCalibrationDataForAxis.  Returns NULL if the axis was calibrated
+ * before per-direction data was recorded.
+ */
+int64_t *readDirectionalCalibrationDataForAxis(axis_identifier_t axis,
+                                               calibration_direction_t direction,
+                                               int *maxSpeed);
+
+/**
+ * Writes the calibration data for one direction of the specified axis
+ * to the configuration file.  Returns true if the operation was
+ * successful, else false.
+ */
+bool writeDirectionalCalibrationDataForAxis(axis_identifier_t axis,
+                                            calibration_direction_t direction,
+                                            int64_t *calibrationData,
+                                            int maxSpeed);
+
+/**
+ * Loads the calibration data for both directions of the specified axis
+ * and computes scale data for each.  If an axis has no per-direction
+ * data, both directions use the axis's combined data.  Returns false
+ * (leaving the structure empty) if the axis has no usable data with
+ * the specified maximum speed.
+ */
+bool loadDirectionalCalibrationForAxis(axis_identifier_t axis, int maxSpeed,
+                                       directional_calibration_t *calibration);
+
+/**
+ * Fills in a directional calibration structure from tables for each
+ * direction (which it takes ownership of).  Either table can be NULL
+ * to use the other table for both directions.
+ */
+bool setDirectionalCalibrationData(directional_calibration_t *calibration, axis_identifier_t axis,
+                                   int maxSpeed, int64_t *negativeData, int64_t *positiveData);
+
+/** Frees the tables in a directional calibration structure and empties it. */
+void freeDirectionalCalibration(directional_calibration_t *calibration);
+
+/**
+ * Returns the scale data (for scaleSpeed) that matches the direction of the
+ * specified speed, or NULL if there is no calibration data.
+ */
+int32_t *scaleDataForSpeed(const directional_calibration_t *calibration, int64_t speed);
+
+/**
+ * Returns the number of positions per second that an axis moves in the
+ * specified direction at its fastest speed, or 0 if there is no data.
+ */
+int64_t maximumPositionsPerSecondForCalibration(const directional_calibration_t *calibration,
+                                                calibration_direction_t direction);
+
+/**
+ * Returns the number of positions per second that an axis moves at its slowest
+ * non-stalled speed in whichever direction can't go as slowly, or 0 if there is
+ * no data.
+ */
+int64_t minimumPositionsPerSecondForCalibration(const directional_calibration_t *calibration);
+
+/** The most speed samples that an online calibration holds between updates. */
+#define ONLINE_CALIBRATION_MAX_SAMPLES 256
+
+/** One speed measurement taken during a normal move. */
+typedef struct {
+  int hardwareSpeed;          //! The signed hardware speed (module direction).
+  double positionsPerSecond;  //! The speed that the encoder reported.
+} online_calibration_sample_t;
+
+/** Replaced tables that a reader might still be using. */
+typedef struct online_calibration_retired {
+  directional_calibration_t *calibration;
+  uint64_t readerGeneration;  //! The reader generation when the tables were replaced.
+  struct online_calibration_retired *next;
+} online_calibration_retired_t;
+
+/**
+ * Tracks an axis's calibration while the axis is in normal use, refining its tables
+ * with recursive least squares as the axis's real speeds drift (cable drag, temperature,
+ * payload).  The motor control thread gets the current tables from publishedCalibration
+ * without locking, and calls onlineCalibrationReaderIdle once per loop so that replaced
+ * tables can be freed once it can no longer hold them.  Everything else is protected
+ * by the lock.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  bool started;
+  axis_identifier_t axis;
+  directional_calibration_t base;          //! The tables from the last full calibration.
+  directional_calibration_t *published;    //! The tables in use (swapped atomically).
+  online_calibration_retired_t *retired;   //! Replaced tables waiting to be freed.
+  uint64_t readerGeneration;               //! Bumped by the lock-free reader each loop.
+  online_calibration_sample_t samples[ONLINE_CALIBRATION_MAX_SAMPLES];
+  int sampleCount;
+  double gain[kNumCalibrationDirections][2];           //! Scale and offset (fraction of max).
+  double covariance[kNumCalibrationDirections][2][2];  //! The RLS covariance matrix.
+  int samplesUsed[kNumCalibrationDirections];
+  int64_t persistIntervalNanos;            //! How often to save the tables (0 for never).
+  int64_t lastPersistTime;
+  bool unsaved;
+} online_calibration_t;
+
+/** Measures steady-state speeds for an online calibration as an axis moves. */
+typedef struct {
+  int hardwareSpeed;
+  int64_t speedStartTime;
+  int64_t windowStartTime;
+  int64_t windowStartPosition;
+} online_calibration_sampler_t;
+
+/**
+ * Starts (or restarts) online calibration of an axis from the specified tables,
+ * which the caller still owns, and publishes a copy of them.  Returns false (and
+ * publishes nothing) if there are no tables.
+ */
+bool startOnlineCalibration(online_calibration_t *online, axis_identifier_t axis,
+                            const directional_calibration_t *base);
+
+/**
+ * Stops online calibration of an axis and frees its tables.  The lock-free reader
+ * must not be running.
+ */
+void stopOnlineCalibration(online_calibration_t *online);
+
+/**
+ * Returns the calibration tables currently in use, or NULL if there are none.
+ * Only one thread may call this, and the tables stay valid until that thread next
+ * calls onlineCalibrationReaderIdle.  Other threads must use the accessors below.
+ */
+const directional_calibration_t *publishedCalibration(online_calibration_t *online);
+
+/**
+ * Tells the online calibration that the lock-free reader no longer holds any tables
+ * that it got from publishedCalibration.
+ */
+void onlineCalibrationReaderIdle(online_calibration_t *online);
+
+/**
+ * Returns the minimum nonzero speed (in positions per second) in the tables currently
+ * in use, or 0 if there are none.  Safe to call from any thread.
+ */
+int64_t minimumPositionsPerSecondForOnlineCalibration(online_calibration_t *online);
+
+/**
+ * Returns the top speed (in positions per second) in the specified direction in the
+ * tables currently in use, or 0 if there are none.  Safe to call from any thread.
+ */
+int64_t maximumPositionsPerSecondForOnlineCalibration(online_calibration_t *online,
+                                                      calibration_direction_t direction);
+
+/**
+ * Feeds the commanded (signed) hardware speed and encoder position of an axis to a
+ * sampler.  Call this every time the speed is set.  Once the speed has been steady
+ * long enough, the sampler adds its measured speed to the online calibration.
+ */
+void observeOnlineCalibrationSpeed(online_calibration_sampler_t *sampler,
+                                   online_calibration_t *online, int hardwareSpeed,
+                                   int64_t position, int64_t now);
+
+/**
+ * Folds the samples collected since the last call into the axis's speed model and,
+ * if the tables changed noticeably, publishes new tables.  Saves the tables to the
+ * configuration file no more often than the persistence interval.  Returns true if
+ * new tables were published.
+ */
+bool updateOnlineCalibration(online_calibration_t *online, int64_t now);
+
 /**
  * Converts an array of raw scale values into a scaled array.
  *
@@ -96,6 +353,11 @@ bool writeCalibrationDataForAxis(axis_identifier_t axis,
  * core values slightly below 1,000 will map on to the
  * maximum value.
  *
+ * The maxSpeed + 1 scaled values are followed by an inverse
+ * table with SCALE_CORE + 1 entries that maps each core speed
+ * onto the matching hardware speed, so that scaleSpeed can
+ * convert speeds with a single lookup.
+ *
  * This function returns an array allocated with malloc.
  * it must be freed by the caller when no longer needed.
  *
@@ -182,9 +444,10 @@ int64_t setZoomOutLimit(int64_t limit);
  * equally sized groups of numbers on the output size or input groups onto
  * single output values, depending on direction.
  *
- * If scaleData is non-NULL, it is assumed to be a set of values that
- * are equal to the raw scale value for that motor speed divided by
- * the raw scale value for the fastest motor position times 1,000.
+ * If scaleData is non-NULL, it must have been returned by a call to
+ * convertSpeedValues with a maxSpeed value equal to toScale.  Its
+ * values are equal to the raw scale value for that motor speed divided
+ * by the raw scale value for the fastest motor position times 1,000.
  *
  * Thus, each value represents the core scale value that most closely
  * approximates that speed in the target scale.  Any zero-speed values
@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 #include <termios.h>
 #include <unistd.h>
@@ -19,6 +20,7 @@
 #include "main.h"
 #include "configurator.h"
 #include "constants.h"
+#include "motorsim.h"
 
 #define ENABLE_STATUS_DEBUGGING 0
 
@@ -40,6 +42,7 @@
 #include <linux/can/raw.h>
 #include <linux/if.h>
 #include <sys/ioctl.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 #endif  // ENABLE_HARDWARE && ENABLE_MOTOR_HARDWARE
 
@@ -61,8 +64,10 @@ static bool motor_enable_debugging = false;
 
 pthread_t motor_control_thread;
 pthread_t position_monitor_thread;
+pthread_t motor_recalibration_thread;
 void *runMotorControlThread(void *argIgnored);
 void *runPositionMonitorThread(void *argIgnored);
+void *runMotorRecalibrationThread(void *argIgnored);
 
 static volatile int64_t g_pan_speed = 0;
 static volatile int64_t g_tilt_speed = 0;
@@ -74,13 +79,24 @@ static volatile bool g_pan_tilt_raw = false;
 
 const char *kMotorsAreSwappedKey = "motors_are_swapped";
 
+#if !(ENABLE_HARDWARE && ENABLE_MOTOR_HARDWARE)
+  /** Simulated pan and tilt axes, used in place of the motors and encoders. */
+  static motor_sim_axis_t g_simulated_pan_axis;
+  static motor_sim_axis_t g_simulated_tilt_axis;
+#endif  // !(ENABLE_HARDWARE && ENABLE_MOTOR_HARDWARE)
+
 #if USE_MOTOR_PAN_AND_TILT
-  int64_t *motor_pan_data = NULL;
-  int32_t *motor_pan_scaled_data = NULL;
-  int64_t *motor_tilt_data = NULL;
-  int32_t *motor_tilt_scaled_data = NULL;
+  /** How often tables refined during normal moves are saved to the configuration file. */
+  static const int64_t kMotorRecalibrationPersistNanos = 10 * 60 * NSEC_PER_SEC;
 #endif  // USE_MOTOR_PAN_AND_TILT
 
+/** The speed tables in use, refined as the motors drift (see runMotorRecalibrationThread). */
+online_calibration_t motor_pan_calibration;
+online_calibration_t motor_tilt_calibration;
+
+static online_calibration_sampler_t motor_pan_sampler;
+static online_calibration_sampler_t motor_tilt_sampler;
+
 
 #pragma mark - Motor module initialization
 
@@ -99,6 +115,11 @@ bool motorModuleInit(void) {
     Motor_Init();
   #else
     // Start the fake hardware in the middle.
+    motor_sim_params_t params;
+    motorSimDefaultParams(&params, axis_identifier_pan);
+    motorSimInitAxis(&g_simulated_pan_axis, &params, 1000000);
+    motorSimDefaultParams(&params, axis_identifier_tilt);
+    motorSimInitAxis(&g_simulated_tilt_axis, &params, 1000000);
     g_last_pan_position = 1000000;
     g_last_tilt_position = 1000000;
   #endif  // ENABLE_HARDWARE && ENABLE_MOTOR_HARDWARE
@@ -116,6 +137,8 @@ bool motorModuleStart(void) {
     pthread_create(&position_monitor_thread, NULL, runPositionMonitorThread, NULL);
   #endif  // !(ENABLE_ENCODER_HARDWARE && ENABLE_HARDWARE)
 
+  pthread_create(&motor_recalibration_thread, NULL, runMotorRecalibrationThread, NULL);
+
   if (localDebug) fprintf(stderr, "Motor module init done\n");
   return motorModuleReload();
 }
@@ -125,22 +148,17 @@ bool motorModuleStart(void) {
 // Reinitializes the motor control/encoder module after calibration.
 bool motorModuleReload(void) {
   #if USE_MOTOR_PAN_AND_TILT
-    int maxSpeed = 0;
-    motor_pan_data =
-        readCalibrationDataForAxis(axis_identifier_pan, &maxSpeed);
-    if (maxSpeed == PAN_TILT_SCALE_HARDWARE) {
-        motor_pan_scaled_data =
-            convertSpeedValues(motor_pan_data, PAN_TILT_SCALE_HARDWARE,
-                               axis_identifier_pan);
-    }
+    motor_pan_calibration.persistIntervalNanos = kMotorRecalibrationPersistNanos;
+    motor_tilt_calibration.persistIntervalNanos = kMotorRecalibrationPersistNanos;
 
-    motor_tilt_data =
-        readCalibrationDataForAxis(axis_identifier_tilt, &maxSpeed);
-    if (maxSpeed == PAN_TILT_SCALE_HARDWARE) {
-        motor_tilt_scaled_data =
-            convertSpeedValues(motor_tilt_data, PAN_TILT_SCALE_HARDWARE,
-                               axis_identifier_tilt);
-    }
+    directional_calibration_t calibration;
+    loadDirectionalCalibrationForAxis(axis_identifier_pan, PAN_TILT_SCALE_HARDWARE, &calibration);
+    startOnlineCalibration(&motor_pan_calibration, axis_identifier_pan, &calibration);
+    freeDirectionalCalibration(&calibration);
+
+    loadDirectionalCalibrationForAxis(axis_identifier_tilt, PAN_TILT_SCALE_HARDWARE, &calibration);
+    startOnlineCalibration(&motor_tilt_calibration, axis_identifier_tilt, &calibration);
+    freeDirectionalCalibration(&calibration);
   #endif  // USE_MOTOR_PAN_AND_TILT
   return true;
 }
@@ -555,17 +573,21 @@ void resetCenterPositionsSerial(int tilt_fd, int pan_fd) {
 void *runMotorControlThread(void *argIgnored) {
 #if (ENABLE_HARDWARE && ENABLE_MOTOR_HARDWARE && ENABLE_HARDWARE)
   bool localDebug = false;
+#else
+  int64_t lastSimulationTime = monotonicTimeNanos();
 #endif
 
   while (1) {
     int scaledPanSpeed = g_pan_tilt_raw ?
         llabs(g_pan_speed) :
         llabs(scaleSpeed(g_pan_speed, SCALE_CORE, PAN_TILT_SCALE_HARDWARE,
-                         motor_pan_scaled_data));
+                         scaleDataForSpeed(publishedCalibration(&motor_pan_calibration),
+                                           g_pan_speed)));
     int scaledTiltSpeed = g_pan_tilt_raw ?
         llabs(g_tilt_speed) :
         llabs(scaleSpeed(g_tilt_speed, SCALE_CORE, PAN_TILT_SCALE_HARDWARE,
-                         motor_tilt_scaled_data));
+                         scaleDataForSpeed(publishedCalibration(&motor_tilt_calibration),
+                                           g_tilt_speed)));
 
 #if (ENABLE_HARDWARE && ENABLE_MOTOR_HARDWARE)
 
@@ -590,15 +612,34 @@ void *runMotorControlThread(void *argIgnored) {
     int tilt_sign_2 = (g_tilt_speed < 0) ? -1 : 1;
 
     /***************************************************************************
-     * Fake hardware simulates encoder values based on the motor speed.  This  *
-     * allows for some limited testing of recall functions without actual      *
-     * hardware.                                                               *
+     * Fake hardware simulates the motors (with inertia, friction, deadband,   *
+     * and backlash) and encoders, using the actual elapsed time.  This allows *
+     * for testing of recall functions without actual hardware.                *
      ***************************************************************************/
-    g_last_pan_position += 6 * scaledPanSpeed * pan_sign * pan_sign_2 / 100;
-    g_last_tilt_position += 6 * scaledTiltSpeed * tilt_sign * tilt_sign_2 / 100;
+    int64_t simulationTime = monotonicTimeNanos();
+    motorSimSetSpeed(&g_simulated_pan_axis, scaledPanSpeed * pan_sign * pan_sign_2);
+    motorSimSetSpeed(&g_simulated_tilt_axis, scaledTiltSpeed * tilt_sign * tilt_sign_2);
+    motorSimStep(&g_simulated_pan_axis, simulationTime - lastSimulationTime);
+    motorSimStep(&g_simulated_tilt_axis, simulationTime - lastSimulationTime);
+    lastSimulationTime = simulationTime;
+
+    g_last_pan_position = motorSimEncoderPosition(&g_simulated_pan_axis);
+    g_last_tilt_position = motorSimEncoderPosition(&g_simulated_tilt_axis);
 
 #endif  // ENABLE_HARDWARE && ENABLE_MOTOR_HARDWARE
 
+    // Measure the real speeds of normal moves so that the speed tables can follow
+    // the motors as they drift.  Raw speeds (calibration) are measured separately.
+    if (!g_pan_tilt_raw) {
+      int64_t now = monotonicTimeNanos();
+      observeOnlineCalibrationSpeed(&motor_pan_sampler, &motor_pan_calibration,
+                                    (g_pan_speed < 0) ? -scaledPanSpeed : scaledPanSpeed,
+                                    g_last_pan_position, now);
+      observeOnlineCalibrationSpeed(&motor_tilt_sampler, &motor_tilt_calibration,
+                                    (g_tilt_speed < 0) ? -scaledTiltSpeed : scaledTiltSpeed,
+                                    g_last_tilt_position, now);
+    }
+
 #if ENABLE_STATUS_DEBUGGING || !ENABLE_HARDWARE
     // If hardware is disabled or if we have enabled status debugging, print
     // the current state of the motors (including zoom position and speed) here.
@@ -620,11 +661,32 @@ void *runMotorControlThread(void *argIgnored) {
 #endif  // ENABLE_HARDWARE
 #endif  // ENABLE_STATUS_DEBUGGING || !ENABLE_HARDWARE
 
+    // The speed tables fetched at the top of this loop are no longer in use.
+    onlineCalibrationReaderIdle(&motor_pan_calibration);
+    onlineCalibrationReaderIdle(&motor_tilt_calibration);
+
     usleep(10000);  // Update 100x per second (latency-critical).
   }
   return NULL;
 }
 
+/**
+ * The main loop of the motor recalibration thread.
+ *
+ * This thread refines the pan and tilt speed tables from the speeds that the motor
+ * control thread measures during normal moves, so that the control thread never
+ * does more than record a measurement.
+ */
+void *runMotorRecalibrationThread(void *argIgnored) {
+  while (1) {
+    int64_t now = monotonicTimeNanos();
+    updateOnlineCalibration(&motor_pan_calibration, now);
+    updateOnlineCalibration(&motor_tilt_calibration, now);
+    sleep(1);
+  }
+  return NULL;
+}
+
 
 #pragma mark - Calibration
 
@@ -645,15 +707,34 @@ void motorModuleCalibrate(void) {
     fprintf(stderr, "BottomTiltLimit: %" PRId64 "\n", bottomLimit);
   }
 
-  fprintf(stderr, "Calibrating pan and tilt motors.  This takes about 40 minutes.\n");
-
-  int64_t *panCalibrationData = calibrationDataForMoveAlongAxis(
-      axis_identifier_pan, leftLimit, rightLimit, 0, PAN_TILT_SCALE_HARDWARE, false);
-  int64_t *tiltCalibrationData = calibrationDataForMoveAlongAxis(
-      axis_identifier_tilt, topLimit, bottomLimit, 0, PAN_TILT_SCALE_HARDWARE, false);
-
-  writeCalibrationDataForAxis(axis_identifier_pan, panCalibrationData, PAN_TILT_SCALE_HARDWARE);
-  writeCalibrationDataForAxis(axis_identifier_tilt, tiltCalibrationData, PAN_TILT_SCALE_HARDWARE);
+  fprintf(stderr, "Calibrating pan and tilt motors.  This takes a few minutes.\n");
+
+  // Pan and tilt have independent motors and encoders, so calibrate them both at once.  Their
+  // speed curves are smooth, so measuring a fraction of the speeds and fitting a curve through
+  // them is enough.
+  axis_calibration_request_t requests[2] = {
+    { .axis = axis_identifier_pan, .startPosition = leftLimit, .endPosition = rightLimit,
+      .minSpeed = 0, .maxSpeed = PAN_TILT_SCALE_HARDWARE, .pollingIsSlow = false,
+      .adaptive = true },
+    { .axis = axis_identifier_tilt, .startPosition = topLimit, .endPosition = bottomLimit,
+      .minSpeed = 0, .maxSpeed = PAN_TILT_SCALE_HARDWARE, .pollingIsSlow = false,
+      .adaptive = true },
+  };
+  calibrateAxesConcurrently(requests, 2);
+
+  // The tilt axis in particular moves faster with gravity than against it, so keep each
+  // direction's data, too.
+  for (int i = 0; i < 2; i++) {
+    writeCalibrationDataForAxis(requests[i].axis, requests[i].data, PAN_TILT_SCALE_HARDWARE);
+    for (calibration_direction_t direction = 0; direction < kNumCalibrationDirections;
+         direction++) {
+      writeDirectionalCalibrationDataForAxis(requests[i].axis, direction,
+                                             requests[i].directionalData[direction],
+                                             PAN_TILT_SCALE_HARDWARE);
+      free(requests[i].directionalData[direction]);
+    }
+    free(requests[i].data);
+  }
 
   fprintf(stderr, "Done calibrating motors.\n");
 }
@@ -663,7 +744,7 @@ void motorModuleCalibrate(void) {
 // Returns the minimum nonzero number of positions per second that the pan axis moves
 // at its slowest non-stalled speed.
 int64_t motorMinimumPanPositionsPerSecond(void) {
-  return minimumPositionsPerSecondForData(motor_pan_data, PAN_TILT_SCALE_HARDWARE);
+  return minimumPositionsPerSecondForOnlineCalibration(&motor_pan_calibration);
 }
 
 // Public function.  Docs in header.
@@ -671,21 +752,33 @@ int64_t motorMinimumPanPositionsPerSecond(void) {
 // Returns the minimum nonzero number of positions per second that the tilt axis moves
 // at its slowest non-stalled speed.
 int64_t motorMinimumTiltPositionsPerSecond(void) {
-  return minimumPositionsPerSecondForData(motor_tilt_data, PAN_TILT_SCALE_HARDWARE);
+  return minimumPositionsPerSecondForOnlineCalibration(&motor_tilt_calibration);
 }
 
 // Public function.  Docs in header.
 //
 // Returns the number of positions per second that the pan axis moves at its fastest
-// speed.
+// speed in its slower direction.
 int64_t motorMaximumPanPositionsPerSecond(void) {
-  return motor_pan_data[PAN_TILT_SCALE_HARDWARE];
+  return MIN(motorMaximumPanPositionsPerSecondInDirection(kCalibrationDirectionNegative),
+             motorMaximumPanPositionsPerSecondInDirection(kCalibrationDirectionPositive));
 }
 
 // Public function.  Docs in header.
 //
 // Returns the number of positions per second that the tilt axis moves at its fastest
-// speed.
+// speed in its slower direction.
 int64_t motorMaximumTiltPositionsPerSecond(void) {
-  return motor_tilt_data[PAN_TILT_SCALE_HARDWARE];
+  return MIN(motorMaximumTiltPositionsPerSecondInDirection(kCalibrationDirectionNegative),
+             motorMaximumTiltPositionsPerSecondInDirection(kCalibrationDirectionPositive));
+}
+
+// Public function.  Docs in header.
+int64_t motorMaximumPanPositionsPerSecondInDirection(calibration_direction_t direction) {
+  return maximumPositionsPerSecondForOnlineCalibration(&motor_pan_calibration, direction);
+}
+
+// Public function.  Docs in header.
+int64_t motorMaximumTiltPositionsPerSecondInDirection(calibration_direction_t direction) {
+  return maximumPositionsPerSecondForOnlineCalibration(&motor_tilt_calibration, direction);
 }
@@ -25,8 +25,8 @@ bool motorModuleReload(void);
  * per second at each motor speed in each axis, then computing each of those
  * values relative to the value at the maximum speed.
  *
- * This function uses calibrationDataForMoveAlongAxis to repeatedly move
- * back and forth at various speeds.
+ * This function uses calibrateAxesConcurrently to repeatedly move both
+ * axes back and forth at various speeds at the same time.
  */
 void motorModuleCalibrate(void);
 
@@ -81,6 +81,22 @@ int64_t motorMaximumPanPositionsPerSecond(void);
  */
 int64_t motorMaximumTiltPositionsPerSecond(void);
 
+/**
+ * Returns the number of encoder positions per second that the pan axis moves
+ * at its fastest speed in the specified direction (the sign of the speed
+ * passed to motorSetPanTiltSpeed).  Returns 0 if no calibration data is
+ * available.
+ */
+int64_t motorMaximumPanPositionsPerSecondInDirection(calibration_direction_t direction);
+
+/**
+ * Returns the number of encoder positions per second that the tilt axis moves
+ * at its fastest speed in the specified direction (the sign of the speed
+ * passed to motorSetPanTiltSpeed).  Returns 0 if no calibration data is
+ * available.
+ */
+int64_t motorMaximumTiltPositionsPerSecondInDirection(calibration_direction_t direction);
+
 
 // If motor pan and tilt are enabled, map the standard motion and position macros
 // to functions in this module.
@@ -105,4 +121,8 @@ int64_t motorMaximumTiltPositionsPerSecond(void);
     #define MIN_TILT_POSITIONS_PER_SECOND() motorMinimumTiltPositionsPerSecond();
     #define MAX_PAN_POSITIONS_PER_SECOND() motorMaximumPanPositionsPerSecond();
     #define MAX_TILT_POSITIONS_PER_SECOND() motorMaximumTiltPositionsPerSecond();
+    #define MAX_PAN_POSITIONS_PER_SECOND_IN_DIRECTION(direction) \
+        motorMaximumPanPositionsPerSecondInDirection(direction)
+    #define MAX_TILT_POSITIONS_PER_SECOND_IN_DIRECTION(direction) \
+        motorMaximumTiltPositionsPerSecondInDirection(direction)
 #endif
@@ -0,0 +1,149 @@
+#include "motorsim.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+/** The length of one simulation step, in nanoseconds. */
+static const int64_t kMotorSimStepNanos = 1000000;
+
+
+#pragma mark - Parameters
+
+// Public function.  Docs in header.
+//
+// These values are loosely based on a geared DC pan/tilt head with CANBus encoders and
+// a typical camcorder lens.  They are not meant to match any
+// particular hardware exactly, just to behave like real hardware does.
+void motorSimDefaultParams(motor_sim_params_t *params, axis_identifier_t axis) {
+  memset(params, 0, sizeof(*params));
+  switch (axis) {
+    case axis_identifier_pan:
+      params->hardwareScale = 100;
+      params->maxPositionsPerSecond = 8000;
+      params->speedExponent = 1.6;
+      params->deadband = 0.12;
+      params->timeConstant = 0.03;
+      params->frictionDeceleration = 4000;
+      params->backlash = 3;
+      params->encoderResolution = 1;
+      params->negativeSpeedScale = 1;
+      break;
+    case axis_identifier_tilt:
+      params->hardwareScale = 100;
+      params->maxPositionsPerSecond = 5000;
+      params->speedExponent = 1.6;
+      params->deadband = 0.15;
+      params->timeConstant = 0.04;
+      params->frictionDeceleration = 3000;
+      params->backlash = 4;
+      params->encoderResolution = 1;
+      params->negativeSpeedScale = 1;
+      break;
+    case axis_identifier_zoom:
+      params->hardwareScale = 49;
+      params->maxPositionsPerSecond = 1500;
+      params->speedExponent = 1.2;
+      params->deadband = 0.02;
+      params->timeConstant = 0.03;
+      params->frictionDeceleration = 2000;
+      params->backlash = 0;
+      params->encoderResolution = 1;
+      params->negativeSpeedScale = 1;
+      break;
+  }
+}
+
+
+#pragma mark - Simulation
+
+// Public function.  Docs in header.
+void motorSimInitAxis(motor_sim_axis_t *axis, const motor_sim_params_t *params,
+                      int64_t startPosition) {
+  memset(axis, 0, sizeof(*axis));
+  axis->params = *params;
+  axis->motorPosition = startPosition;
+  axis->loadPosition = startPosition;
+}
+
+// Public function.  Docs in header.
+void motorSimSetSpeed(motor_sim_axis_t *axis, int hardwareSpeed) {
+  int scale = axis->params.hardwareScale;
+  axis->commandedSpeed = MAX(MIN(hardwareSpeed, scale), -scale);
+}
+
+// Public function.  Docs in header.
+double motorSimSteadyStateSpeed(const motor_sim_params_t *params, int hardwareSpeed) {
+  if (params->hardwareScale <= 0) {
+    return 0;
+  }
+  double dutyCycle = (double)abs(hardwareSpeed) / params->hardwareScale;
+  if (dutyCycle <= params->deadband) {
+    return 0;
+  }
+  double usableFraction = (dutyCycle - params->deadband) / (1 - params->deadband);
+  double directionScale = (hardwareSpeed < 0) ? params->negativeSpeedScale : 1;
+  return params->maxPositionsPerSecond * directionScale *
+      pow(MIN(usableFraction, 1), params->speedExponent);
+}
+
+// Advances the axis by one step of deltaTime seconds.
+static void motorSimStepOnce(motor_sim_axis_t *axis, double deltaTime) {
+  const motor_sim_params_t *params = &axis->params;
+  double targetSpeed = motorSimSteadyStateSpeed(params, axis->commandedSpeed);
+  double targetVelocity = (axis->commandedSpeed < 0) ? -targetSpeed : targetSpeed;
+
+  // Inertia: the speed approaches the target exponentially.
+  double blend = (params->timeConstant > 0) ? (1 - exp(-deltaTime / params->timeConstant)) : 1;
+  double velocity = axis->velocity + ((targetVelocity - axis->velocity) * blend);
+
+  // Friction: when the motor isn't driving the load (or is driving it slower than it is
+  // moving), it slows down faster than inertia alone would suggest, and it stops for good
+  // instead of coasting forever.
+  if (fabs(targetVelocity) < fabs(velocity)) {
+    double slowdown = params->frictionDeceleration * deltaTime;
+    if (fabs(velocity) - slowdown <= fabs(targetVelocity)) {
+      velocity = targetVelocity;
+    } else {
+      velocity -= (velocity > 0) ? slowdown : -slowdown;
+    }
+  }
+  axis->velocity = velocity;
+  axis->motorPosition += velocity * deltaTime;
+
+  // Backlash: the load only moves once the motor has taken up the slack in the gears.
+  double halfSlack = params->backlash / 2;
+  if (axis->motorPosition - axis->loadPosition > halfSlack) {
+    axis->loadPosition = axis->motorPosition - halfSlack;
+  } else if (axis->loadPosition - axis->motorPosition > halfSlack) {
+    axis->loadPosition = axis->motorPosition + halfSlack;
+  }
+}
+
+// Public function.  Docs in header.
+void motorSimStep(motor_sim_axis_t *axis, int64_t nanoseconds) {
+  while (nanoseconds > 0) {
+    int64_t stepNanos = MIN(nanoseconds, kMotorSimStepNanos);
+    motorSimStepOnce(axis, (double)stepNanos / NSEC_PER_SEC);
+    nanoseconds -= stepNanos;
+  }
+}
+
+// Public function.  Docs in header.
+int64_t motorSimEncoderPosition(const motor_sim_axis_t *axis) {
+  double resolution = (axis->params.encoderResolution > 0) ? axis->params.encoderResolution : 1;
+  return (int64_t)(floor(axis->loadPosition / resolution) * resolution);
+}
+
+
+#pragma mark - Calibration
+
+// Public function.  Docs in header.
+int64_t *motorSimCalibrationData(const motor_sim_params_t *params, int direction) {
+  int64_t *calibrationData = malloc((params->hardwareScale + 1) * sizeof(int64_t));
+  for (int speed = 0; speed <= params->hardwareScale; speed++) {
+    calibrationData[speed] = (int64_t)motorSimSteadyStateSpeed(params, speed * direction);
+  }
+  return calibrationData;
+}
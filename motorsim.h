@@ -0,0 +1,62 @@
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "constants.h"
+
+/** The physical characteristics of one simulated motor, gear train, and encoder. */
+typedef struct {
+  int hardwareScale;             //! The fastest hardware speed (e.g. 100 for the motor board).
+  double maxPositionsPerSecond;  //! The steady-state speed at the fastest hardware speed.
+  double speedExponent;          //! Shape of the duty-cycle-to-speed curve (1 is linear).
+  double deadband;               //! Fraction of the hardware scale below which the motor stalls.
+  double timeConstant;           //! Seconds for the speed to cover 63% of a change (inertia).
+  double frictionDeceleration;   //! Extra deceleration (positions/sec^2) while coasting.
+  double backlash;               //! Gear slack (positions) taken up after each reversal.
+  double encoderResolution;      //! Positions per encoder count.
+  double negativeSpeedScale;     //! Speed at negative hardware speeds relative to positive (gravity).
+} motor_sim_params_t;
+
+/** The state of one simulated axis. */
+typedef struct {
+  motor_sim_params_t params;
+  int commandedSpeed;     //! The signed hardware speed most recently set.
+  double velocity;        //! The motor's velocity (positions per second).
+  double motorPosition;   //! The motor side of the gear train.
+  double loadPosition;    //! The load side of the gear train (what the encoder sees).
+} motor_sim_axis_t;
+
+/**
+ * Fills in plausible parameters for the specified axis (a geared DC motor for pan and
+ * tilt, and a camera lens for zoom).
+ */
+void motorSimDefaultParams(motor_sim_params_t *params, axis_identifier_t axis);
+
+/** Initializes a simulated axis at rest at the specified position. */
+void motorSimInitAxis(motor_sim_axis_t *axis, const motor_sim_params_t *params,
+                      int64_t startPosition);
+
+/** Sets the signed hardware speed of a simulated axis (clamped to the hardware scale). */
+void motorSimSetSpeed(motor_sim_axis_t *axis, int hardwareSpeed);
+
+/**
+ * Advances a simulated axis by the specified number of nanoseconds.  The simulation
+ * uses fixed one-millisecond steps (plus a shorter final step if needed), so the result
+ * depends only on the inputs, never on the host's clock or speed.
+ */
+void motorSimStep(motor_sim_axis_t *axis, int64_t nanoseconds);
+
+/** Returns the value that the simulated axis's encoder currently reports. */
+int64_t motorSimEncoderPosition(const motor_sim_axis_t *axis);
+
+/**
+ * Returns the speed (unsigned, in positions per second) that the simulated axis eventually
+ * reaches at the specified signed hardware speed.
+ */
+double motorSimSteadyStateSpeed(const motor_sim_params_t *params, int hardwareSpeed);
+
+/**
+ * Returns ideal calibration data for a simulated axis (positions per second at each
+ * hardware speed, in the same format as calibrationDataForMoveAlongAxis) when moving
+ * with hardware speeds of the specified sign (1 or -1).  The caller must free the result.
+ */
+int64_t *motorSimCalibrationData(const motor_sim_params_t *params, int direction);
@@ -2,10 +2,14 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <ctype.h>
 #include <curl/curl.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -18,8 +22,6 @@
 #include <termios.h>
 #include <unistd.h>
 
-#include <libxml/parser.h>  // -lxml2
-
 #include <openssl/md5.h>  // -lcrypto
 
 #include "main.h"
@@ -43,12 +45,150 @@ typedef struct {
 /** A motor/zoom position at a given time. */
 typedef struct {
   int64_t position;
-  double timeStamp;
+  int64_t timeStamp;  // Monotonic time in nanoseconds.
 } timed_position_t;
 
+/** The size of each session's receive buffer.  Responses must fit in this. */
+#define P2_RECEIVE_BUFFER_SIZE 8192
+
+/** The size of the buffers that hold values extracted from responses. */
+#define P2_MAX_VALUE_SIZE 128
+
+/** The deepest element nesting that the XML scanner accepts. */
+#define P2_XML_MAX_DEPTH 8
+
+/** The longest element or attribute name that the XML scanner accepts. */
+#define P2_XML_MAX_NAME_LENGTH 15
+
+/** A range of bytes within a response, relative to the start of the response. */
+typedef struct {
+  size_t offset;
+  size_t length;
+  bool present;  //! False if the response did not contain the item.
+} p2_span_t;
+
+/** The states of the XML scanner. */
+typedef enum {
+  kP2ScanText = 0,             //! Between tags.
+  kP2ScanTagStart,             //! After a '<'.
+  kP2ScanStartTagName,         //! In the name of a start tag.
+  kP2ScanEndTagName,           //! In the name of an end tag.
+  kP2ScanAfterEndTagName,      //! After the name of an end tag, before its '>'.
+  kP2ScanInTag,                //! In a start tag, between attributes.
+  kP2ScanAttributeName,        //! In an attribute name.
+  kP2ScanAfterAttributeName,   //! After an attribute name, before its '='.
+  kP2ScanAttributeValueStart,  //! After an attribute's '=', before its opening quote.
+  kP2ScanAttributeValue,       //! In a quoted attribute value.
+  kP2ScanEmptyTagEnd,          //! After the '/' of an empty-element tag, before its '>'.
+  kP2ScanSkip,                 //! In a declaration (<?...> or <!...>).
+  kP2ScanComment,              //! In a comment (<!--...-->).
+  kP2ScanFailed,               //! After malformed data.
+} p2_scan_state_t;
+
+/** The result of scanning the bytes received so far. */
+typedef enum {
+  kP2ScanIncomplete = 0,  //! The response is not complete yet.
+  kP2ScanComplete = 1,    //! The response is complete (see frameLength).
+  kP2ScanMalformed = 2,   //! The data is not a response that this module understands.
+} p2_scan_result_t;
+
+/**
+ * A streaming scanner for the camera's XML responses.  The responses use a tiny, fixed
+ * grammar, so rather than building a document tree, this pulls out the few items that
+ * this module uses as byte ranges within the receive buffer, resuming where it left off
+ * as more data arrives.
+ */
+typedef struct {
+  // Results.  These are valid once the scanner returns kP2ScanComplete.
+  size_t frameLength;  //! The length of the response, including its closing tag.
+  p2_span_t camCtl;    //! The contents of the first CamCtl element.
+  p2_span_t sessionID; //! The SessionID attribute of the first CamCtl element.
+  p2_span_t realm;     //! The contents of the first Realm element.
+  p2_span_t nonce;     //! The contents of the first Nonce element.
+
+  // Scanning state.
+  size_t position;                //! The number of bytes scanned so far.
+  p2_scan_state_t state;
+  int depth;                      //! The number of open elements.
+  char openNames[P2_XML_MAX_DEPTH][P2_XML_MAX_NAME_LENGTH + 1];  //! The open elements.
+  size_t contentStart[P2_XML_MAX_DEPTH];  //! Where each open element's contents start.
+  char name[P2_XML_MAX_NAME_LENGTH + 1];  //! The tag name being scanned.
+  size_t nameLength;
+  char attributeName[P2_XML_MAX_NAME_LENGTH + 1];  //! The attribute name being scanned.
+  size_t attributeNameLength;
+  char quote;                     //! The quote character around the current attribute value.
+  size_t valueStart;              //! Where the current attribute value starts.
+  size_t tagStart;                //! Where the current tag's '<' is.
+} p2_xml_scanner_t;
+
+/**
+ * Called on the reader thread when a response arrives (ok is true) or when the session
+ * fails first (ok is false).  The value is the contents of the response's CamCtl element.
+ */
+typedef void (*p2_response_callback_t)(bool ok, const char *value, void *context);
+
+/** A request that has been sent and is waiting for its response. */
+typedef struct p2_pending_request {
+  int64_t sendTime;                  //! When the request was sent.
+  p2_response_callback_t callback;   //! Called with the response, or NULL if a caller waits.
+  void *context;                     //! Passed to the callback.
+  bool done;                         //! True once the response (or a failure) arrives.
+  bool received;                     //! True if a response arrived, even an unparseable one.
+  bool ok;                           //! True if the response arrived and was parsed.
+  char value[P2_MAX_VALUE_SIZE];     //! The contents of the response's CamCtl element.
+  struct p2_pending_request *next;
+} p2_pending_request_t;
+
+/** An authenticated TCP connection to the camera. */
+typedef struct {
+  int socket;                //! The TCP socket, or -1 if not connected.
+  uint64_t generation;       //! Distinguishes this session from later ones on the same socket.
+  char *authToken;           //! The hashed credentials sent with every request.
+  char *sessionID;           //! The session ID that the camera assigned.
+  int64_t lastRequestTime;   //! When a caller last sent a request on this session.
+  int64_t lastActivityTime;  //! When the session last carried any traffic (including probes).
+
+  // The camera answers requests in order, so responses are matched to requests in FIFO
+  // order as they are scanned out of the receive buffer.
+  p2_pending_request_t *pendingHead;  //! The oldest request still awaiting a response.
+  p2_pending_request_t *pendingTail;  //! The newest request still awaiting a response.
+  char receiveBuffer[P2_RECEIVE_BUFFER_SIZE];  //! Received bytes not yet handed to a request.
+  size_t receiveLength;               //! The number of bytes in receiveBuffer.
+  p2_xml_scanner_t scanner;           //! The scan of the response at the start of the buffer.
+} p2_session_t;
+
 static const int panasonic_p2_udp_port = 49153;
 static const int panasonic_p2_tcp_port = 49152;
 
+/** How long a session can be quiet before the session thread checks that it still works. */
+static const int64_t kP2KeepaliveIntervalNanos = 5 * NSEC_PER_SEC;
+
+/** How long to wait before trying again after a connection attempt fails. */
+static const int64_t kP2ReconnectIntervalNanos = 2 * NSEC_PER_SEC;
+
+/** How often the session thread wakes up when nothing needs to be done. */
+static const int64_t kP2SessionThreadIntervalNanos = NSEC_PER_SEC / 2;
+
+/** How long to wait for a response before deciding that the session has failed. */
+static const int64_t kP2ResponseTimeoutNanos = NSEC_PER_SEC;
+
+/** How long the reader thread waits for data before checking for timeouts. */
+static const int kP2ReaderIntervalMicros = 20000;
+
+/**
+ * The request used to check whether a quiet session still works.  This asks for the
+ * range of zoom speeds, which has no side effects.
+ */
+static const char *kP2KeepaliveRequest = "<CamCtl>$ZmSpd:c</CamCtl>";
+
+/**
+ * Integer key containing the number of seconds after which a session that carries no
+ * requests is replaced with a fresh one (zero to never replace it).  Some camera
+ * firmware stops honoring sessions that have been idle for a while, even though they
+ * still answer keepalive probes.
+ */
+static const char *kP2SessionMaxIdleKey = "p2_session_max_idle_seconds";
+
 
 #pragma mark - Function prototypes
 
@@ -62,31 +202,72 @@ int64_t p2GetZoomPositionRaw(void);
 char *md5_string(uint8_t *hashbuf);
 char *getP2Auth(int sock);
 
-bool sendP2Request(char *request, char **buf);
-bool requestEnv(char *authToken, int sock);
+bool sendP2Request(char *request, char *value, size_t valueSize);
+bool sendP2RequestAsync(char *request, p2_response_callback_t callback, void *context);
+bool requestEnv(char *authToken, int sock, char **sessionID);
+bool openP2Session(p2_session_t *session);
+void closeP2Session(p2_session_t *session);
+void *runP2SessionThread(void *argIgnored);
+void *runP2ReaderThread(void *argIgnored);
+static void runP2Callbacks(p2_pending_request_t *finished);
 
 char *p2IntString(uint64_t value, int digits, bool hex);
 
-char *textForResponseElement(char *tag, char *result);
+void p2ScannerReset(p2_xml_scanner_t *scanner);
+p2_scan_result_t p2ScanResponse(p2_xml_scanner_t *scanner, const char *response, size_t length);
+bool p2CopySpan(const char *response, p2_span_t span, char *buffer, size_t bufferSize);
+bool readP2Response(int sock, char *buffer, size_t bufferSize, p2_xml_scanner_t *scanner);
 
 void populateZoomNonlinearityTable(void);
 
 void runP2Tests(void);
 
-ssize_t syncread(int fd, void *buf, size_t count);
-
 #pragma mark - Global variables
 
 static pthread_mutex_t gSocketLock, gSpeedLock;
 static pthread_cond_t gZoomDataCond;
 
+/** Signaled when the active session fails, so that the session thread replaces it. */
+static pthread_cond_t gSessionCond;
+
+/** Signaled (with gSocketLock held) whenever a waiting caller's request finishes. */
+static pthread_cond_t gResponseCond;
+
+/**
+ * Finished requests whose callbacks have not run yet, oldest first.  The reader thread
+ * runs the callbacks without holding gSocketLock.  Guarded by gSocketLock.
+ */
+static p2_pending_request_t *gFinishedHead = NULL;
+static p2_pending_request_t *gFinishedTail = NULL;
+
+/** The source of session generation numbers.  Guarded by gSocketLock. */
+static uint64_t gLastSessionGeneration = 0;
+
 static int gP2UDPSocket = -1;
-static int gP2TCPSocket = -1;
 struct sockaddr_in gP2Addr;
 
+/** The session used for requests.  Guarded by gSocketLock. */
+static p2_session_t gActiveSession = { .socket = -1 };
+
+/**
+ * A second, already authenticated session that replaces the active session instantly
+ * if it fails.  Guarded by gSocketLock.
+ */
+static p2_session_t gStandbySession = { .socket = -1 };
+
 static pthread_t gP2UDPThread;
 void *runP2UDPThread(void *argIgnored);
 
+static pthread_t gP2SessionThread;
+static bool gP2SessionThreadStarted = false;
+
+/** Set during teardown to stop the background threads.  Guarded by gSocketLock. */
+static bool gP2Stopping = false;
+
+static pthread_t gP2ReaderThread;
+static bool gP2ReaderThreadStarted = false;
+static pthread_once_t gP2ReaderOnce = PTHREAD_ONCE_INIT;
+
 /** If true, enables extra debugging. */
 static bool p2_enable_debugging = false;
 
@@ -96,15 +277,24 @@ static int64_t gLastZoomSpeed = 0;
 /** The last zoom position received. */
 static int64_t gLastZoomPosition = 0;
 
+/**
+ * Filtered zoom position and velocity (in linear positions, not the camera's raw
+ * values), updated whenever the camera reports a position.
+ */
+static axis_estimator_t gZoomEstimator;
+
+/**
+ * True if the zoom speed did not change between the last two position reports, which
+ * means that gZoomEstimator's velocity was measured at the current speed.
+ */
+static bool gZoomSpeedSteady = false;
+
 /** The last tally state received. */
 static int64_t gLastTallyState = 0;
 
 /** The IP address of the camera. */
 static char *g_cameraIPAddr = NULL;
 
-static char *gAuthToken = NULL;
-static char *gSessionID = NULL;
-
 #if USE_PANASONIC_PTZ
   /** The zoom calibration data in raw form (positions per second for each speed). */
   int64_t *p2ZoomCalibrationData = NULL;
@@ -196,7 +386,7 @@ typedef struct p2_camera_data {
 } p2_camera_data_t;
 
 typedef struct speed_time {
-  uint64_t timestamp;
+  int64_t timestamp;  // Monotonic time in nanoseconds.
   int speed;
   struct speed_time *next;
 } speed_time_t;
@@ -212,6 +402,15 @@ bool p2ModuleInit(void) {
   pthread_mutex_init(&gSocketLock, NULL);
   pthread_mutex_init(&gSpeedLock, NULL);
   pthread_cond_init(&gZoomDataCond, NULL);
+  // The session thread's timed waits use the monotonic clock so that wall clock
+  // changes (NTP, for example) don't stretch or cut short its sleeps.
+  pthread_condattr_t sessionCondAttributes;
+  pthread_condattr_init(&sessionCondAttributes);
+  pthread_condattr_setclock(&sessionCondAttributes, CLOCK_MONOTONIC);
+  pthread_cond_init(&gSessionCond, &sessionCondAttributes);
+  pthread_condattr_destroy(&sessionCondAttributes);
+  pthread_cond_init(&gResponseCond, NULL);
+  resetAxisEstimator(&gZoomEstimator, axisEstimatorProcessNoise(), axisEstimatorMeasurementNoise());
 
   assert(sizeof(p2_optical_data_t) == 65);
 
@@ -268,6 +467,8 @@ bool p2ModuleInit(void) {
 bool p2ModuleStart(void) {
   #if USE_PANASONIC_PTZ && ENABLE_P2_MODE
     pthread_create(&gP2UDPThread, NULL, runP2UDPThread, NULL);
+    gP2SessionThreadStarted =
+        (pthread_create(&gP2SessionThread, NULL, runP2SessionThread, NULL) == 0);
   #endif
   return true;
 }
@@ -303,10 +504,29 @@ bool p2ModuleReload(void) {
 //
 // Tears down the module.
 bool p2ModuleTeardown(void) {
-  if (gP2TCPSocket != -1) {
-    close(gP2TCPSocket);
-    gP2TCPSocket = -1;
+  // Stop the session thread first so that it can't open new sessions.
+  pthread_mutex_lock(&gSocketLock);
+  gP2Stopping = true;
+  pthread_cond_broadcast(&gSessionCond);
+  pthread_mutex_unlock(&gSocketLock);
+  if (gP2SessionThreadStarted) {
+    pthread_join(gP2SessionThread, NULL);
+    gP2SessionThreadStarted = false;
+  }
+  if (gP2ReaderThreadStarted) {
+    pthread_join(gP2ReaderThread, NULL);
+    gP2ReaderThreadStarted = false;
   }
+
+  // With the reader thread gone, run the callbacks here, including those for requests
+  // that fail because their sessions are closed.
+  pthread_mutex_lock(&gSocketLock);
+  closeP2Session(&gActiveSession);
+  closeP2Session(&gStandbySession);
+  p2_pending_request_t *finished = gFinishedHead;
+  gFinishedHead = gFinishedTail = NULL;
+  pthread_mutex_unlock(&gSocketLock);
+  runP2Callbacks(finished);
   if (gP2UDPSocket != -1) {
     close(gP2UDPSocket);
     gP2UDPSocket = -1;
@@ -364,8 +584,8 @@ int p2GetMaxZoomSpeed(void) {
   // Response:
   // <P2Control><CamCtl>$ZmSpd:i-8,8</CamCtl></P2Control
 
-  char *result = NULL;
-  bool ok = sendP2Request("<CamCtl>$ZmSpd:c</CamCtl>", &result);
+  char text[P2_MAX_VALUE_SIZE];
+  bool ok = sendP2Request("<CamCtl>$ZmSpd:c</CamCtl>", text, sizeof(text));
   if (!ok) {
     fprintf(stderr, "Could not send request.\n");
     return 0;
@@ -374,10 +594,6 @@ int p2GetMaxZoomSpeed(void) {
   // <P2Control><Response><CamCtl>$ZmSpd:8</CamCtl></Response></P2Control>
   // <P2Control><Response><CamCtl>$ZmSpd:i-8,8</CamCtl></Response></P2Control>
 
-  fprintf(stderr, "Zoom speed response: %s\n", result);
-
-  char *text = textForResponseElement("CamCtl", result);
-
   fprintf(stderr, "Zoom speed result: %s\n", text);
 
   if (!strncmp(text, "$ZmSpd:", 7)) {
@@ -426,16 +642,16 @@ bool p2SetZoomSpeed(int64_t speed, bool isRaw) {
     bool retval = true;
     char *command = NULL;
     asprintf(&command, "<CamCtl>$ZmSpd:=%d</CamCtl>", intSpeed);
-    char *response = NULL;
-    bool ok = sendP2Request(command, &response);
+    char response[P2_MAX_VALUE_SIZE];
+    bool ok = sendP2Request(command, response, sizeof(response));
+    free(command);
 
-    fprintf(stderr, "In p2SetZoomSpeed: response: %s\n", response);
+    fprintf(stderr, "In p2SetZoomSpeed: response: %s\n", ok ? response : "(none)");
 
     // Response violates the spec.  My camera just sends back an empty element.
 
-    if (!ok /* || !response || atoi(response) != intSpeed */) {
+    if (!ok /* || atoi(response) != intSpeed */) {
         retval = false;
-        free(response);
     }
     markSpeedChange(intSpeed);
     return retval;
@@ -487,24 +703,26 @@ int p2GetTallyState(void) {
   return gLastTallyState;
 }
 
+/** Logs failures to change a tally light (named by the context). */
+static void logP2TallyResponse(bool ok, const char *value, void *context) {
+  if (!ok) {
+    fprintf(stderr, "Could not set the %s tally light.\n", (const char *)context);
+  }
+}
+
 // Public function.  Docs in header.
 //
 // Sets the camera's tally light state.
 bool p2SetTallyState(int tallyState) {
-  bool retval = true;
-
-  char *redRequest = (tallyState == kTallyStateRed) ?  "$RTlySw:=On" : "$RTlySw:=Off";
-  char *greenRequest = (tallyState == kTallyStateGreen) ?  "$GTlySw:=On" : "$GTlySw:=Off";
-
-  char *junkbuf = NULL;
-  sendP2Request(redRequest, &junkbuf);
-  if (junkbuf != NULL) free(junkbuf);
-
-  junkbuf = NULL;
-  sendP2Request(greenRequest, &junkbuf);
-  if (junkbuf != NULL) free(junkbuf);
-
-  return retval;
+  // Send both lights' states together rather than waiting for the first response.
+  char *redRequest = (tallyState == kTallyStateRed) ?
+      "<CamCtl>$RTlySw:=On</CamCtl>" : "<CamCtl>$RTlySw:=Off</CamCtl>";
+  char *greenRequest = (tallyState == kTallyStateGreen) ?
+      "<CamCtl>$GTlySw:=On</CamCtl>" : "<CamCtl>$GTlySw:=Off</CamCtl>";
+
+  bool redOK = sendP2RequestAsync(redRequest, logP2TallyResponse, "red");
+  bool greenOK = sendP2RequestAsync(greenRequest, logP2TallyResponse, "green");
+  return redOK && greenOK;
 }
 
 
@@ -533,15 +751,51 @@ int64_t p2MaximumZoomPositionsPerSecond(void) {
 }
 
 
-#pragma mark - Helper methods
+#pragma mark - Sessions
+
+/*
+ * The camera's TCP sessions are expensive to set up (a login round trip, an MD5
+ * challenge, an environment query, and a connect request), so rather than reconnecting
+ * periodically, this module keeps one session open for as long as it keeps working.
+ *
+ * A background thread checks quiet sessions with keepalive probes (backed up by TCP
+ * keepalives for dead links) and keeps a second, already authenticated standby session
+ * ready.  When a request fails, sendP2Request switches to the standby session and
+ * retries immediately, and the thread replaces the standby session in the background.
+ */
+
+/**
+ * Turns on TCP keepalives and a send timeout so that a dead link is noticed.  Reads
+ * need no socket timeout, because readP2Response and the reader thread wait with
+ * deadlines of their own.
+ */
+static void configureP2Socket(int sock) {
+  int enable = 1;
+  setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+#ifdef TCP_KEEPIDLE
+  int idleSeconds = 5, intervalSeconds = 2, probeCount = 3;
+  setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idleSeconds, sizeof(idleSeconds));
+  setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &intervalSeconds, sizeof(intervalSeconds));
+  setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &probeCount, sizeof(probeCount));
+#endif
+  struct timeval timeout = { 1, 0 };
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/** Connects to the camera and authenticates.  Returns false on failure. */
+bool openP2Session(p2_session_t *session) {
+  bzero(session, sizeof(*session));
+  session->socket = -1;
 
-int openP2Socket(void) {
   fprintf(stderr, "Opening P2 socket.\n");
   int sock = socket(PF_INET, SOCK_STREAM, 0);
   if (sock == -1) {
     perror("socket");
-    return -1;
+    return false;
   }
+  configureP2Socket(sock);
+
   struct sockaddr_in sa;
   bzero(&sa, sizeof(sa));
 
@@ -550,22 +804,417 @@ int openP2Socket(void) {
   inet_aton(g_cameraIPAddr, &sa.sin_addr);
 
   if (connect(sock, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
-        perror("connect");
-        printf("Connection with the server failed...\n");
-        return -1;
+    perror("connect");
+    fprintf(stderr, "Connection with the camera failed.\n");
+    close(sock);
+    return false;
   }
 
   char *authToken = getP2Auth(sock);
   if (authToken == NULL) {
     close(sock);
-    return -1;
+    return false;
+  }
+
+  char *sessionID = NULL;
+  if (!requestEnv(authToken, sock, &sessionID)) {
+    free(authToken);
+    free(sessionID);
+    close(sock);
+    return false;
+  }
+
+  session->socket = sock;
+  session->authToken = authToken;
+  session->sessionID = sessionID;
+  session->lastRequestTime = monotonicTimeNanos();
+  session->lastActivityTime = session->lastRequestTime;
+  return true;
+}
+
+/**
+ * Marks a request as finished.  Received is false if the session failed before the
+ * response arrived, and ok is false if the response could not be parsed (or never
+ * arrived).  Waiting callers are woken up, and requests with callbacks are handed to
+ * the reader thread.  Call with gSocketLock held.
+ */
+static void finishP2RequestLocked(p2_pending_request_t *pending, bool received, bool ok) {
+  pending->done = true;
+  pending->received = received;
+  pending->ok = received && ok;
+  pending->next = NULL;
+  if (pending->callback == NULL) {
+    pthread_cond_broadcast(&gResponseCond);
+  } else if (gFinishedTail) {
+    gFinishedTail->next = pending;
+    gFinishedTail = pending;
+  } else {
+    gFinishedHead = gFinishedTail = pending;
+  }
+}
+
+/**
+ * Closes a session (if open), fails any requests still waiting for responses on it,
+ * and frees its credentials.  Call with gSocketLock held (except during teardown).
+ */
+void closeP2Session(p2_session_t *session) {
+  if (session->socket != -1) {
+    close(session->socket);
+  }
+  p2_pending_request_t *next = NULL;
+  for (p2_pending_request_t *pending = session->pendingHead; pending; pending = next) {
+    next = pending->next;
+    pending->value[0] = '\0';
+    finishP2RequestLocked(pending, false, false);
+  }
+  free(session->authToken);
+  free(session->sessionID);
+  bzero(session, sizeof(*session));
+  session->socket = -1;
+}
+
+/** Puts a newly opened session into service.  Call with gSocketLock held. */
+static void installP2SessionLocked(p2_session_t *slot, p2_session_t *session) {
+  *slot = *session;
+  slot->generation = ++gLastSessionGeneration;
+}
+
+/** Starts the thread that reads responses from the camera. */
+static void startP2ReaderThread(void) {
+  gP2ReaderThreadStarted =
+      (pthread_create(&gP2ReaderThread, NULL, runP2ReaderThread, NULL) == 0);
+}
+
+/**
+ * Sends a request on a session and adds it to the session's queue of requests awaiting
+ * responses.  Returns false (without queueing it) if the session failed.  Call with
+ * gSocketLock held.
+ */
+static bool queueP2RequestLocked(p2_session_t *session, const char *request,
+                                 p2_pending_request_t *pending) {
+  pthread_once(&gP2ReaderOnce, startP2ReaderThread);
+
+  char *message = NULL;
+  asprintf(&message, "<P2Control><Auth>%s</Auth><SessionID>%s</SessionID>%s</P2Control>",
+           session->authToken, session->sessionID ? session->sessionID : "", request);
+
+  if (p2_enable_debugging) {
+    // The Auth token is a reusable credential, so keep it out of the logs.
+    fprintf(stderr, "In sendP2Request: <P2Control><Auth>[redacted]</Auth><SessionID>%s</SessionID>"
+            "%s</P2Control>\n", session->sessionID ? session->sessionID : "", request);
+  }
+
+  size_t expectedSize = strlen(message);
+  size_t sent = 0;
+  while (sent < expectedSize) {
+    ssize_t size = send(session->socket, message + sent, expectedSize - sent, MSG_NOSIGNAL);
+    if (size <= 0) {
+      perror("send");
+      free(message);
+      return false;
+    }
+    sent += size;
+  }
+  free(message);
+
+  pending->sendTime = monotonicTimeNanos();
+  pending->done = false;
+  pending->next = NULL;
+  if (session->pendingTail) {
+    session->pendingTail->next = pending;
+  } else {
+    session->pendingHead = pending;
+  }
+  session->pendingTail = pending;
+  return true;
+}
+
+/**
+ * Reads whatever data is available on a session and hands each complete response to the
+ * oldest waiting request.  Returns false if the session failed.  Call with gSocketLock
+ * held.
+ */
+static bool receiveP2DataLocked(p2_session_t *session) {
+  if (session->receiveLength == P2_RECEIVE_BUFFER_SIZE) {
+    fprintf(stderr, "P2 response too large.\n");
+    return false;
+  }
+  ssize_t length = recv(session->socket, session->receiveBuffer + session->receiveLength,
+                        P2_RECEIVE_BUFFER_SIZE - session->receiveLength, MSG_DONTWAIT);
+  if (length == 0 || (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+    fprintf(stderr, "P2 connection closed.\n");
+    return false;
+  }
+  if (length < 0) {
+    return true;
+  }
+  session->receiveLength += length;
+  session->lastActivityTime = monotonicTimeNanos();
+
+  // The scanner picks up where it left off, so a response split across reads is only
+  // scanned once.
+  while (true) {
+    p2_scan_result_t result = p2ScanResponse(&session->scanner, session->receiveBuffer,
+                                             session->receiveLength);
+    if (result == kP2ScanIncomplete) {
+      return true;
+    }
+    if (result == kP2ScanMalformed) {
+      fprintf(stderr, "Malformed P2 response: %.*s\n", (int)session->receiveLength,
+              session->receiveBuffer);
+      return false;
+    }
+
+    size_t responseLength = session->scanner.frameLength;
+    if (p2_enable_debugging) {
+      fprintf(stderr, "In sendP2Request: Got response %.*s\n", (int)responseLength,
+              session->receiveBuffer);
+    }
+
+    p2_pending_request_t *pending = session->pendingHead;
+    if (pending == NULL) {
+      fprintf(stderr, "Ignoring unexpected P2 response.\n");
+    } else {
+      session->pendingHead = pending->next;
+      if (session->pendingHead == NULL) {
+        session->pendingTail = NULL;
+      }
+      bool ok = p2CopySpan(session->receiveBuffer, session->scanner.camCtl, pending->value,
+                           sizeof(pending->value));
+      if (!ok) {
+        fprintf(stderr, "Could not parse P2 response.\n");
+      }
+      finishP2RequestLocked(pending, true, ok);
+    }
+
+    session->receiveLength -= responseLength;
+    memmove(session->receiveBuffer, session->receiveBuffer + responseLength,
+            session->receiveLength);
+    p2ScannerReset(&session->scanner);
+  }
+}
+
+/**
+ * Returns true if the oldest request on a session has waited too long for its response.
+ * Call with gSocketLock held.
+ */
+static bool p2SessionTimedOut(const p2_session_t *session, int64_t now) {
+  return session->pendingHead != NULL &&
+         now - session->pendingHead->sendTime > kP2ResponseTimeoutNanos;
+}
+
+/** Runs the callbacks for finished requests, without holding gSocketLock. */
+static void runP2Callbacks(p2_pending_request_t *finished) {
+  p2_pending_request_t *next = NULL;
+  for (p2_pending_request_t *pending = finished; pending; pending = next) {
+    next = pending->next;
+    pending->callback(pending->ok, pending->value, pending->context);
+    free(pending);
+  }
+}
+
+/**
+ * Reads responses for both sessions as they arrive, fails sessions whose responses
+ * don't arrive in time, and runs response callbacks.
+ */
+void *runP2ReaderThread(void *argIgnored) {
+  while (true) {
+    int64_t now = monotonicTimeNanos();
+    p2_session_t *sessions[2] = { &gActiveSession, &gStandbySession };
+    int sockets[2];
+    uint64_t generations[2];
+
+    pthread_mutex_lock(&gSocketLock);
+    if (gP2Stopping) {
+      pthread_mutex_unlock(&gSocketLock);
+      break;
+    }
+    for (int i = 0; i < 2; i++) {
+      if (sessions[i]->socket != -1 && p2SessionTimedOut(sessions[i], now)) {
+        fprintf(stderr, "P2 response timed out.  Closing session.\n");
+        closeP2Session(sessions[i]);
+        pthread_cond_signal(&gSessionCond);
+      }
+      sockets[i] = sessions[i]->socket;
+      generations[i] = sessions[i]->generation;
+    }
+    p2_pending_request_t *finished = gFinishedHead;
+    gFinishedHead = gFinishedTail = NULL;
+    pthread_mutex_unlock(&gSocketLock);
+
+    runP2Callbacks(finished);
+
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    int maxSocket = -1;
+    for (int i = 0; i < 2; i++) {
+      if (sockets[i] != -1) {
+        FD_SET(sockets[i], &read_fds);
+        maxSocket = MAX(maxSocket, sockets[i]);
+      }
+    }
+    struct timeval tv = { 0, kP2ReaderIntervalMicros };
+    if (select(maxSocket + 1, &read_fds, NULL, NULL, &tv) <= 0) {
+      continue;
+    }
+
+    pthread_mutex_lock(&gSocketLock);
+    for (int i = 0; i < 2; i++) {
+      // Skip sessions that were closed (or replaced) while this thread was waiting.
+      if (sockets[i] == -1 || !FD_ISSET(sockets[i], &read_fds) ||
+          sessions[i]->socket != sockets[i] || sessions[i]->generation != generations[i]) {
+        continue;
+      }
+      if (!receiveP2DataLocked(sessions[i])) {
+        closeP2Session(sessions[i]);
+        pthread_cond_signal(&gSessionCond);
+      }
+    }
+    pthread_mutex_unlock(&gSocketLock);
+  }
+  return NULL;
+}
+
+/**
+ * Replaces the active session (if any) with the standby session.  Returns false if there
+ * is no standby session.  Call with gSocketLock held.
+ */
+static bool promoteP2StandbySessionLocked(void) {
+  if (gStandbySession.socket == -1) {
+    return false;
+  }
+  closeP2Session(&gActiveSession);
+  gActiveSession = gStandbySession;
+  gActiveSession.lastRequestTime = monotonicTimeNanos();
+  bzero(&gStandbySession, sizeof(gStandbySession));
+  gStandbySession.socket = -1;
+  fprintf(stderr, "Switched to standby P2 session.\n");
+
+  // Tell the session thread to open a new standby session.
+  pthread_cond_signal(&gSessionCond);
+  return true;
+}
+
+/**
+ * Makes sure that there is an active session, switching to the standby session or (if
+ * there is none) connecting right away.  Returns false if no session could be opened.
+ * Call with gSocketLock held.  The lock is dropped while connecting.
+ */
+static bool ensureP2ActiveSessionLocked(void) {
+  if (gActiveSession.socket != -1 || promoteP2StandbySessionLocked()) {
+    return true;
+  }
+  // Neither session is open yet (at startup, or after losing both), so connect now.
+  // Connecting takes several round trips, so don't block the reader and session
+  // threads while it happens.
+  p2_session_t session;
+  pthread_mutex_unlock(&gSocketLock);
+  bool opened = openP2Session(&session);
+  pthread_mutex_lock(&gSocketLock);
+
+  // Another thread may have filled the slots in the meantime.
+  if (!opened) {
+    return gActiveSession.socket != -1 || promoteP2StandbySessionLocked();
+  }
+  if (gActiveSession.socket == -1) {
+    installP2SessionLocked(&gActiveSession, &session);
+  } else if (gStandbySession.socket == -1) {
+    installP2SessionLocked(&gStandbySession, &session);
+  } else {
+    closeP2Session(&session);
+  }
+  return true;
+}
+
+/** Ignores the response to a keepalive probe.  Failures are handled by the reader. */
+static void discardP2Response(bool ok, const char *value, void *context) {
+}
+
+/**
+ * Sends a keepalive probe on a session if it has been quiet for a while.  If the probe
+ * goes unanswered, the reader thread closes the session.  Call with gSocketLock held.
+ */
+static void probeP2SessionLocked(p2_session_t *session, int64_t now) {
+  if (session->socket == -1 || session->pendingHead != NULL ||
+      now - session->lastActivityTime < kP2KeepaliveIntervalNanos) {
+    return;
   }
+  p2_pending_request_t *pending = calloc(1, sizeof(*pending));
+  pending->callback = discardP2Response;
+  if (queueP2RequestLocked(session, kP2KeepaliveRequest, pending)) {
+    // Don't probe again until this probe is answered.
+    session->lastActivityTime = now;
+  } else {
+    fprintf(stderr, "P2 session failed a keepalive probe.  Closing it.\n");
+    free(pending);
+    closeP2Session(session);
+  }
+}
 
-  requestEnv(authToken, sock);
+/**
+ * Keeps the active and standby sessions healthy: opens sessions that are missing,
+ * probes sessions that have been quiet, and replaces the active session if it has been
+ * idle for longer than the configured limit.
+ */
+void *runP2SessionThread(void *argIgnored) {
+  int64_t maxIdleNanos = getConfigKeyInteger(kP2SessionMaxIdleKey) * NSEC_PER_SEC;
+  int64_t nextConnectTime = 0;
+
+  while (true) {
+    int64_t now = monotonicTimeNanos();
+
+    // Open a session (off the request path) if either slot is empty.
+    pthread_mutex_lock(&gSocketLock);
+    if (gP2Stopping) {
+      pthread_mutex_unlock(&gSocketLock);
+      break;
+    }
+    bool needSession = gActiveSession.socket == -1 || gStandbySession.socket == -1;
+    pthread_mutex_unlock(&gSocketLock);
+    if (needSession && now >= nextConnectTime) {
+      p2_session_t session;
+      if (openP2Session(&session)) {
+        pthread_mutex_lock(&gSocketLock);
+        if (gActiveSession.socket == -1) {
+          installP2SessionLocked(&gActiveSession, &session);
+        } else if (gStandbySession.socket == -1) {
+          installP2SessionLocked(&gStandbySession, &session);
+        } else {
+          closeP2Session(&session);
+        }
+        pthread_mutex_unlock(&gSocketLock);
+      } else {
+        nextConnectTime = now + kP2ReconnectIntervalNanos;
+      }
+      now = monotonicTimeNanos();
+    }
 
-  return sock;
+    pthread_mutex_lock(&gSocketLock);
+    if (maxIdleNanos > 0 && gActiveSession.socket != -1 &&
+        now - gActiveSession.lastRequestTime > maxIdleNanos && gStandbySession.socket != -1) {
+      fprintf(stderr, "P2 session idle too long.  Replacing it.\n");
+      promoteP2StandbySessionLocked();
+    }
+    probeP2SessionLocked(&gActiveSession, now);
+    probeP2SessionLocked(&gStandbySession, now);
+
+    // Sleep until the next check, or until a request fails.
+    struct timespec wakeTime;
+    clock_gettime(CLOCK_MONOTONIC, &wakeTime);
+    int64_t wakeNanos = wakeTime.tv_nsec + kP2SessionThreadIntervalNanos;
+    wakeTime.tv_sec += wakeNanos / NSEC_PER_SEC;
+    wakeTime.tv_nsec = wakeNanos % NSEC_PER_SEC;
+    if (!gP2Stopping) {
+      pthread_cond_timedwait(&gSessionCond, &gSocketLock, &wakeTime);
+    }
+    pthread_mutex_unlock(&gSocketLock);
+  }
+  return NULL;
 }
 
+
+#pragma mark - Helper methods
+
 char *getP2Auth(int sock) {
   char *message = NULL;
   char *user = getenv("PANA_USER");
@@ -580,42 +1229,25 @@ char *getP2Auth(int sock) {
   if (length != strlen(message)) {
     perror("write");
     fprintf(stderr, "Could not write auth message 1; got %" PRId64 "\n", (uint64_t)length);
-    return false;
+    free(message);
+    return NULL;
   }
+  free(message);
 
-  char buf[4097];
-
-  length = syncread(sock, buf, 4096);
-  if (length <= 0) {
+  char buf[4096];
+  p2_xml_scanner_t scanner;
+  if (!readP2Response(sock, buf, sizeof(buf), &scanner)) {
     fprintf(stderr, "Short read.\n");
-    return false;
+    return NULL;
   }
 
-  fprintf(stderr, "Parsing response\n");
-
-  xmlDocPtr doc = xmlReadMemory(buf, length, "response.xml", NULL, 0);
-
   // <P2Control><Response><Realm>...</Realm><Nonce>...</Nonce></Response></P2Control>
-  xmlNode *root_element = xmlDocGetRootElement(doc);
-  xmlNode *response = root_element->children;
-  xmlNode *curnode = response->children;
-  const char *realm = NULL;
-  const char *nonce = NULL;
-
-  while (curnode) {
-    if (!strcmp((const char *)curnode->name, "Realm")) {
-      xmlNode *realmTextNode = curnode->children;
-      if (realmTextNode != NULL) {
-        realm = (const char *)xmlNodeGetContent(realmTextNode);
-      }
-    }
-    if (!strcmp((const char *)curnode->name, "Nonce")) {
-      xmlNode *nonceTextNode = curnode->children;
-      if (nonceTextNode != NULL) {
-        nonce = (const char *)xmlNodeGetContent(nonceTextNode);
-      }
-    }
-    curnode = curnode->next;
+  char realm[P2_MAX_VALUE_SIZE];
+  char nonce[P2_MAX_VALUE_SIZE];
+  if (!p2CopySpan(buf, scanner.realm, realm, sizeof(realm)) || !scanner.realm.present ||
+      !p2CopySpan(buf, scanner.nonce, nonce, sizeof(nonce)) || !scanner.nonce.present) {
+    fprintf(stderr, "Missing realm or nonce in response: %.*s\n", (int)scanner.frameLength, buf);
+    return NULL;
   }
 
   fprintf(stderr, "Realm: \"%s\"\nNonce: \"%s\"\n", realm, nonce);
@@ -634,6 +1266,7 @@ char *getP2Auth(int sock) {
   // unsigned char *MD5(const unsigned char *d, unsigned long n, unsigned char *md);
   uint8_t hash[MD5_DIGEST_LENGTH];
   MD5((const unsigned char *)encryptedPasswordStage1, strlen(encryptedPasswordStage1), hash);
+  free(encryptedPasswordStage1);
 
   char *hashstring = md5_string(hash);
 
@@ -643,6 +1276,7 @@ char *getP2Auth(int sock) {
   fprintf(stderr, "Encryption 2: %s\n", encryptedPasswordStage2);
 
   MD5((const unsigned char *)encryptedPasswordStage2, strlen(encryptedPasswordStage2), hash);
+  free(encryptedPasswordStage2);
 
 #pragma clang diagnostic pop
 
@@ -650,72 +1284,64 @@ char *getP2Auth(int sock) {
 
   fprintf(stderr, "Encryption 3: %s\n", hashstring);
 
-  xmlFreeDoc(doc);
-
   return hashstring;
 }
 
-bool requestEnv(char *authToken, int sock) {
+bool requestEnv(char *authToken, int sock, char **sessionID) {
   char *message = NULL;
   asprintf(&message, "<P2Control><Auth>%s</Auth><Query Type=\"env\"/></P2Control>", authToken);
-  gAuthToken = authToken;
 
   ssize_t length = write(sock, message, strlen(message));
   if (length != strlen(message)) {
     perror("write");
     fprintf(stderr, "Could not write auth message 2; got %" PRId64 "\n", (uint64_t)length);
+    free(message);
     return false;
   }
+  free(message);
 
-  char buf[4097];
-  length = syncread(sock, buf, 4096);
-  if (length <= 0) return false;
-
-  buf[length] = '\0';
-
-  fprintf(stderr, "Environment:\n%s\n", buf);
+  char buf[4096];
+  p2_xml_scanner_t scanner;
+  if (!readP2Response(sock, buf, sizeof(buf), &scanner)) return false;
 
-  free(message);
+  fprintf(stderr, "Environment:\n%.*s\n", (int)scanner.frameLength, buf);
 
   asprintf(&message, "<P2Control><Auth>%s</Auth><SessionID></SessionID><CamCtl>$Connect:=On</CamCtl><CamCtl>$MyName:%s</CamCtl></P2Control>", authToken, P2_APP_NAME);
 
-  fprintf(stderr, "Auth message: %s", message);
+  if (p2_enable_debugging) {
+    fprintf(stderr, "Auth message: <P2Control><Auth>[redacted]</Auth><SessionID></SessionID>"
+            "<CamCtl>$Connect:=On</CamCtl><CamCtl>$MyName:%s</CamCtl></P2Control>\n",
+            P2_APP_NAME);
+  }
 
   length = write(sock, message, strlen(message));
   if (length != strlen(message)) {
     fprintf(stderr, "Could not write auth message 3; got %" PRId64 "\n", (uint64_t)length);
+    free(message);
     return false;
   }
+  free(message);
 
-  length = syncread(sock, buf, 4096);
-  if (length <= 0) {
+  if (!readP2Response(sock, buf, sizeof(buf), &scanner)) {
     fprintf(stderr, "No response from camera.\n");
     return false;
   }
 
+  // <P2Control><CamCtl SessionID="...">$Connect:On</CamCtl></P2Control>
   fprintf(stderr, "Parsing auth message.\n");
-  xmlDocPtr doc = xmlReadMemory(buf, length, "response.xml", NULL, 0);
-
-  xmlNode *root_element = xmlDocGetRootElement(doc);
-  xmlNode *camctl = root_element->children;
-
-  if (strcmp((const char *)camctl->name, "CamCtl")) {
-    fprintf(stderr, "Invalid first tag %s in response\n", (const char *)camctl->name);
-    xmlFreeDoc(doc);
+  if (!scanner.camCtl.present) {
+    fprintf(stderr, "Missing CamCtl tag in response\n");
     return false;
   }
-  for (xmlAttr *attribute = camctl->properties; attribute ; attribute = attribute->next) {
-    if (!strcmp((const char *)attribute->name, "SessionID")) {
-      xmlChar *attributeValue = xmlNodeListGetString(doc, attribute->children, 1);
-      asprintf(&gSessionID, "%s", (const char *)attributeValue);
-      xmlFree(attributeValue);
-    }
+  char sessionIDValue[P2_MAX_VALUE_SIZE];
+  if (scanner.sessionID.present &&
+      p2CopySpan(buf, scanner.sessionID, sessionIDValue, sizeof(sessionIDValue))) {
+    free(*sessionID);
+    asprintf(sessionID, "%s", sessionIDValue);
   }
-  fprintf(stderr, "Session ID: \"%s\"\n", gSessionID);
-  buf[length] = '\0';
-  fprintf(stderr, "Message was: %s\n", buf);
+  fprintf(stderr, "Session ID: \"%s\"\n", *sessionID);
+  fprintf(stderr, "Message was: %.*s\n", (int)scanner.frameLength, buf);
 
-  xmlFreeDoc(doc);
   return true;
 }
 
@@ -728,65 +1354,69 @@ char *md5_string(uint8_t *hashbuf) {
   return buf;
 }
 
-bool sendP2Request(char *request, char **buf) {
-  if (buf == NULL) return false;
+bool sendP2Request(char *request, char *value, size_t valueSize) {
+  if (value == NULL || valueSize == 0) return false;
+  value[0] = '\0';
 
-  static double timestampForCrappyFirmware = 0;
   pthread_mutex_lock(&gSocketLock);
 
-  fprintf(stderr, "sendP2Request point 1\n");
-
-  // 30 second limit
-  fprintf(stderr, "TS: %lf %lf\n", timeStamp(), timestampForCrappyFirmware);
-
-  if (gP2TCPSocket == -1 || (timeStamp() - timestampForCrappyFirmware) > 10) {
-    if (gP2TCPSocket != -1) {
-      fprintf(stderr, "Forcing socket closed (time limit expired).\n");
-      close(gP2TCPSocket);
-      gP2TCPSocket = -1;
+  // If the active session fails, switch to the standby session and try again once.
+  // A response that arrived but could not be parsed is not retried, because the camera
+  // already acted on the request.  Other requests can be sent while this one waits for
+  // its response.
+  bool ok = false;
+  bool received = false;
+  for (int attempt = 0; attempt < 2 && !received; attempt++) {
+    if (!ensureP2ActiveSessionLocked()) {
+      break;
+    }
+    p2_pending_request_t pending;
+    bzero(&pending, sizeof(pending));
+    if (!queueP2RequestLocked(&gActiveSession, request, &pending)) {
+      fprintf(stderr, "P2 session failed.  Closing it.\n");
+      closeP2Session(&gActiveSession);
+      pthread_cond_signal(&gSessionCond);
+      continue;
+    }
+    while (!pending.done) {
+      pthread_cond_wait(&gResponseCond, &gSocketLock);
+    }
+    received = pending.received;
+    ok = pending.ok;
+    if (ok) {
+      snprintf(value, valueSize, "%s", pending.value);
+      gActiveSession.lastRequestTime = monotonicTimeNanos();
     }
-    gP2TCPSocket = openP2Socket();
-    fprintf(stderr, "Set gP2TCPSocket to %d\n", gP2TCPSocket);
-    timestampForCrappyFirmware = timeStamp();
-  }
-
-  char *authToken = gAuthToken; //getP2Auth(gP2TCPSocket);
-  if (authToken == NULL) {
-    fprintf(stderr, "Could not get auth token for sendP2Request\n");
-    return false;
   }
 
-  char *message = NULL;
-  asprintf(&message, "<P2Control><Auth>%s</Auth><SessionID>%s</SessionID>%s</P2Control>", authToken, gSessionID, request);
-
-  fprintf(stderr, "In sendP2Request: %s", message);
-
-  ssize_t expectedSize = strlen(message);
-  ssize_t size = write(gP2TCPSocket, message, expectedSize);
+  pthread_mutex_unlock(&gSocketLock);
+  return ok;
+}
 
-  free(message);
+/**
+ * Sends a request without waiting for the response.  The callback runs on the reader
+ * thread when the response arrives or the session fails.  Returns false (without running
+ * the callback) if the request could not be sent.
+ */
+bool sendP2RequestAsync(char *request, p2_response_callback_t callback, void *context) {
+  p2_pending_request_t *pending = calloc(1, sizeof(*pending));
+  pending->callback = callback;
+  pending->context = context;
 
-  fprintf(stderr, "sendP2Request point 2 %zu %zu\n", size, expectedSize);
+  pthread_mutex_lock(&gSocketLock);
+  bool ok = ensureP2ActiveSessionLocked() && queueP2RequestLocked(&gActiveSession, request, pending);
+  if (ok) {
+    gActiveSession.lastRequestTime = monotonicTimeNanos();
+  } else if (gActiveSession.socket != -1) {
+    closeP2Session(&gActiveSession);
+    pthread_cond_signal(&gSessionCond);
+  }
   pthread_mutex_unlock(&gSocketLock);
 
-  if (size < 0) {
-    return false;
-  }
-  bool retval = true;
-  if (size != expectedSize) {
-    retval = false;
+  if (!ok) {
+    free(pending);
   }
-
-  fprintf(stderr, "In sendP2Request: Waiting for response.\n");
-  char *localBuf = (char *)malloc(4096);
-  ssize_t length = syncread(gP2TCPSocket, localBuf, 4096);
-  *buf = localBuf;
-
-  localBuf[length] = '\0';
-
-  fprintf(stderr, "In sendP2Request: Got response %s\n", localBuf);
-
-  return retval && (length > 0);
+  return ok;
 }
 
 // Helper function that computes the zoom position from a P2 data packet.
@@ -834,10 +1464,10 @@ bool enableZoomPositionupdates(void) {
 }
 
 bool timeToRequestZoomPosition(void) {
-  static double lastUpdateTimestamp = 0;
-  double timestamp = timeStamp();
+  static int64_t lastUpdateTimestamp = 0;
+  int64_t timestamp = monotonicTimeNanos();
 
-  if (timestamp - lastUpdateTimestamp >= 3.0) {
+  if (lastUpdateTimestamp == 0 || NANOS_TO_SECONDS(timestamp - lastUpdateTimestamp) >= 3.0) {
     lastUpdateTimestamp = timestamp;
     return true;
   }
@@ -847,7 +1477,9 @@ bool timeToRequestZoomPosition(void) {
 void updateZoomPositionAndTallyFromP2Data(uint8_t *packetBuffer, size_t packetSize) {
   uint8_t message_type = packetBuffer[0];
   if (message_type == 6) {
-    int64_t expectedPosition = gLastZoomPosition + estimatedPositionsSinceLastPositionData();
+    // The estimate is in linear positions, like the calibration data.
+    int64_t expectedPosition = panaMakeZoomLinear(gLastZoomPosition) +
+                               estimatedPositionsSinceLastPositionData();
     // fprintf(stderr, "Zoom position message type\n");
 
     p2_optical_data_t *optical_data = (p2_optical_data_t *)packetBuffer;
@@ -859,8 +1491,15 @@ void updateZoomPositionAndTallyFromP2Data(uint8_t *packetBuffer, size_t packetSi
     gLastZoomPosition = zoomPositionFromData(optical_data);
     fprintf(stderr, "ZOOM POSITION NOW %lld\n", gLastZoomPosition);
 
+    // p2GetZoomPosition adds the estimator's velocity to a linearized position, so
+    // the estimator must track linear positions, too.
+    int64_t linearZoomPosition = panaMakeZoomLinear(gLastZoomPosition);
+    pthread_mutex_lock(&gSpeedLock);
+    updateAxisEstimator(&gZoomEstimator, linearZoomPosition, monotonicTimeNanos());
+    pthread_mutex_unlock(&gSpeedLock);
+
     fprintf(stderr, "@@@ Zoom position: %" PRId64 " expected %" PRId64 "\n",
-        gLastZoomPosition, expectedPosition);
+        linearZoomPosition, expectedPosition);
 
     freeSpeedChanges();
     pthread_cond_broadcast(&gZoomDataCond);
@@ -906,26 +1545,6 @@ void *runP2UDPThread(void *argIgnored) {
   }
 }
 
-ssize_t syncread(int fd, void *buf, size_t count) {
-  ssize_t len = 0;
-  int retries = 0;
-  while (len <= 0 && retries < 100) {
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(fd, &read_fds);
-
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 10000;  // 0.01 second wakeup
-    int retval = select(fd + 1, &read_fds, NULL, NULL, &tv);
-    if (retval > 0) {
-      len = read(fd, buf, count);
-    }
-    retries++;
-  }
-  return len;
-}
-
 #pragma mark - Position estimation
 
 /*
@@ -956,7 +1575,7 @@ void markSpeedChange(int newSpeed) {
  */
 void markSpeedChangeNoLock(int newSpeed) {
   speed_time_t *newSpeedItem = malloc(sizeof(speed_time_t));
-  newSpeedItem->timestamp = timeStamp();
+  newSpeedItem->timestamp = monotonicTimeNanos();
   newSpeedItem->speed = newSpeed;
   newSpeedItem->next = NULL;
 
@@ -973,16 +1592,28 @@ void markSpeedChangeNoLock(int newSpeed) {
 /*
  * Returns the estimated number of positions moved since the last time we received
  * position data from the camera (half a second).
+ *
+ * If the speed has not changed recently, the estimator's measured velocity is more
+ * accurate than the calibration data, so use that instead.
  */
 int64_t estimatedPositionsSinceLastPositionData(void) {
-  uint64_t timestamp = timeStamp();
+  int64_t timestamp = monotonicTimeNanos();
   pthread_mutex_lock(&gSpeedLock);
 
+  if (gZoomSpeedSteady && gZoomEstimator.initialized && gSpeedHead != NULL &&
+      gSpeedHead->next == NULL && gSpeedHead->speed != 0) {
+    double positions = gZoomEstimator.velocity *
+                       NANOS_TO_SECONDS(timestamp - gZoomEstimator.lastUpdateTime);
+    pthread_mutex_unlock(&gSpeedLock);
+    return positions;
+  }
+
+  // The last entry is the current speed, which has been in effect until now.
   double positions = 0.0;
-  for (speed_time_t *pos = gSpeedHead; pos && pos->next; pos = pos->next) {
-    uint64_t nextTimestamp = (pos->next == NULL) ? timestamp : pos->next->timestamp;
-    uint64_t msec = nextTimestamp - pos->timestamp;
-    positions += (panaZoomPositionsPerSecondAtSpeed(pos->speed) * msec) / 1000000.0;
+  for (speed_time_t *pos = gSpeedHead; pos; pos = pos->next) {
+    int64_t nextTimestamp = (pos->next == NULL) ? timestamp : pos->next->timestamp;
+    double seconds = NANOS_TO_SECONDS(nextTimestamp - pos->timestamp);
+    positions += panaZoomPositionsPerSecondAtSpeed(pos->speed) * seconds;
   }
   pthread_mutex_unlock(&gSpeedLock);
 
@@ -996,47 +1627,373 @@ void freeSpeedChanges(void) {
   speed_time_t *oldHead = gSpeedHead;
   gSpeedHead = NULL;
 
+  // If there was only one entry, the speed did not change since the previous report.
+  gZoomSpeedSteady = (oldHead != NULL && oldHead->next == NULL);
+
   // Create a speed change entry starting from the time when the zoom data became available.
   markSpeedChangeNoLock(gLastZoomSpeed);
 
   pthread_mutex_unlock(&gSpeedLock);
-  for (speed_time_t *pos = oldHead; pos && pos->next; pos = pos->next) {
+  speed_time_t *next = NULL;
+  for (speed_time_t *pos = oldHead; pos; pos = next) {
+    next = pos->next;
     free(pos);
   }
 }
 
 #pragma mark - XML
 
-char *textForResponseElement(char *tag, char *result) {
-  char *resultBuf = NULL;
-  xmlDocPtr doc = NULL;
+/** Returns true if the character can start an XML name. */
+static bool isP2NameStartCharacter(char c) {
+  return isalpha((unsigned char)c) || c == '_' || c == ':';
+}
+
+/** Returns true if the character can appear within an XML name. */
+static bool isP2NameCharacter(char c) {
+  return isalnum((unsigned char)c) || c == '_' || c == ':' || c == '-' || c == '.';
+}
+
+/** Returns true if the character is XML whitespace. */
+static bool isP2Whitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/** Appends a character to a name.  Returns false if the name is too long. */
+static bool appendP2NameCharacter(char *name, size_t *nameLength, char c) {
+  if (*nameLength >= P2_XML_MAX_NAME_LENGTH) {
+    return false;
+  }
+  name[(*nameLength)++] = c;
+  name[*nameLength] = '\0';
+  return true;
+}
 
-  if (result == NULL) goto fail;
-  if (tag == NULL) goto fail;
+/** Records the contents of an element if it is one that this module uses. */
+static void recordP2Element(p2_xml_scanner_t *scanner, const char *name, size_t offset,
+                            size_t length) {
+  p2_span_t *span = NULL;
+  if (!strcmp(name, "CamCtl")) {
+    span = &scanner->camCtl;
+  } else if (!strcmp(name, "Realm")) {
+    span = &scanner->realm;
+  } else if (!strcmp(name, "Nonce")) {
+    span = &scanner->nonce;
+  }
+  if (span != NULL && !span->present) {
+    span->offset = offset;
+    span->length = length;
+    span->present = true;
+  }
+}
 
-  doc = xmlReadMemory(result, strlen(result), "response.xml", NULL, 0);
-  if (doc == NULL) goto fail;
+/**
+ * Opens the element named in scanner->name, whose contents start at contentStart.
+ * Returns false if the response is malformed.
+ */
+static bool openP2Element(p2_xml_scanner_t *scanner, size_t contentStart) {
+  if (scanner->depth == 0 && strcmp(scanner->name, "P2Control")) {
+    return false;
+  }
+  if (scanner->depth >= P2_XML_MAX_DEPTH) {
+    return false;
+  }
+  strcpy(scanner->openNames[scanner->depth], scanner->name);
+  scanner->contentStart[scanner->depth] = contentStart;
+  scanner->depth++;
+  return true;
+}
 
-  xmlNode *root_element = xmlDocGetRootElement(doc);  // P2Control
-  if (root_element == NULL) goto fail;
+/**
+ * Closes the element named in scanner->name, whose contents end where the current tag
+ * starts.  Returns false if the response is malformed.
+ */
+static bool closeP2Element(p2_xml_scanner_t *scanner) {
+  if (scanner->depth == 0 || strcmp(scanner->openNames[scanner->depth - 1], scanner->name)) {
+    return false;
+  }
+  scanner->depth--;
+  size_t contentStart = scanner->contentStart[scanner->depth];
+  recordP2Element(scanner, scanner->name, contentStart, scanner->tagStart - contentStart);
+  return true;
+}
 
-  xmlNode *response = root_element->children;  // Response
-  if (response == NULL) goto fail;
-  xmlNode *startNode = (!strcmp((const char *)response->name, "Response")) ? response->children : response;
+/**
+ * Resets a scanner so that it can scan a new response.
+ */
+void p2ScannerReset(p2_xml_scanner_t *scanner) {
+  bzero(scanner, sizeof(*scanner));
+  scanner->state = kP2ScanText;
+}
+
+/**
+ * Scans the bytes of a response that have not yet been scanned.  The response pointer
+ * must point to the start of the response, and must contain all of the bytes passed in
+ * earlier calls since the last reset, so the results can refer to it by offset.  Returns
+ * kP2ScanComplete once the response's closing tag has been scanned, after which the
+ * scanner must be reset before it is used again.
+ */
+p2_scan_result_t p2ScanResponse(p2_xml_scanner_t *scanner, const char *response, size_t length) {
+  if (scanner->state == kP2ScanFailed) {
+    return kP2ScanMalformed;
+  }
+  bool complete = false;
+  bool ok = true;
+  while (ok && !complete && scanner->position < length) {
+    size_t position = scanner->position++;
+    char c = response[position];
+    switch (scanner->state) {
+      case kP2ScanText:
+        if (c == '<') {
+          scanner->tagStart = position;
+          scanner->state = kP2ScanTagStart;
+        } else if (scanner->depth == 0 && !isP2Whitespace(c)) {
+          ok = false;
+        }
+        break;
+      case kP2ScanTagStart:
+        scanner->nameLength = 0;
+        scanner->name[0] = '\0';
+        if (c == '/') {
+          scanner->state = kP2ScanEndTagName;
+        } else if (c == '?' || c == '!') {
+          scanner->state = kP2ScanSkip;
+        } else if (isP2NameStartCharacter(c)) {
+          ok = appendP2NameCharacter(scanner->name, &scanner->nameLength, c);
+          scanner->state = kP2ScanStartTagName;
+        } else {
+          ok = false;
+        }
+        break;
+      case kP2ScanStartTagName:
+        if (isP2NameCharacter(c)) {
+          ok = appendP2NameCharacter(scanner->name, &scanner->nameLength, c);
+        } else if (isP2Whitespace(c)) {
+          scanner->state = kP2ScanInTag;
+        } else if (c == '>') {
+          ok = openP2Element(scanner, position + 1);
+          scanner->state = kP2ScanText;
+        } else if (c == '/') {
+          scanner->state = kP2ScanEmptyTagEnd;
+        } else {
+          ok = false;
+        }
+        break;
+      case kP2ScanInTag:
+        if (isP2Whitespace(c)) {
+          // Keep going.
+        } else if (c == '>') {
+          ok = openP2Element(scanner, position + 1);
+          scanner->state = kP2ScanText;
+        } else if (c == '/') {
+          scanner->state = kP2ScanEmptyTagEnd;
+        } else if (isP2NameStartCharacter(c)) {
+          scanner->attributeNameLength = 0;
+          ok = appendP2NameCharacter(scanner->attributeName, &scanner->attributeNameLength, c);
+          scanner->state = kP2ScanAttributeName;
+        } else {
+          ok = false;
+        }
+        break;
+      case kP2ScanAttributeName:
+        if (isP2NameCharacter(c)) {
+          ok = appendP2NameCharacter(scanner->attributeName, &scanner->attributeNameLength, c);
+        } else if (isP2Whitespace(c)) {
+          scanner->state = kP2ScanAfterAttributeName;
+        } else if (c == '=') {
+          scanner->state = kP2ScanAttributeValueStart;
+        } else {
+          ok = false;
+        }
+        break;
+      case kP2ScanAfterAttributeName:
+        if (c == '=') {
+          scanner->state = kP2ScanAttributeValueStart;
+        } else if (!isP2Whitespace(c)) {
+          ok = false;
+        }
+        break;
+      case kP2ScanAttributeValueStart:
+        if (c == '"' || c == '\'') {
+          scanner->quote = c;
+          scanner->valueStart = position + 1;
+          scanner->state = kP2ScanAttributeValue;
+        } else if (!isP2Whitespace(c)) {
+          ok = false;
+        }
+        break;
+      case kP2ScanAttributeValue:
+        if (c == scanner->quote) {
+          if (!strcmp(scanner->name, "CamCtl") && !strcmp(scanner->attributeName, "SessionID") &&
+              !scanner->sessionID.present) {
+            scanner->sessionID.offset = scanner->valueStart;
+            scanner->sessionID.length = position - scanner->valueStart;
+            scanner->sessionID.present = true;
+          }
+          scanner->state = kP2ScanInTag;
+        } else if (c == '<') {
+          ok = false;
+        }
+        break;
+      case kP2ScanEmptyTagEnd:
+        if (c == '>') {
+          // An empty element opens and closes at once, with empty contents.
+          ok = openP2Element(scanner, position + 1);
+          if (ok) {
+            scanner->tagStart = position + 1;
+            ok = closeP2Element(scanner);
+            complete = ok && scanner->depth == 0;
+          }
+          scanner->state = kP2ScanText;
+        } else {
+          ok = false;
+        }
+        break;
+      case kP2ScanEndTagName:
+        if (isP2NameCharacter(c)) {
+          ok = appendP2NameCharacter(scanner->name, &scanner->nameLength, c);
+        } else if (isP2Whitespace(c)) {
+          scanner->state = kP2ScanAfterEndTagName;
+        } else if (c == '>') {
+          ok = closeP2Element(scanner);
+          complete = ok && scanner->depth == 0;
+          scanner->state = kP2ScanText;
+        } else {
+          ok = false;
+        }
+        break;
+      case kP2ScanAfterEndTagName:
+        if (c == '>') {
+          ok = closeP2Element(scanner);
+          complete = ok && scanner->depth == 0;
+          scanner->state = kP2ScanText;
+        } else if (!isP2Whitespace(c)) {
+          ok = false;
+        }
+        break;
+      case kP2ScanSkip:
+        if (position == scanner->tagStart + 3 &&
+            !strncmp(response + scanner->tagStart, "<!--", 4)) {
+          // Comments can contain '>', so they end only at "-->".
+          scanner->state = kP2ScanComment;
+        } else if (c == '>') {
+          scanner->state = kP2ScanText;
+        }
+        break;
+      case kP2ScanComment:
+        // The "--" must not overlap the "<!--", so "<!-->" doesn't end the comment.
+        if (c == '>' && position >= scanner->tagStart + 6 && response[position - 1] == '-' &&
+            response[position - 2] == '-') {
+          scanner->state = kP2ScanText;
+        }
+        break;
+      case kP2ScanFailed:
+        ok = false;
+        break;
+    }
+  }
+  if (!ok) {
+    scanner->state = kP2ScanFailed;
+    return kP2ScanMalformed;
+  }
+  if (complete) {
+    scanner->frameLength = scanner->position;
+    return kP2ScanComplete;
+  }
+  return kP2ScanIncomplete;
+}
 
-  for (xmlNode *curnode = startNode; curnode; curnode = curnode->next) {
-    if (!strcmp((const char *)curnode->name, tag)) {
-      asprintf(&resultBuf, "%s", (const char *)xmlNodeGetContent(curnode));
-      xmlFreeDoc(doc);
-      return resultBuf;
+/**
+ * Copies an item from a response into a buffer as a C string, decoding the predefined
+ * XML entities.  A missing item produces an empty string.  Returns false (leaving a
+ * truncated string) if the item does not fit.
+ */
+bool p2CopySpan(const char *response, p2_span_t span, char *buffer, size_t bufferSize) {
+  static const struct {
+    const char *entity;
+    char character;
+  } entities[] = {
+    { "&lt;", '<' }, { "&gt;", '>' }, { "&amp;", '&' }, { "&quot;", '"' }, { "&apos;", '\'' },
+  };
+
+  if (bufferSize == 0) {
+    return false;
+  }
+  size_t length = 0;
+  const char *source = response + span.offset;
+  const char *end = source + (span.present ? span.length : 0);
+  while (source < end) {
+    char c = *source++;
+    if (c == '&') {
+      for (size_t i = 0; i < sizeof(entities) / sizeof(entities[0]); i++) {
+        size_t entityLength = strlen(entities[i].entity);
+        if (end - source + 1 >= entityLength &&
+            !strncmp(source - 1, entities[i].entity, entityLength)) {
+          c = entities[i].character;
+          source += entityLength - 1;
+          break;
+        }
+      }
+    }
+    if (length + 1 >= bufferSize) {
+      buffer[length] = '\0';
+      return false;
     }
+    buffer[length++] = c;
   }
-fail:
-  asprintf(&resultBuf, "");
-  if (doc != NULL) {
-    xmlFreeDoc(doc);
+  buffer[length] = '\0';
+  return true;
+}
+
+/**
+ * Reads one complete response from a socket that is not yet owned by the reader thread
+ * (during the login handshake).  Returns false if the response does not arrive within
+ * the response timeout, does not fit, or is malformed.
+ */
+bool readP2Response(int sock, char *buffer, size_t bufferSize, p2_xml_scanner_t *scanner) {
+  p2ScannerReset(scanner);
+  int64_t deadline = monotonicTimeNanos() + kP2ResponseTimeoutNanos;
+  size_t length = 0;
+  while (length < bufferSize) {
+    int64_t remaining = deadline - monotonicTimeNanos();
+    if (remaining <= 0) {
+      fprintf(stderr, "Timed out waiting for P2 response.\n");
+      return false;
+    }
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(sock, &readSet);
+    struct timeval timeout = {
+      .tv_sec = remaining / NSEC_PER_SEC,
+      .tv_usec = (remaining % NSEC_PER_SEC) / 1000
+    };
+    int result = select(sock + 1, &readSet, NULL, NULL, &timeout);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      continue;
+    }
+    ssize_t bytesRead = recv(sock, buffer + length, bufferSize - length, 0);
+    if (bytesRead <= 0) {
+      if (bytesRead < 0 && errno == EINTR) {
+        continue;
+      }
+      perror("recv");
+      return false;
+    }
+    length += bytesRead;
+
+    p2_scan_result_t scanResult = p2ScanResponse(scanner, buffer, length);
+    if (scanResult == kP2ScanComplete) {
+      return true;
+    }
+    if (scanResult == kP2ScanMalformed) {
+      fprintf(stderr, "Malformed P2 response: %.*s\n", (int)length, buffer);
+      return false;
+    }
   }
-  return resultBuf;
+  fprintf(stderr, "P2 response too large.\n");
+  return false;
 }
 
 // Public function.  Docs in header. 
@@ -1052,8 +2009,180 @@ int64_t panaZoomPositionsPerSecondAtSpeed(int speed) {
 
 #pragma mark - Tests
 
+/** Returns the result of scanning a response in a single pass. */
+static p2_scan_result_t scanWholeP2Response(const char *response, size_t length,
+                                            p2_xml_scanner_t *scanner) {
+  p2ScannerReset(scanner);
+  return p2ScanResponse(scanner, response, length);
+}
+
+/** Returns true if two spans are the same. */
+static bool p2SpansEqual(p2_span_t a, p2_span_t b) {
+  return a.present == b.present && (!a.present || (a.offset == b.offset && a.length == b.length));
+}
+
+/** Returns true if a span lies within the first length bytes of a response. */
+static bool p2SpanInBounds(p2_span_t span, size_t length) {
+  return !span.present || (span.offset <= length && span.length <= length - span.offset);
+}
+
+/** Returns a pseudorandom number, so the fuzz test is repeatable. */
+static uint32_t p2TestRandom(uint32_t *seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 16) & 0x7fff;
+}
+
 /** Runs some basic tests of miscellaneous routines. */
 void runP2Tests(void) {
+  const char *validResponses[] = {
+    "<P2Control><Response><Realm>AW-UE150</Realm><Nonce>0123abcd</Nonce></Response></P2Control>",
+    "<P2Control><CamCtl SessionID=\"42\">$Connect:On</CamCtl></P2Control>",
+    "<P2Control><Response><CamCtl>$ZmSpd:i-8,8</CamCtl></Response></P2Control>",
+    "<?xml version=\"1.0\"?>\r\n<P2Control>\n  <Response>\n    <CamCtl/>\n  </Response>\n</P2Control >",
+    "<P2Control><Response><CamCtl>a &lt;&amp;&gt; b</CamCtl></Response></P2Control>",
+    "<P2Control><Env Type='env' Model=\"AW\"><Item/></Env></P2Control>",
+    "<P2Control/>",
+    "<P2Control><!-- a > b <CamCtl>x</CamCtl> --><!---->"
+        "<Response><CamCtl>$Ok</CamCtl></Response></P2Control>",
+  };
+  const char *malformedResponses[] = {
+    "<Other></Other>",
+    "junk<P2Control></P2Control>",
+    "<P2Control><CamCtl></Response></P2Control>",
+    "<P2Control><CamCtl SessionID=42></CamCtl></P2Control>",
+    "<P2Control><ThisNameIsFarTooLong></ThisNameIsFarTooLong></P2Control>",
+    "<P2Control><a><b><c><d><e><f><g><h></h></g></f></e></d></c></b></a></P2Control>",
+    "<P2Control></P2Control x>",
+    "<P2Control><1CamCtl></1CamCtl></P2Control>",
+    "<P2Control><CamCtl Id=\"<\"></CamCtl></P2Control>",
+  };
+  p2_xml_scanner_t scanner;
+  char value[P2_MAX_VALUE_SIZE];
+
+  // Extraction of the items that this module uses.
+  const char *response = validResponses[0];
+  assert(scanWholeP2Response(response, strlen(response), &scanner) == kP2ScanComplete);
+  assert(scanner.frameLength == strlen(response));
+  assert(p2CopySpan(response, scanner.realm, value, sizeof(value)) && !strcmp(value, "AW-UE150"));
+  assert(p2CopySpan(response, scanner.nonce, value, sizeof(value)) && !strcmp(value, "0123abcd"));
+  assert(!scanner.camCtl.present && !scanner.sessionID.present);
+
+  response = validResponses[1];
+  assert(scanWholeP2Response(response, strlen(response), &scanner) == kP2ScanComplete);
+  assert(p2CopySpan(response, scanner.sessionID, value, sizeof(value)) && !strcmp(value, "42"));
+  assert(p2CopySpan(response, scanner.camCtl, value, sizeof(value)) &&
+         !strcmp(value, "$Connect:On"));
+
+  response = validResponses[2];
+  assert(scanWholeP2Response(response, strlen(response), &scanner) == kP2ScanComplete);
+  assert(p2CopySpan(response, scanner.camCtl, value, sizeof(value)) &&
+         !strcmp(value, "$ZmSpd:i-8,8"));
+
+  response = validResponses[3];
+  assert(scanWholeP2Response(response, strlen(response), &scanner) == kP2ScanComplete);
+  assert(scanner.camCtl.present && scanner.camCtl.length == 0);
+  assert(p2CopySpan(response, scanner.camCtl, value, sizeof(value)) && !strcmp(value, ""));
+
+  response = validResponses[4];
+  assert(scanWholeP2Response(response, strlen(response), &scanner) == kP2ScanComplete);
+  assert(p2CopySpan(response, scanner.camCtl, value, sizeof(value)) && !strcmp(value, "a <&> b"));
+  assert(!p2CopySpan(response, scanner.camCtl, value, 4) && !strcmp(value, "a <"));
+
+  // A '>' (or a tag) inside a comment doesn't end the comment.
+  response = validResponses[7];
+  assert(scanWholeP2Response(response, strlen(response), &scanner) == kP2ScanComplete);
+  assert(scanner.frameLength == strlen(response));
+  assert(p2CopySpan(response, scanner.camCtl, value, sizeof(value)) && !strcmp(value, "$Ok"));
+  response = "<P2Control><!--> <CamCtl>x</CamCtl> --></P2Control>";
+  assert(scanWholeP2Response(response, strlen(response), &scanner) == kP2ScanComplete);
+  assert(!scanner.camCtl.present);
+
+  // Responses that arrive back to back are framed one at a time.
+  char pair[256];
+  snprintf(pair, sizeof(pair), "%s%s", validResponses[2], validResponses[1]);
+  assert(scanWholeP2Response(pair, strlen(pair), &scanner) == kP2ScanComplete);
+  assert(scanner.frameLength == strlen(validResponses[2]));
+
+  // Any split across reads produces the same results as a single read.
+  for (int i = 0; i < sizeof(validResponses) / sizeof(validResponses[0]); i++) {
+    response = validResponses[i];
+    size_t length = strlen(response);
+    p2_xml_scanner_t whole;
+    assert(scanWholeP2Response(response, length, &whole) == kP2ScanComplete);
+    for (size_t split = 0; split < length; split++) {
+      p2ScannerReset(&scanner);
+      assert(p2ScanResponse(&scanner, response, split) == kP2ScanIncomplete);
+      assert(p2ScanResponse(&scanner, response, length) == kP2ScanComplete);
+      assert(scanner.frameLength == whole.frameLength);
+      assert(p2SpansEqual(scanner.camCtl, whole.camCtl));
+      assert(p2SpansEqual(scanner.sessionID, whole.sessionID));
+      assert(p2SpansEqual(scanner.realm, whole.realm));
+      assert(p2SpansEqual(scanner.nonce, whole.nonce));
+    }
+  }
+
+  for (int i = 0; i < sizeof(malformedResponses) / sizeof(malformedResponses[0]); i++) {
+    response = malformedResponses[i];
+    assert(scanWholeP2Response(response, strlen(response), &scanner) == kP2ScanMalformed);
+    assert(p2ScanResponse(&scanner, response, strlen(response)) == kP2ScanMalformed);
+  }
+
+  // Fuzz the scanner with mutated responses fed in random pieces.  It must never read or
+  // report anything outside the data it was given.
+  const char *alphabet = "<>/?!=\"' \n&;PCamtl2";
+  uint32_t seed = 2024;
+  for (int iteration = 0; iteration < 2000; iteration++) {
+    char buffer[256];
+    response = validResponses[p2TestRandom(&seed) % (sizeof(validResponses) / sizeof(validResponses[0]))];
+    size_t length = strlen(response);
+    memcpy(buffer, response, length);
+    int mutations = 1 + p2TestRandom(&seed) % 4;
+    for (int i = 0; i < mutations && length > 1; i++) {
+      size_t position = p2TestRandom(&seed) % length;
+      switch (p2TestRandom(&seed) % 4) {
+        case 0:
+          buffer[position] = alphabet[p2TestRandom(&seed) % strlen(alphabet)];
+          break;
+        case 1:
+          buffer[position] = (char)(p2TestRandom(&seed) & 0xff);
+          break;
+        case 2:
+          memmove(buffer + position, buffer + position + 1, length - position - 1);
+          length--;
+          break;
+        case 3:
+          if (length < sizeof(buffer)) {
+            memmove(buffer + position + 1, buffer + position, length - position);
+            buffer[position] = alphabet[p2TestRandom(&seed) % strlen(alphabet)];
+            length++;
+          }
+          break;
+      }
+    }
+
+    p2_xml_scanner_t whole;
+    p2_scan_result_t wholeResult = scanWholeP2Response(buffer, length, &whole);
+
+    p2ScannerReset(&scanner);
+    p2_scan_result_t result = kP2ScanIncomplete;
+    size_t available = 0;
+    while (result == kP2ScanIncomplete && available < length) {
+      size_t step = 1 + p2TestRandom(&seed) % 16;
+      available = MIN(length, available + step);
+      result = p2ScanResponse(&scanner, buffer, available);
+    }
+    assert(result == wholeResult);
+    if (result == kP2ScanComplete) {
+      assert(scanner.frameLength == whole.frameLength && scanner.frameLength <= length);
+      assert(p2SpanInBounds(scanner.camCtl, scanner.frameLength));
+      assert(p2SpanInBounds(scanner.sessionID, scanner.frameLength));
+      assert(p2SpanInBounds(scanner.realm, scanner.frameLength));
+      assert(p2SpanInBounds(scanner.nonce, scanner.frameLength));
+      char small[8];
+      p2CopySpan(buffer, scanner.camCtl, small, sizeof(small));
+      assert(strlen(small) < sizeof(small));
+    }
+  }
 }
 
 #endif  // USE_PANASONIC_PTZ && ENABLE_P2_MODE
@@ -50,7 +50,7 @@ static const char *kZoomOutInternalLimitKey = "zoom_out_internal_limit";
 /** A motor/zoom position at a given time. */
 typedef struct {
   int64_t position;
-  double timeStamp;
+  int64_t timeStamp;  // Monotonic time in nanoseconds.
 } timed_position_t;
 
 
@@ -64,6 +64,12 @@ void waitForZoomStop(timed_position_t **dataPointsOut, int *dataPointCountOut);
 /** The zoom calibration data in raw form (positions per second for each speed). */
 int64_t *sharedCalibrationData = NULL;
 
+#if !PANASONIC_PTZ_ZOOM_ONLY
+  /** The pan and tilt calibration data (defined in panasonicptz.c).  NULL if not calibrated. */
+  extern int64_t *pana_pan_data;
+  extern int64_t *pana_tilt_data;
+#endif
+
 #pragma mark - Functions
 
 void panasonicSharedInit(int64_t **calibrationDataBuffer, int *maxSpeed) {
@@ -100,6 +106,28 @@ int64_t panaMakeZoomLinear(int64_t zoomPosition) {
   return retval;
 }
 
+// The reverse of panaMakeZoomLinear(): returns the hardware zoom value whose
+// linearized value is the closest one at or below the specified position.
+int64_t panaMakeZoomRaw(int64_t linearPosition) {
+  if (zoom_position_map_count == 0) {
+    return linearPosition;
+  }
+  int64_t minZoom = getConfigKeyInteger(kZoomOutInternalLimitKey);
+
+  // The map only ever increases, so a binary search works.
+  int low = 0;
+  int high = zoom_position_map_count - 1;
+  while (low < high) {
+    int middle = (low + high + 1) / 2;
+    if (zoom_position_map[middle] <= linearPosition) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return minZoom + low;
+}
+
 void populateZoomNonlinearityTable(void) {
   bool localDebug = true || pana_enable_debugging;
   int64_t minZoom = getConfigKeyInteger(kZoomOutInternalLimitKey);
@@ -282,7 +310,8 @@ void panaModuleCalibrate(void) {
   fprintf(stderr, "Done determining endpoints.\n");
 
   int64_t *zoomCalibrationData = calibrationDataForMoveAlongAxis(
-      axis_identifier_zoom, maximumZoom, minimumZoom, ZOOM_MIN_HARDWARE, ZOOM_SCALE_HARDWARE, true);
+      axis_identifier_zoom, maximumZoom, minimumZoom, ZOOM_MIN_HARDWARE, ZOOM_SCALE_HARDWARE, true,
+      NULL);
 
   writeCalibrationDataForAxis(axis_identifier_zoom, zoomCalibrationData, ZOOM_SCALE_HARDWARE);
 }
@@ -301,7 +330,7 @@ void waitForZoomStop(timed_position_t **dataPointsOut, int *dataPointCountOut) {
 
   if (dataPointsOut != NULL) {
     dataPoints[0].position = lastPosition;
-    dataPoints[0].timeStamp = timeStamp();
+    dataPoints[0].timeStamp = monotonicTimeNanos();
   }
 
   if (localDebug) {
@@ -325,7 +354,7 @@ void waitForZoomStop(timed_position_t **dataPointsOut, int *dataPointCountOut) {
       if (dataPointsOut != NULL) {
         dataPoints = realloc(dataPoints, dataPointCount * sizeof(timed_position_t));
         dataPoints[dataPointCount - 1].position = currentPosition;
-        dataPoints[dataPointCount - 1].timeStamp = timeStamp();
+        dataPoints[dataPointCount - 1].timeStamp = monotonicTimeNanos();
       }
     }
     lastPosition = currentPosition;
@@ -343,7 +372,7 @@ void printZoomNonlinearityComputation(timed_position_t *positionArray, int count
   fprintf(stderr, "NLC\n");
   for (int i = 0 ; i < count; i++) {
     fprintf(stderr, "%d\t%lf\t%lld\n", i,
-            positionArray[i].timeStamp - positionArray[0].timeStamp,
+            NANOS_TO_SECONDS(positionArray[i].timeStamp - positionArray[0].timeStamp),
             positionArray[i].position);
   }
 }
@@ -382,7 +411,7 @@ int64_t panaMinimumZoomPositionsPerSecond(void) {
 // Returns the number of pan positions per second at the camera's fastest speed.
 int64_t panaMaximumPanPositionsPerSecond(void) {
   #if !PANASONIC_PTZ_ZOOM_ONLY
-    return pana_pan_data[PAN_TILT_SCALE_HARDWARE];
+    return (pana_pan_data == NULL) ? 0 : pana_pan_data[PAN_TILT_SCALE_HARDWARE];
   #else
     return 0;
   #endif
@@ -393,7 +422,7 @@ int64_t panaMaximumPanPositionsPerSecond(void) {
 // Returns the number of tilt positions per second at the camera's fastest speed.
 int64_t panaMaximumTiltPositionsPerSecond(void) {
   #if !PANASONIC_PTZ_ZOOM_ONLY
-    return pana_tilt_data[PAN_TILT_SCALE_HARDWARE];
+    return (pana_tilt_data == NULL) ? 0 : pana_tilt_data[PAN_TILT_SCALE_HARDWARE];
   #else
     return 0;
   #endif
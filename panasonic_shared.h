@@ -5,6 +5,7 @@ extern bool pana_enable_debugging;
 
 void populateZoomNonlinearityTable(void);
 int64_t panaMakeZoomLinear(int64_t zoomPosition);
+int64_t panaMakeZoomRaw(int64_t linearPosition);
 uint64_t scaleLinearZoomToRawZoom(uint64_t linearZoom);
 
 /** Initializes the shared code. */
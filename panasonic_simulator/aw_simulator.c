@@ -0,0 +1,674 @@
+// A self-contained simulator for a Panasonic camera's AW-CGI interface.  Unlike the
+// aw_ptz and aw_cam CGI programs, this needs no web server and keeps all of its state
+// in memory, so integration tests and benchmarks of the HTTP path can run on any box.
+//
+// Usage: aw_simulator [-p port] [-l latency_ms] [-j jitter_ms] [-f failure_percent]
+//                     [-s random_seed] [-v]
+//
+// Then point the daemon at it with:  viscaptz --setcameraip 127.0.0.1:<port>
+
+#define _GNU_SOURCE  // For memmem and strcasestr.
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../motorsim.h"
+
+#define SIM_REQUEST_BUFFER_SIZE 4096
+#define SIM_COMMAND_BUFFER_SIZE 64
+#define SIM_RESPONSE_BUFFER_SIZE 64
+#define SIM_NUM_PRESETS 100
+
+/** The hardware scale for pan, tilt, and zoom speeds (#PTS and #Z send 50 +/- 49). */
+#define SIM_SPEED_SCALE 49
+
+/** The fastest speed that #APS accepts. */
+static const int kSimMaxPositionSpeed = 0x1D;
+
+/** How long an absolute move should take to cover its remaining distance, in seconds. */
+static const double kSimApproachSeconds = 0.1;
+
+/**
+ * The longest idle interval that the simulator replays.  Every move ends at a limit or a
+ * target well before this, so there is no reason to step through hours of idle time.
+ */
+static const int64_t kSimMaxCatchUpNanos = 10 * NSEC_PER_SEC;
+
+/** The length of one simulation step, in nanoseconds. */
+static const int64_t kSimStepNanos = 1000000;
+
+/** The range of positions for each axis (roughly that of an AW-UE150). */
+static const int64_t kSimMinimumPosition[NUM_AXES] = { 0x2D09, 0x5555, 0x555 };
+static const int64_t kSimMaximumPosition[NUM_AXES] = { 0xD2F6, 0x8E38, 0xFFF };
+static const int64_t kSimStartPosition[NUM_AXES] = { 0x8000, 0x8000, 0x555 };
+
+
+#pragma mark - Options
+
+/** The ways that an injected failure can break a request. */
+typedef enum {
+  kSimFailureDropConnection = 0,  //! Close the connection without responding.
+  kSimFailureServerError = 1,     //! Respond with HTTP status 500.
+  kSimFailureCameraBusy = 2,      //! Respond with the camera's "busy" error (eR2).
+  kNumSimFailureModes = 3
+} sim_failure_mode_t;
+
+typedef struct {
+  int port;                //! The localhost port to listen on.
+  int latencyMillis;       //! The minimum delay before each response.
+  int jitterMillis;        //! The maximum random delay added to the latency.
+  int failurePercent;      //! The percentage of requests that fail.
+  unsigned int seed;       //! The seed for the latency jitter and injected failures.
+  bool verbose;            //! If true, logs every request.
+} sim_options_t;
+
+static sim_options_t g_options = { 8080, 0, 0, 0, 1, false };
+
+
+#pragma mark - Camera model
+
+/** The camera's state.  Guarded by lock. */
+typedef struct {
+  pthread_mutex_t lock;
+  motor_sim_axis_t axes[NUM_AXES];
+  double steadyStateSpeeds[NUM_AXES][SIM_SPEED_SCALE + 1];  //! By hardware speed (0 to 49).
+  bool hasTarget[NUM_AXES];         //! True while the camera performs an absolute move.
+  double target[NUM_AXES];          //! The target position of an absolute move.
+  int targetSpeedLimit[NUM_AXES];   //! The fastest hardware speed for the absolute move.
+  int64_t lastUpdateTime;           //! When the axes were last stepped.
+  bool tallyRed;
+  bool tallyGreen;
+  bool presetValid[SIM_NUM_PRESETS];
+  int64_t presetPosition[SIM_NUM_PRESETS][NUM_AXES];
+} sim_camera_t;
+
+static sim_camera_t g_camera;
+
+/** Returns the current time in nanoseconds from an arbitrary starting point. */
+static int64_t simTimeNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec;
+}
+
+/** Puts the camera at rest in its starting position with the tally lights off. */
+static void simInitCamera(sim_camera_t *camera, int64_t now) {
+  bzero(camera, sizeof(*camera));
+  pthread_mutex_init(&camera->lock, NULL);
+  for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+    // The camera's own servo loop hides the deadband and gear slack of its motors.
+    motor_sim_params_t params;
+    motorSimDefaultParams(&params, axis);
+    params.hardwareScale = SIM_SPEED_SCALE;
+    params.deadband = 0;
+    params.backlash = 0;
+    motorSimInitAxis(&camera->axes[axis], &params, kSimStartPosition[axis]);
+    for (int speed = 0; speed <= SIM_SPEED_SCALE; speed++) {
+      camera->steadyStateSpeeds[axis][speed] = motorSimSteadyStateSpeed(&params, speed);
+    }
+  }
+  camera->lastUpdateTime = now;
+}
+
+/** Starts an absolute move of one axis at up to the specified hardware speed. */
+static void simSetTarget(sim_camera_t *camera, axis_identifier_t axis, int64_t position,
+                         int speedLimit) {
+  camera->hasTarget[axis] = true;
+  camera->target[axis] = MAX(kSimMinimumPosition[axis], MIN(kSimMaximumPosition[axis], position));
+  camera->targetSpeedLimit[axis] = MAX(1, MIN(SIM_SPEED_SCALE, speedLimit));
+}
+
+/** Starts a speed-based move of one axis, cancelling any absolute move. */
+static void simSetSpeed(sim_camera_t *camera, axis_identifier_t axis, int speed) {
+  camera->hasTarget[axis] = false;
+  motorSimSetSpeed(&camera->axes[axis], speed);
+}
+
+/** Stops an axis instantly at the specified position. */
+static void simStopAxisAt(motor_sim_axis_t *axis, double position) {
+  axis->motorPosition = position;
+  axis->loadPosition = position;
+  axis->velocity = 0;
+  axis->commandedSpeed = 0;
+}
+
+/**
+ * Returns the slowest hardware speed (up to the move's speed limit) that covers the
+ * remaining distance of an absolute move in about kSimApproachSeconds, so that the
+ * axis slows down smoothly as it nears its target.
+ */
+static int simApproachSpeed(const sim_camera_t *camera, axis_identifier_t axis,
+                            double distance) {
+  double desiredSpeed = fabs(distance) / kSimApproachSeconds;
+  int speed = 1;
+  while (speed < camera->targetSpeedLimit[axis] &&
+         camera->steadyStateSpeeds[axis][speed] < desiredSpeed) {
+    speed++;
+  }
+  return (distance < 0) ? -speed : speed;
+}
+
+/** Advances one axis by one simulation step. */
+static void simStepAxis(sim_camera_t *camera, axis_identifier_t axis) {
+  motor_sim_axis_t *simAxis = &camera->axes[axis];
+  if (!camera->hasTarget[axis] && simAxis->commandedSpeed == 0 && simAxis->velocity == 0) {
+    return;
+  }
+  double distanceBefore = camera->target[axis] - simAxis->loadPosition;
+  if (camera->hasTarget[axis]) {
+    motorSimSetSpeed(simAxis, simApproachSpeed(camera, axis, distanceBefore));
+  }
+  motorSimStep(simAxis, kSimStepNanos);
+
+  if (camera->hasTarget[axis]) {
+    // Arrive exactly, rather than creeping up on the last fraction of a position.
+    double distanceAfter = camera->target[axis] - simAxis->loadPosition;
+    if (fabs(distanceAfter) < 0.5 || (distanceAfter < 0) != (distanceBefore < 0)) {
+      simStopAxisAt(simAxis, camera->target[axis]);
+      camera->hasTarget[axis] = false;
+    }
+  }
+  if (simAxis->loadPosition < kSimMinimumPosition[axis]) {
+    simStopAxisAt(simAxis, kSimMinimumPosition[axis]);
+  } else if (simAxis->loadPosition > kSimMaximumPosition[axis]) {
+    simStopAxisAt(simAxis, kSimMaximumPosition[axis]);
+  }
+}
+
+/** Advances the camera's axes to the specified time.  Call with the lock held. */
+static void simUpdateCamera(sim_camera_t *camera, int64_t now) {
+  int64_t elapsed = MIN(now - camera->lastUpdateTime, kSimMaxCatchUpNanos);
+  for (; elapsed >= kSimStepNanos; elapsed -= kSimStepNanos) {
+    for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+      simStepAxis(camera, axis);
+    }
+  }
+  // Keep any partial step for next time.
+  camera->lastUpdateTime = now - elapsed;
+}
+
+/** Returns the position that the camera currently reports for an axis. */
+static int64_t simPosition(const sim_camera_t *camera, axis_identifier_t axis) {
+  return motorSimEncoderPosition(&camera->axes[axis]);
+}
+
+
+#pragma mark - Commands
+
+/**
+ * Reads exactly the specified number of digits in the specified base (10 or 16) and
+ * advances the cursor past them.  Returns false if the digits are missing or invalid.
+ */
+static bool simParseField(const char **cursor, int digits, int base, int *value) {
+  char field[9];
+  if (digits >= (int)sizeof(field)) {
+    return false;
+  }
+  for (int i = 0; i < digits; i++) {
+    char digit = (*cursor)[i];
+    if (!((base == 16) ? isxdigit(digit) : isdigit(digit))) {
+      return false;
+    }
+    field[i] = digit;
+  }
+  field[digits] = '\0';
+  *value = (int)strtol(field, NULL, base);
+  *cursor += digits;
+  return true;
+}
+
+/**
+ * Handles a command sent to the aw_ptz CGI (pan, tilt, zoom, and presets).  Returns the
+ * camera's response in the provided buffer.  Call with the lock held.
+ */
+static void simHandlePTZCommand(sim_camera_t *camera, const char *command, char *response,
+                                size_t responseSize) {
+  const char *arguments = NULL;
+  int values[4] = { 0 };
+
+  if (!strcmp(command, "#GZ")) {
+    snprintf(response, responseSize, "gz%03X", (int)simPosition(camera, axis_identifier_zoom));
+  } else if (!strcmp(command, "#APC")) {
+    snprintf(response, responseSize, "aPC%04X%04X", (int)simPosition(camera, axis_identifier_pan),
+             (int)simPosition(camera, axis_identifier_tilt));
+  } else if (!strncmp(command, "#AXZ", 4)) {
+    arguments = command + 4;
+    if (!simParseField(&arguments, 3, 16, &values[0]) || *arguments ||
+        values[0] < kSimMinimumPosition[axis_identifier_zoom] ||
+        values[0] > kSimMaximumPosition[axis_identifier_zoom]) {
+      snprintf(response, responseSize, "eR3");
+      return;
+    }
+    simSetTarget(camera, axis_identifier_zoom, values[0], SIM_SPEED_SCALE);
+    snprintf(response, responseSize, "axz%03X", values[0]);
+  } else if (!strncmp(command, "#APS", 4)) {
+    // Pan, tilt, speed, and speed table.  The speed table only changes acceleration on
+    // a real camera, so it is ignored here.
+    arguments = command + 4;
+    if (!simParseField(&arguments, 4, 16, &values[0]) ||
+        !simParseField(&arguments, 4, 16, &values[1]) ||
+        !simParseField(&arguments, 2, 16, &values[2]) ||
+        !simParseField(&arguments, 1, 16, &values[3]) || *arguments ||
+        values[2] < 1 || values[2] > kSimMaxPositionSpeed || values[3] > 2) {
+      snprintf(response, responseSize, "eR3");
+      return;
+    }
+    int speedLimit = (values[2] * SIM_SPEED_SCALE) / kSimMaxPositionSpeed;
+    simSetTarget(camera, axis_identifier_pan, values[0], speedLimit);
+    simSetTarget(camera, axis_identifier_tilt, values[1], speedLimit);
+    snprintf(response, responseSize, "aPS%s", command + 4);
+  } else if (!strncmp(command, "#PTS", 4)) {
+    arguments = command + 4;
+    if (!simParseField(&arguments, 2, 10, &values[0]) ||
+        !simParseField(&arguments, 2, 10, &values[1]) || *arguments ||
+        values[0] < 1 || values[1] < 1) {
+      snprintf(response, responseSize, "eR3");
+      return;
+    }
+    simSetSpeed(camera, axis_identifier_pan, values[0] - 50);
+    simSetSpeed(camera, axis_identifier_tilt, values[1] - 50);
+    snprintf(response, responseSize, "pTS%02d%02d", values[0], values[1]);
+  } else if (!strncmp(command, "#Z", 2)) {
+    arguments = command + 2;
+    if (!simParseField(&arguments, 2, 10, &values[0]) || *arguments || values[0] < 1) {
+      snprintf(response, responseSize, "eR3");
+      return;
+    }
+    simSetSpeed(camera, axis_identifier_zoom, values[0] - 50);
+    snprintf(response, responseSize, "zS%02d", values[0]);
+  } else if (!strncmp(command, "#M", 2) || !strncmp(command, "#R", 2)) {
+    arguments = command + 2;
+    if (!simParseField(&arguments, 2, 10, &values[0]) || *arguments) {
+      snprintf(response, responseSize, "eR3");
+      return;
+    }
+    int preset = values[0];
+    if (command[1] == 'M') {
+      for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+        camera->presetPosition[preset][axis] = simPosition(camera, axis);
+      }
+      camera->presetValid[preset] = true;
+    } else if (camera->presetValid[preset]) {
+      for (axis_identifier_t axis = axis_identifier_pan; axis < NUM_AXES; axis++) {
+        simSetTarget(camera, axis, camera->presetPosition[preset][axis], SIM_SPEED_SCALE);
+      }
+    }
+    snprintf(response, responseSize, "s%02d", preset);
+  } else {
+    snprintf(response, responseSize, "eR1");
+  }
+}
+
+/**
+ * Handles a command sent to the aw_cam CGI (tally lights).  Returns the camera's response
+ * in the provided buffer.  Call with the lock held.
+ */
+static void simHandleCameraCommand(sim_camera_t *camera, const char *command, char *response,
+                                   size_t responseSize) {
+  if (!strcmp(command, "QLR")) {
+    snprintf(response, responseSize, "OLR:%d", camera->tallyRed);
+  } else if (!strcmp(command, "QLG")) {
+    snprintf(response, responseSize, "OLG:%d", camera->tallyGreen);
+  } else if ((!strcmp(command, "TLR:0") || !strcmp(command, "TLR:1"))) {
+    camera->tallyRed = (command[4] == '1');
+    snprintf(response, responseSize, "%s", command);
+  } else if ((!strcmp(command, "TLG:0") || !strcmp(command, "TLG:1"))) {
+    camera->tallyGreen = (command[4] == '1');
+    snprintf(response, responseSize, "%s", command);
+  } else {
+    snprintf(response, responseSize, "eR1");
+  }
+}
+
+/**
+ * Runs a command against the camera as of the specified time.  The group is the CGI
+ * name ("aw_ptz" or "aw_cam").  Returns false if the group is unknown.
+ */
+static bool simHandleCommand(sim_camera_t *camera, int64_t now, const char *group,
+                             const char *command, char *response, size_t responseSize) {
+  bool isPTZ = !strcmp(group, "aw_ptz");
+  if (!isPTZ && strcmp(group, "aw_cam")) {
+    return false;
+  }
+  pthread_mutex_lock(&camera->lock);
+  simUpdateCamera(camera, now);
+  if (isPTZ) {
+    simHandlePTZCommand(camera, command, response, responseSize);
+  } else {
+    simHandleCameraCommand(camera, command, response, responseSize);
+  }
+  pthread_mutex_unlock(&camera->lock);
+  return true;
+}
+
+
+#pragma mark - HTTP server
+
+/** Per-connection state. */
+typedef struct {
+  int socket;
+  unsigned int randomState;  //! Per-connection state for rand_r.
+} sim_connection_t;
+
+/**
+ * Copies the percent-decoded value of the cmd parameter of a query string into the
+ * provided buffer.  Returns false if the parameter is missing or too long.
+ */
+static bool simCommandFromQuery(const char *query, char *command, size_t commandSize) {
+  const char *start = strstr(query, "cmd=");
+  if (!start || (start != query && start[-1] != '&')) {
+    return false;
+  }
+  size_t length = 0;
+  for (const char *source = start + 4; *source && *source != '&'; source++) {
+    char character = *source;
+    if (character == '%' && isxdigit(source[1]) && isxdigit(source[2])) {
+      char hex[3] = { source[1], source[2], '\0' };
+      character = (char)strtol(hex, NULL, 16);
+      source += 2;
+    } else if (character == '+') {
+      character = ' ';
+    }
+    if (length + 1 >= commandSize) {
+      return false;
+    }
+    command[length++] = character;
+  }
+  command[length] = '\0';
+  return true;
+}
+
+/** Sends an entire buffer.  Returns false if the connection failed. */
+static bool simSendAll(int socket, const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return false;
+    }
+    data += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+/** Sends an HTTP response.  Returns false if the connection failed. */
+static bool simSendResponse(int socket, int status, const char *body, bool keepAlive) {
+  const char *reason = (status == 200) ? "OK" : (status == 404) ? "Not Found" :
+                       (status == 405) ? "Method Not Allowed" : (status == 400) ? "Bad Request" :
+                       "Internal Server Error";
+  char response[SIM_RESPONSE_BUFFER_SIZE + 256];
+  int length = snprintf(response, sizeof(response),
+                        "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n"
+                        "%s\r\n%s", status, reason, strlen(body),
+                        keepAlive ? "" : "Connection: close\r\n", body);
+  return simSendAll(socket, response, MIN(length, (int)sizeof(response) - 1));
+}
+
+/** Waits for the configured latency plus a random amount of jitter. */
+static void simDelayResponse(sim_connection_t *connection) {
+  int64_t delayNanos = (int64_t)g_options.latencyMillis * 1000000;
+  if (g_options.jitterMillis > 0) {
+    delayNanos += (int64_t)(rand_r(&connection->randomState) % (g_options.jitterMillis * 1000)) *
+        1000;
+  }
+  if (delayNanos > 0) {
+    struct timespec delay = { delayNanos / NSEC_PER_SEC, delayNanos % NSEC_PER_SEC };
+    while (nanosleep(&delay, &delay) && errno == EINTR);
+  }
+}
+
+/**
+ * Handles one request, given its header block.  Returns true if the connection should
+ * stay open for further requests.
+ */
+static bool simHandleRequest(sim_connection_t *connection, char *header) {
+  char method[16], target[1024], version[16];
+  if (sscanf(header, "%15s %1023s %15s", method, target, version) != 3) {
+    simSendResponse(connection->socket, 400, "", false);
+    return false;
+  }
+  bool keepAlive = !strcmp(version, "HTTP/1.1") ? !strcasestr(header, "\nConnection: close") :
+                   (strcasestr(header, "\nConnection: keep-alive") != NULL);
+
+  bool failed = g_options.failurePercent > 0 &&
+      (rand_r(&connection->randomState) % 100) < g_options.failurePercent;
+  sim_failure_mode_t failureMode =
+      failed ? (rand_r(&connection->randomState) % kNumSimFailureModes) : 0;
+
+  simDelayResponse(connection);
+
+  char *query = strchr(target, '?');
+  if (query) {
+    *query++ = '\0';
+  }
+  const char *group = !strncmp(target, "/cgi-bin/", 9) ? target + 9 : "";
+  char command[SIM_COMMAND_BUFFER_SIZE];
+  char response[SIM_RESPONSE_BUFFER_SIZE] = "";
+  int status = 200;
+  if (strcmp(method, "GET")) {
+    status = 405;
+  } else if (failed && failureMode == kSimFailureDropConnection) {
+    if (g_options.verbose) fprintf(stderr, "%s?%s -> (dropped)\n", target, query ? query : "");
+    return false;
+  } else if (failed && failureMode == kSimFailureServerError) {
+    status = 500;
+  } else if (!query || !simCommandFromQuery(query, command, sizeof(command))) {
+    status = 400;
+  } else if (failed && failureMode == kSimFailureCameraBusy) {
+    snprintf(response, sizeof(response), "eR2");
+  } else if (!simHandleCommand(&g_camera, simTimeNanos(), group, command, response,
+                               sizeof(response))) {
+    status = 404;
+  }
+
+  if (g_options.verbose) {
+    fprintf(stderr, "%s?%s -> %d %s\n", target, query ? query : "", status, response);
+  }
+  return simSendResponse(connection->socket, status, response, keepAlive) && keepAlive;
+}
+
+/** Serves requests on one connection until the client closes it. */
+static void *simConnectionThread(void *argument) {
+  sim_connection_t *connection = argument;
+  char buffer[SIM_REQUEST_BUFFER_SIZE + 1];
+  size_t length = 0;
+  while (true) {
+    char *headerEnd;
+    while (!(headerEnd = memmem(buffer, length, "\r\n\r\n", 4))) {
+      if (length == SIM_REQUEST_BUFFER_SIZE) {
+        simSendResponse(connection->socket, 400, "", false);
+        goto done;
+      }
+      ssize_t count = recv(connection->socket, buffer + length,
+                           SIM_REQUEST_BUFFER_SIZE - length, 0);
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count <= 0) {
+        goto done;
+      }
+      length += count;
+    }
+    // Requests to the camera never have a body, so the next request starts right after
+    // the blank line.
+    size_t requestLength = (headerEnd - buffer) + 4;
+    *headerEnd = '\0';
+    if (!simHandleRequest(connection, buffer)) {
+      break;
+    }
+    memmove(buffer, buffer + requestLength, length - requestLength);
+    length -= requestLength;
+  }
+done:
+  close(connection->socket);
+  free(connection);
+  return NULL;
+}
+
+/** Accepts connections forever.  Returns only if the server could not start. */
+static bool simRunServer(void) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0) {
+    perror("socket");
+    return false;
+  }
+  int enable = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+  struct sockaddr_in address;
+  bzero(&address, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(g_options.port);
+  if (bind(listener, (struct sockaddr *)&address, sizeof(address)) || listen(listener, 64)) {
+    fprintf(stderr, "Could not listen on port %d: %s\n", g_options.port, strerror(errno));
+    close(listener);
+    return false;
+  }
+  fprintf(stderr, "Simulating a Panasonic camera at http://127.0.0.1:%d/\n", g_options.port);
+
+  for (unsigned int connectionNumber = 0; ; connectionNumber++) {
+    int clientSocket = accept(listener, NULL, NULL);
+    if (clientSocket < 0) {
+      if (errno != EINTR) perror("accept");
+      continue;
+    }
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    sim_connection_t *connection = malloc(sizeof(*connection));
+    connection->socket = clientSocket;
+    connection->randomState = g_options.seed + connectionNumber;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, simConnectionThread, connection)) {
+      fprintf(stderr, "Could not create connection thread.\n");
+      close(clientSocket);
+      free(connection);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+
+#pragma mark - Tests
+
+/** Runs a command against a test camera and returns the response. */
+static const char *simTestCommand(sim_camera_t *camera, int64_t now, const char *group,
+                                  const char *command) {
+  static char response[SIM_RESPONSE_BUFFER_SIZE];
+  assert(simHandleCommand(camera, now, group, command, response, sizeof(response)));
+  return response;
+}
+
+static void runSimulatorTests(void) {
+  sim_camera_t camera;
+  int64_t now = 0;
+  simInitCamera(&camera, now);
+
+  char command[SIM_COMMAND_BUFFER_SIZE];
+  assert(simCommandFromQuery("cmd=%23GZ&res=1", command, sizeof(command)));
+  assert(!strcmp(command, "#GZ"));
+  assert(simCommandFromQuery("cmd=TLG%3A1&res=1", command, sizeof(command)));
+  assert(!strcmp(command, "TLG:1"));
+  assert(!simCommandFromQuery("res=1", command, sizeof(command)));
+  assert(!simHandleCommand(&camera, now, "aw_foo", "#GZ", command, sizeof(command)));
+
+  // Zoom: speed-based moves stop at the limits.
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#GZ"), "gz555"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#Z99"), "zS99"));
+  now += NSEC_PER_SEC / 2;
+  int zoomPosition = (int)strtol(simTestCommand(&camera, now, "aw_ptz", "#GZ") + 2, NULL, 16);
+  assert(zoomPosition > 0x555 && zoomPosition < 0xFFF);
+  now += 5 * NSEC_PER_SEC;
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#GZ"), "gzFFF"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#Z50"), "zS50"));
+
+  // Zoom: absolute moves arrive exactly.
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#AXZ800"), "axz800"));
+  now += 5 * NSEC_PER_SEC;
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#GZ"), "gz800"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#AXZ100"), "eR3"));
+
+  // Pan and tilt.
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#APC"), "aPC80008000"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#APS900060001D2"), "aPS900060001D2"));
+  now += 10 * NSEC_PER_SEC;
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#APC"), "aPC90006000"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#APS900060001E2"), "eR3"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#PTS9950"), "pTS9950"));
+  now += 10 * NSEC_PER_SEC;
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#APC"), "aPCD2F66000"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#PTS5050"), "pTS5050"));
+
+  // Presets.
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#M07"), "s07"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#APS800080001D2"), "aPS800080001D2"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#AXZFFF"), "axzFFF"));
+  now += 10 * NSEC_PER_SEC;
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#R07"), "s07"));
+  now += 10 * NSEC_PER_SEC;
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#APC"), "aPCD2F66000"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#GZ"), "gz800"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#R7"), "eR3"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_ptz", "#XYZ"), "eR1"));
+
+  // Tally.
+  assert(!strcmp(simTestCommand(&camera, now, "aw_cam", "QLR"), "OLR:0"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_cam", "TLR:1"), "TLR:1"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_cam", "QLR"), "OLR:1"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_cam", "QLG"), "OLG:0"));
+  assert(!strcmp(simTestCommand(&camera, now, "aw_cam", "TLG:2"), "eR1"));
+}
+
+
+#pragma mark - Main
+
+static void simUsage(void) {
+  fprintf(stderr, "Usage: aw_simulator [-p port] [-l latency_ms] [-j jitter_ms] "
+                  "[-f failure_percent] [-s random_seed] [-v]\n");
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  int option;
+  while ((option = getopt(argc, argv, "p:l:j:f:s:v")) != -1) {
+    switch (option) {
+      case 'p': g_options.port = atoi(optarg); break;
+      case 'l': g_options.latencyMillis = atoi(optarg); break;
+      case 'j': g_options.jitterMillis = atoi(optarg); break;
+      case 'f': g_options.failurePercent = atoi(optarg); break;
+      case 's': g_options.seed = (unsigned int)strtoul(optarg, NULL, 10); break;
+      case 'v': g_options.verbose = true; break;
+      default: simUsage();
+    }
+  }
+  if (optind != argc || g_options.port <= 0 || g_options.port > 65535 ||
+      g_options.latencyMillis < 0 || g_options.jitterMillis < 0 ||
+      g_options.failurePercent < 0 || g_options.failurePercent > 100) {
+    simUsage();
+  }
+
+  runSimulatorTests();
+
+  signal(SIGPIPE, SIG_IGN);
+  simInitCamera(&g_camera, simTimeNanos());
+  return simRunServer() ? 0 : 1;
+}
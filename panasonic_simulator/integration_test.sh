@@ -0,0 +1,113 @@
+#!/bin/bash
+#
+# Runs viscaptz against aw_simulator: zooms in and then out over VISCA, and checks
+# that the simulated camera's zoom position follows.  Uses a temporary configuration
+# file, so the real one is never touched.
+#
+# With --benchmark, runs viscaptz --benchmarkcamera against the simulator instead.
+#
+# Usage: integration_test.sh [--benchmark] [path to viscaptz]
+
+BENCHMARK=0
+if [ "$1" = "--benchmark" ]; then
+  BENCHMARK=1
+  shift
+fi
+
+VISCAPTZ="$(cd "$(dirname "${1:-../viscaptz}")" && pwd)/$(basename "${1:-../viscaptz}")"
+SIMULATOR="$(cd "$(dirname "$0")" && pwd)/aw_simulator"
+PORT=18080
+VISCA_PORT=52381
+
+WORKDIR="$(mktemp -d)"
+export VISCAPTZ_CONFIG_FILE="$WORKDIR/viscaptz.conf"
+SIMULATOR_PID=""
+VISCAPTZ_PID=""
+
+cleanup() {
+  [ -n "$VISCAPTZ_PID" ] && kill "$VISCAPTZ_PID" 2>/dev/null
+  [ -n "$SIMULATOR_PID" ] && kill "$SIMULATOR_PID" 2>/dev/null
+  wait 2>/dev/null
+  rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+fail() {
+  echo "Integration test FAILED: $1" >&2
+  echo "Last lines of the viscaptz log:" >&2
+  grep -v "PAN SPEED" "$WORKDIR/viscaptz.log" 2>/dev/null | tail -20 >&2
+  exit 1
+}
+
+# Prints the simulated camera's zoom position (in decimal).
+zoom_position() {
+  local response
+  response="$(curl -s "http://127.0.0.1:$PORT/cgi-bin/aw_ptz?cmd=%23GZ&res=1")"
+  case "$response" in
+    gz*) echo $((16#${response#gz})) ;;
+    *) fail "bad zoom position response \"$response\"" ;;
+  esac
+}
+
+# Sends a VISCA-over-IP command.  Arguments are the payload bytes in hex.
+visca_sequence=0
+send_visca() {
+  visca_sequence=$((visca_sequence + 1))
+  local header
+  header="$(printf '\\x01\\x00\\x00\\x%02x\\x00\\x00\\x00\\x%02x' $# $visca_sequence)"
+  local payload=""
+  for byte in "$@"; do
+    payload="$payload\\x$byte"
+  done
+  printf "$header$payload" > "/dev/udp/127.0.0.1/$VISCA_PORT"
+}
+
+[ -x "$VISCAPTZ" ] || fail "$VISCAPTZ is not built"
+[ -x "$SIMULATOR" ] || fail "$SIMULATOR is not built"
+
+"$SIMULATOR" -p "$PORT" -s 1 > "$WORKDIR/simulator.log" 2>&1 &
+SIMULATOR_PID=$!
+
+# The Tricaster tally source needs an address, but the test doesn't use it.
+"$VISCAPTZ" --setcameraip "127.0.0.1:$PORT" > /dev/null 2>&1 || fail "could not set the camera IP"
+"$VISCAPTZ" --settricasterip "127.0.0.1:$PORT" > /dev/null 2>&1
+"$VISCAPTZ" --settallysourcename integration > /dev/null 2>&1
+
+if [ "$BENCHMARK" = 1 ]; then
+  for attempt in $(seq 1 50); do
+    curl -s "http://127.0.0.1:$PORT/cgi-bin/aw_ptz?cmd=%23GZ&res=1" > /dev/null && break
+    sleep 0.1
+  done
+  "$VISCAPTZ" --benchmarkcamera 2> "$WORKDIR/viscaptz.log" || fail "camera benchmark failed"
+  exit 0
+fi
+
+"$VISCAPTZ" > "$WORKDIR/viscaptz.log" 2>&1 &
+VISCAPTZ_PID=$!
+for attempt in $(seq 1 300); do
+  grep -q "Ready for VISCA commands." "$WORKDIR/viscaptz.log" && break
+  kill -0 "$VISCAPTZ_PID" 2>/dev/null || fail "viscaptz exited during startup"
+  sleep 0.1
+done
+grep -q "Ready for VISCA commands." "$WORKDIR/viscaptz.log" || fail "viscaptz did not start"
+
+start=$(zoom_position)
+
+# Zoom in (tele) at a medium speed, then stop.
+send_visca 81 01 04 07 24 FF
+sleep 1
+send_visca 81 01 04 07 00 FF
+sleep 0.5
+zoomed_in=$(zoom_position)
+[ "$zoomed_in" -gt "$start" ] || fail "zoom in moved from $start to $zoomed_in"
+
+# Zoom out (wide), then stop.
+send_visca 81 01 04 07 34 FF
+sleep 1
+send_visca 81 01 04 07 00 FF
+sleep 0.5
+zoomed_out=$(zoom_position)
+[ "$zoomed_out" -lt "$zoomed_in" ] || fail "zoom out moved from $zoomed_in to $zoomed_out"
+
+kill -0 "$VISCAPTZ_PID" 2>/dev/null || fail "viscaptz exited"
+echo "Integration test passed (zoom $start -> $zoomed_in -> $zoomed_out)."
@@ -1,6 +1,7 @@
 #include "panasonicptz.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <curl/curl.h>
 #include <fcntl.h>
 #include <math.h>
@@ -14,6 +15,17 @@
 #include <termios.h>
 #include <unistd.h>
 
+// The tests measure the heap with mallinfo2, which first appeared in glibc 2.33.  Older
+// releases (Raspberry Pi OS Buster and Bullseye, for example) only have mallinfo.
+#ifdef __GLIBC__
+  #include <malloc.h>
+  #if __GLIBC_PREREQ(2, 33)
+    #define PANA_HEAP_IN_USE() ((size_t)mallinfo2().uordblks)
+  #else
+    #define PANA_HEAP_IN_USE() ((size_t)mallinfo().uordblks)
+  #endif
+#endif
+
 #include "main.h"
 #include "configurator.h"
 #include "constants.h"
@@ -23,26 +35,111 @@
 
 #pragma mark - Data types
 
-/** A sized buffer for passing around data from libcurl. */
+/** The longest response that the camera sends, plus a terminating null. */
+#define PANA_RESPONSE_BUFFER_SIZE 64
+
+/** A fixed-size buffer for passing around data from libcurl. */
 typedef struct {
-  char *data;
+  char data[PANA_RESPONSE_BUFFER_SIZE];
   size_t len;
 } curl_buffer_t;
 
+/** The most numeric arguments that any command takes. */
+#define PANA_MAX_COMMAND_VALUES 4
+
+/** The kinds of commands that can be sent to the camera. */
+typedef enum {
+  kPanaCommandZoomSpeed = 0,           //! Sets the zoom speed (#Z).
+  kPanaCommandZoomPosition = 1,        //! Moves to a zoom position (#AXZ).
+  kPanaCommandPanTiltSpeed = 2,        //! Sets the pan and tilt speed (#PTS).
+  kPanaCommandPanTiltPosition = 3,     //! Moves to a pan and tilt position (#APS).
+  kPanaCommandTallyState = 4,          //! Sets the tally light (TLR:, then TLG:).
+  kPanaCommandGetZoomPosition = 5,     //! Reads the zoom position (#GZ).
+  kPanaCommandGetPanTiltPosition = 6,  //! Reads the pan and tilt position (#APC).
+  kPanaCommandGetTallyState = 7,       //! Reads the tally light (QLR, then QLG).
+  kPanaCommandRecallPreset = 8,        //! Moves to a camera preset (#R).
+  kPanaCommandSavePreset = 9,          //! Stores a camera preset (#M).
+  kNumPanaCommandTypes = 10
+} pana_command_type_t;
+
+/** The queue slot for one type of command. */
+typedef struct {
+  bool pending;                             //! Waiting to be sent.
+  bool inFlight;                            //! Being sent now.
+  int64_t values[PANA_MAX_COMMAND_VALUES];  //! The arguments (meaning depends on the type).
+} pana_command_slot_t;
+
+/** The longest argument string that any command takes (#APS takes 11 digits). */
+#define PANA_MAX_ARGUMENTS_LENGTH 16
 
-#pragma mark - Function prototypes
+/** The longest URL for any command, plus a terminating null. */
+#define PANA_URL_BUFFER_SIZE 256
+
+/** One HTTP request that makes up all or part of a command. */
+typedef struct {
+  const char *group;                             //! The CGI script ("ptz" or "cam").
+  const char *command;                           //! The command code.
+  char arguments[PANA_MAX_ARGUMENTS_LENGTH];     //! The formatted arguments, concatenated.
+  const char *responsePrefix;                    //! The expected start of the response.
+} pana_request_t;
 
-#define FREEMULTI(array) freeMulti(array, sizeof(array) / sizeof(array[0]))
-void freeMulti(char **array, ssize_t count);
+/** The most HTTP requests that make up one command. */
+#define PANA_MAX_COMMAND_PARTS 2
 
-char *panaIntString(uint64_t value, int digits, bool hex);
+/** A command being sent by the I/O thread.  All of its requests are sent at once. */
+typedef struct {
+  pana_command_type_t type;
+  int64_t values[PANA_MAX_COMMAND_VALUES];
+  int partsRemaining;                                 //! Requests that haven't finished.
+  pana_request_t requests[PANA_MAX_COMMAND_PARTS];
+  CURL *handles[PANA_MAX_COMMAND_PARTS];
+  curl_buffer_t buffers[PANA_MAX_COMMAND_PARTS];
+  const char *responses[PANA_MAX_COMMAND_PARTS];      //! Each value, in buffers (NULL on failure).
+  int64_t startTime;
+} pana_transfer_t;
+
+/** Request counts and times for one type of command, for measuring network load. */
+typedef struct {
+  int64_t requests;            //! HTTP requests sent.
+  int64_t failures;            //! Requests that failed or got an unexpected response.
+  int64_t totalLatencyNanos;   //! The sum of the time taken by each request.
+  int64_t maxLatencyNanos;     //! The longest time taken by any request.
+} pana_command_statistics_t;
 
-void freeURLBuffer(curl_buffer_t *buffer);
-curl_buffer_t *fetchURLWithCURL(char *URL, CURL *handle);
+/** A zoom position reported by the camera. */
+typedef struct {
+  int64_t rawPosition;     //! The position that the camera reported.
+  int64_t linearPosition;  //! The same position, corrected for nonlinearity.
+  int64_t timestamp;       //! When the camera read it (halfway through the request).
+  bool valid;              //! False until the camera has reported a position.
+} pana_zoom_sample_t;
+
+/** The zoom speeds that the camera acknowledged most recently. */
+typedef struct {
+  int64_t speed;          //! The hardware speed (-49 to 49) in effect now.
+  int64_t previousSpeed;  //! The hardware speed in effect before changeTime.
+  int64_t changeTime;     //! When the camera acknowledged the current speed.
+} pana_zoom_speed_history_t;
+
+
+#pragma mark - Function prototypes
+
+bool panaAppendInt(char *buffer, size_t bufferSize, uint64_t value, int digits, bool hex);
+static bool panaParseInt(const char *string, bool hex, int64_t *value);
+
+bool fetchURLWithCURL(const char *URL, CURL *handle, curl_buffer_t *buffer);
+static CURL *checkOutCURLHandle(void);
+static void checkInCURLHandle(CURL *handle);
+static void lockCURLShare(CURL *handle, curl_lock_data data, curl_lock_access access,
+                          void *userptr);
+static void unlockCURLShare(CURL *handle, curl_lock_data data, void *userptr);
 static size_t writeMemoryCallback(void *contents, size_t chunkSize, size_t nChunks, void *userp);
 
-char *sendCommand(const char *group, const char *command, char *values[],
-                  int numValues, const char *responsePrefix);
+const char *sendCommand(const pana_request_t *request, curl_buffer_t *response);
+static bool panasonicCommandURL(char *URL, size_t URLSize, const pana_request_t *request);
+static const char *panasonicResponseValue(const char *response, const char *command,
+                                          const char *responsePrefix);
+void *runPanasonicIOThread(void *argIgnored);
 
 void runPanasonicTests(void);
 
@@ -55,6 +152,106 @@ static int64_t gLastZoomSpeed = 0;
 /** The IP address of the camera. */
 static char *g_cameraIPAddr = NULL;
 
+/**
+ * The most idle curl handles kept for reuse.  Commands usually come from one or two
+ * threads at a time, so a few handles are enough.
+ */
+#define PANA_CURL_HANDLE_POOL_SIZE 4
+
+/** Idle curl handles, each of which may be holding a keep-alive connection to the camera. */
+static CURL *g_curlHandlePool[PANA_CURL_HANDLE_POOL_SIZE];
+static int g_curlHandlePoolCount = 0;
+static pthread_mutex_t g_curlHandlePoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** DNS and connection cache shared by all of the curl handles. */
+static CURLSH *g_curlShare = NULL;
+static pthread_mutex_t g_curlShareLocks[CURL_LOCK_DATA_LAST];
+
+/** The thread that sends queued commands, and its curl multi handle. */
+pthread_t pana_io_thread;
+static CURLM *g_panaCurlMulti = NULL;
+static volatile bool g_panaIOThreadRunning = false;
+
+/**
+ * The commands being sent by the I/O thread.  Only one command of each type is sent
+ * at a time, so each type needs only one transfer.
+ */
+static pana_transfer_t g_panaTransfers[kNumPanaCommandTypes];
+
+/** The command queue: one slot per command type, plus the order in which they were queued. */
+static pthread_mutex_t g_panaCommandLock = PTHREAD_MUTEX_INITIALIZER;
+static pana_command_slot_t g_panaCommandSlots[kNumPanaCommandTypes];
+static pana_command_type_t g_panaCommandOrder[kNumPanaCommandTypes];
+static int g_panaCommandOrderCount = 0;
+
+/** The tally state most recently queued or sent (-1 if unknown), for skipping repeats. */
+static int64_t g_requestedTallyState = -1;
+
+#if PANASONIC_PTZ_ZOOM_ONLY || PANASONIC_DISABLE_ZOOM_COMMAND
+  /**
+   * How often the I/O thread asks for the zoom position (at most; see pollPanasonicState).
+   * Zoom moves are driven from this end, one speed change at a time, so this is often.
+   */
+  static const int64_t kPanaZoomPollIntervalNanos = 10 * 1000000;
+#else
+  /**
+   * How often the I/O thread asks for the zoom position.  The camera performs zoom moves
+   * on its own (#AXZ), so the position is only needed for reporting.
+   */
+  static const int64_t kPanaZoomPollIntervalNanos = 100 * 1000000;
+#endif
+
+/** How long the I/O thread waits before asking again after a zoom position request fails. */
+static const int64_t kPanaZoomPollRetryNanos = 200 * 1000000;
+
+/** How far past the newest sample the zoom position is extrapolated. */
+static const int64_t kPanaZoomExtrapolationLimitNanos = 250 * 1000000;
+
+/** The newest zoom position and zoom speeds.  Protected by g_zoomStateLock. */
+static pthread_mutex_t g_zoomStateLock = PTHREAD_MUTEX_INITIALIZER;
+static pana_zoom_sample_t g_zoomSample;
+static pana_zoom_speed_history_t g_zoomSpeedHistory;
+
+/** How often the I/O thread asks for the tally state once someone has read it. */
+static const int64_t kPanaTallyPollIntervalNanos = 200 * 1000000;
+
+#if !PANASONIC_PTZ_ZOOM_ONLY
+  /**
+   * How often the I/O thread asks for the pan and tilt position.  The camera performs
+   * pan and tilt moves on its own (#APS), so the position is only needed for reporting
+   * and for saving presets.
+   */
+  static const int64_t kPanaPanTiltPollIntervalNanos = 100 * 1000000;
+#endif
+
+/** When the I/O thread should next ask for the zoom position, pan/tilt position, and tally state. */
+static int64_t g_nextZoomPollTime = 0;
+static int64_t g_nextPanTiltPollTime = 0;
+static int64_t g_nextTallyPollTime = 0;
+
+/** True once something has read the tally state (so it is worth polling). */
+static volatile bool g_tallyPollingEnabled = false;
+
+/** The calibrated zoom range (linear), for limiting extrapolation.  Empty if not calibrated. */
+static int64_t g_zoomMinimumPosition = 0;
+static int64_t g_zoomMaximumPosition = 0;
+
+/** The camera state from the most recent responses. */
+static volatile int64_t g_lastPanPosition = 0;
+static volatile int64_t g_lastTiltPosition = 0;
+static volatile bool g_havePanTiltPosition = false;
+static volatile int g_lastTallyState = 0;
+
+/** Request counts and times for each command type.  Protected by g_panaStatisticsLock. */
+static pthread_mutex_t g_panaStatisticsLock = PTHREAD_MUTEX_INITIALIZER;
+static pana_command_statistics_t g_panaCommandStatistics[kNumPanaCommandTypes];
+
+/** How often the I/O thread prints the request statistics (when debugging). */
+static const int64_t kPanaStatisticsIntervalNanos = 10 * NSEC_PER_SEC;
+
+/** When the tally state last changed (monotonic nanoseconds), for change detection. */
+static volatile int64_t g_lastTallyChangeTime = 0;
+
 #if USE_PANASONIC_PTZ
   /** The zoom calibration data in raw form (positions per second for each speed). */
   int64_t *panasonicZoomCalibrationData = NULL;
@@ -91,6 +288,17 @@ bool panaModuleInit(void) {
 
     curl_global_init(CURL_GLOBAL_ALL);
 
+    // Share one connection cache among all handles, so that a connection opened by any
+    // thread can be reused by every other thread.
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+      pthread_mutex_init(&g_curlShareLocks[i], NULL);
+    }
+    g_curlShare = curl_share_init();
+    curl_share_setopt(g_curlShare, CURLSHOPT_LOCKFUNC, lockCURLShare);
+    curl_share_setopt(g_curlShare, CURLSHOPT_UNLOCKFUNC, unlockCURLShare);
+    curl_share_setopt(g_curlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(g_curlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
     if (pana_enable_debugging) fprintf(stderr, "Panasonic module init done\n");
   #else
     if (pana_enable_debugging) fprintf(stderr, "Panasonic module init skipped\n");
@@ -102,8 +310,17 @@ bool panaModuleInit(void) {
 
 // Public function.  Docs in header.
 //
-// Starts the module's threads.  (Nothing to do for this module.)
+// Starts the module's I/O thread.  Until then, commands are sent synchronously.
 bool panaModuleStart(void) {
+  #if USE_PANASONIC_PTZ
+    g_panaCurlMulti = curl_multi_init();
+    if (g_panaCurlMulti == NULL) {
+      fprintf(stderr, "Could not create curl multi handle.\n");
+      return false;
+    }
+    g_panaIOThreadRunning = true;
+    pthread_create(&pana_io_thread, NULL, runPanasonicIOThread, NULL);
+  #endif  // USE_PANASONIC_PTZ
   return true;
 }
 
@@ -114,34 +331,44 @@ bool panaModuleReload(void) {
   #if USE_PANASONIC_PTZ
     int maxSpeed = 0;
     bool localDebug = false;
+    int64_t *previousZoomData = panasonicZoomCalibrationData;
     panasonicSharedInit(&panasonicZoomCalibrationData, &maxSpeed);
+    free(previousZoomData);
     if (maxSpeed == ZOOM_SCALE_HARDWARE) {
+        int32_t *previousScaledZoomData = panasonicScaledZoomCalibrationData;
         panasonicScaledZoomCalibrationData =
             convertSpeedValues(panasonicZoomCalibrationData, ZOOM_SCALE_HARDWARE,
                                axis_identifier_zoom);
+        free(previousScaledZoomData);
         if (localDebug) {
           for (int i=0; i<=ZOOM_SCALE_HARDWARE; i++) {
             fprintf(stderr, "%d: raw: %" PRId64 "\n", i, panasonicZoomCalibrationData[i]);
             fprintf(stderr, "%d: scaled: %d\n", i, panasonicScaledZoomCalibrationData[i]);
           }
         }
+        g_zoomMinimumPosition = zoomOutLimit();
+        g_zoomMaximumPosition = zoomInLimit();
     } else {
         fprintf(stderr, "Ignoring calibration data because the scale (%d) is incorrect.\n",
                 maxSpeed);
     }
 
     #if !PANASONIC_PTZ_ZOOM_ONLY
+      free(pana_pan_data);
       pana_pan_data =
           readCalibrationDataForAxis(axis_identifier_pan, &maxSpeed);
       if (maxSpeed == PAN_TILT_SCALE_HARDWARE) {
+          free(pana_pan_scaled_data);
           pana_pan_scaled_data =
               convertSpeedValues(pana_pan_data, PAN_TILT_SCALE_HARDWARE,
                                axis_identifier_pan);
       }
 
+      free(pana_tilt_data);
       pana_tilt_data =
           readCalibrationDataForAxis(axis_identifier_tilt, &maxSpeed);
       if (maxSpeed == PAN_TILT_SCALE_HARDWARE) {
+          free(pana_tilt_scaled_data);
           pana_tilt_scaled_data =
               convertSpeedValues(pana_tilt_data, PAN_TILT_SCALE_HARDWARE,
                                axis_identifier_tilt);
@@ -155,6 +382,38 @@ bool panaModuleReload(void) {
 //
 // Tears down the module.
 bool panaModuleTeardown(void) {
+    // Stop the I/O thread, then take back the handles of any commands still in flight
+    // before the multi handle (and then the share that the handles use) goes away.
+    if (g_panaIOThreadRunning) {
+      g_panaIOThreadRunning = false;
+      curl_multi_wakeup(g_panaCurlMulti);
+      pthread_join(pana_io_thread, NULL);
+    }
+    if (g_panaCurlMulti != NULL) {
+      for (int type = 0; type < kNumPanaCommandTypes; type++) {
+        for (int part = 0; part < PANA_MAX_COMMAND_PARTS; part++) {
+          CURL *handle = g_panaTransfers[type].handles[part];
+          if (handle != NULL) {
+            curl_multi_remove_handle(g_panaCurlMulti, handle);
+            checkInCURLHandle(handle);
+            g_panaTransfers[type].handles[part] = NULL;
+          }
+        }
+      }
+      CURLM *multi = g_panaCurlMulti;
+      g_panaCurlMulti = NULL;
+      curl_multi_cleanup(multi);
+    }
+
+    pthread_mutex_lock(&g_curlHandlePoolLock);
+    while (g_curlHandlePoolCount > 0) {
+      curl_easy_cleanup(g_curlHandlePool[--g_curlHandlePoolCount]);
+    }
+    pthread_mutex_unlock(&g_curlHandlePoolLock);
+    if (g_curlShare != NULL) {
+      curl_share_cleanup(g_curlShare);
+      g_curlShare = NULL;
+    }
     curl_global_cleanup();
     return true;
 }
@@ -170,55 +429,568 @@ bool panaSetIPAddress(char *address) {
   return true;
 }
 
-/** Returns the number of characters required to represent the specified value in hexadecimal. */
-int hexDigits(uint64_t value) {
-  int digits = 1;
-  value = value >> 4;
-  while (value > 0) {
-    value = value >> 4;
-    digits++;
+/**
+ * Appends the provided number to the string in a fixed-size buffer, zero-padded to have
+ * the specified number of digits.  If hex is true, the number is in base 16 (but with no
+ * leading 0x).  Otherwise, it is in base 10.  Returns false if the buffer is too small.
+ */
+bool panaAppendInt(char *buffer, size_t bufferSize, uint64_t value, int digits, bool hex) {
+    size_t length = strlen(buffer);
+    int written = hex ? snprintf(buffer + length, bufferSize - length, "%0*" PRIx64, digits, value)
+                      : snprintf(buffer + length, bufferSize - length, "%0*" PRIu64, digits, value);
+    return written >= 0 && (size_t)written < bufferSize - length;
+}
+
+/**
+ * Decodes a number in a response value (in base 16 if hex is true, or else base 10).
+ * Returns false if the value is empty or contains anything but digits (and trailing
+ * whitespace).
+ */
+static bool panaParseInt(const char *string, bool hex, int64_t *value) {
+    int64_t result = 0;
+    const char *pos = string;
+    for ( ; *pos != '\0'; pos++) {
+        int digit;
+        if (*pos >= '0' && *pos <= '9') {
+            digit = *pos - '0';
+        } else if (hex && *pos >= 'a' && *pos <= 'f') {
+            digit = *pos - 'a' + 10;
+        } else if (hex && *pos >= 'A' && *pos <= 'F') {
+            digit = *pos - 'A' + 10;
+        } else {
+            break;
+        }
+        result = (result * (hex ? 16 : 10)) + digit;
+    }
+    if (pos == string || pos - string > 15) {
+        return false;
+    }
+    for (const char *rest = pos; *rest != '\0'; rest++) {
+        if (!isspace((unsigned char)*rest)) {
+            return false;
+        }
+    }
+    *value = result;
+    return true;
+}
+
+#pragma mark - Commands
+
+/**
+ * Returns true if commands should be sent on the calling thread.  This is true
+ * before the I/O thread starts and during calibration, where the timing of each
+ * command matters more than not blocking.
+ */
+static bool panasonicCommandsAreSynchronous(void) {
+  return !g_panaIOThreadRunning || gCalibrationMode;
+}
+
+/** Returns the number of HTTP requests that make up a command of the specified type. */
+static int panasonicCommandParts(pana_command_type_t type) {
+  return (type == kPanaCommandTallyState || type == kPanaCommandGetTallyState) ? 2 : 1;
+}
+
+/**
+ * Fills in the CGI group, command code, arguments, and response prefix for one request
+ * of a command.
+ */
+static void panasonicCommandRequest(pana_command_type_t type, const int64_t *values, int part,
+                                    pana_request_t *request) {
+  bzero(request, sizeof(*request));
+  request->group = "ptz";
+  switch (type) {
+    case kPanaCommandZoomSpeed:
+      request->command = "#Z";
+      panaAppendInt(request->arguments, sizeof(request->arguments), values[0], 2, false);
+      request->responsePrefix = "zS";
+      break;
+    case kPanaCommandZoomPosition:
+      request->command = "#AXZ";
+      panaAppendInt(request->arguments, sizeof(request->arguments), values[0], 3, true);
+      request->responsePrefix = "axz";
+      break;
+    case kPanaCommandPanTiltSpeed:
+      request->command = "#PTS";
+      panaAppendInt(request->arguments, sizeof(request->arguments), values[0], 2, false);
+      panaAppendInt(request->arguments, sizeof(request->arguments), values[1], 2, false);
+      request->responsePrefix = "pTS";
+      break;
+    case kPanaCommandPanTiltPosition:
+      request->command = "#APS";
+      panaAppendInt(request->arguments, sizeof(request->arguments), values[0], 4, true);
+      panaAppendInt(request->arguments, sizeof(request->arguments), values[1], 4, true);
+      panaAppendInt(request->arguments, sizeof(request->arguments), values[2], 2, true);
+      panaAppendInt(request->arguments, sizeof(request->arguments), values[3], 1, true);
+      request->responsePrefix = "aPS";
+      break;
+    case kPanaCommandTallyState:
+      request->group = "cam";
+      request->command = part ? "TLG:" : "TLR:";
+      panaAppendInt(request->arguments, sizeof(request->arguments),
+                    values[0] == (part ? kTallyStateGreen : kTallyStateRed), 1, false);
+      request->responsePrefix = request->command;
+      break;
+    case kPanaCommandGetZoomPosition:
+      request->command = "#GZ";
+      request->responsePrefix = "gz";
+      break;
+    case kPanaCommandGetPanTiltPosition:
+      request->command = "#APC";
+      request->responsePrefix = "aPC";
+      break;
+    case kPanaCommandGetTallyState:
+      request->group = "cam";
+      request->command = part ? "QLG" : "QLR";
+      request->responsePrefix = part ? "OLG:" : "OLR:";
+      break;
+    case kPanaCommandRecallPreset:
+      request->command = "#R";
+      panaAppendInt(request->arguments, sizeof(request->arguments), values[0], 2, false);
+      request->responsePrefix = "s";
+      break;
+    case kPanaCommandSavePreset:
+      request->command = "#M";
+      panaAppendInt(request->arguments, sizeof(request->arguments), values[0], 2, false);
+      request->responsePrefix = "s";
+      break;
+    case kNumPanaCommandTypes:
+      break;
   }
-  return digits;
 }
 
-/** Returns the number of characters required to represent the specified value in base 10. */
-int decDigits(uint64_t value) {
-  int digits = 1;
-  value = value / 10;
-  while (value > 0) {
-    value = value / 10;
-    digits++;
+/** Returns a short description of a command type for debugging output. */
+static const char *panasonicCommandName(pana_command_type_t type) {
+  switch (type) {
+    case kPanaCommandZoomSpeed: return "zoom speed";
+    case kPanaCommandZoomPosition: return "zoom position";
+    case kPanaCommandPanTiltSpeed: return "pan/tilt speed";
+    case kPanaCommandPanTiltPosition: return "pan/tilt position";
+    case kPanaCommandTallyState: return "set tally";
+    case kPanaCommandGetZoomPosition: return "get zoom position";
+    case kPanaCommandGetPanTiltPosition: return "get pan/tilt position";
+    case kPanaCommandGetTallyState: return "get tally";
+    case kPanaCommandRecallPreset: return "recall preset";
+    case kPanaCommandSavePreset: return "save preset";
+    case kNumPanaCommandTypes: break;
   }
-  return digits;
+  return "unknown";
+}
+
+/** Records the outcome of one request in the statistics for its command type. */
+static void recordPanasonicRequest(pana_command_type_t type, int64_t latency, bool succeeded) {
+  pthread_mutex_lock(&g_panaStatisticsLock);
+  pana_command_statistics_t *statistics = &g_panaCommandStatistics[type];
+  statistics->requests++;
+  statistics->failures += succeeded ? 0 : 1;
+  statistics->totalLatencyNanos += latency;
+  statistics->maxLatencyNanos = MAX(statistics->maxLatencyNanos, latency);
+  pthread_mutex_unlock(&g_panaStatisticsLock);
 }
 
 /**
- * Returns a string containing the provided number, zero-padded to have the specified
- * number of digits.  If hex is true, the result is in base 16 (but with no leading 0x).
- * Otherwise, the result is in base 10.
+ * Copies the statistics for every command type (kNumPanaCommandTypes entries) into
+ * statistics, then starts counting again.
  */
-char *panaIntString(uint64_t value, int digits, bool hex) {
-    int actualDigits = hex ? hexDigits(value) : decDigits(value);
-    ssize_t length = MAX(digits, actualDigits);
-    char *str = malloc(length + 1);
-    memset(str, (int)'0', length);
-    if (hex) {
-        sprintf(str + MAX(0, (digits - actualDigits)), "%" PRIx64 "", value);
-    } else {
-        sprintf(str + MAX(0, (digits - actualDigits)), "%" PRId64 "", value);
+static void takePanasonicStatistics(pana_command_statistics_t *statistics) {
+  pthread_mutex_lock(&g_panaStatisticsLock);
+  memcpy(statistics, g_panaCommandStatistics, sizeof(g_panaCommandStatistics));
+  bzero(g_panaCommandStatistics, sizeof(g_panaCommandStatistics));
+  pthread_mutex_unlock(&g_panaStatisticsLock);
+}
+
+/**
+ * Prints the number of requests of each type sent in the past interval (in
+ * nanoseconds), and how long they took, then starts counting again.
+ */
+static void printPanasonicStatistics(int64_t interval) {
+  pana_command_statistics_t statistics[kNumPanaCommandTypes];
+  takePanasonicStatistics(statistics);
+
+  for (pana_command_type_t type = 0; type < kNumPanaCommandTypes; type++) {
+    if (statistics[type].requests == 0) {
+      continue;
+    }
+    fprintf(stderr, "Panasonic %s: %" PRId64 " requests (%.1f/s), %" PRId64 " failed, "
+            "mean %.2f ms, max %.2f ms\n", panasonicCommandName(type),
+            statistics[type].requests, statistics[type].requests * 1.0e9 / interval,
+            statistics[type].failures,
+            statistics[type].totalLatencyNanos / 1.0e6 / statistics[type].requests,
+            statistics[type].maxLatencyNanos / 1.0e6);
+  }
+}
+
+/**
+ * Updates the cached camera state from the responses to a command (NULL for requests
+ * that failed), received at the specified time.  Returns true if the command succeeded.
+ */
+static bool handlePanasonicResponses(pana_command_type_t type, const int64_t *values,
+                                     const char **responses, int64_t responseTime) {
+  bool localDebug = pana_enable_debugging || false;
+  int parts = panasonicCommandParts(type);
+  for (int part = 0; part < parts; part++) {
+    if (responses[part] == NULL) {
+      if (localDebug) {
+        fprintf(stderr, "Panasonic command %d failed.  Keeping previous state.\n", type);
+      }
+      return false;
+    }
+  }
+
+  switch (type) {
+    case kPanaCommandZoomSpeed: {
+      int64_t speed = -1;
+      if (!panaParseInt(responses[0], false, &speed) || speed != values[0]) {
+        if (localDebug) {
+          fprintf(stderr, "Zoom speed %s does not match %" PRId64 "\n", responses[0], values[0]);
+        }
+        return false;
+      }
+      pthread_mutex_lock(&g_zoomStateLock);
+      g_zoomSpeedHistory.previousSpeed = g_zoomSpeedHistory.speed;
+      g_zoomSpeedHistory.speed = values[0] - 50;
+      g_zoomSpeedHistory.changeTime = responseTime;
+      pthread_mutex_unlock(&g_zoomStateLock);
+      return true;
+    }
+    case kPanaCommandGetZoomPosition: {
+      // Correct for nonlinearity here, once per sample, rather than in every reader.
+      pana_zoom_sample_t sample;
+      if (!panaParseInt(responses[0], true, &sample.rawPosition)) {
+        if (localDebug) fprintf(stderr, "Did not get response from CGI.  Returning last value.\n");
+        return false;
+      }
+      sample.linearPosition = panaMakeZoomLinear(sample.rawPosition);
+      sample.timestamp = responseTime;
+      sample.valid = true;
+      pthread_mutex_lock(&g_zoomStateLock);
+      g_zoomSample = sample;
+      pthread_mutex_unlock(&g_zoomStateLock);
+      if (localDebug) fprintf(stderr, "Zoom position: %" PRId64 "\n", sample.rawPosition);
+      return true;
+    }
+    case kPanaCommandGetPanTiltPosition: {
+      // Four hex digits of pan position, then four of tilt position.
+      int64_t value = 0;
+      if (!panaParseInt(responses[0], true, &value)) {
+        return false;
+      }
+      g_lastPanPosition = (value >> 16) & 0xffff;
+      g_lastTiltPosition = value & 0xffff;
+      g_havePanTiltPosition = true;
+      if (localDebug) fprintf(stderr, "Pan position: %" PRId64 "\n", g_lastPanPosition);
+      if (localDebug) fprintf(stderr, "Tilt position: %" PRId64 "\n", g_lastTiltPosition);
+      return true;
+    }
+    case kPanaCommandSavePreset: {
+      // The camera echoes the preset number (s07) once the preset is stored.
+      int64_t presetNumber = -1;
+      if (!panaParseInt(responses[0], false, &presetNumber) || presetNumber != values[0]) {
+        if (localDebug) {
+          fprintf(stderr, "Preset %s does not match %" PRId64 "\n", responses[0], values[0]);
+        }
+        return false;
+      }
+      return true;
+    }
+    case kPanaCommandGetTallyState: {
+      bool redState = responses[0][0] == '1';
+      bool greenState = responses[1][0] == '1';
+      int tallyState = redState ? kTallyStateRed : greenState ? kTallyStateGreen : 0;
+      if (tallyState != g_lastTallyState) {
+        if (localDebug) fprintf(stderr, "Tally state changed: %d\n", tallyState);
+        g_lastTallyState = tallyState;
+        g_lastTallyChangeTime = responseTime;
+      }
+      return true;
     }
-    return str;
+    default:
+      return true;
+  }
+}
+
+/** Sends a command on the calling thread and waits for the camera's response. */
+static bool sendPanasonicCommandNow(pana_command_type_t type, const int64_t *values) {
+  curl_buffer_t buffers[PANA_MAX_COMMAND_PARTS];
+  const char *responses[PANA_MAX_COMMAND_PARTS] = { NULL, NULL };
+  int parts = panasonicCommandParts(type);
+  int64_t startTime = monotonicTimeNanos();
+  for (int part = 0; part < parts; part++) {
+    pana_request_t request;
+    panasonicCommandRequest(type, values, part, &request);
+    int64_t requestStartTime = monotonicTimeNanos();
+    responses[part] = sendCommand(&request, &buffers[part]);
+    recordPanasonicRequest(type, monotonicTimeNanos() - requestStartTime,
+                           responses[part] != NULL);
+  }
+  return handlePanasonicResponses(type, values, responses,
+                                  (startTime + monotonicTimeNanos()) / 2);
+}
+
+
+#pragma mark - Command queue
+
+/**
+ * Queues a command for the I/O thread.  Each command type has a single slot, so a
+ * command replaces any older command of the same type that hasn't been sent yet (and
+ * keeps that command's place in line).  Tally changes are also dropped if they
+ * wouldn't change anything.  Returns true if the command was queued.
+ */
+static bool queuePanasonicCommand(pana_command_type_t type, const int64_t *values,
+                                  int numValues) {
+  pthread_mutex_lock(&g_panaCommandLock);
+  pana_command_slot_t *slot = &g_panaCommandSlots[type];
+  if (type == kPanaCommandTallyState && !slot->pending &&
+      values[0] == g_requestedTallyState) {
+    pthread_mutex_unlock(&g_panaCommandLock);
+    return false;
+  }
+  if (!slot->pending) {
+    slot->pending = true;
+    g_panaCommandOrder[g_panaCommandOrderCount++] = type;
+  }
+  bzero(slot->values, sizeof(slot->values));
+  memcpy(slot->values, values, numValues * sizeof(int64_t));
+  if (type == kPanaCommandTallyState) {
+    g_requestedTallyState = values[0];
+  }
+  pthread_mutex_unlock(&g_panaCommandLock);
+
+  if (g_panaCurlMulti != NULL) {
+    curl_multi_wakeup(g_panaCurlMulti);
+  }
+  return true;
 }
 
 /**
- * Frees each string in an array of the specified length.
+ * Takes the oldest queued command whose type isn't already being sent (so that
+ * commands of one type reach the camera in order).  Returns false if there is none.
  */
-void freeMulti(char **array, ssize_t count) {
-  for (ssize_t i = 0; i < count; i++) {
-    free(array[i]);
+static bool takeNextPanasonicCommand(pana_command_type_t *type, int64_t *values) {
+  pthread_mutex_lock(&g_panaCommandLock);
+  for (int i = 0; i < g_panaCommandOrderCount; i++) {
+    pana_command_slot_t *slot = &g_panaCommandSlots[g_panaCommandOrder[i]];
+    if (slot->inFlight) {
+      continue;
+    }
+    *type = g_panaCommandOrder[i];
+    memcpy(values, slot->values, sizeof(slot->values));
+    slot->pending = false;
+    slot->inFlight = true;
+    memmove(&g_panaCommandOrder[i], &g_panaCommandOrder[i + 1],
+            (g_panaCommandOrderCount - i - 1) * sizeof(pana_command_type_t));
+    g_panaCommandOrderCount--;
+    pthread_mutex_unlock(&g_panaCommandLock);
+    return true;
+  }
+  pthread_mutex_unlock(&g_panaCommandLock);
+  return false;
+}
+
+/** Marks a command as sent.  If a tally change failed, the next identical change retries it. */
+static void finishPanasonicCommand(pana_command_type_t type, bool succeeded) {
+  pthread_mutex_lock(&g_panaCommandLock);
+  g_panaCommandSlots[type].inFlight = false;
+  if (type == kPanaCommandTallyState && !succeeded &&
+      !g_panaCommandSlots[type].pending) {
+    g_requestedTallyState = -1;
+  }
+  pthread_mutex_unlock(&g_panaCommandLock);
+}
+
+/**
+ * Sends a command, either right away (see panasonicCommandsAreSynchronous) or by
+ * queueing it for the I/O thread.  Returns whether the command succeeded or, if
+ * it was queued, true.
+ */
+static bool submitPanasonicCommand(pana_command_type_t type, const int64_t *values,
+                                   int numValues) {
+  if (panasonicCommandsAreSynchronous()) {
+    int64_t allValues[PANA_MAX_COMMAND_VALUES] = { 0 };
+    memcpy(allValues, values, numValues * sizeof(int64_t));
+    if (type == kPanaCommandTallyState) {
+      pthread_mutex_lock(&g_panaCommandLock);
+      g_requestedTallyState = values[0];
+      pthread_mutex_unlock(&g_panaCommandLock);
+    }
+    bool retval = sendPanasonicCommandNow(type, allValues);
+    if (!retval && type == kPanaCommandTallyState) {
+      finishPanasonicCommand(type, false);
+    }
+    return retval;
+  }
+  queuePanasonicCommand(type, values, numValues);
+  return true;
+}
+
+
+#pragma mark - I/O thread
+
+/** Starts all of a command's requests on the I/O thread's multi handle. */
+static void startPanasonicTransfer(pana_transfer_t *transfer) {
+  bool localDebug = pana_enable_debugging || false;
+  transfer->partsRemaining = panasonicCommandParts(transfer->type);
+  transfer->startTime = monotonicTimeNanos();
+
+  // The camera only speaks HTTP/1.1, so the requests for a multi-part command (the red
+  // and green tally lights) go out in parallel on separate keep-alive connections.
+  for (int part = 0; part < transfer->partsRemaining; part++) {
+    pana_request_t *request = &transfer->requests[part];
+    panasonicCommandRequest(transfer->type, transfer->values, part, request);
+
+    // Curl copies the URL, so it can live on the stack.
+    char URL[PANA_URL_BUFFER_SIZE];
+    if (!panasonicCommandURL(URL, sizeof(URL), request)) {
+      fprintf(stderr, "URL for Panasonic command %s is too long\n", request->command);
+      URL[0] = '\0';
+    }
+    if (localDebug) fprintf(stderr, "Queueing URL: %s\n", URL);
+
+    CURL *handle = checkOutCURLHandle();
+    transfer->handles[part] = handle;
+    transfer->buffers[part].data[0] = '\0';
+    transfer->buffers[part].len = 0;
+    curl_easy_setopt(handle, CURLOPT_URL, URL);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *)&transfer->buffers[part]);
+    curl_easy_setopt(handle, CURLOPT_PRIVATE, (void *)transfer);
+    curl_multi_add_handle(g_panaCurlMulti, handle);
+  }
+}
+
+/** Starts every queued command that can be started. */
+static void startPanasonicCommands(void) {
+  pana_command_type_t type;
+  int64_t values[PANA_MAX_COMMAND_VALUES];
+  while (takeNextPanasonicCommand(&type, values)) {
+    pana_transfer_t *transfer = &g_panaTransfers[type];
+    bzero(transfer, sizeof(*transfer));
+    transfer->type = type;
+    memcpy(transfer->values, values, sizeof(values));
+    startPanasonicTransfer(transfer);
+  }
+}
+
+/**
+ * Handles a finished request.  Once all of a command's requests have finished, updates
+ * the cached camera state.
+ */
+static void finishPanasonicTransfer(CURL *handle, CURLcode result) {
+  bool localDebug = pana_enable_debugging || false;
+  pana_transfer_t *transfer = NULL;
+  curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **)&transfer);
+  curl_multi_remove_handle(g_panaCurlMulti, handle);
+  checkInCURLHandle(handle);
+
+  int part = (transfer->handles[1] == handle) ? 1 : 0;
+  transfer->handles[part] = NULL;
+  const pana_request_t *request = &transfer->requests[part];
+  if (localDebug) {
+    fprintf(stderr, "%s returned \"%s\" (%.1f ms)\n", request->command,
+            transfer->buffers[part].data,
+            (monotonicTimeNanos() - transfer->startTime) / 1000000.0);
+  }
+  if (result != CURLE_OK) {
+    fprintf(stderr, "Panasonic command %s failed: %s\n", request->command,
+            curl_easy_strerror(result));
+  } else {
+    transfer->responses[part] =
+        panasonicResponseValue(transfer->buffers[part].data, request->command,
+                               request->responsePrefix);
+  }
+  recordPanasonicRequest(transfer->type, monotonicTimeNanos() - transfer->startTime,
+                         transfer->responses[part] != NULL);
+  if (--transfer->partsRemaining > 0) {
+    return;
+  }
+
+  int64_t now = monotonicTimeNanos();
+  bool succeeded = handlePanasonicResponses(transfer->type, transfer->values,
+                                            transfer->responses,
+                                            (transfer->startTime + now) / 2);
+  finishPanasonicCommand(transfer->type, succeeded);
+  if (transfer->type == kPanaCommandGetZoomPosition && !succeeded) {
+    g_nextZoomPollTime = now + kPanaZoomPollRetryNanos;
+  }
+  if (transfer->type == kPanaCommandGetPanTiltPosition && !succeeded) {
+    g_nextPanTiltPollTime = now + kPanaZoomPollRetryNanos;
+  }
+}
+
+/**
+ * Queues a request for the camera's state (if the previous request has finished and
+ * the next one is due).  Returns the number of milliseconds until the next request.
+ */
+static int pollPanasonicState(pana_command_type_t type, int64_t *nextPollTime,
+                              int64_t interval, int64_t now) {
+  pthread_mutex_lock(&g_panaCommandLock);
+  pana_command_slot_t *slot = &g_panaCommandSlots[type];
+  bool idle = !slot->pending && !slot->inFlight;
+  pthread_mutex_unlock(&g_panaCommandLock);
+
+  if (idle && now >= *nextPollTime) {
+    queuePanasonicCommand(type, NULL, 0);
+    *nextPollTime = now + interval;
+  }
+  return (int)MAX(1, MIN(1000, (*nextPollTime - now) / 1000000));
+}
+
+/**
+ * The main loop of the Panasonic I/O thread.
+ *
+ * This thread sends queued commands to the camera with the curl multi interface,
+ * so commands of different types run concurrently, and no caller ever waits for
+ * the camera.  It also polls the zoom position continuously (as often as the camera
+ * answers, up to the control loop's rate), the pan and tilt position when the camera
+ * drives them, and the tally state periodically, so that readers get recent values
+ * without asking the camera.
+ */
+void *runPanasonicIOThread(void *argIgnored) {
+  int64_t nextStatisticsTime = monotonicTimeNanos() + kPanaStatisticsIntervalNanos;
+  while (g_panaIOThreadRunning) {
+    int64_t now = monotonicTimeNanos();
+    if (now >= nextStatisticsTime) {
+      if (pana_enable_debugging) {
+        printPanasonicStatistics(kPanaStatisticsIntervalNanos);
+      }
+      nextStatisticsTime = now + kPanaStatisticsIntervalNanos;
+    }
+    int pollTimeout = 1000;
+    if (!gCalibrationMode) {
+      pollTimeout = pollPanasonicState(kPanaCommandGetZoomPosition, &g_nextZoomPollTime,
+                                       kPanaZoomPollIntervalNanos, now);
+      #if !PANASONIC_PTZ_ZOOM_ONLY
+        pollTimeout = MIN(pollTimeout,
+                          pollPanasonicState(kPanaCommandGetPanTiltPosition,
+                                             &g_nextPanTiltPollTime,
+                                             kPanaPanTiltPollIntervalNanos, now));
+      #endif
+    }
+    if (g_tallyPollingEnabled) {
+      pollTimeout = MIN(pollTimeout,
+                        pollPanasonicState(kPanaCommandGetTallyState, &g_nextTallyPollTime,
+                                           kPanaTallyPollIntervalNanos, now));
+    }
+    startPanasonicCommands();
+
+    int runningTransfers = 0;
+    curl_multi_perform(g_panaCurlMulti, &runningTransfers);
+
+    CURLMsg *message = NULL;
+    int remainingMessages = 0;
+    while ((message = curl_multi_info_read(g_panaCurlMulti, &remainingMessages)) != NULL) {
+      if (message->msg == CURLMSG_DONE) {
+        finishPanasonicTransfer(message->easy_handle, message->data.result);
+      }
+    }
+
+    // Newly queued commands wake this up early (curl_multi_wakeup).
+    curl_multi_poll(g_panaCurlMulti, NULL, 0, pollTimeout, NULL);
   }
+  return NULL;
 }
 
+
+#pragma mark - Camera control
+
 #if !PANASONIC_PTZ_ZOOM_ONLY
 
 // Public function.  Docs in header.
@@ -232,18 +1004,12 @@ bool panaSetPanTiltSpeed(int64_t panSpeed, int64_t tiltSpeed, bool isRaw) {
         isRaw ? tiltSpeed : scaleSpeed(tiltSpeed, SCALE_CORE, PAN_TILT_SCALE_HARDWARE,
                                        pana_tilt_scaled_data);
 
-    bool localDebug = pana_enable_debugging || false;
-    static int64_t last_zoom_position = 0;
-    char *values[2] = { panaIntString(scaledPanSpeed, 3, true), panaIntString(scaledTiltSpeed, 3, true) };
-    char *response = sendCommand("ptz", "#PTS", values, 2, "gz");
-    bool retval = false;
-    if (response != NULL) {
-        retval = true;
-        free(response);
-    }
-
-    FREEMULTI(values);
-    return retval;
+    // The camera's speeds go from 1 to 99, with 50 stopped.
+    int64_t values[2] = {
+        MAX(-PAN_TILT_SCALE_HARDWARE, MIN(PAN_TILT_SCALE_HARDWARE, scaledPanSpeed)) + 50,
+        MAX(-PAN_TILT_SCALE_HARDWARE, MIN(PAN_TILT_SCALE_HARDWARE, scaledTiltSpeed)) + 50
+    };
+    return submitPanasonicCommand(kPanaCommandPanTiltSpeed, values, 2);
 }
 
 // Public function.  Docs in header.
@@ -251,26 +1017,41 @@ bool panaSetPanTiltSpeed(int64_t panSpeed, int64_t tiltSpeed, bool isRaw) {
 // Moves the camera to the specified pan and tilt position.
 bool panaSetPanTiltPosition(int64_t panPosition, int64_t panSpeed,
                             int64_t tiltPosition, int64_t tiltSpeed) {
-    // Panasonic's documentation makes no sense, so this is probably wrong,
-    // and I don't have the hardware required to try it, so this should be
-    // considered entirely unsupported.  Why don't these use PAN_TILT_SCALE_HARDWARE?
-    int convertedPanSpeed = scaleSpeed(panSpeed, SCALE_CORE, 0x1D, NULL) - 1;    // Speeds are 0 through 0x1D?
-    int convertedTiltSpeed = scaleSpeed(tiltSpeed, SCALE_CORE, 3, NULL) - 1;  // Speeds are 0, 1, or 2?
-
-    char *values[4] = {
-        panaIntString(panPosition, 4, true),
-        panaIntString(tiltPosition, 4, true),
-        panaIntString(convertedPanSpeed, 2, true),
-        panaIntString(convertedTiltSpeed, 1, true)
-    };
-    char *response = sendCommand("ptz", "#APS", values, 4, "aPS");
-    if (response != NULL) {
-        free(response);
-        FREEMULTI(values);
-        return true;
+    // #APS takes a single speed (0 to 0x1D) for both axes, plus a speed table (0 is
+    // slow, 1 is medium, and 2 is fast).  Use the fast table so that the speed covers
+    // the camera's whole range, and use the faster axis's speed so that neither axis
+    // is slower than requested.
+    int64_t speed = MAX(llabs(panSpeed), llabs(tiltSpeed));
+    int64_t convertedSpeed = MAX(0, MIN(0x1D, scaleSpeed(speed, SCALE_CORE, 0x1D, NULL)));
+
+    int64_t values[4] = { MAX(0, MIN(0xFFFF, panPosition)), MAX(0, MIN(0xFFFF, tiltPosition)),
+                          convertedSpeed, 2 };
+    return submitPanasonicCommand(kPanaCommandPanTiltPosition, values, 4);
+}
+
+// Public function.  Docs in header.
+//
+// Stores the camera's current position in one of its presets.  This always waits for
+// the camera's reply, because callers rely on the preset actually being stored.
+bool panaSavePreset(int presetNumber) {
+    if (presetNumber < 0 || presetNumber > 99) {
+        fprintf(stderr, "Camera presets must be between 0 and 99.\n");
+        return false;
     }
-    FREEMULTI(values);
-    return false;
+    int64_t values[PANA_MAX_COMMAND_VALUES] = { presetNumber };
+    return sendPanasonicCommandNow(kPanaCommandSavePreset, values);
+}
+
+// Public function.  Docs in header.
+//
+// Tells the camera to move to one of its presets.
+bool panaRecallPreset(int presetNumber) {
+    if (presetNumber < 0 || presetNumber > 99) {
+        fprintf(stderr, "Camera presets must be between 0 and 99.\n");
+        return false;
+    }
+    int64_t value = presetNumber;
+    return submitPanasonicCommand(kPanaCommandRecallPreset, &value, 1);
 }
 #endif
 
@@ -295,107 +1076,124 @@ bool panaGetZoomRange(int64_t *min, int64_t *max) {
 
 // Public function.  Docs in header.
 //
-// Tells the camera to move to the specified zoom position.  Not used because we don't have
-// any real control over speed versus time that way.
+// Tells the camera to move to the specified zoom position.  Not used for zoom-only
+// cameras, because we don't have any real control over speed versus time that way.
 bool panaSetZoomPosition(int64_t position, int64_t maxSpeed) {
+    if (pana_enable_debugging) {
+        fprintf(stderr, "SET ZOOM POSITION TO %" PRId64 " SPEED %d\n", position, (int)maxSpeed);
+    }
 
-    fprintf(stderr, "SET ZOOM POSITION TO %" PRId64 " SPEED %d\n", position, (int)maxSpeed);
+    // The camera takes raw positions from 0x555 (wide) to 0xFFF (tele).
+    int64_t rawPosition = MAX(0x555, MIN(0xFFF, panaMakeZoomRaw(position)));
+    return submitPanasonicCommand(kPanaCommandZoomPosition, &rawPosition, 1);
+}
 
-    char *value = panaIntString(position, 3, true);
-    char *response = sendCommand("ptz", "#AXZ", &value, 1, "axz");
-    if (response != NULL) {
-        free(response);
-        free(value);
-        return true;
+/**
+ * Percent-encodes a string into a fixed-size buffer (like curl_easy_escape, but without
+ * allocating memory).  Returns false if the buffer is too small.
+ */
+static bool panaEscapeString(char *buffer, size_t bufferSize, const char *string) {
+    static const char *hexChars = "0123456789ABCDEF";
+    size_t length = 0;
+    for (const char *pos = string; *pos != '\0'; pos++) {
+        unsigned char c = (unsigned char)*pos;
+        bool unreserved = isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+        if (length + (unreserved ? 1 : 3) >= bufferSize) {
+            return false;
+        }
+        if (unreserved) {
+            buffer[length++] = c;
+        } else {
+            buffer[length++] = '%';
+            buffer[length++] = hexChars[c >> 4];
+            buffer[length++] = hexChars[c & 0xf];
+        }
     }
-    free(value);
-    return false;
+    buffer[length] = '\0';
+    return true;
 }
 
 /**
- * Sends the specified command to a Panasonic camera.
- *
- * @param group          The command group (CGI script name), typically "ptz" or "cam".
- * @param command        The command code.
- * @param values         An array of string values to concatenate onto the command.
- * @param numValues      The size of the additional values array.
- * @param responsePrefix The expected prefix for the response.
+ * Writes the URL for a request into a fixed-size buffer.  Returns false if the buffer
+ * is too small.
  *
- * @result
- *     Returns the response with the response prefix stripped from the beginning, and
- *     returns it as a newly allocated string.  This code prints a warning if the
- *     expected prefix is not present.
+ * @param URL     The buffer.
+ * @param URLSize The size of the buffer.
+ * @param request The request (command group, command code, and arguments).
  */
-char *sendCommand(const char *group, const char *command, char *values[],
-                  int numValues, const char *responsePrefix) {
-    CURL *curlQueryHandle = curl_easy_init();
-
-    // For thread safety.
-    curl_easy_setopt(curlQueryHandle, CURLOPT_NOSIGNAL, 1L);
-
-    // The following line deserves explanation.  I originally used a 2-second timeout, but
-    // then wondered why (when it turned out the camera's IP was wrong) this software failed to
-    // respond to control commands, then suddenly started moving uncontrollably minutes later.
-    // It turned out that received packets were queueing up in the kernel, and being basically
-    // delivered one per second because the tally light operations currently happen on the main
-    // network thread.  This should probably be moved to a separate thread, but a short timeout
-    // is still preferable, because you don't want the camera to keep zooming forever if a
-    // request stalls for any reason.
-    curl_easy_setopt(curlQueryHandle, CURLOPT_TIMEOUT_MS, 300);  // By IP, so very short limit.
-    curl_easy_setopt(curlQueryHandle, CURLOPT_WRITEFUNCTION, writeMemoryCallback);
-    curl_easy_setopt(curlQueryHandle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-
-    char *encoded_command = curl_easy_escape(curlQueryHandle, command, 0);
+static bool panasonicCommandURL(char *URL, size_t URLSize, const pana_request_t *request) {
     bool localDebug = pana_enable_debugging || false;
+    char encoded_command[32];
+    if (!panaEscapeString(encoded_command, sizeof(encoded_command), request->command)) {
+        return false;
+    }
 
     if (localDebug) {
-        fprintf(stderr, "Command: \"%s\" encoded command: \"%s\"\n", command, encoded_command);
+        fprintf(stderr, "Command: \"%s\" encoded command: \"%s\"\n", request->command,
+                encoded_command);
     }
 
-    char *URL = NULL;
-    char *valueString = NULL;
-    asprintf(&valueString, "%s", "");
-    for (int i = 0 ; i < numValues; i++) {
-        char *temp = valueString;
-        asprintf(&valueString, "%s%s", temp, values[i]);
-        free(temp);
+    int length = snprintf(URL, URLSize, "http://%s/cgi-bin/aw_%s?cmd=%s%s&res=1",
+                          g_cameraIPAddr, request->group, encoded_command, request->arguments);
+    return length >= 0 && (size_t)length < URLSize;
+}
+
+/**
+ * Returns the part of a response after the expected prefix (a pointer into the response
+ * itself), or NULL (with a warning) if the prefix is not present.
+ */
+static const char *panasonicResponseValue(const char *response, const char *command,
+                                          const char *responsePrefix) {
+    ssize_t prefixLength = strlen(responsePrefix);
+    if (!strncmp(response, responsePrefix, prefixLength)) {
+      return &(response[prefixLength]);
     }
+    fprintf(stderr, "Unexpected prefix %s for %s (expected %s)\n",
+            response, command, responsePrefix);
+    return NULL;
+}
 
-    asprintf(&URL, "http://%s/cgi-bin/aw_%s?cmd=%s%s&res=1",
-             g_cameraIPAddr, group, encoded_command, valueString);
+/**
+ * Sends the specified request to a Panasonic camera and waits for the response.
+ *
+ * @param request  The request (command group, command code, arguments, and the
+ *                 expected prefix for the response).
+ * @param response A buffer to hold the camera's response.
+ *
+ * @result
+ *     Returns the response with the response prefix stripped from the beginning (a
+ *     pointer into the response buffer), or NULL if the request failed.  This code
+ *     prints a warning if the expected prefix is not present.
+ */
+const char *sendCommand(const pana_request_t *request, curl_buffer_t *response) {
+    int64_t startTime = monotonicTimeNanos();
+    bool localDebug = pana_enable_debugging || false;
+
+    char URL[PANA_URL_BUFFER_SIZE];
+    if (!panasonicCommandURL(URL, sizeof(URL), request)) {
+        fprintf(stderr, "URL for Panasonic command %s is too long\n", request->command);
+        return NULL;
+    }
 
     if (localDebug || false) {
         fprintf(stderr, "Fetching URL: %s\n", URL);
     }
 
-    curl_buffer_t *data = fetchURLWithCURL(URL, curlQueryHandle);
+    CURL *curlQueryHandle = checkOutCURLHandle();
+    bool fetched = fetchURLWithCURL(URL, curlQueryHandle, response);
+    checkInCURLHandle(curlQueryHandle);
 
     if (localDebug || false) {
-        fprintf(stderr, "URL fetch raw return is \"%s\"\n", data ? data->data : NULL);
+        fprintf(stderr, "URL fetch raw return is \"%s\" (%.1f ms)\n",
+                fetched ? response->data : "(failed)",
+                (monotonicTimeNanos() - startTime) / 1000000.0);
     }
 
-    char *retval = NULL;
-    if (data != NULL) {
-      ssize_t prefixLength = strlen(responsePrefix);
-      if (!strncmp(data->data, responsePrefix, prefixLength)) {
-        asprintf(&retval, "%s", &(data->data[prefixLength]));
-      } else {
-        fprintf(stderr, "Unexpected prefix %s for %s (expected %s)\n",
-                data->data, command, responsePrefix);
-      }
-      freeURLBuffer(data);
-    } else if (localDebug) {
-        fprintf(stderr, "URL fetch returned NULL\n");
+    if (!fetched) {
+        if (localDebug) fprintf(stderr, "URL fetch returned NULL\n");
+        return NULL;
     }
-
-
-
-    free(encoded_command);
-    free(valueString);
-
-    curl_easy_cleanup(curlQueryHandle);
-
-    return retval;
+    return panasonicResponseValue(response->data, request->command, request->responsePrefix);
 }
 
 // Public function.  Docs in header.
@@ -409,79 +1207,127 @@ int64_t panaGetZoomSpeed(void) {
 
 // Public function.  Docs in header.
 //
-// Sets the camera's zoom speed.
+// Sets the camera's zoom speed.  If several speed changes arrive while the camera is
+// still handling an earlier one, only the newest is sent.
 int64_t panaGetZoomPositionRaw(void);
 bool panaSetZoomSpeed(int64_t speed, bool isRaw) {
     bool localDebug = false || pana_enable_debugging;
     gLastZoomSpeed = speed;
 
-    int intSpeed =
+    int64_t intSpeed =
         isRaw ? (speed + 50) : scaleSpeed(speed, SCALE_CORE, ZOOM_SCALE_HARDWARE,
                                           panasonicScaledZoomCalibrationData) + 50;
-    char *intSpeedString = panaIntString(intSpeed, 2, false);
 
     if (localDebug) {
         fprintf(stderr, "Zoom Core speed %" PRId64 "\n", speed);
-        fprintf(stderr, "Zoom Speed %d\n", intSpeed - 50);
-        fprintf(stderr, "Zoom Speed string %s\n", intSpeedString);
+        fprintf(stderr, "Zoom Speed %d\n", (int)intSpeed - 50);
     }
 
-    bool retval = true;
-    char *response = sendCommand("ptz", "#Z", &intSpeedString, 1, "zS");
-    if (!response || atoi(response) != intSpeed) {
-        retval = false;
-        free(response);
-    }
-    free(intSpeedString);
-    return retval;
+    return submitPanasonicCommand(kPanaCommandZoomSpeed, &intSpeed, 1);
 }
 
 // Public function.  Docs in header.
 //
-// Gets the camera's current pan and tilt position.
+// Gets the camera's pan and tilt position.  Once the I/O thread is polling, this is
+// its newest sample (at most one poll interval old).  Before the first sample arrives
+// (or during calibration), this asks the camera and waits for the answer.
 bool panaGetPanTiltPosition(int64_t *panPosition, int64_t *tiltPosition) {
-    bool localDebug = pana_enable_debugging || false;
-    static int64_t last_pan_position = 0;
-    static int64_t last_tilt_position = 0;
-    char *response = sendCommand("ptz", "#APC", NULL, 0, "aPC");
-    bool retval = false;
-    if (response != NULL) {
-        retval = true;
-        int32_t value = strtol(response, NULL, 16);
-        last_pan_position = (value >> 12) & 0xfff;
-        last_tilt_position = value & 0xfff;
-
-        if (localDebug) fprintf(stderr, "Pan position: %" PRId64 "\n", last_pan_position);
-        if (localDebug) fprintf(stderr, "Tilt position: %" PRId64 "\n", last_tilt_position);
-        free(response);
+    bool retval = true;
+    if (panasonicCommandsAreSynchronous() || !g_havePanTiltPosition) {
+        int64_t values[PANA_MAX_COMMAND_VALUES] = { 0 };
+        retval = sendPanasonicCommandNow(kPanaCommandGetPanTiltPosition, values);
+    }
+    if (!g_havePanTiltPosition) {
+        return false;
+    }
+    if (panPosition != NULL) {
+        *panPosition = g_lastPanPosition;
+    }
+    if (tiltPosition != NULL) {
+        *tiltPosition = g_lastTiltPosition;
     }
     return retval;
 }
 
+/**
+ * Returns the zoom speed (in linear positions per nanosecond) at a hardware speed
+ * (-49 to 49), or 0 if there is no calibration data.
+ */
+static double zoomPositionsPerNanosecond(int64_t hardwareSpeed, const int64_t *calibrationData) {
+    if (calibrationData == NULL || hardwareSpeed == 0) {
+        return 0;
+    }
+    double speed = calibrationData[MIN(llabs(hardwareSpeed), ZOOM_SCALE_HARDWARE)];
+    return ((hardwareSpeed < 0) ? -speed : speed) / NSEC_PER_SEC;
+}
+
+/**
+ * Estimates the zoom position at the specified time from a sample by assuming that
+ * the lens moved at the calibrated speed for whichever zoom speed was in effect.
+ * Estimates stop moving a short time after the sample, in case the samples stop
+ * arriving, and never leave the calibrated range.
+ */
+static int64_t extrapolateZoomPosition(const pana_zoom_sample_t *sample,
+                                       const pana_zoom_speed_history_t *history,
+                                       const int64_t *calibrationData,
+                                       int64_t minimumPosition, int64_t maximumPosition,
+                                       int64_t now) {
+    int64_t endTime = MIN(now, sample->timestamp + kPanaZoomExtrapolationLimitNanos);
+    if (endTime <= sample->timestamp) {
+        return sample->linearPosition;
+    }
+    double position = sample->linearPosition;
+    int64_t changeTime = MAX(sample->timestamp, MIN(history->changeTime, endTime));
+    position += zoomPositionsPerNanosecond(history->previousSpeed, calibrationData) *
+                (changeTime - sample->timestamp);
+    position += zoomPositionsPerNanosecond(history->speed, calibrationData) *
+                (endTime - changeTime);
+    if (maximumPosition > minimumPosition) {
+        position = MAX(minimumPosition, MIN(maximumPosition, position));
+    }
+    return llround(position);
+}
+
 // Similar to panaGetZoomPosition, but does not correct for the nonlinearity of
 // the position data.  [redacted swearing at Panasonic]
+//
+// Returns the newest position from the I/O thread's polling, or (during calibration,
+// or before the first poll has finished) asks the camera.
 int64_t panaGetZoomPositionRaw(void) {
-    bool localDebug = pana_enable_debugging || false;
-    static int64_t last_zoom_position = 0;
-    char *response = sendCommand("ptz", "#GZ", NULL, 0, "gz");
-    if (response != NULL && strlen(response)) {
-        int32_t value = strtol(response, NULL, 16);
-        last_zoom_position = value;
-        if (localDebug) fprintf(stderr, "Zoom position: %" PRId64 "\n", last_zoom_position);
-        free(response);
-    } else {
-        if (localDebug) fprintf(stderr, "Did not get response from CGI.  Returning last value.\n");
+    pthread_mutex_lock(&g_zoomStateLock);
+    bool haveSample = g_zoomSample.valid;
+    pthread_mutex_unlock(&g_zoomStateLock);
+    if (panasonicCommandsAreSynchronous() || !haveSample) {
+        int64_t values[PANA_MAX_COMMAND_VALUES] = { 0 };
+        sendPanasonicCommandNow(kPanaCommandGetZoomPosition, values);
     }
-    return last_zoom_position;
+    pthread_mutex_lock(&g_zoomStateLock);
+    int64_t retval = g_zoomSample.rawPosition;
+    pthread_mutex_unlock(&g_zoomStateLock);
+    return retval;
 }
 
 // Public function.  Docs in header.
 //
-// Gets the camera's current zoom position.
+// Gets the camera's current zoom position, estimated from the newest sample and the
+// zoom speed since then.
 int64_t panaGetZoomPosition(void) {
     bool localDebug = false;
-    int64_t nonlinearZoomPosition = panaGetZoomPositionRaw();
-    int64_t retval = panaMakeZoomLinear(nonlinearZoomPosition);
+    if (panasonicCommandsAreSynchronous()) {
+        return panaMakeZoomLinear(panaGetZoomPositionRaw());
+    }
+    pthread_mutex_lock(&g_zoomStateLock);
+    pana_zoom_sample_t sample = g_zoomSample;
+    pana_zoom_speed_history_t history = g_zoomSpeedHistory;
+    pthread_mutex_unlock(&g_zoomStateLock);
+    if (!sample.valid) {
+        // Don't extrapolate from an empty sample.  Ask the camera instead.
+        return panaMakeZoomLinear(panaGetZoomPositionRaw());
+    }
+
+    int64_t retval = extrapolateZoomPosition(&sample, &history, panasonicZoomCalibrationData,
+                                             g_zoomMinimumPosition, g_zoomMaximumPosition,
+                                             monotonicTimeNanos());
     if (localDebug) {
         fprintf(stderr, "ZOOMPOS: %" PRId64 "\n", retval);
     }
@@ -490,36 +1336,17 @@ int64_t panaGetZoomPosition(void) {
 
 // Public function.  Docs in header.
 //
-// Returns the camera's current tally light state.
+// Returns the camera's most recently reported tally light state.  The first call
+// starts the I/O thread polling for changes.
 int panaGetTallyState(void) {
-    bool localDebug = pana_enable_debugging || false;
-    static int g_last_tally_state = 0;
-    bool redState = false;
-    bool greenState = false;
-    if (localDebug) fprintf(stderr, "Fetching RED\n");
-
-    char *redResponse = sendCommand("cam", "QLR", NULL, 0, "OLR:");
-    char *greenResponse = sendCommand("cam", "QLG", NULL, 0, "OLG:");
-
-    if (redResponse != NULL && greenResponse != NULL) {
-        redState = redResponse[0] == '1';
-
-        greenState = greenResponse[0] == '1';
-
-        g_last_tally_state = redState ? kTallyStateRed : greenState ? kTallyStateGreen : 0;
-        if (localDebug) {
-            fprintf(stderr, "Tally state: %d\n", g_last_tally_state);
-        }
-    } else if (localDebug) {
-        fprintf(stderr, "Request failed.  Returning previons tally state: %d\n", g_last_tally_state);
-    }
-    if (redResponse != NULL) {
-        free(redResponse);
+    if (panasonicCommandsAreSynchronous()) {
+        int64_t values[PANA_MAX_COMMAND_VALUES] = { 0 };
+        sendPanasonicCommandNow(kPanaCommandGetTallyState, values);
+    } else if (!g_tallyPollingEnabled) {
+        g_tallyPollingEnabled = true;
+        curl_multi_wakeup(g_panaCurlMulti);
     }
-    if (greenResponse != NULL) {
-        free(greenResponse);
-    }
-    return g_last_tally_state;
+    return g_lastTallyState;
 }
 
 // Public function.  Docs in header.
@@ -532,75 +1359,112 @@ bool panaSetTallyState(int tallyState) {
                 tallyStateName(tallyState));
     }
 
-    bool localDebug = pana_enable_debugging || false;
-    int redState = (tallyState == 5);
-    int greenState = (tallyState == 6);
-    if (localDebug) fprintf(stderr, "Fetching RED\n");
-
-    char *redTallyState = panaIntString(redState, 1, false);
-    char *greenTallyState = panaIntString(greenState, 1, false);
+    int64_t value = tallyState;
+    return submitPanasonicCommand(kPanaCommandTallyState, &value, 1);
+}
 
-    char *redResponse = sendCommand("cam", "TLR:", &redTallyState, 1, "TLR:");
-    char *greenResponse = sendCommand("cam", "TLG:", &greenTallyState, 1, "TLG:");
 
-    bool retval = (redResponse != NULL && greenResponse != NULL);
+#pragma mark - URL support
 
-    if (redResponse != NULL) {
-        free(redResponse);
-    }
-    if (greenResponse != NULL) {
-        free(greenResponse);
-    }
-    free(redTallyState);
-    free(greenTallyState);
+/** Locks the part of the shared curl cache that curl is about to use. */
+static void lockCURLShare(CURL *handle, curl_lock_data data, curl_lock_access access,
+                          void *userptr) {
+  pthread_mutex_lock(&g_curlShareLocks[data]);
+}
 
-    return retval;
+/** Unlocks the part of the shared curl cache that curl is done using. */
+static void unlockCURLShare(CURL *handle, curl_lock_data data, void *userptr) {
+  pthread_mutex_unlock(&g_curlShareLocks[data]);
 }
 
+/**
+ * Returns an idle curl handle (reusing one from the pool if possible).  Reusing
+ * handles lets curl keep its HTTP/1.1 connections to the camera alive, so that
+ * most commands don't have to wait for a new TCP handshake.
+ */
+static CURL *checkOutCURLHandle(void) {
+  pthread_mutex_lock(&g_curlHandlePoolLock);
+  if (g_curlHandlePoolCount > 0) {
+    CURL *handle = g_curlHandlePool[--g_curlHandlePoolCount];
+    pthread_mutex_unlock(&g_curlHandlePoolLock);
+    return handle;
+  }
+  pthread_mutex_unlock(&g_curlHandlePoolLock);
+
+  CURL *handle = curl_easy_init();
+
+  // For thread safety.
+  curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+
+  // The following line deserves explanation.  I originally used a 2-second timeout, but
+  // then wondered why (when it turned out the camera's IP was wrong) this software failed to
+  // respond to control commands, then suddenly started moving uncontrollably minutes later.
+  // It turned out that received packets were queueing up in the kernel, and being basically
+  // delivered one per second because the tally light operations happened on the main
+  // network thread.  Commands now go through the I/O thread (runPanasonicIOThread), but a
+  // short timeout is still preferable, because you don't want the camera to keep zooming
+  // forever if a request stalls for any reason.
+  curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, 300);  // By IP, so very short limit.
+  curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writeMemoryCallback);
+  curl_easy_setopt(handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+
+  // Keep connections open between commands, and notice when the camera goes away.
+  curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(handle, CURLOPT_TCP_NODELAY, 1L);
+  if (g_curlShare != NULL) {
+    curl_easy_setopt(handle, CURLOPT_SHARE, g_curlShare);
+  }
+  return handle;
+}
 
-#pragma mark - URL support
+/** Returns a curl handle to the pool (or frees it if the pool is full). */
+static void checkInCURLHandle(CURL *handle) {
+  pthread_mutex_lock(&g_curlHandlePoolLock);
+  if (g_curlHandlePoolCount < PANA_CURL_HANDLE_POOL_SIZE) {
+    g_curlHandlePool[g_curlHandlePoolCount++] = handle;
+    handle = NULL;
+  }
+  pthread_mutex_unlock(&g_curlHandlePoolLock);
+  if (handle != NULL) {
+    curl_easy_cleanup(handle);
+  }
+}
 
-/** Fetches the provided URL with the provided handle and returns the data in a buffer. */
-curl_buffer_t *fetchURLWithCURL(char *URL, CURL *handle) {
-  curl_buffer_t *chunk = malloc(sizeof(curl_buffer_t));;
-  chunk->data = malloc(1);
-  chunk->len = 0;
+/**
+ * Fetches the provided URL with the provided handle and stores the data in the provided
+ * buffer.  Returns false if the request fails (or the response doesn't fit).
+ */
+bool fetchURLWithCURL(const char *URL, CURL *handle, curl_buffer_t *buffer) {
+  buffer->data[0] = '\0';
+  buffer->len = 0;
 
   curl_easy_setopt(handle, CURLOPT_URL, URL);
-  curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *)chunk);
+  curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *)buffer);
 
   CURLcode res = curl_easy_perform(handle);
 
   if(res != CURLE_OK) {
     fprintf(stderr, "curl_easy_perform() failed: %s\n",
         curl_easy_strerror(res));
-    free(chunk->data);
-    free(chunk);
-    return NULL;
+    return false;
   }
-
-  return chunk;
-}
-
-/** Frees a curl_buffer_t, including the data inside it. */
-void freeURLBuffer(curl_buffer_t *buffer) {
-  free(buffer->data);
-  free(buffer);
+  return true;
 }
 
-/** Curl callback that accumulates data in an in-memory buffer. */
+/**
+ * Curl callback that accumulates data in a fixed-size buffer.  A response that doesn't
+ * fit makes the request fail.
+ */
 static size_t writeMemoryCallback(void *contents, size_t chunkSize, size_t nChunks, void *userp)
 {
   size_t totalSize = chunkSize * nChunks;
   curl_buffer_t *chunk = (curl_buffer_t *)userp;
 
-  char *ptr = realloc(chunk->data, chunk->len + totalSize + 1);
-  if(!ptr) {
-    fprintf(stderr, "Out of memory in realloc\n");
+  if (chunk->len + totalSize >= sizeof(chunk->data)) {
+    fprintf(stderr, "Response too long for buffer\n");
     return 0;
   }
 
-  chunk->data = ptr;
   bcopy(contents, &(chunk->data[chunk->len]), totalSize);
   chunk->len += totalSize;
   chunk->data[chunk->len] = 0;
@@ -608,48 +1472,417 @@ static size_t writeMemoryCallback(void *contents, size_t chunkSize, size_t nChun
   return totalSize;
 }
 
+#pragma mark - Benchmarks
 
-#pragma mark - Tests
+/** How often the polling path reads the position and sets the speed (the control loop's rate). */
+static const int64_t kPanaBenchmarkControlIntervalNanos = 10 * 1000000;
 
-/** Runs some basic tests of miscellaneous routines. */
-void runPanasonicTests(void) {
-  fprintf(stderr, "Running Panasonic module tests.\n");
+/** How often the native path reads the position (the I/O thread's rate for status reporting). */
+static const int64_t kPanaBenchmarkReportIntervalNanos = 100 * 1000000;
 
-  char *tempValue = panaIntString(0x444, 2, true);
-  assert(!strcmp(tempValue, "444"));
-  free(tempValue);
+/**
+ * The slowest speed that the polling path uses before it gets close.  The camera barely
+ * moves at the lowest few speeds.
+ */
+static const int64_t kPanaBenchmarkCreepSpeed = 10;
 
-  tempValue = panaIntString(0x444, 3, true);
-  assert(!strcmp(tempValue, "444"));
-  free(tempValue);
+/** How long a benchmark move can take before it fails. */
+static const int64_t kPanaBenchmarkTimeoutNanos = 10 * NSEC_PER_SEC;
 
-  tempValue = panaIntString(0x444, 3, true);
-  assert(!strcmp(tempValue, "444"));
-  free(tempValue);
+/** How long to wait after a move before measuring how far from the target it stopped. */
+static const int64_t kPanaBenchmarkSettleNanos = 500 * 1000000;
 
-  tempValue = panaIntString(0x444, 4, true);
-  assert(!strcmp(tempValue, "0444"));
-  free(tempValue);
+/** A move for the camera benchmark, in raw camera positions. */
+typedef struct {
+  const char *name;              //! The axes that move.
+  bool panTilt;                  //! True for pan and tilt (#PTS, #APS, #APC), or false for zoom.
+  int64_t startPositions[2];     //! The zoom position, or the pan and tilt positions.
+  int64_t targetPositions[2];    //! The zoom position, or the pan and tilt positions.
+} pana_benchmark_move_t;
+
+static const pana_benchmark_move_t kPanaBenchmarkMoves[] = {
+  { "zoom", false, { 0x600, 0 }, { 0xE00, 0 } },
+#if !PANASONIC_PTZ_ZOOM_ONLY
+  { "pan_tilt", true, { 0x6000, 0x6000 }, { 0xA000, 0x7800 } },
+#endif
+};
 
-  tempValue = panaIntString(0x444, 5, true);
-  assert(!strcmp(tempValue, "00444"));
-  free(tempValue);
+/** The results of one benchmark move. */
+typedef struct {
+  pana_command_statistics_t requests;  //! Every request sent during the move.
+  double elapsedTime;                  //! Seconds from the start of the move until it ended.
+  double moveTime;                     //! Seconds until every axis got close (or NAN).
+  int64_t finalError;                  //! Distance from the target after settling.
+} pana_benchmark_result_t;
 
-  tempValue = panaIntString(333, 2, false);
-  assert(!strcmp(tempValue, "333"));
-  free(tempValue);
+/**
+ * Asks the camera for the position of the axes in a benchmark move and stores it in
+ * positions.  Returns false if the request failed.
+ */
+static bool panaBenchmarkReadPositions(const pana_benchmark_move_t *move, int64_t *positions) {
+  int64_t values[PANA_MAX_COMMAND_VALUES] = { 0 };
+  if (move->panTilt) {
+    if (!sendPanasonicCommandNow(kPanaCommandGetPanTiltPosition, values)) {
+      return false;
+    }
+    positions[0] = g_lastPanPosition;
+    positions[1] = g_lastTiltPosition;
+  } else {
+    if (!sendPanasonicCommandNow(kPanaCommandGetZoomPosition, values)) {
+      return false;
+    }
+    pthread_mutex_lock(&g_zoomStateLock);
+    positions[0] = g_zoomSample.rawPosition;
+    pthread_mutex_unlock(&g_zoomStateLock);
+  }
+  return true;
+}
+
+/** Tells the camera to move the axes in a benchmark move to positions on its own. */
+static bool panaBenchmarkMoveTo(const pana_benchmark_move_t *move, const int64_t *positions) {
+  int64_t values[PANA_MAX_COMMAND_VALUES] = { positions[0], positions[1], 0x1D, 2 };
+  return sendPanasonicCommandNow(move->panTilt ? kPanaCommandPanTiltPosition :
+                                                 kPanaCommandZoomPosition, values);
+}
+
+/** Sets the speed (-49 to 49) of the axes in a benchmark move. */
+static bool panaBenchmarkSetSpeeds(const pana_benchmark_move_t *move, const int64_t *speeds) {
+  int64_t values[PANA_MAX_COMMAND_VALUES] = { speeds[0] + 50, speeds[1] + 50 };
+  return sendPanasonicCommandNow(move->panTilt ? kPanaCommandPanTiltSpeed :
+                                                 kPanaCommandZoomSpeed, values);
+}
+
+/**
+ * Moves the camera to the start of a benchmark move and waits for it to get there, then
+ * performs the move, either by setting the speed and polling the position at the control
+ * loop's rate, or (if native is true) by letting the camera perform it and polling only
+ * for status.  Fills in result and returns true if the camera reached the target.
+ */
+static bool panaRunBenchmarkMove(const pana_benchmark_move_t *move, bool native,
+                                 pana_benchmark_result_t *result) {
+  int numAxes = move->panTilt ? 2 : 1;
+  int64_t tolerance[2] = { 0, 0 };
+  int64_t positions[2] = { 0, 0 };
+  for (int axis = 0; axis < numAxes; axis++) {
+    tolerance[axis] = MAX(llabs(move->targetPositions[axis] - move->startPositions[axis]) / 200, 2);
+  }
+
+  // Get into position first.  None of this counts.
+  panaBenchmarkMoveTo(move, move->startPositions);
+  for (int64_t startTime = monotonicTimeNanos();
+       monotonicTimeNanos() - startTime < kPanaBenchmarkTimeoutNanos; ) {
+    usleep(kPanaBenchmarkReportIntervalNanos / 1000);
+    if (panaBenchmarkReadPositions(move, positions) &&
+        llabs(positions[0] - move->startPositions[0]) <= tolerance[0] &&
+        llabs(positions[1] - move->startPositions[1]) <= tolerance[1]) {
+      break;
+    }
+  }
+  pana_command_statistics_t statistics[kNumPanaCommandTypes];
+  takePanasonicStatistics(statistics);
+
+  int64_t startTime = monotonicTimeNanos();
+  int64_t interval = native ? kPanaBenchmarkReportIntervalNanos :
+                              kPanaBenchmarkControlIntervalNanos;
+  int64_t nextTime = startTime;
+  int64_t lastSpeeds[2] = { 0, 0 };
+  result->moveTime = NAN;
+  if (native) {
+    panaBenchmarkMoveTo(move, move->targetPositions);
+  }
+  while (monotonicTimeNanos() - startTime < kPanaBenchmarkTimeoutNanos) {
+    if (panaBenchmarkReadPositions(move, positions)) {
+      // Full speed (49 on every axis) until the last quarter of the move, then slow
+      // down in proportion to the remaining distance, but not below the creep speed.
+      bool arrived = true;
+      int64_t speeds[2] = { 0, 0 };
+      for (int axis = 0; axis < numAxes; axis++) {
+        int64_t remaining = move->targetPositions[axis] - positions[axis];
+        int64_t slowdownDistance =
+            MAX(llabs(move->targetPositions[axis] - move->startPositions[axis]) / 4, 1);
+        if (llabs(remaining) > tolerance[axis]) {
+          arrived = false;
+          speeds[axis] = MAX(kPanaBenchmarkCreepSpeed, MIN(49, llabs(remaining) * 49 / slowdownDistance));
+          speeds[axis] *= (remaining < 0) ? -1 : 1;
+        }
+      }
+      if (arrived) {
+        result->moveTime = (monotonicTimeNanos() - startTime) / 1.0e9;
+        break;
+      }
+      if (!native && (speeds[0] != lastSpeeds[0] || speeds[1] != lastSpeeds[1]) &&
+          panaBenchmarkSetSpeeds(move, speeds)) {
+        memcpy(lastSpeeds, speeds, sizeof(lastSpeeds));
+      }
+    }
+    nextTime += interval;
+    int64_t delay = nextTime - monotonicTimeNanos();
+    if (delay > 0) {
+      usleep(delay / 1000);
+    }
+  }
+  if (lastSpeeds[0] != 0 || lastSpeeds[1] != 0) {
+    int64_t stopped[2] = { 0, 0 };
+    panaBenchmarkSetSpeeds(move, stopped);
+  }
+  result->elapsedTime = (monotonicTimeNanos() - startTime) / 1.0e9;
+
+  takePanasonicStatistics(statistics);
+  bzero(&result->requests, sizeof(result->requests));
+  for (pana_command_type_t type = 0; type < kNumPanaCommandTypes; type++) {
+    result->requests.requests += statistics[type].requests;
+    result->requests.failures += statistics[type].failures;
+    result->requests.totalLatencyNanos += statistics[type].totalLatencyNanos;
+    result->requests.maxLatencyNanos =
+        MAX(result->requests.maxLatencyNanos, statistics[type].maxLatencyNanos);
+  }
+
+  // Measure any coasting or overshoot after the move, without counting the request.
+  usleep(kPanaBenchmarkSettleNanos / 1000);
+  result->finalError = -1;
+  if (panaBenchmarkReadPositions(move, positions)) {
+    result->finalError = 0;
+    for (int axis = 0; axis < numAxes; axis++) {
+      result->finalError = MAX(result->finalError,
+                               llabs(positions[axis] - move->targetPositions[axis]));
+    }
+  }
+  takePanasonicStatistics(statistics);
+  return !isnan(result->moveTime);
+}
+
+// Public function.  Docs in header.
+//
+// Performs each benchmark move both ways and prints a table comparing them.
+bool panaRunBenchmarks(void) {
+  bool allPassed = true;
+  fprintf(stdout, "path\taxes\trequests\trequests_per_s\tfailures\tmean_latency_ms\t"
+                  "max_latency_ms\tmove_s\tfinal_error\tstatus\n");
+  for (int i = 0; i < sizeof(kPanaBenchmarkMoves) / sizeof(kPanaBenchmarkMoves[0]); i++) {
+    for (int native = 0; native <= 1; native++) {
+      const pana_benchmark_move_t *move = &kPanaBenchmarkMoves[i];
+      pana_benchmark_result_t result;
+      bool passed = panaRunBenchmarkMove(move, native, &result);
+      if (!passed) {
+        fprintf(stderr, "Camera benchmark FAILED: the %s path did not finish the %s move.\n",
+                native ? "native" : "polling", move->name);
+        allPassed = false;
+      }
+      fprintf(stdout, "%s\t%s\t%" PRId64 "\t%.1lf\t%" PRId64 "\t%.2lf\t%.2lf\t%.3lf\t%" PRId64 "\t%s\n",
+              native ? "native" : "polling", move->name, result.requests.requests,
+              result.requests.requests / result.elapsedTime, result.requests.failures,
+              result.requests.requests ?
+                  result.requests.totalLatencyNanos / 1.0e6 / result.requests.requests : 0,
+              result.requests.maxLatencyNanos / 1.0e6, result.moveTime, result.finalError,
+              passed ? "ok" : "FAILED");
+    }
+  }
+  return allPassed;
+}
 
-  tempValue = panaIntString(333, 3, false);
-  assert(!strcmp(tempValue, "333"));
-  free(tempValue);
+#pragma mark - Tests
 
-  tempValue = panaIntString(333, 4, false);
-  assert(!strcmp(tempValue, "0333"));
-  free(tempValue);
+/** Runs some basic tests of miscellaneous routines. */
+void runPanasonicTests(void) {
+  fprintf(stderr, "Running Panasonic module tests.\n");
 
-  tempValue = panaIntString(333, 5, false);
-  assert(!strcmp(tempValue, "00333"));
-  free(tempValue);
+  char testBuffer[16] = "";
+  assert(panaAppendInt(testBuffer, sizeof(testBuffer), 0x444, 2, true));
+  assert(!strcmp(testBuffer, "444"));
+
+  testBuffer[0] = '\0';
+  assert(panaAppendInt(testBuffer, sizeof(testBuffer), 0x444, 3, true));
+  assert(!strcmp(testBuffer, "444"));
+
+  testBuffer[0] = '\0';
+  assert(panaAppendInt(testBuffer, sizeof(testBuffer), 0x444, 4, true));
+  assert(!strcmp(testBuffer, "0444"));
+
+  testBuffer[0] = '\0';
+  assert(panaAppendInt(testBuffer, sizeof(testBuffer), 0x444, 5, true));
+  assert(!strcmp(testBuffer, "00444"));
+
+  testBuffer[0] = '\0';
+  assert(panaAppendInt(testBuffer, sizeof(testBuffer), 333, 2, false));
+  assert(!strcmp(testBuffer, "333"));
+
+  testBuffer[0] = '\0';
+  assert(panaAppendInt(testBuffer, sizeof(testBuffer), 333, 4, false));
+  assert(!strcmp(testBuffer, "0333"));
+
+  // Values are appended, and values that don't fit are reported.
+  assert(panaAppendInt(testBuffer, sizeof(testBuffer), 0x1f, 3, true));
+  assert(!strcmp(testBuffer, "033301f"));
+  assert(!panaAppendInt(testBuffer, 10, 333, 5, false));
+
+  int64_t testParsedValue = 0;
+  assert(panaParseInt("555", true, &testParsedValue) && testParsedValue == 0x555);
+  assert(panaParseInt("80008000", true, &testParsedValue) && testParsedValue == 0x80008000);
+  assert(panaParseInt("AbC\r\n", true, &testParsedValue) && testParsedValue == 0xabc);
+  assert(panaParseInt("49", false, &testParsedValue) && testParsedValue == 49);
+  assert(!panaParseInt("4a", false, &testParsedValue));
+  assert(!panaParseInt("", true, &testParsedValue));
+  assert(!panaParseInt("12 3", true, &testParsedValue));
+
+  // Requests are built and responses are parsed in place.
+  char *savedIPAddr = g_cameraIPAddr;
+  g_cameraIPAddr = "192.0.2.1";
+  pana_request_t testRequest;
+  char testURL[PANA_URL_BUFFER_SIZE];
+  int64_t testPanTiltValues[PANA_MAX_COMMAND_VALUES] = { 0x1234, 0x5678, 0x1d, 2 };
+  panasonicCommandRequest(kPanaCommandPanTiltPosition, testPanTiltValues, 0, &testRequest);
+  assert(panasonicCommandURL(testURL, sizeof(testURL), &testRequest));
+  assert(!strcmp(testURL, "http://192.0.2.1/cgi-bin/aw_ptz?cmd=%23APS123456781d2&res=1"));
+  assert(!panasonicCommandURL(testURL, 40, &testRequest));
+
+  int64_t testTallyValue[PANA_MAX_COMMAND_VALUES] = { kTallyStateGreen };
+  panasonicCommandRequest(kPanaCommandTallyState, testTallyValue, 1, &testRequest);
+  assert(panasonicCommandURL(testURL, sizeof(testURL), &testRequest));
+  assert(!strcmp(testURL, "http://192.0.2.1/cgi-bin/aw_cam?cmd=TLG%3A1&res=1"));
+
+  // Camera-side moves and presets.
+  int64_t testSpeedValues[PANA_MAX_COMMAND_VALUES] = { 1, 99 };
+  panasonicCommandRequest(kPanaCommandPanTiltSpeed, testSpeedValues, 0, &testRequest);
+  assert(!strcmp(testRequest.command, "#PTS") && !strcmp(testRequest.arguments, "0199"));
+  int64_t testZoomValue[PANA_MAX_COMMAND_VALUES] = { 0x555 };
+  panasonicCommandRequest(kPanaCommandZoomPosition, testZoomValue, 0, &testRequest);
+  assert(!strcmp(testRequest.command, "#AXZ") && !strcmp(testRequest.arguments, "555"));
+  int64_t testPresetValue[PANA_MAX_COMMAND_VALUES] = { 7 };
+  panasonicCommandRequest(kPanaCommandRecallPreset, testPresetValue, 0, &testRequest);
+  assert(!strcmp(testRequest.command, "#R") && !strcmp(testRequest.arguments, "07"));
+  panasonicCommandRequest(kPanaCommandSavePreset, testPresetValue, 0, &testRequest);
+  assert(!strcmp(testRequest.command, "#M") && !strcmp(testRequest.arguments, "07"));
+  const char *testPresetResponses[1] = { "07" };
+  assert(handlePanasonicResponses(kPanaCommandSavePreset, testPresetValue,
+                                  testPresetResponses, 0));
+  testPresetResponses[0] = "08";
+  assert(!handlePanasonicResponses(kPanaCommandSavePreset, testPresetValue,
+                                   testPresetResponses, 0));
+
+  const char *testPanTiltResponses[1] = { "2D098E38" };
+  assert(handlePanasonicResponses(kPanaCommandGetPanTiltPosition, testPresetValue,
+                                  testPanTiltResponses, 0));
+  assert(g_lastPanPosition == 0x2D09 && g_lastTiltPosition == 0x8E38);
+  g_havePanTiltPosition = false;
+
+  const char *testResponse = "aPC80008000";
+  assert(panasonicResponseValue(testResponse, "#APC", "aPC") == testResponse + 3);
+
+  #ifdef PANA_HEAP_IN_USE
+    // Neither building requests nor parsing responses uses the heap.
+    size_t heapInUse = PANA_HEAP_IN_USE();
+    for (int i = 0; i < 1000; i++) {
+      for (pana_command_type_t type = 0; type < kNumPanaCommandTypes; type++) {
+        for (int part = 0; part < panasonicCommandParts(type); part++) {
+          panasonicCommandRequest(type, testPanTiltValues, part, &testRequest);
+          assert(panasonicCommandURL(testURL, sizeof(testURL), &testRequest));
+        }
+      }
+      const char *value = panasonicResponseValue(testResponse, "#APC", "aPC");
+      assert(panaParseInt(value, true, &testParsedValue));
+      assert(PANA_HEAP_IN_USE() == heapInUse);
+    }
+  #endif
+  g_cameraIPAddr = savedIPAddr;
+
+  // Queued zoom speeds collapse to the newest one, and keep their place in line.
+  int64_t testValue = 60;
+  assert(queuePanasonicCommand(kPanaCommandZoomSpeed, &testValue, 1));
+  assert(queuePanasonicCommand(kPanaCommandGetZoomPosition, NULL, 0));
+  testValue = 75;
+  assert(queuePanasonicCommand(kPanaCommandZoomSpeed, &testValue, 1));
+  assert(queuePanasonicCommand(kPanaCommandGetZoomPosition, NULL, 0));
+  assert(g_panaCommandOrderCount == 2);
+
+  pana_command_type_t testType;
+  int64_t testValues[PANA_MAX_COMMAND_VALUES];
+  assert(takeNextPanasonicCommand(&testType, testValues));
+  assert(testType == kPanaCommandZoomSpeed && testValues[0] == 75);
+
+  // A newer speed waits until the one being sent finishes, so speeds arrive in order.
+  testValue = 40;
+  assert(queuePanasonicCommand(kPanaCommandZoomSpeed, &testValue, 1));
+  assert(takeNextPanasonicCommand(&testType, testValues));
+  assert(testType == kPanaCommandGetZoomPosition);
+  assert(!takeNextPanasonicCommand(&testType, testValues));
+  finishPanasonicCommand(kPanaCommandZoomSpeed, true);
+  finishPanasonicCommand(kPanaCommandGetZoomPosition, true);
+  assert(takeNextPanasonicCommand(&testType, testValues));
+  assert(testType == kPanaCommandZoomSpeed && testValues[0] == 40);
+  finishPanasonicCommand(kPanaCommandZoomSpeed, true);
+
+  // Repeated tally changes are dropped unless the previous change failed.
+  testValue = kTallyStateRed;
+  assert(queuePanasonicCommand(kPanaCommandTallyState, &testValue, 1));
+  assert(takeNextPanasonicCommand(&testType, testValues));
+  assert(!queuePanasonicCommand(kPanaCommandTallyState, &testValue, 1));
+  finishPanasonicCommand(kPanaCommandTallyState, true);
+  assert(!queuePanasonicCommand(kPanaCommandTallyState, &testValue, 1));
+  testValue = kTallyStateGreen;
+  assert(queuePanasonicCommand(kPanaCommandTallyState, &testValue, 1));
+  assert(takeNextPanasonicCommand(&testType, testValues));
+  finishPanasonicCommand(kPanaCommandTallyState, false);
+  assert(queuePanasonicCommand(kPanaCommandTallyState, &testValue, 1));
+  assert(takeNextPanasonicCommand(&testType, testValues));
+  finishPanasonicCommand(kPanaCommandTallyState, true);
+  assert(g_panaCommandOrderCount == 0);
+  g_requestedTallyState = -1;
+
+  // Multi-part responses update the cached state only if every part succeeded.
+  const char *tallyResponses[2] = { "1", "0" };
+  assert(handlePanasonicResponses(kPanaCommandGetTallyState, testValues, tallyResponses, 0));
+  assert(g_lastTallyState == kTallyStateRed);
+  tallyResponses[0] = NULL;
+  assert(!handlePanasonicResponses(kPanaCommandGetTallyState, testValues, tallyResponses, 0));
+  assert(g_lastTallyState == kTallyStateRed);
+
+  // Only real tally changes are recorded as changes.
+  tallyResponses[0] = "0";
+  tallyResponses[1] = "1";
+  assert(handlePanasonicResponses(kPanaCommandGetTallyState, testValues, tallyResponses, 5));
+  assert(g_lastTallyState == kTallyStateGreen && g_lastTallyChangeTime == 5);
+  assert(handlePanasonicResponses(kPanaCommandGetTallyState, testValues, tallyResponses, 9));
+  assert(g_lastTallyChangeTime == 5);
+  g_lastTallyState = 0;
+  g_lastTallyChangeTime = 0;
+
+  // State polls are queued only when due and when the previous poll has finished.
+  int64_t testPollTime = 100;
+  assert(pollPanasonicState(kPanaCommandGetTallyState, &testPollTime, 2000000, 50) == 1);
+  assert(g_panaCommandOrderCount == 0);
+  assert(pollPanasonicState(kPanaCommandGetTallyState, &testPollTime, 2000000, 100) == 2);
+  assert(g_panaCommandOrderCount == 1 && testPollTime == 2000100);
+  testPollTime = 0;
+  pollPanasonicState(kPanaCommandGetTallyState, &testPollTime, 2000000, 100);
+  assert(g_panaCommandOrderCount == 1 && testPollTime == 0);
+  assert(takeNextPanasonicCommand(&testType, testValues));
+  finishPanasonicCommand(kPanaCommandGetTallyState, true);
+
+  // Zoom positions are extrapolated with the calibrated speed of whichever zoom speed
+  // was in effect, for a limited time, within the calibrated range.
+  int64_t testZoomCalibration[ZOOM_SCALE_HARDWARE + 1];
+  for (int i = 0; i <= ZOOM_SCALE_HARDWARE; i++) {
+    testZoomCalibration[i] = i * 100;
+  }
+  pana_zoom_sample_t testSample = { .rawPosition = 0, .linearPosition = 1000, .timestamp = 0 };
+  pana_zoom_speed_history_t testHistory = { .speed = 10, .previousSpeed = 0, .changeTime = 0 };
+  int64_t msec = 1000000;
+  assert(extrapolateZoomPosition(&testSample, &testHistory, testZoomCalibration, 0, 0,
+                                 100 * msec) == 1100);
+  assert(extrapolateZoomPosition(&testSample, &testHistory, NULL, 0, 0, 100 * msec) == 1000);
+  assert(extrapolateZoomPosition(&testSample, &testHistory, testZoomCalibration, 0, 0,
+                                 5000 * msec) == 1250);
+  assert(extrapolateZoomPosition(&testSample, &testHistory, testZoomCalibration, 0, 1050,
+                                 100 * msec) == 1050);
+  testHistory = (pana_zoom_speed_history_t){ .speed = -20, .previousSpeed = 10,
+                                             .changeTime = 50 * msec };
+  assert(extrapolateZoomPosition(&testSample, &testHistory, testZoomCalibration, 0, 0,
+                                 100 * msec) == 1000 + 50 - 100);
+  testSample.timestamp = 80 * msec;
+  assert(extrapolateZoomPosition(&testSample, &testHistory, testZoomCalibration, 0, 0,
+                                 100 * msec) == 1000 - 40);
+  assert(extrapolateZoomPosition(&testSample, &testHistory, testZoomCalibration, 0, 0,
+                                 70 * msec) == 1000);
 
   fprintf(stderr, "Done.\n");
 }
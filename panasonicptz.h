@@ -3,6 +3,7 @@
 #include <stdbool.h>
 
 #include "constants.h"
+#include "panasonic_shared.h"
 
 /** Initializes the Panasonic pan/tilt/zoom module. */
 bool panaModuleInit(void);
@@ -19,8 +20,15 @@ bool panaModuleTeardown(void);
 /** Sets the camera IP address. */
 bool panaSetIPAddress(char *address);
 
-/** Sets the pan and tilt speed (for true PTZ cameras only). */
-bool panaSetPanTiltSpeed(int64_t panSpeed, int64_t tiltSpeed);
+/**
+ * Sets the pan and tilt speed (for true PTZ cameras only).
+ *
+ * @param panSpeed  The pan speed.
+ * @param tiltSpeed The tilt speed.
+ * @param isRaw     If true, the speeds are in hardware scale (-49 to 49).
+ *                  If false, the speeds are in core scale.
+ */
+bool panaSetPanTiltSpeed(int64_t panSpeed, int64_t tiltSpeed, bool isRaw);
 
 /**
  * Gets the maximum possible zoom range for the camera (based on calibration data).
@@ -37,7 +45,10 @@ bool panaGetZoomRange(int64_t *min, int64_t *max);
  */
 bool panaSetZoomSpeed(int64_t speed, bool isRaw);
 
-/** Gets the pan and tilt position (for true PTZ cameras only). */
+/**
+ * Gets the pan and tilt position (for true PTZ cameras only).  The position is never
+ * older than one background poll, and the first call waits for the camera.
+ */
 bool panaGetPanTiltPosition(int64_t *panPosition, int64_t *tiltPosition);
 
 /** Gets the current zoom position. */
@@ -48,14 +59,36 @@ int64_t panaGetZoomSpeed(void);
 
 /**
  * Moves the camera to the specified pan and tilt position at the specified speed
- * (for true PTZ cameras only).
+ * (for true PTZ cameras only).  The camera performs the move on its own.
  */
 bool panaSetPanTiltPosition(int64_t panPosition, int64_t panSpeed,
                             int64_t tiltPosition, int64_t tiltSpeed);
 
-/** Moves the camera to the specified zoom position at the specified speed.  */
+/**
+ * Moves the camera to the specified (linearized) zoom position.  The camera performs
+ * the move on its own, at a speed of its choosing.
+ */
 bool panaSetZoomPosition(int64_t position, int64_t maxSpeed);
 
+/**
+ * Stores the current position in one of the camera's presets (0 to 99).  Waits for the
+ * camera's reply, and returns true only if the camera confirmed that it stored the preset.
+ */
+bool panaSavePreset(int presetNumber);
+
+/** Moves the camera to one of its presets (0 to 99), stored with panaSavePreset. */
+bool panaRecallPreset(int presetNumber);
+
+/**
+ * Compares the two ways of moving the camera, and prints a tab-separated table of the
+ * requests that each one sends and how long they take.  The polling path sets the speed
+ * and reads the position every 10 ms, as the control loop does.  The native path sends
+ * one #AXZ or #APS command and reads the position every 100 ms for status.  This moves
+ * the camera.  Call it after panaModuleInit but not panaModuleStart, so that every
+ * request is sent (and timed) on the calling thread.  Returns false if a move failed.
+ */
+bool panaRunBenchmarks(void);
+
 /** Gets the current tally state from the camera. */
 int panaGetTallyState(void);
 
@@ -68,6 +101,7 @@ bool panaSetTallyState(int tallyState);
 
     #define MODULE_INIT() panaModuleInit()
     #define SET_IP_ADDR(address) panaSetIPAddress(address);
+    #define BENCHMARK_CAMERA() panaRunBenchmarks()
 
     // If the Panasonic tally source is enabled, map the tally state getter
     // macro onto a function in this module.
@@ -96,8 +130,8 @@ bool panaSetTallyState(int tallyState);
         #define SET_ZOOM_POSITION(position, maxSpeed, time, startTime) \
             setAxisPositionIncrementally(axis_identifier_zoom, position, maxSpeed, time, startTime)
     #else  // !(PANASONIC_PTZ_ZOOM_ONLY || PANASONIC_DISABLE_ZOOM_COMMAND)
-        #define SET_ZOOM_POSITION(position, maxSpeed, time) \
-            panaSetZoomPosition(axis_identifier_zoom, position, maxSpeed)
+        #define SET_ZOOM_POSITION(position, maxSpeed, time, startTime) \
+            panaSetZoomPosition(position, maxSpeed)
     #endif  // PANASONIC_PTZ_ZOOM_ONLY || PANASONIC_DISABLE_ZOOM_COMMAND
 
     #define MIN_ZOOM_POSITIONS_PER_SECOND() panaMinimumZoomPositionsPerSecond();
@@ -109,7 +143,7 @@ bool panaSetTallyState(int tallyState);
         #define GET_PAN_TILT_POSITION(panPositionRef, tiltPositionRef) \
             panaGetPanTiltPosition(panPositionRef, tiltPositionRef)
         #define SET_PAN_TILT_SPEED(panSpeed, tiltSpeed, isRaw) \
-            panaSetPanSpeed(panSpeed, tiltSpeed, isRaw)
+            panaSetPanTiltSpeed(panSpeed, tiltSpeed, isRaw)
         #define SET_PAN_TILT_POSITION(panPosition, panSpeed, tiltPosition, tiltSpeed, \
                                       panDuration, tiltDuration, panStartTime, tiltStartTime) \
             panaSetPanTiltPosition(panPosition, panSpeed, tiltPosition, tiltSpeed)
@@ -125,6 +159,11 @@ bool panaSetTallyState(int tallyState);
         #define MIN_TILT_POSITIONS_PER_SECOND() panaMinimumTiltPositionsPerSecond();
         #define MAX_PAN_POSITIONS_PER_SECOND() panaMaximumPanPositionsPerSecond();
         #define MAX_TILT_POSITIONS_PER_SECOND() panaMaximumTiltPositionsPerSecond();
+
+        // The camera stores presets and moves to them on its own.
+        #define NATIVE_PRESETS_SUPPORTED true
+        #define SAVE_NATIVE_PRESET(presetNumber) panaSavePreset(presetNumber)
+        #define RECALL_NATIVE_PRESET(presetNumber) panaRecallPreset(presetNumber)
     #endif
 
 #endif